@@ -27,6 +27,7 @@
 #ifndef HIDAPI_H__
 #define HIDAPI_H__
 
+#include <stdint.h>
 #include <wchar.h>
 
 #ifdef _WIN32
@@ -48,7 +49,7 @@
 
 	@ingroup API
 */
-#define HID_API_VERSION_MINOR 12
+#define HID_API_VERSION_MINOR 13
 /** @brief Static/compile-time patch version of the library.
 
 	@ingroup API
@@ -100,6 +101,31 @@ extern "C" {
 		struct hid_device_;
 		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
 
+		struct hid_context_;
+		typedef struct hid_context_ hid_context; /**< opaque library context, see hid_context_create() */
+
+		struct hid_broadcast_reader_;
+		typedef struct hid_broadcast_reader_ hid_broadcast_reader; /**< opaque reader of a broadcast ring, see hid_broadcast_open() */
+
+		/** @brief HID underlying bus types.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** Unknown bus type */
+			HID_API_BUS_UNKNOWN = 0x00,
+			/** USB bus */
+			HID_API_BUS_USB = 0x01,
+			/** Bluetooth or Bluetooth LE bus */
+			HID_API_BUS_BLUETOOTH = 0x02,
+			/** I2C bus */
+			HID_API_BUS_I2C = 0x03,
+			/** SPI bus */
+			HID_API_BUS_SPI = 0x04,
+		} hid_bus_type;
+
 		/** hidapi info structure */
 		struct hid_device_info {
 			/** Platform-specific device path */
@@ -118,10 +144,10 @@ extern "C" {
 			/** Product string */
 			wchar_t *product_string;
 			/** Usage Page for this Device/Interface
-			    (Windows/Mac/hidraw only) */
+			    (Windows/Mac/hidraw only, and libusb on Linux) */
 			unsigned short usage_page;
 			/** Usage for this Device/Interface
-			    (Windows/Mac/hidraw only) */
+			    (Windows/Mac/hidraw only, and libusb on Linux) */
 			unsigned short usage;
 			/** The USB interface which this logical device
 			    represents.
@@ -135,7 +161,98 @@ extern "C" {
 
 			/** Pointer to the next device */
 			struct hid_device_info *next;
+
+			/** Serial Number, UTF-8 encoded (since version 0.13.0) */
+			char *serial_number_utf8;
+			/** Manufacturer String, UTF-8 encoded (since version 0.13.0) */
+			char *manufacturer_string_utf8;
+			/** Product String, UTF-8 encoded (since version 0.13.0) */
+			char *product_string_utf8;
+			/** Underlying bus type (since version 0.13.0) */
+			hid_bus_type bus_type;
+		};
+
+		/** @brief Error codes, see hid_error_code().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** No error */
+			HID_API_ERROR_SUCCESS = 0,
+			/** An error without a more specific code */
+			HID_API_ERROR_UNKNOWN = -1,
+			/** Invalid parameter (e.g. a zero-length buffer) */
+			HID_API_ERROR_INVALID_PARAM = -2,
+			/** No (matching) device found */
+			HID_API_ERROR_NOT_FOUND = -3,
+			/** Insufficient permissions */
+			HID_API_ERROR_ACCESS = -4,
+			/** The device was disconnected */
+			HID_API_ERROR_NO_DEVICE = -5,
+			/** The device is used by someone else */
+			HID_API_ERROR_BUSY = -6,
+			/** The operation timed out */
+			HID_API_ERROR_TIMEOUT = -7,
+			/** The operation would block, try again later */
+			HID_API_ERROR_AGAIN = -8,
+			/** The operation was interrupted by a signal */
+			HID_API_ERROR_INTERRUPTED = -9,
+			/** Input/output error */
+			HID_API_ERROR_IO = -10,
+			/** Out of memory */
+			HID_API_ERROR_NO_MEM = -11,
+			/** The operation is not supported by the device or the backend */
+			HID_API_ERROR_NOT_SUPPORTED = -12,
+		} hid_api_error;
+
+		/** @brief A Vendor ID/Product ID pair of a #hid_filter.
+
+			A zero Vendor ID or Product ID matches any.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_filter_id {
+			/** Vendor ID, or 0 for any */
+			unsigned short vendor_id;
+			/** Product ID, or 0 for any */
+			unsigned short product_id;
+		};
+
+		/** @brief The criteria of hid_enumerate_filtered().
+
+			A device matches the filter if it matches all of its
+			criteria. A zero-initialized filter matches all devices.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_filter {
+			/** The VID/PID pairs to match (any of them),
+			    or NULL to match any device */
+			const struct hid_filter_id *ids;
+			/** The number of pairs in @p ids */
+			size_t num_ids;
+			/** Usage Page to match, or 0 for any */
+			unsigned short usage_page;
+			/** Usage to match, or 0 for any */
+			unsigned short usage;
+			/** Non-zero to match @p interface_number */
+			int match_interface_number;
+			/** Interface Number to match (-1 matches the devices
+			    which don't have an interface number) */
+			int interface_number;
+			/** Bus type to match, or #HID_API_BUS_UNKNOWN for any */
+			hid_bus_type bus_type;
+			/** Prefix of the Serial Number to match (UTF-8 encoded),
+			    or NULL for any */
+			const char *serial_number_prefix;
 		};
+		typedef struct hid_filter hid_filter;
 
 
 		/** @brief Initialize the HIDAPI library.
@@ -195,10 +312,92 @@ extern "C" {
 		*/
 		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
+		/** @brief Enumerate the HID Devices matching a filter.
+
+			Same as hid_enumerate(), for the devices (and usages)
+			matching all the criteria of @p filter. Several VID/PID
+			pairs can be matched in a single scan of the system.
+
+			The backends check each criterion as soon as it is known,
+			so non-matching devices are skipped before their strings
+			are converted or their report descriptor is read.
+			On Linux (but not Android) the libusb backend reads the
+			Usage Page and Usage from sysfs, for the interfaces bound
+			to the kernel's HID driver. On other platforms it only
+			knows them when built with INVASIVE_GET_USAGE, otherwise
+			a non-zero @p usage_page or @p usage matches no device.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param filter The criteria of the devices to return,
+				or NULL to return all the HID devices.
+
+			@returns
+				This function returns a pointer to a linked list of type
+				struct #hid_device_info, or NULL in the case of failure
+				or if no matching HID devices are present in the system.
+				Call hid_error(NULL) to get the failure reason.
+
+			@note The returned value by this function must to be freed by calling hid_free_enumeration(),
+			      when not needed anymore.
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_filtered(const hid_filter *filter);
+
+		/** @brief Callback of hid_enumerate_visit().
+
+			@param info The matching device. It is only valid during
+				the call, and its @p next member is always NULL.
+			@param user_data The @p user_data given to hid_enumerate_visit().
+
+			@returns
+				0 to continue the enumeration, any other value
+				to stop it.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef int (HID_API_CALL *hid_enumerate_callback)(const struct hid_device_info *info, void *user_data);
+
+		/** @brief Visit the HID Devices matching a filter.
+
+			Calls @p callback for each device (and usage) matching
+			@p filter, as soon as it is found, without building
+			a list. The enumeration stops as soon as the callback
+			returns a non-zero value, so finding the first matching
+			device doesn't cost a scan of the whole system.
+
+			HIDAPI functions which enumerate devices must not be
+			called from the callback.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param filter The criteria of the devices to visit,
+				or NULL to visit all the HID devices.
+			@param callback The function to call for each device.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 if all the matching devices
+				were visited, the non-zero value returned by @p callback
+				if it stopped the enumeration, or -1 on error.
+				Call hid_error(NULL) to get the failure reason.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enumerate_visit(const hid_filter *filter, hid_enumerate_callback callback, void *user_data);
+
 		/** @brief Free an enumeration Linked List
 
 			This function frees a linked list created by hid_enumerate().
 
+			The list is freed as a whole: @p devs must be the first
+			element exactly as returned by hid_enumerate(),
+			hid_enumerate_filtered() or hid_context_enumerate(). Passing
+			another element of the list, or a list the application
+			built or relinked, is undefined behavior, since the
+			elements aren't allocated one by one on all platforms.
+
 			@ingroup API
 			@param devs Pointer to a list of struct_device returned from
 			            hid_enumerate().
@@ -246,6 +445,134 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** @brief Options of hid_context_create().
+
+			Zero-initialize it (or pass NULL) for the defaults.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_context_options {
+			/** Reserved for future options, must be 0. */
+			unsigned int flags;
+		};
+
+		/** @brief Create a library context.
+
+			The functions without a context argument (hid_init(),
+			hid_enumerate(), hid_open() ...) use a default context,
+			shared by the whole process. A context created here owns
+			its own backend state instead: the libusb context, the
+			list of open devices and their event threads (libusb),
+			the udev handle (hidraw), the IOHIDManager (macOS) and
+			the last error. Independent parts of an application
+			can each use their own context without sharing locks or
+			event loops with each other.
+
+			The devices opened from a context are used with the
+			usual functions (hid_read(), hid_close() ...).
+
+			A context is not thread-safe: its enumeration, open and
+			error functions must not be called concurrently (its
+			devices can still be used from other threads, as usual).
+			Unlike the default context, its last error is not kept
+			per thread.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param opts The options, or NULL for the defaults.
+
+			@returns
+				This function returns a pointer to a #hid_context object
+				on success or NULL on failure.
+				Call hid_error(NULL) to get the failure reason.
+
+			@note The returned object must be freed by calling hid_context_destroy(),
+			      before hid_exit() is called.
+		*/
+		HID_API_EXPORT hid_context * HID_API_CALL hid_context_create(const struct hid_context_options *opts);
+
+		/** @brief Destroy a context created by hid_context_create().
+
+			All the devices opened from the context must have been
+			closed with hid_close() first.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx The context, NULL is ignored.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_context_destroy(hid_context *ctx);
+
+		/** @brief Same as hid_enumerate_filtered(), within a context.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx A context returned by hid_context_create(),
+				or NULL for the default context.
+			@param filter The criteria of the devices to return,
+				or NULL to return all the HID devices.
+
+			@returns
+				Same as hid_enumerate_filtered().
+				Call hid_context_error(ctx) to get the failure reason.
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_context_enumerate(hid_context *ctx, const hid_filter *filter);
+
+		/** @brief Same as hid_enumerate_visit(), within a context.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx A context returned by hid_context_create(),
+				or NULL for the default context.
+			@param filter The criteria of the devices to visit,
+				or NULL to visit all the HID devices.
+			@param callback The function to call for each device.
+			@param user_data Passed to @p callback.
+
+			@returns
+				Same as hid_enumerate_visit().
+				Call hid_context_error(ctx) to get the failure reason.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_context_enumerate_visit(hid_context *ctx, const hid_filter *filter, hid_enumerate_callback callback, void *user_data);
+
+		/** @brief Same as hid_open(), within a context.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx A context returned by hid_context_create(),
+				or NULL for the default context.
+			@param vendor_id The Vendor ID (VID) of the device to open.
+			@param product_id The Product ID (PID) of the device to open.
+			@param serial_number The Serial Number of the device to open
+				(Optionally NULL).
+
+			@returns
+				Same as hid_open().
+				Call hid_context_error(ctx) to get the failure reason.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number);
+
+		/** @brief Same as hid_open_path(), within a context.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx A context returned by hid_context_create(),
+				or NULL for the default context.
+			@param path The path name of the device to open.
+
+			@returns
+				Same as hid_open_path().
+				Call hid_context_error(ctx) to get the failure reason.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_context_open_path(hid_context *ctx, const char *path);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -341,6 +668,688 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *dev, int nonblock);
 
+		/** @brief Get a file descriptor to wait for input reports on.
+
+			The returned file descriptor becomes readable (POLLIN)
+			when an input report can be read from the device, or
+			when the device has been disconnected (so hid_read()
+			would return -1). It can be added to poll(), select(),
+			epoll or any other event loop, together with a zero
+			timeout hid_read_timeout() call to fetch the report
+			once it is readable. Reports which were received but not
+			returned yet (e.g. the ones hid_transact() read while
+			waiting for its response) keep it readable as well.
+
+			The file descriptor is owned by the device: don't read
+			from or close it. It stays valid until hid_close().
+
+			Only available on POSIX platforms (hidraw, libusb and
+			macOS backends).
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns a file descriptor on success
+				and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_get_input_fd(hid_device *dev);
+
+		/** @brief Callback of hid_subscribe_report_id().
+
+			@param dev The device the report was received from.
+			@param data The Input report, starting with its Report ID,
+				as hid_read() would return it. It is only valid
+				during the call.
+			@param length The length of the report in bytes.
+			@param user_data The @p user_data given to hid_subscribe_report_id().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef void (HID_API_CALL *hid_report_callback)(hid_device *dev, const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Route the Input reports with a given Report ID to a callback.
+
+			Input reports whose Report ID is @p report_id are passed
+			to @p callback instead of being queued for hid_read(), so
+			that rare reports (e.g. status reports) don't wait behind,
+			or get dropped with, a high rate stream of other reports
+			of the same device. Only devices which use numbered reports
+			can be subscribed to.
+
+			Where the backend receives the reports in the background
+			(libusb and macOS), @p callback is called as soon as a
+			report arrives, from the thread which receives it. On
+			hidraw and Windows the reports are only received by
+			hid_read() and hid_read_timeout(): the subscribed ones
+			are passed to @p callback from these calls, which then
+			wait for the next report for the rest of their timeout.
+			In both cases @p callback should return quickly, and must
+			not call hid_read(), hid_close() or the subscription
+			functions of the device.
+
+			Subscribing to a Report ID which already has a callback
+			replaces it.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param report_id The Report ID, non-zero.
+			@param callback The function to call for each report
+				with this Report ID.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_subscribe_report_id(hid_device *dev, unsigned char report_id, hid_report_callback callback, void *user_data);
+
+		/** @brief Stop routing the Input reports of a Report ID to a callback.
+
+			The reports with this Report ID are queued for hid_read()
+			again. Once the function returns, the callback given to
+			hid_subscribe_report_id() is not running and won't be called
+			again for this Report ID.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param report_id The Report ID, non-zero.
+
+			@returns
+				This function returns 0 on success and -1 on error
+				(including when @p report_id had no subscription).
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_unsubscribe_report_id(hid_device *dev, unsigned char report_id);
+
+		/** @brief Keep only the newest Input report of each Report ID.
+
+			For devices which report a state (joysticks, gauges,
+			sensors), where only the newest value matters. In latest
+			mode the Input reports are not queued for hid_read(): each
+			report replaces the previous one with the same Report ID
+			(Report ID 0 on devices without numbered reports), which
+			hid_read_latest() returns. Subscribed Report IDs (see
+			hid_subscribe_report_id()) still go to their callback.
+
+			On libusb and macOS the reports are stored as they arrive.
+			On hidraw and Windows they are only stored by hid_read()
+			and hid_read_timeout(): in latest mode these store the
+			reports they receive and return 0 once their timeout
+			expires. The application keeps the reports current with
+			a thread blocked in hid_read(), or by calling
+			hid_read_timeout() with a timeout of 0 (e.g. when the
+			descriptor of hid_get_input_fd() is readable).
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param enable 1 to enable latest mode, 0 to queue the
+				reports for hid_read() again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_set_read_latest(hid_device *dev, int enable);
+
+		/** @brief Get the newest Input report of a Report ID.
+
+			Only available in latest mode, see hid_set_read_latest().
+			Never waits for a report, and doesn't take a lock shared
+			with the thread receiving the reports: it can be called
+			from any number of threads at once. It only copies the
+			stored report; on hidraw and Windows it doesn't read
+			from the device itself.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param report_id The Report ID, 0 for devices without
+				numbered reports.
+			@param data A buffer to put the report into, starting
+				with the Report ID for numbered reports (as
+				hid_read() would return it).
+			@param length The length in bytes of @p data.
+
+			@returns
+				This function returns the number of bytes copied,
+				0 if no report with this Report ID was received yet,
+				and -1 on error (including when @p dev is not in
+				latest mode).
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_read_latest(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length);
+
+		/** @brief Deliver only the Input reports which changed.
+
+			For devices which repeat their state at a fixed rate. In
+			changes-only mode each Input report is compared with the
+			previous one with the same Report ID (Report ID 0 on
+			devices without numbered reports) as it is received. A
+			report equal to the previous one is counted (see
+			hid_get_unchanged_count()) and dropped: it never reaches
+			hid_read(), hid_transact(), the subscribed callbacks or
+			latest mode. The bytes which change with every report
+			(counters, timestamps) can be left out of the comparison
+			with hid_set_change_mask().
+
+			The first report of each Report ID after enabling the mode
+			is always delivered.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param enable 1 to enable changes-only mode, 0 to deliver
+				every report again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_set_changes_only(hid_device *dev, int enable);
+
+		/** @brief Set which bits of a Report ID are compared in changes-only mode.
+
+			Bit n of byte i of @p mask tells whether bit n of byte i of
+			the report (laid out as hid_read() returns it, starting
+			with the Report ID for numbered reports) is compared, see
+			hid_set_changes_only(). The bytes past @p length are
+			compared entirely, as are all the bytes of the Report IDs
+			without a mask.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param report_id The Report ID, 0 for devices without
+				numbered reports.
+			@param mask The bits to compare, or NULL to compare the
+				whole report again.
+			@param length The length in bytes of @p mask.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length);
+
+		/** @brief Get the number of reports dropped as unchanged.
+
+			Counts the Input reports dropped by changes-only mode
+			(see hid_set_changes_only()) since the device was opened.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param count Set to the number of dropped reports.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_get_unchanged_count(hid_device *dev, unsigned long long *count);
+
+		/** @brief Decimation modes, see hid_set_decimation().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** Deliver every report */
+			HID_DECIMATE_OFF = 0,
+			/** Deliver one report out of every hid_decimation::every */
+			HID_DECIMATE_EVERY_NTH = 1,
+			/** Deliver the last report of each time window */
+			HID_DECIMATE_WINDOW_LATEST = 2,
+			/** Deliver the reduction of the reports of each time
+			    window, see #hid_report_reducer */
+			HID_DECIMATE_WINDOW_REDUCE = 3,
+		} hid_decimation_mode;
+
+		/** @brief Reduction function of #HID_DECIMATE_WINDOW_REDUCE.
+
+			Called for each report of a time window, in order.
+			@p window holds the report delivered when the window
+			closes: for the first report of a window (@p index 0) it
+			is a copy of that report, and the function folds each
+			following report into it (e.g. keeps the minimum, the
+			maximum or a running mean of some fields).
+
+			The function is called with an internal lock held and
+			must not call HIDAPI functions on the device.
+
+			@param window The report of the window, to update.
+			@param window_length The length of @p window in bytes.
+			@param data The report to fold into @p window.
+			@param length The length of @p data in bytes.
+			@param index The number of reports of the window before
+				this one.
+			@param user_data The hid_decimation::user_data.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef void (HID_API_CALL *hid_report_reducer)(unsigned char *window, size_t window_length, const unsigned char *data, size_t length, unsigned int index, void *user_data);
+
+		/** @brief A decimation stage, see hid_set_decimation().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_decimation {
+			/** What to deliver */
+			hid_decimation_mode mode;
+			/** #HID_DECIMATE_EVERY_NTH: deliver one report out of this
+			    many (the first, the (every + 1)th, ...) */
+			unsigned int every;
+			/** The window modes: the length of a window in
+			    milliseconds */
+			unsigned int window_ms;
+			/** #HID_DECIMATE_WINDOW_REDUCE: the reduction function */
+			hid_report_reducer reducer;
+			/** Passed to @p reducer */
+			void *user_data;
+		};
+
+		/** @brief Downsample the Input reports of a Report ID.
+
+			For devices reporting faster than the consumer needs the
+			data. The reports of @p report_id go through the stage as
+			they are received, before they are queued for hid_read(),
+			dispatched to a subscribed callback or stored for latest
+			mode, so the dropped ones don't wake up any reader.
+
+			A time window starts with its first report. Where the
+			backend receives the reports in the background (libusb
+			and macOS), the window is delivered when it ends. On
+			hidraw and Windows the reports are only received by the
+			reading functions, so a window is delivered when the
+			first report after its end arrives, which then starts
+			the next window: there a window isn't delivered before
+			the device sends another report. The libusb backend does
+			the same when the application handles the events of its
+			context (see hid_libusb_set_context()).
+
+			In changes-only mode (see hid_set_changes_only()) the
+			repeated reports are dropped before they reach the stage.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param report_id The Report ID, 0 for devices without
+				numbered reports.
+			@param decimation The stage, or NULL (like
+				#HID_DECIMATE_OFF) to deliver every report again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_set_decimation(hid_device *dev, unsigned char report_id, const struct hid_decimation *decimation);
+
+		/** @brief Deliver the Input reports in batches.
+
+			Trades a bounded extra latency for fewer wake-ups of the
+			reading thread, like the interrupt moderation of network
+			adapters.
+
+			On libusb and macOS, the threads waiting in hid_read(),
+			hid_read_timeout() or hid_transact(), and the descriptor
+			of hid_get_input_fd(), are woken up once @p max_reports
+			reports are queued, or @p max_delay_us after the first
+			of them was received, whichever comes first.
+
+			On hidraw and Windows, where hid_read() waits on the OS
+			for each report, hid_read_timeout() keeps reading after
+			the first report until it has @p max_reports of them,
+			@p max_delay_us have passed or its own timeout is up,
+			whichever comes first (without blocking, it only takes
+			the reports already there); the following calls return
+			them without waiting. The delay is rounded up to whole
+			milliseconds.
+
+			The libusb backend doesn't support batching when the
+			application handles the events of its context (see
+			hid_libusb_set_context()), since no thread of its own
+			would release a batch after @p max_delay_us: the call
+			fails with #HID_API_ERROR_NOT_SUPPORTED.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param max_reports The size of a batch, at most 30 (the
+				reports queued for a device). 0 or 1 turns batching
+				off.
+			@param max_delay_us The longest a report is held back,
+				in microseconds. Must be non-zero with batching on.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_set_batching(hid_device *dev, unsigned int max_reports, unsigned int max_delay_us);
+
+		/** @brief Predicate of hid_transact().
+
+			@param data An Input report, as hid_read() would return it.
+			@param length The length of the report in bytes.
+			@param user_data The @p user_data given to hid_transact().
+
+			@returns
+				Non-zero if the report is the expected response.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef int (HID_API_CALL *hid_report_match)(const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Send a request and wait for its response.
+
+			Writes @p request as hid_write() does, then waits for the
+			first Input report for which @p match returns non-zero
+			(e.g. the one with the expected Report ID or sequence
+			number) and returns it as hid_read() would. The reports
+			which don't match stay queued for hid_read(), in order,
+			so other consumers of the device don't lose them.
+
+			On libusb and macOS, only the reports received after the
+			request was written are considered. On hidraw and Windows,
+			the reports which were already received by the OS but not
+			read yet can't be told apart from the response, so the
+			predicate should identify the response precisely.
+
+			@p match may be called with an internal lock held and must
+			not call HIDAPI functions on @p dev. Not available in
+			latest mode (see hid_set_read_latest()), and the Report
+			IDs subscribed to with hid_subscribe_report_id() never
+			reach @p match.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param request The Output report to send, starting with
+				the Report ID (see hid_write()).
+			@param request_length The length in bytes of @p request.
+			@param match The predicate identifying the response.
+			@param user_data Passed to @p match.
+			@param response A buffer to put the response into.
+			@param response_length The length in bytes of @p response.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of bytes of the
+				response, 0 if no response arrived within the timeout,
+				and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_transact(hid_device *dev, const unsigned char *request, size_t request_length, hid_report_match match, void *user_data, unsigned char *response, size_t response_length, int milliseconds);
+
+		/** @brief Fan the Input reports out to several readers.
+
+			In broadcast mode the Input reports are not queued for
+			hid_read(): they are written to a ring of @p slots
+			reports, which any number of readers (see
+			hid_broadcast_open()) read at their own pace, each report
+			being seen by all of them. The ring is written without
+			waiting for the readers: a reader left behind by more than
+			@p slots reports skips the oldest ones and counts them
+			(see hid_broadcast_get_overflow()). Subscribed Report IDs
+			(see hid_subscribe_report_id()) still go to their callback.
+
+			On libusb and macOS the reports are written as they arrive.
+			On hidraw and Windows one of the readers waiting in
+			hid_broadcast_read() reads them from the device for all the
+			others.
+
+			hid_read(), hid_read_timeout() and hid_transact() are not
+			available in broadcast mode, and it can't be combined with
+			latest mode (see hid_set_read_latest()).
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param slots The number of reports the ring holds, rounded
+				up to a power of two (at most 65536). 0 turns broadcast
+				mode off.
+			@param max_report_length The length in bytes of the slots,
+				starting with the Report ID for numbered reports.
+				Longer reports are truncated.
+
+			@returns
+				This function returns 0 on success and -1 on error
+				(including while readers are open).
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_set_broadcast(hid_device *dev, unsigned int slots, size_t max_report_length);
+
+		/** @brief Open a reader of the broadcast ring.
+
+			The reader starts with the next report written to the ring
+			(see hid_set_broadcast()). Each reader is meant for one
+			thread at a time; the readers of a device can be used
+			from different threads at once. All the readers must be
+			closed with hid_broadcast_close() before hid_close(), or
+			before broadcast mode is turned off.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle in broadcast mode.
+
+			@returns
+				This function returns a pointer to a #hid_broadcast_reader
+				object on success or NULL on failure.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		HID_API_EXPORT hid_broadcast_reader * HID_API_CALL hid_broadcast_open(hid_device *dev);
+
+		/** @brief Read the next report of a reader, with timeout.
+
+			Unlike the other functions, hid_broadcast_read() doesn't
+			clear the error of the device on success, as it is called
+			from several threads at once.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param reader A reader returned from hid_broadcast_open().
+			@param data A buffer to put the report into, starting
+				with the Report ID for numbered reports (as
+				hid_read() would return it).
+			@param length The length in bytes of @p data.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of bytes copied,
+				0 if no report arrived within the timeout, and -1 on
+				error. Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_broadcast_read(hid_broadcast_reader *reader, unsigned char *data, size_t length, int milliseconds);
+
+		/** @brief Get the number of reports a reader missed.
+
+			Counts the reports overwritten in the broadcast ring before
+			@p reader got to them, see hid_set_broadcast().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param reader A reader returned from hid_broadcast_open().
+			@param count Set to the number of missed reports.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_broadcast_get_overflow(hid_broadcast_reader *reader, unsigned long long *count);
+
+		/** @brief Close a reader of the broadcast ring.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param reader A reader returned from hid_broadcast_open().
+		*/
+		void HID_API_EXPORT_CALL hid_broadcast_close(hid_broadcast_reader *reader);
+
+		/** @brief The kinds of records of a capture file, see
+			hid_start_capture().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		typedef enum {
+			/** An Input report received from the device */
+			HID_CAPTURE_INPUT = 1,
+			/** A report written with hid_write() */
+			HID_CAPTURE_OUTPUT = 2,
+			/** A report sent with hid_send_feature_report() */
+			HID_CAPTURE_FEATURE_SET = 3,
+			/** A report returned by hid_get_feature_report() */
+			HID_CAPTURE_FEATURE_GET = 4,
+			/** A report returned by hid_get_input_report() */
+			HID_CAPTURE_INPUT_GET = 5,
+			/** The Manufacturer String, UTF-8 encoded */
+			HID_CAPTURE_MANUFACTURER = 0x100,
+			/** The Product String, UTF-8 encoded */
+			HID_CAPTURE_PRODUCT = 0x101,
+			/** The Serial Number, UTF-8 encoded */
+			HID_CAPTURE_SERIAL_NUMBER = 0x102,
+		} hid_capture_record_type;
+
+		/** The hid_capture_header::magic of a capture file */
+#define HID_CAPTURE_MAGIC "HIDCAPT"
+		/** The hid_capture_header::version written by this library */
+#define HID_CAPTURE_VERSION 1
+		/** hid_capture_header::flags: the device uses numbered reports */
+#define HID_CAPTURE_NUMBERED_REPORTS 0x1
+
+		/** @brief The header at the start of a capture file.
+
+			A capture is this header followed by data_length bytes of
+			records, each one a #hid_capture_record followed by its
+			data, padded with zeroes to a multiple of 8 bytes. All the
+			numbers are in the byte order of the machine which
+			recorded it.
+
+			The recorder only increases data_length once a record is
+			complete, so a capture file is readable while it is
+			recorded, and after a crash of the recording process.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_capture_header {
+			/** #HID_CAPTURE_MAGIC, with its terminating zero */
+			char magic[8];
+			/** #HID_CAPTURE_VERSION */
+			uint32_t version;
+			/** sizeof(struct hid_capture_header), where the records start */
+			uint32_t header_size;
+			/** The size of the complete records */
+			uint64_t data_length;
+			/** The monotonic clock of the recording machine when the
+			    capture started, in nanoseconds */
+			uint64_t start_time_ns;
+			/** As in the #hid_device_info passed to hid_start_capture() */
+			uint16_t vendor_id;
+			uint16_t product_id;
+			uint16_t release_number;
+			uint16_t usage_page;
+			uint16_t usage;
+			uint16_t bus_type;
+			int32_t interface_number;
+			/** #HID_CAPTURE_NUMBERED_REPORTS */
+			uint32_t flags;
+			uint32_t reserved[3];
+		};
+
+		/** @brief A record of a capture file, see #hid_capture_header.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_capture_record {
+			/** The time since hid_capture_header::start_time_ns */
+			uint64_t timestamp_ns;
+			/** The length of the data following the record */
+			uint32_t length;
+			/** A #hid_capture_record_type */
+			uint16_t type;
+			uint16_t reserved;
+		};
+
+		/** @brief Record the reports of a device to a capture file.
+
+			Every Input report received from the device, and every
+			report passed to hid_write() and hid_send_feature_report()
+			or returned by hid_get_feature_report() and
+			hid_get_input_report(), is appended to the file at @p path
+			with its direction and the time since the start of the
+			capture. The Input reports are recorded as they arrive,
+			before changes-only mode and decimation drop any of them.
+			The format is described by #hid_capture_header; the replay
+			backend (hidapi-replay) plays a capture back.
+
+			The file is memory-mapped and grown in large steps, so
+			recording a report costs a copy rather than a system call.
+
+			Stopped by hid_stop_capture() or hid_close().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param path The capture file, created or truncated.
+			@param info The device as returned by hid_enumerate(), for
+				the IDs, usage and strings of the header, or NULL.
+
+			@returns
+				This function returns 0 on success and -1 on error
+				(including when the device is already recorded).
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_start_capture(hid_device *dev, const char *path, const struct hid_device_info *info);
+
+		/** @brief Stop recording a device, see hid_start_capture().
+
+			The file is truncated to its records and closed.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 if the
+				device isn't recorded.
+		*/
+		int HID_API_EXPORT_CALL hid_stop_capture(hid_device *dev);
+
 		/** @brief Send a Feature report to the device.
 
 			Feature reports are sent over the Control endpoint as a
@@ -472,6 +1481,9 @@ extern "C" {
 
 		/** @brief Get a string from a HID device, based on its string index.
 
+			Not supported by the hidraw and macOS backends, where it
+			fails with #HID_API_ERROR_NOT_SUPPORTED.
+
 			@ingroup API
 			@param dev A device handle returned from hid_open().
 			@param string_index The index of the string to get.
@@ -484,6 +1496,79 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen);
 
+		/** @brief Get The Manufacturer String from a HID device, UTF-8 encoded.
+
+			Same as hid_get_manufacturer_string(), without the conversion
+			to wchar_t. The string is truncated (at a character boundary)
+			if it doesn't fit the buffer.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param string A buffer to put the NULL-terminated string into.
+			@param maxlen The length of the buffer in bytes.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_get_manufacturer_string_utf8(hid_device *dev, char *string, size_t maxlen);
+
+		/** @brief Get The Product String from a HID device, UTF-8 encoded.
+
+			See hid_get_manufacturer_string_utf8().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param string A buffer to put the NULL-terminated string into.
+			@param maxlen The length of the buffer in bytes.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_get_product_string_utf8(hid_device *dev, char *string, size_t maxlen);
+
+		/** @brief Get The Serial Number String from a HID device, UTF-8 encoded.
+
+			See hid_get_manufacturer_string_utf8().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param string A buffer to put the NULL-terminated string into.
+			@param maxlen The length of the buffer in bytes.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_get_serial_number_string_utf8(hid_device *dev, char *string, size_t maxlen);
+
+		/** @brief Get a string from a HID device, based on its string index, UTF-8 encoded.
+
+			See hid_get_manufacturer_string_utf8() and
+			hid_get_indexed_string(): not supported by the hidraw and
+			macOS backends either.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param string_index The index of the string to get.
+			@param string A buffer to put the NULL-terminated string into.
+			@param maxlen The length of the buffer in bytes.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_get_indexed_string_utf8(hid_device *dev, int string_index, char *string, size_t maxlen);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			This function is intended for logging/debugging purposes.
@@ -499,7 +1584,14 @@ extern "C" {
 			Strings returned from hid_error() must not be freed by the user,
 			i.e. owned by HIDAPI library.
 			Device-specific error string may remain allocated at most until hid_close() is called.
-			Global error string may remain allocated at most until hid_exit() is called.
+			Global error string may remain allocated at most until hid_exit() is called
+			by the same thread, or until that thread exits.
+
+			The global error (@p dev is NULL) is kept per thread: it is
+			the last error of a non-device-specific call made by the
+			calling thread (since version 0.13.0), so threads enumerating
+			or opening devices concurrently don't overwrite each other's
+			errors.
 
 			@ingroup API
 			@param dev A device handle returned from hid_open(),
@@ -511,6 +1603,65 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *dev);
 
+		/** @brief Get the code of the last error which occurred.
+
+			The numeric counterpart of hid_error(), for applications
+			which decide what to do (e.g. retry or give up) depending
+			on the error. Same as hid_error(), the global error
+			(@p dev is NULL) is kept per thread.
+
+			Setting the error of a device doesn't allocate memory on
+			the hidraw, libusb and macOS backends, so it is cheap to
+			check after every failed hid_read()/hid_write(); the
+			string of hid_error() is only rendered when it is asked
+			for.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open(),
+			  or NULL to get the code of the last non-device-specific
+			  error of the calling thread.
+
+			@returns
+				One of #hid_api_error: #HID_API_ERROR_SUCCESS if the
+				last call succeeded.
+		*/
+		int HID_API_EXPORT_CALL hid_error_code(hid_device *dev);
+
+		/** @brief Get the last non-device-specific error of a context.
+
+			Same as hid_error(NULL), for the functions called
+			with @p ctx. For the default context (@p ctx is NULL),
+			this is the same as hid_error(NULL).
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx A context returned by hid_context_create(),
+				or NULL for the default context.
+
+			@returns
+				Same as hid_error(NULL).
+		*/
+		HID_API_EXPORT const wchar_t* HID_API_CALL hid_context_error(hid_context *ctx);
+
+		/** @brief Get the code of the last non-device-specific error of a context.
+
+			Same as hid_error_code(NULL), for the functions called
+			with @p ctx.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx A context returned by hid_context_create(),
+				or NULL for the default context.
+
+			@returns
+				Same as hid_error_code(NULL).
+		*/
+		int HID_API_EXPORT_CALL hid_context_error_code(hid_context *ctx);
+
 		/** @brief Get a runtime version of the library.
 
 			This function is thread-safe.
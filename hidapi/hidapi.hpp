@@ -0,0 +1,646 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/** @file
+ * @defgroup CPP hidapi C++ API
+ *
+ * Optional header-only C++ wrapper of the hidapi C API.
+ * Requires C++20 (std::span).
+ *
+ * The wrappers only manage the lifetime of the hidapi objects: every
+ * member function is an inline call of the corresponding C function,
+ * and reports as well as errors are passed the same way as in the C API
+ * (a negative return value is an error, see hid::device::error()).
+ *
+ * Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0).
+ */
+
+#ifndef HIDAPI_HPP__
+#define HIDAPI_HPP__
+
+#include "hidapi.h"
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+
+#if !defined(__cpp_lib_span)
+#error "hidapi.hpp requires C++20 (std::span)"
+#endif
+
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+namespace hid {
+
+	/** @brief Initialize the HIDAPI library, see hid_init().
+
+		@ingroup CPP
+	*/
+	inline int init() noexcept
+	{
+		return hid_init();
+	}
+
+	/** @brief Finalize the HIDAPI library, see hid_exit().
+
+		@ingroup CPP
+	*/
+	inline int exit() noexcept
+	{
+		return hid_exit();
+	}
+
+	namespace detail {
+
+		/* The timeout argument of the C API: rounded up to whole
+		   milliseconds, -1 for a negative timeout */
+		template <class Rep, class Period>
+		int to_milliseconds(std::chrono::duration<Rep, Period> timeout) noexcept
+		{
+			if (timeout < std::chrono::duration<Rep, Period>::zero())
+				return -1;
+
+			const auto ms = std::chrono::ceil<std::chrono::duration<long long, std::milli>>(timeout).count();
+			return ms > INT_MAX ? INT_MAX : static_cast<int>(ms);
+		}
+
+	}
+
+	/** @brief A reader of the broadcast ring of a device.
+
+		Move-only owner of a #hid_broadcast_reader, closed with
+		hid_broadcast_close() when the object is destroyed. Must be
+		destroyed before the device is closed. See
+		hid_set_broadcast().
+
+		@ingroup CPP
+	*/
+	class broadcast_reader {
+	public:
+		broadcast_reader() noexcept = default;
+
+		/** @brief Take the ownership of a reader returned by the C API. */
+		explicit broadcast_reader(hid_broadcast_reader *reader) noexcept
+			: reader_(reader)
+		{
+		}
+
+		broadcast_reader(const broadcast_reader &) = delete;
+		broadcast_reader &operator=(const broadcast_reader &) = delete;
+
+		broadcast_reader(broadcast_reader &&other) noexcept
+			: reader_(std::exchange(other.reader_, nullptr))
+		{
+		}
+
+		broadcast_reader &operator=(broadcast_reader &&other) noexcept
+		{
+			if (this != &other) {
+				close();
+				reader_ = std::exchange(other.reader_, nullptr);
+			}
+			return *this;
+		}
+
+		~broadcast_reader()
+		{
+			close();
+		}
+
+		/** @brief Close the reader (if open), see hid_broadcast_close(). */
+		void close() noexcept
+		{
+			if (reader_)
+				hid_broadcast_close(std::exchange(reader_, nullptr));
+		}
+
+		/** @brief The underlying C handle (still owned by this object). */
+		hid_broadcast_reader *get() const noexcept
+		{
+			return reader_;
+		}
+
+		/** @brief true if the object holds an open reader. */
+		explicit operator bool() const noexcept
+		{
+			return reader_ != nullptr;
+		}
+
+		/** @brief Read the next report of the reader, see hid_broadcast_read().
+
+			The timeout is rounded up to whole milliseconds.
+			A negative timeout blocks until a report is available.
+		*/
+		template <class Rep, class Period>
+		int read(std::span<unsigned char> data, std::chrono::duration<Rep, Period> timeout) noexcept
+		{
+			return hid_broadcast_read(reader_, data.data(), data.size(), detail::to_milliseconds(timeout));
+		}
+
+		/** @brief Get the number of reports the reader missed, see hid_broadcast_get_overflow(). */
+		int overflow(unsigned long long &count) noexcept
+		{
+			return hid_broadcast_get_overflow(reader_, &count);
+		}
+
+	private:
+		hid_broadcast_reader *reader_ = nullptr;
+	};
+
+	/** @brief An open HID device.
+
+		Move-only owner of a #hid_device, closed with hid_close()
+		when the object is destroyed. An object may be empty
+		(if opening the device failed or after it was moved from),
+		which can be tested with operator bool().
+
+		@ingroup CPP
+	*/
+	class device {
+	public:
+		device() noexcept = default;
+
+		/** @brief Take the ownership of a handle returned by the C API. */
+		explicit device(hid_device *dev) noexcept
+			: dev_(dev)
+		{
+		}
+
+		device(const device &) = delete;
+		device &operator=(const device &) = delete;
+
+		device(device &&other) noexcept
+			: dev_(std::exchange(other.dev_, nullptr))
+		{
+		}
+
+		device &operator=(device &&other) noexcept
+		{
+			if (this != &other) {
+				close();
+				dev_ = std::exchange(other.dev_, nullptr);
+			}
+			return *this;
+		}
+
+		~device()
+		{
+			close();
+		}
+
+		/** @brief Open a device by its VID, PID and optionally serial number, see hid_open(). */
+		static device open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number = nullptr) noexcept
+		{
+			return device(hid_open(vendor_id, product_id, serial_number));
+		}
+
+		/** @brief Open a device by its path, see hid_open_path(). */
+		static device open_path(const char *path) noexcept
+		{
+			return device(hid_open_path(path));
+		}
+
+		/** @brief Close the device (if open), see hid_close(). */
+		void close() noexcept
+		{
+			if (dev_)
+				hid_close(std::exchange(dev_, nullptr));
+		}
+
+		/** @brief The underlying C handle (still owned by this object). */
+		hid_device *get() const noexcept
+		{
+			return dev_;
+		}
+
+		/** @brief Give up the ownership of the C handle. */
+		hid_device *release() noexcept
+		{
+			return std::exchange(dev_, nullptr);
+		}
+
+		/** @brief true if the object holds an open device. */
+		explicit operator bool() const noexcept
+		{
+			return dev_ != nullptr;
+		}
+
+		/** @brief Write an Output report, see hid_write(). */
+		int write(std::span<const unsigned char> data) noexcept
+		{
+			return hid_write(dev_, data.data(), data.size());
+		}
+
+		/** @brief Read an Input report, see hid_read(). */
+		int read(std::span<unsigned char> data) noexcept
+		{
+			return hid_read(dev_, data.data(), data.size());
+		}
+
+		/** @brief Read an Input report with a timeout, see hid_read_timeout().
+
+			The timeout is rounded up to whole milliseconds.
+			A negative timeout blocks until a report is available.
+		*/
+		template <class Rep, class Period>
+		int read(std::span<unsigned char> data, std::chrono::duration<Rep, Period> timeout) noexcept
+		{
+			return hid_read_timeout(dev_, data.data(), data.size(), detail::to_milliseconds(timeout));
+		}
+
+		/** @brief Set the blocking mode of read(), see hid_set_nonblocking(). */
+		int set_nonblocking(bool nonblock) noexcept
+		{
+			return hid_set_nonblocking(dev_, nonblock ? 1 : 0);
+		}
+
+		/** @brief Route the Input reports of a Report ID to a callback, see hid_subscribe_report_id(). */
+		int subscribe_report_id(unsigned char report_id, hid_report_callback callback, void *user_data) noexcept
+		{
+			return hid_subscribe_report_id(dev_, report_id, callback, user_data);
+		}
+
+		/** @brief Stop routing the Input reports of a Report ID, see hid_unsubscribe_report_id(). */
+		int unsubscribe_report_id(unsigned char report_id) noexcept
+		{
+			return hid_unsubscribe_report_id(dev_, report_id);
+		}
+
+		/** @brief Keep only the newest Input report of each Report ID, see hid_set_read_latest(). */
+		int set_read_latest(bool enable) noexcept
+		{
+			return hid_set_read_latest(dev_, enable ? 1 : 0);
+		}
+
+		/** @brief Get the newest Input report of a Report ID, see hid_read_latest(). */
+		int read_latest(unsigned char report_id, std::span<unsigned char> data) noexcept
+		{
+			return hid_read_latest(dev_, report_id, data.data(), data.size());
+		}
+
+		/** @brief Deliver only the Input reports which changed, see hid_set_changes_only(). */
+		int set_changes_only(bool enable) noexcept
+		{
+			return hid_set_changes_only(dev_, enable ? 1 : 0);
+		}
+
+		/** @brief Set which bits of a Report ID are compared in changes-only mode, see hid_set_change_mask().
+
+			An empty mask compares the whole report again.
+		*/
+		int set_change_mask(unsigned char report_id, std::span<const unsigned char> mask) noexcept
+		{
+			return hid_set_change_mask(dev_, report_id, mask.empty() ? nullptr : mask.data(), mask.size());
+		}
+
+		/** @brief Get the number of reports dropped as unchanged, see hid_get_unchanged_count(). */
+		int unchanged_count(unsigned long long &count) noexcept
+		{
+			return hid_get_unchanged_count(dev_, &count);
+		}
+
+		/** @brief Downsample the Input reports of a Report ID, see hid_set_decimation().
+
+			A null @p decimation delivers every report again.
+		*/
+		int set_decimation(unsigned char report_id, const hid_decimation *decimation) noexcept
+		{
+			return hid_set_decimation(dev_, report_id, decimation);
+		}
+
+		/** @brief Deliver the Input reports in batches, see hid_set_batching().
+
+			A @p max_reports of 0 or 1 turns batching off.
+		*/
+		int set_batching(unsigned int max_reports, std::chrono::microseconds max_delay) noexcept
+		{
+			const auto us = max_delay.count();
+			return hid_set_batching(dev_, max_reports, us < 0 ? 0u : static_cast<unsigned int>(us));
+		}
+
+		/** @brief Fan the Input reports out to several readers, see hid_set_broadcast().
+
+			A @p slots of 0 turns broadcast mode off.
+		*/
+		int set_broadcast(unsigned int slots, std::size_t max_report_length) noexcept
+		{
+			return hid_set_broadcast(dev_, slots, max_report_length);
+		}
+
+		/** @brief Open a reader of the broadcast ring, see hid_broadcast_open().
+
+			The returned object is empty on failure.
+		*/
+		broadcast_reader open_broadcast_reader() noexcept
+		{
+			return broadcast_reader(hid_broadcast_open(dev_));
+		}
+
+		/** @brief Write a request and read the Input report answering it, see hid_transact().
+
+			The timeout is rounded up to whole milliseconds.
+		*/
+		template <class Rep, class Period>
+		int transact(std::span<const unsigned char> request, hid_report_match match, void *user_data, std::span<unsigned char> response, std::chrono::duration<Rep, Period> timeout) noexcept
+		{
+			return hid_transact(dev_, request.data(), request.size(), match, user_data, response.data(), response.size(), detail::to_milliseconds(timeout));
+		}
+
+		/** @brief Send a Feature report, see hid_send_feature_report(). */
+		int send_feature_report(std::span<const unsigned char> data) noexcept
+		{
+			return hid_send_feature_report(dev_, data.data(), data.size());
+		}
+
+		/** @brief Get a Feature report, see hid_get_feature_report().
+
+			The first byte of @p data must be set to the Report ID.
+		*/
+		int get_feature_report(std::span<unsigned char> data) noexcept
+		{
+			return hid_get_feature_report(dev_, data.data(), data.size());
+		}
+
+		/** @brief Get an Input report, see hid_get_input_report().
+
+			The first byte of @p data must be set to the Report ID.
+		*/
+		int get_input_report(std::span<unsigned char> data) noexcept
+		{
+			return hid_get_input_report(dev_, data.data(), data.size());
+		}
+
+		/** @brief Get the Manufacturer String, see hid_get_manufacturer_string(). */
+		int get_manufacturer_string(std::span<wchar_t> string) noexcept
+		{
+			return hid_get_manufacturer_string(dev_, string.data(), string.size());
+		}
+
+		/** @brief Get the Product String, see hid_get_product_string(). */
+		int get_product_string(std::span<wchar_t> string) noexcept
+		{
+			return hid_get_product_string(dev_, string.data(), string.size());
+		}
+
+		/** @brief Get the Serial Number String, see hid_get_serial_number_string(). */
+		int get_serial_number_string(std::span<wchar_t> string) noexcept
+		{
+			return hid_get_serial_number_string(dev_, string.data(), string.size());
+		}
+
+		/** @brief Get a string by its index, see hid_get_indexed_string(). */
+		int get_indexed_string(int string_index, std::span<wchar_t> string) noexcept
+		{
+			return hid_get_indexed_string(dev_, string_index, string.data(), string.size());
+		}
+
+		/** @brief Get the Manufacturer String as UTF-8, see hid_get_manufacturer_string_utf8(). */
+		int get_manufacturer_string(std::span<char> string) noexcept
+		{
+			return hid_get_manufacturer_string_utf8(dev_, string.data(), string.size());
+		}
+
+		/** @brief Get the Product String as UTF-8, see hid_get_product_string_utf8(). */
+		int get_product_string(std::span<char> string) noexcept
+		{
+			return hid_get_product_string_utf8(dev_, string.data(), string.size());
+		}
+
+		/** @brief Get the Serial Number String as UTF-8, see hid_get_serial_number_string_utf8(). */
+		int get_serial_number_string(std::span<char> string) noexcept
+		{
+			return hid_get_serial_number_string_utf8(dev_, string.data(), string.size());
+		}
+
+		/** @brief Get a string by its index as UTF-8, see hid_get_indexed_string_utf8(). */
+		int get_indexed_string(int string_index, std::span<char> string) noexcept
+		{
+			return hid_get_indexed_string_utf8(dev_, string_index, string.data(), string.size());
+		}
+
+		/** @brief The last error on this device, see hid_error(). */
+		const wchar_t *error() const noexcept
+		{
+			return hid_error(dev_);
+		}
+
+		/** @brief The code of the last error on this device, see hid_error_code(). */
+		int error_code() const noexcept
+		{
+			return hid_error_code(dev_);
+		}
+
+	private:
+		hid_device *dev_ = nullptr;
+	};
+
+	/** @brief The result of an enumeration.
+
+		Move-only owner of a #hid_device_info list, freed with
+		hid_free_enumeration() when the object is destroyed.
+		Iterating it walks the list in place.
+
+		@ingroup CPP
+	*/
+	class enumeration {
+	public:
+		/** @brief Forward iterator over the #hid_device_info records. */
+		class iterator {
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = hid_device_info;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const hid_device_info *;
+			using reference = const hid_device_info &;
+
+			iterator() noexcept = default;
+
+			explicit iterator(const hid_device_info *info) noexcept
+				: info_(info)
+			{
+			}
+
+			reference operator*() const noexcept
+			{
+				return *info_;
+			}
+
+			pointer operator->() const noexcept
+			{
+				return info_;
+			}
+
+			iterator &operator++() noexcept
+			{
+				info_ = info_->next;
+				return *this;
+			}
+
+			iterator operator++(int) noexcept
+			{
+				iterator tmp = *this;
+				info_ = info_->next;
+				return tmp;
+			}
+
+			friend bool operator==(const iterator &a, const iterator &b) noexcept
+			{
+				return a.info_ == b.info_;
+			}
+
+			friend bool operator!=(const iterator &a, const iterator &b) noexcept
+			{
+				return a.info_ != b.info_;
+			}
+
+		private:
+			const hid_device_info *info_ = nullptr;
+		};
+
+		using const_iterator = iterator;
+
+		enumeration() noexcept = default;
+
+		/** @brief Enumerate the HID devices, see hid_enumerate(). */
+		enumeration(unsigned short vendor_id, unsigned short product_id) noexcept
+			: devs_(hid_enumerate(vendor_id, product_id))
+		{
+		}
+
+		/** @brief Enumerate the HID devices matching a filter, see hid_enumerate_filtered(). */
+		explicit enumeration(const hid_filter &filter) noexcept
+			: devs_(hid_enumerate_filtered(&filter))
+		{
+		}
+
+		/** @brief Take the ownership of a list returned by the C API. */
+		explicit enumeration(hid_device_info *devs) noexcept
+			: devs_(devs)
+		{
+		}
+
+		enumeration(const enumeration &) = delete;
+		enumeration &operator=(const enumeration &) = delete;
+
+		enumeration(enumeration &&other) noexcept
+			: devs_(std::exchange(other.devs_, nullptr))
+		{
+		}
+
+		enumeration &operator=(enumeration &&other) noexcept
+		{
+			if (this != &other) {
+				reset();
+				devs_ = std::exchange(other.devs_, nullptr);
+			}
+			return *this;
+		}
+
+		~enumeration()
+		{
+			reset();
+		}
+
+		/** @brief Free the list (if any), see hid_free_enumeration(). */
+		void reset() noexcept
+		{
+			if (devs_)
+				hid_free_enumeration(std::exchange(devs_, nullptr));
+		}
+
+		/** @brief The underlying list (still owned by this object). */
+		hid_device_info *get() const noexcept
+		{
+			return devs_;
+		}
+
+		/** @brief Give up the ownership of the list. */
+		hid_device_info *release() noexcept
+		{
+			return std::exchange(devs_, nullptr);
+		}
+
+		bool empty() const noexcept
+		{
+			return devs_ == nullptr;
+		}
+
+		iterator begin() const noexcept
+		{
+			return iterator(devs_);
+		}
+
+		iterator end() const noexcept
+		{
+			return iterator();
+		}
+
+	private:
+		hid_device_info *devs_ = nullptr;
+	};
+
+	/** @brief Enumerate the HID devices, see hid_enumerate().
+
+		@ingroup CPP
+	*/
+	inline enumeration enumerate(unsigned short vendor_id = 0, unsigned short product_id = 0) noexcept
+	{
+		return enumeration(vendor_id, product_id);
+	}
+
+	/** @brief Enumerate the HID devices matching a filter, see hid_enumerate_filtered().
+
+		@ingroup CPP
+	*/
+	inline enumeration enumerate(const hid_filter &filter) noexcept
+	{
+		return enumeration(filter);
+	}
+
+	/** @brief Visit the HID devices matching a filter, see hid_enumerate_visit().
+
+		@p visitor is called with a const #hid_device_info & and
+		returns true to stop the enumeration. It must not throw.
+
+		@returns 1 if @p visitor stopped the enumeration, 0 if all
+			the matching devices were visited, -1 on error.
+
+		@ingroup CPP
+	*/
+	template <class Visitor>
+	int visit(const hid_filter *filter, Visitor &&visitor) noexcept
+	{
+		using visitor_type = std::remove_reference_t<Visitor>;
+		return hid_enumerate_visit(filter, [](const hid_device_info *info, void *user_data) -> int {
+			return (*static_cast<visitor_type *>(user_data))(*info) ? 1 : 0;
+		}, const_cast<void *>(static_cast<const void *>(std::addressof(visitor))));
+	}
+
+}
+
+#endif
@@ -0,0 +1,413 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/** @file
+ * @ingroup CPP
+ *
+ * Optional header-only C++20 coroutine API on top of hidapi.hpp
+ * (Linux only, for the hidraw and libusb backends).
+ *
+ * A hid::executor waits with epoll on the input file descriptors of its
+ * devices (see hid_get_input_fd()): an epoll instance watching the hidraw
+ * node for the hidraw backend, and a pipe signaled from the transfer
+ * completion callback for the libusb backend. Any number of devices can
+ * be served by a single thread calling hid::executor::run():
+ *
+ * @code
+ * hid::detached_task pump(hid::async_device &dev)
+ * {
+ *     std::array<unsigned char, 64> buf;
+ *     for (;;) {
+ *         int res = co_await dev.read_async(buf);
+ *         if (res < 0)
+ *             break;
+ *         ...
+ *     }
+ * }
+ *
+ * hid::executor ex;
+ * hid::async_device dev(ex, hid::device::open_path(path));
+ * pump(dev);
+ * ex.run();
+ * @endcode
+ *
+ * Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0).
+ */
+
+#ifndef HIDAPI_ASYNC_HPP__
+#define HIDAPI_ASYNC_HPP__
+
+#include "hidapi.hpp"
+
+#if !defined(__cpp_impl_coroutine) || !defined(__cpp_lib_coroutine)
+#error "hidapi_async.hpp requires C++20 coroutines"
+#endif
+
+#if !defined(__linux__)
+#error "hidapi_async.hpp is only available on Linux"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace hid {
+
+	namespace detail {
+		/* An operation waiting for a file descriptor of the executor */
+		class waiter {
+		public:
+			virtual void on_ready() noexcept = 0;
+
+		protected:
+			~waiter() = default;
+		};
+	}
+
+	/** @brief Coroutine type for fire-and-forget tasks.
+
+		The coroutine starts running immediately and
+		destroys itself when it returns.
+
+		@ingroup CPP
+	*/
+	struct detached_task {
+		struct promise_type {
+			detached_task get_return_object() noexcept
+			{
+				return {};
+			}
+
+			std::suspend_never initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			std::suspend_never final_suspend() noexcept
+			{
+				return {};
+			}
+
+			void return_void() noexcept
+			{
+			}
+
+			void unhandled_exception() noexcept
+			{
+				std::terminate();
+			}
+		};
+	};
+
+	/** @brief Event loop resuming the coroutines waiting on HID devices.
+
+		Uses a single epoll instance. Not thread-safe, except for stop():
+		an executor, and the devices attached to it, should be used from
+		the thread which calls run(). Use one executor per thread to
+		spread the devices over several threads.
+
+		@ingroup CPP
+	*/
+	class executor {
+	public:
+		executor() noexcept
+			: epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+			  wake_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+		{
+			if (epoll_fd_ >= 0 && wake_fd_ >= 0) {
+				struct epoll_event ev = {};
+				ev.events = EPOLLIN;
+				ev.data.ptr = nullptr;
+				epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+			}
+		}
+
+		executor(const executor &) = delete;
+		executor &operator=(const executor &) = delete;
+
+		~executor()
+		{
+			if (wake_fd_ >= 0)
+				::close(wake_fd_);
+			if (epoll_fd_ >= 0)
+				::close(epoll_fd_);
+		}
+
+		/** @brief true if the epoll instance could be created. */
+		explicit operator bool() const noexcept
+		{
+			return epoll_fd_ >= 0 && wake_fd_ >= 0;
+		}
+
+		/** @brief Resume the waiting coroutines until stop() is called.
+
+			@returns 0 after stop(), -1 on an epoll error.
+		*/
+		int run() noexcept
+		{
+			while (!stopped_.exchange(false)) {
+				if (run_one(-1) < 0)
+					return -1;
+			}
+			return 0;
+		}
+
+		/** @brief Wait for events once and resume the coroutines they complete.
+
+			@param timeout_ms Maximum time to wait, -1 to wait
+				until an event (or stop()) arrives.
+
+			@returns The number of events handled, or -1 on error.
+		*/
+		int run_one(int timeout_ms) noexcept
+		{
+			struct epoll_event events[64];
+			int n = epoll_wait(epoll_fd_, events, 64, timeout_ms);
+			if (n < 0)
+				return errno == EINTR ? 0 : -1;
+
+			for (int i = 0; i < n; i++) {
+				auto *w = static_cast<detail::waiter *>(events[i].data.ptr);
+				if (w) {
+					w->on_ready();
+				}
+				else {
+					uint64_t count;
+					if (::read(wake_fd_, &count, sizeof(count)) < 0) {
+						/* Already drained */
+					}
+				}
+			}
+			return n;
+		}
+
+		/** @brief Make run() return. Can be called from any thread. */
+		void stop() noexcept
+		{
+			uint64_t one = 1;
+			stopped_ = true;
+			if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+				/* The counter is already non-zero */
+			}
+		}
+
+		/* Calls w->on_ready() once when fd becomes readable. */
+		bool wait_readable(int fd, detail::waiter *w) noexcept
+		{
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = w;
+			if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0)
+				return true;
+			return errno == ENOENT && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+		}
+
+		/* Stops watching fd. */
+		void forget(int fd) noexcept
+		{
+			epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+		}
+
+	private:
+		int epoll_fd_;
+		int wake_fd_;
+		std::atomic<bool> stopped_{false};
+	};
+
+	class async_device;
+
+	/** @brief Awaitable returned by async_device::read_async().
+
+		co_await gives the same result as hid_read() would:
+		the number of bytes read, or -1 on error (including
+		disconnection of the device).
+
+		@ingroup CPP
+	*/
+	class read_operation final : private detail::waiter {
+	public:
+		read_operation(async_device &dev, std::span<unsigned char> data) noexcept
+			: dev_(&dev), data_(data)
+		{
+		}
+
+		bool await_ready() noexcept;
+
+		bool await_suspend(std::coroutine_handle<> handle) noexcept;
+
+		int await_resume() const noexcept
+		{
+			return result_;
+		}
+
+	private:
+		void on_ready() noexcept override;
+
+		int try_read() noexcept;
+
+		async_device *dev_;
+		std::span<unsigned char> data_;
+		std::coroutine_handle<> handle_;
+		int result_ = 0;
+	};
+
+	/** @brief Awaitable returned by async_device::write_async().
+
+		None of the backends can queue Output reports, so the write
+		is made synchronously (like hid_write()) and the awaiting
+		coroutine is never suspended. co_await gives the result of
+		hid_write().
+
+		@ingroup CPP
+	*/
+	class write_operation {
+	public:
+		write_operation(async_device &dev, std::span<const unsigned char> data) noexcept
+			: dev_(&dev), data_(data)
+		{
+		}
+
+		bool await_ready() noexcept;
+
+		void await_suspend(std::coroutine_handle<>) noexcept
+		{
+		}
+
+		int await_resume() const noexcept
+		{
+			return result_;
+		}
+
+	private:
+		async_device *dev_;
+		std::span<const unsigned char> data_;
+		int result_ = -1;
+	};
+
+	/** @brief A HID device whose reports are awaited on an executor.
+
+		Only one read_async() may be pending at a time, and the object
+		must outlive it. The object can't be moved, since pending
+		operations refer to it.
+
+		@ingroup CPP
+	*/
+	class async_device {
+	public:
+		async_device(executor &ex, device dev) noexcept
+			: ex_(&ex), dev_(std::move(dev)),
+			  fd_(dev_ ? hid_get_input_fd(dev_.get()) : -1)
+		{
+		}
+
+		async_device(const async_device &) = delete;
+		async_device &operator=(const async_device &) = delete;
+
+		~async_device()
+		{
+			if (fd_ >= 0)
+				ex_->forget(fd_);
+		}
+
+		/** @brief true if the device is open and can be waited on. */
+		explicit operator bool() const noexcept
+		{
+			return dev_ && fd_ >= 0;
+		}
+
+		/** @brief The underlying device, for the synchronous calls. */
+		device &get() noexcept
+		{
+			return dev_;
+		}
+
+		/** @brief Wait for an Input report, see hid_read().
+
+			@p data must stay valid until the operation completes.
+		*/
+		read_operation read_async(std::span<unsigned char> data) noexcept
+		{
+			return read_operation(*this, data);
+		}
+
+		/** @brief Write an Output report, see hid_write() and write_operation. */
+		write_operation write_async(std::span<const unsigned char> data) noexcept
+		{
+			return write_operation(*this, data);
+		}
+
+	private:
+		friend class read_operation;
+		friend class write_operation;
+
+		executor *ex_;
+		device dev_;
+		int fd_;
+	};
+
+	inline int read_operation::try_read() noexcept
+	{
+		if (dev_->fd_ < 0 || data_.empty())
+			return -1;
+		return hid_read_timeout(dev_->dev_.get(), data_.data(), data_.size(), 0);
+	}
+
+	inline bool read_operation::await_ready() noexcept
+	{
+		result_ = try_read();
+		return result_ != 0;
+	}
+
+	inline bool read_operation::await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		handle_ = handle;
+		if (dev_->ex_->wait_readable(dev_->fd_, this))
+			return true;
+
+		result_ = -1;
+		return false;
+	}
+
+	inline void read_operation::on_ready() noexcept
+	{
+		result_ = try_read();
+		if (result_ == 0) {
+			/* Spurious wakeup, wait again */
+			if (dev_->ex_->wait_readable(dev_->fd_, this))
+				return;
+			result_ = -1;
+		}
+		handle_.resume();
+	}
+
+	inline bool write_operation::await_ready() noexcept
+	{
+		result_ = dev_->dev_.write(data_);
+		return true;
+	}
+
+}
+
+#endif
@@ -0,0 +1,559 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/** @file
+ * @ingroup CPP
+ *
+ * Optional header-only device manager on top of hidapi.hpp
+ * (Linux only, for the hidraw and libusb backends).
+ *
+ * A hid::device_manager serves a large number of devices with a fixed
+ * number of worker threads, one per CPU by default. Each device is
+ * assigned to one worker (its shard), which waits with a single epoll
+ * instance on the input file descriptors of all its devices (see
+ * hid_get_input_fd()) and calls the report handler of the device for
+ * each Input report. A worker whose devices are much less busy than
+ * those of another worker takes over devices from it.
+ *
+ * @code
+ * hid::device_manager manager;
+ * manager.add(hid::device::open_path(path),
+ *     [](hid::device &dev, std::span<const unsigned char> report) {
+ *         if (report.empty())
+ *             return false; // Read error, the device is closed
+ *         ...
+ *         return true;
+ *     });
+ * @endcode
+ *
+ * With the libusb backend, each open device still has a thread of its
+ * own handling the libusb events unless the application handles them,
+ * see hid_libusb_set_context().
+ *
+ * Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0).
+ */
+
+#ifndef HIDAPI_MANAGER_HPP__
+#define HIDAPI_MANAGER_HPP__
+
+#include "hidapi.hpp"
+
+#if !defined(__linux__)
+#error "hidapi_manager.hpp is only available on Linux"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace hid {
+
+	/** @brief Called by a device_manager worker for each Input report.
+
+		An empty @p report means that reading failed (for instance
+		because the device was disconnected); the device is closed
+		after the call. Otherwise returning false closes the device.
+
+		The handler of a device is never called concurrently, but the
+		handlers of different devices are called from different threads.
+
+		@ingroup CPP
+	*/
+	using report_handler = std::function<bool(device &, std::span<const unsigned char>)>;
+
+	/** @brief Settings of a device_manager.
+
+		@ingroup CPP
+	*/
+	struct device_manager_options {
+		/** Number of worker threads, 0 for one per CPU the process
+			may run on (see sched_getaffinity()). */
+		unsigned workers = 0;
+		/** Pin worker i to the CPU (first_cpu + i), modulo their
+			number, of the CPUs the process may run on. See
+			device_manager::pin_error(). */
+		bool pin_workers = true;
+		unsigned first_cpu = 0;
+		/** How often the workers compare their load. */
+		std::chrono::milliseconds rebalance_interval{100};
+		/** Maximum number of reports read from a device per wakeup,
+			so that a busy device can't starve the others of its worker. */
+		unsigned max_reports_per_wakeup = 16;
+		/** Size of the buffer the reports are read into. */
+		std::size_t max_report_size = 4096;
+	};
+
+	/** @brief Serves the Input reports of many devices with a pool of worker threads.
+
+		Devices are added with add() and owned by the manager from then
+		on; they are closed when their handler asks for it, on a read
+		error, or when the manager is destroyed.
+
+		The load of a device is the number of Input reports it recently
+		delivered. Every rebalance interval, a worker whose load is less
+		than half the load of the busiest worker asks it for a device,
+		and gets the busiest of its devices whose move reduces the
+		imbalance, if any.
+
+		add() and the statistics can be called from any thread.
+
+		@ingroup CPP
+	*/
+	class device_manager {
+	public:
+		explicit device_manager(const device_manager_options &options = {})
+			: options_(options)
+		{
+			/* The CPUs the process may run on, which may be fewer (or
+			   other ones) than the cores of the machine */
+			std::vector<int> cpus;
+			int affinity_error = 0;
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+				for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+					if (CPU_ISSET(cpu, &allowed))
+						cpus.push_back(cpu);
+				}
+			}
+			else {
+				affinity_error = errno;
+			}
+
+			unsigned cores = cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : static_cast<unsigned>(cpus.size());
+			unsigned count = options_.workers ? options_.workers : cores;
+			if (options_.max_reports_per_wakeup == 0)
+				options_.max_reports_per_wakeup = 1;
+
+			for (unsigned i = 0; i < count; i++) {
+				shards_.push_back(std::make_unique<shard>(*this, options_.max_report_size));
+				if (!*shards_.back()) {
+					shards_.clear();
+					return;
+				}
+				if (options_.pin_workers) {
+					if (cpus.empty())
+						shards_.back()->pin_error_ = affinity_error ? affinity_error : EINVAL;
+					else
+						shards_.back()->cpu_ = cpus[(options_.first_cpu + i) % cpus.size()];
+				}
+			}
+
+			/* All the shards exist before any worker can look for a
+			   victim, and the workers are pinned (or failed to) when
+			   the constructor returns */
+			std::latch started(count);
+			for (unsigned i = 0; i < count; i++) {
+				shard &s = *shards_[i];
+				s.thread = std::thread([&s, &started] { s.run(started); });
+			}
+			started.wait();
+		}
+
+		device_manager(const device_manager &) = delete;
+		device_manager &operator=(const device_manager &) = delete;
+
+		/** @brief Stops the workers and closes all the devices. */
+		~device_manager()
+		{
+			for (auto &s : shards_)
+				s->post_stop();
+			for (auto &s : shards_) {
+				if (s->thread.joinable())
+					s->thread.join();
+			}
+		}
+
+		/** @brief true if the workers could be started. */
+		explicit operator bool() const noexcept
+		{
+			return !shards_.empty();
+		}
+
+		/** @brief Add a device to the worker with the fewest devices.
+
+			@returns The index of the worker, or -1 if the device is not
+				open or can't be waited on (it is closed in that case).
+		*/
+		int add(device dev, report_handler handler)
+		{
+			if (shards_.empty() || !dev || !handler)
+				return -1;
+
+			int fd = hid_get_input_fd(dev.get());
+			if (fd < 0)
+				return -1;
+
+			std::size_t best = 0;
+			for (std::size_t i = 1; i < shards_.size(); i++) {
+				const shard &s = *shards_[i];
+				const shard &b = *shards_[best];
+				if (s.device_count() < b.device_count() ||
+				    (s.device_count() == b.device_count() && s.load() < b.load()))
+					best = i;
+			}
+
+			auto md = std::make_unique<managed_device>(std::move(dev), std::move(handler), fd);
+			shards_[best]->post_adopt(std::move(md));
+			return static_cast<int>(best);
+		}
+
+		/** @brief The number of worker threads. */
+		std::size_t workers() const noexcept
+		{
+			return shards_.size();
+		}
+
+		/** @brief The number of devices served by a worker. */
+		std::size_t devices(std::size_t worker) const noexcept
+		{
+			return worker < shards_.size() ? shards_[worker]->device_count() : 0;
+		}
+
+		/** @brief The recent load (reports per rebalance interval) of a worker. */
+		std::uint64_t load(std::size_t worker) const noexcept
+		{
+			return worker < shards_.size() ? shards_[worker]->load() : 0;
+		}
+
+		/** @brief Why a worker couldn't be pinned to its CPU.
+
+			@returns 0 if the worker is pinned (or pinning is off),
+				otherwise the error number of sched_getaffinity()
+				or pthread_setaffinity_np(). The worker then runs
+				on any CPU.
+		*/
+		int pin_error(std::size_t worker) const noexcept
+		{
+			return worker < shards_.size() ? shards_[worker]->pin_error_ : 0;
+		}
+
+	private:
+		struct managed_device {
+			managed_device(device d, report_handler h, int f)
+				: dev(std::move(d)), handler(std::move(h)), fd(f)
+			{
+			}
+
+			device dev;
+			report_handler handler;
+			int fd;
+			/* Reports since the last rebalance tick */
+			std::uint64_t recent = 0;
+			/* Decaying average of recent */
+			std::uint64_t score = 0;
+		};
+
+		class shard {
+		public:
+			shard(device_manager &manager, std::size_t report_size)
+				: manager_(manager),
+				  epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+				  wake_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+				  buf_(report_size)
+			{
+				if (epoll_fd_ >= 0 && wake_fd_ >= 0) {
+					struct epoll_event ev = {};
+					ev.events = EPOLLIN;
+					ev.data.ptr = nullptr;
+					epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+				}
+			}
+
+			shard(const shard &) = delete;
+			shard &operator=(const shard &) = delete;
+
+			~shard()
+			{
+				/* Close the devices before the file descriptors they are registered with */
+				devices_.clear();
+				inbox_.clear();
+				if (wake_fd_ >= 0)
+					::close(wake_fd_);
+				if (epoll_fd_ >= 0)
+					::close(epoll_fd_);
+			}
+
+			explicit operator bool() const noexcept
+			{
+				return epoll_fd_ >= 0 && wake_fd_ >= 0;
+			}
+
+			std::size_t device_count() const noexcept
+			{
+				return device_count_.load(std::memory_order_relaxed);
+			}
+
+			std::uint64_t load() const noexcept
+			{
+				return load_.load(std::memory_order_relaxed);
+			}
+
+			void post_adopt(std::unique_ptr<managed_device> md)
+			{
+				device_count_.fetch_add(1, std::memory_order_relaxed);
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					inbox_.push_back(command{std::move(md), nullptr});
+				}
+				wake();
+			}
+
+			void post_steal(shard *thief)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					inbox_.push_back(command{nullptr, thief});
+				}
+				wake();
+			}
+
+			void post_stop() noexcept
+			{
+				stopping_.store(true);
+				wake();
+			}
+
+			void run(std::latch &started) noexcept
+			{
+				/* Pinned from the thread itself, before it serves
+				   any device. started is gone once counted down. */
+				if (cpu_ >= 0) {
+					cpu_set_t set;
+					CPU_ZERO(&set);
+					CPU_SET(cpu_, &set);
+					pin_error_ = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+				}
+				started.count_down();
+
+				const auto interval = std::max(manager_.options_.rebalance_interval, std::chrono::milliseconds(1));
+				auto next_tick = std::chrono::steady_clock::now() + interval;
+
+				while (!stopping_.load()) {
+					auto now = std::chrono::steady_clock::now();
+					if (now >= next_tick) {
+						rebalance_tick();
+						next_tick = now + interval;
+					}
+					int timeout_ms = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(next_tick - now).count());
+
+					struct epoll_event events[64];
+					int n = epoll_wait(epoll_fd_, events, 64, timeout_ms);
+					if (n < 0 && errno != EINTR)
+						break;
+
+					for (int i = 0; i < n; i++) {
+						auto *md = static_cast<managed_device *>(events[i].data.ptr);
+						if (md) {
+							service(md);
+						}
+						else {
+							uint64_t count;
+							if (::read(wake_fd_, &count, sizeof(count)) < 0) {
+								/* Already drained */
+							}
+						}
+					}
+
+					process_inbox();
+				}
+			}
+
+			std::thread thread;
+			/* The CPU to pin the worker to, or -1 */
+			int cpu_ = -1;
+			/* Set before the constructor of the manager returns */
+			int pin_error_ = 0;
+
+		private:
+			struct command {
+				/* Device to adopt, or nullptr for a steal request from thief */
+				std::unique_ptr<managed_device> md;
+				shard *thief;
+			};
+
+			void wake() noexcept
+			{
+				uint64_t one = 1;
+				if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+					/* The counter is already non-zero */
+				}
+			}
+
+			/* Reads the pending reports of md, level-triggered epoll
+			   brings it back if more than the batch is pending. */
+			void service(managed_device *md) noexcept
+			{
+				for (unsigned i = 0; i < manager_.options_.max_reports_per_wakeup; i++) {
+					int res = hid_read_timeout(md->dev.get(), buf_.data(), buf_.size(), 0);
+					if (res == 0)
+						return;
+
+					bool keep;
+					if (res > 0) {
+						md->recent++;
+						keep = call(md, std::span<const unsigned char>(buf_.data(), static_cast<std::size_t>(res)));
+					}
+					else {
+						call(md, std::span<const unsigned char>());
+						keep = false;
+					}
+
+					if (!keep) {
+						/* Closes the device */
+						detach(md);
+						return;
+					}
+				}
+			}
+
+			bool call(managed_device *md, std::span<const unsigned char> report) noexcept
+			{
+				try {
+					return md->handler(md->dev, report);
+				}
+				catch (...) {
+					return false;
+				}
+			}
+
+			std::unique_ptr<managed_device> detach(managed_device *md) noexcept
+			{
+				epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, md->fd, nullptr);
+				device_count_.fetch_sub(1, std::memory_order_relaxed);
+
+				auto it = std::find_if(devices_.begin(), devices_.end(),
+					[md](const std::unique_ptr<managed_device> &p) { return p.get() == md; });
+				std::unique_ptr<managed_device> owned = std::move(*it);
+				*it = std::move(devices_.back());
+				devices_.pop_back();
+				return owned;
+			}
+
+			void adopt(std::unique_ptr<managed_device> md)
+			{
+				struct epoll_event ev = {};
+				ev.events = EPOLLIN;
+				ev.data.ptr = md.get();
+				if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, md->fd, &ev) < 0) {
+					device_count_.fetch_sub(1, std::memory_order_relaxed);
+					return;
+				}
+				devices_.push_back(std::move(md));
+			}
+
+			/* Gives thief the busiest device whose move reduces the imbalance */
+			void give(shard *thief)
+			{
+				if (devices_.size() < 2)
+					return;
+
+				std::uint64_t mine = load();
+				std::uint64_t theirs = thief->load();
+				if (mine <= theirs)
+					return;
+
+				std::uint64_t limit = (mine - theirs) / 2;
+				managed_device *best = nullptr;
+				for (auto &p : devices_) {
+					if (p->score > 0 && p->score <= limit && (!best || p->score > best->score))
+						best = p.get();
+				}
+				if (!best)
+					return;
+
+				load_.fetch_sub(std::min(best->score, load()), std::memory_order_relaxed);
+				thief->load_.fetch_add(best->score, std::memory_order_relaxed);
+				thief->post_adopt(detach(best));
+			}
+
+			void process_inbox()
+			{
+				std::vector<command> commands;
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					commands.swap(inbox_);
+				}
+
+				for (auto &c : commands) {
+					if (c.md)
+						adopt(std::move(c.md));
+					else
+						give(c.thief);
+				}
+			}
+
+			void rebalance_tick()
+			{
+				std::uint64_t total = 0;
+				for (auto &p : devices_) {
+					p->score = (p->score + p->recent) / 2;
+					p->recent = 0;
+					total += p->score;
+				}
+				load_.store(total, std::memory_order_relaxed);
+
+				shard *victim = nullptr;
+				for (auto &s : manager_.shards_) {
+					if (s.get() != this && s->device_count() > 1 &&
+					    (!victim || s->load() > victim->load()))
+						victim = s.get();
+				}
+
+				/* Ignore small differences, moving a device isn't free */
+				if (victim && victim->load() > 2 * total + 16)
+					victim->post_steal(this);
+			}
+
+			device_manager &manager_;
+			int epoll_fd_;
+			int wake_fd_;
+			std::vector<unsigned char> buf_;
+
+			/* Only used by the worker thread */
+			std::vector<std::unique_ptr<managed_device>> devices_;
+
+			std::mutex mutex_;
+			std::vector<command> inbox_;
+
+			std::atomic<std::size_t> device_count_{0};
+			std::atomic<std::uint64_t> load_{0};
+			std::atomic<bool> stopping_{false};
+		};
+
+		device_manager_options options_;
+		std::vector<std::unique_ptr<shard>> shards_;
+	};
+
+}
+
+#endif
@@ -35,10 +35,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <wchar.h>
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <dirent.h>
+#include <limits.h>
+#endif
+#if (defined(__linux__) && !defined(__ANDROID__)) || defined(__FreeBSD__)
+#include <signal.h>
+#include <limits.h>
+#endif
+#if defined(__linux__) && !defined(__ANDROID__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif defined(__FreeBSD__)
+#include <sys/umtx.h>
+#endif
 
 /* GNU / LibUSB */
 #include <libusb.h>
@@ -51,6 +66,12 @@
 
 #include "hidapi_libusb.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #if defined(__ANDROID__) && __ANDROID_API__ < __ANDROID_API_N__
 
 /* Barrier implementation because Android/Bionic don't have pthread_barrier.
@@ -126,34 +147,258 @@ extern "C" {
 #define DETACH_KERNEL_DRIVER
 #endif
 
+/* hid_libusb_share() needs POSIX shared memory with robust,
+   process-shared mutexes. */
+#if (defined(__linux__) && !defined(__ANDROID__)) || defined(__FreeBSD__)
+#define SHARE_DEVICE
+#endif
+
 /* Uncomment to enable the retrieval of Usage and Usage Page in
-hid_enumerate(). Warning, on platforms different from FreeBSD
+hid_enumerate() by reading the Report Descriptor from the device.
+Warning, on platforms different from FreeBSD
 this is very invasive as it requires the detach
 and re-attach of the kernel driver. See comments inside hid_enumerate().
+On Linux this is not needed: the Report Descriptor is read from sysfs instead,
+which doesn't touch the device (see USAGE_FROM_SYSFS).
 libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
+/* Number of IN endpoints an interface can have (endpoints 1..15) */
+#define MAX_INPUT_ENDPOINTS 15
+
 /* Linked List of input reports received from the device. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
+	int interface; /* The interface the report was received on */
+	int endpoint; /* The endpoint the report was received on */
+	uint64_t seq; /* Arrival number, see hid_device::report_seq */
 	struct input_report *next;
 };
 
+/* A callback of hid_subscribe_report_id() */
+struct report_subscription {
+	hid_report_callback callback;
+	void *user_data;
+};
+
+/* The newest Input report of a Report ID, see hid_read_latest().
+   Written by one thread at a time and read lock-free by any number of
+   threads: seq is odd while the writer copies the report, and a reader
+   retries when seq changed during its own copy. */
+struct latest_report {
+	unsigned int seq;
+	size_t len;
+	size_t capacity;
+	unsigned char *data;
+	/* The smaller slot this one replaced, see store_latest_report() */
+	struct latest_report *retired;
+};
+
+/* A report in the broadcast ring. Like in latest_report, seq is odd
+   while the report is written; number tells which report it is. */
+struct broadcast_slot {
+	unsigned int seq;
+	unsigned int number;
+	size_t len;
+	unsigned char *data;
+};
+
+/* The ring of broadcast mode, see hid_set_broadcast(). Written by
+   read_callback() under shared->mutex, which never waits for the readers, and read
+   lock-free by each reader at its own cursor. Report n goes to slot
+   n & mask and head is the number of the next report. mutex and
+   condition only put the readers to sleep while the ring has nothing
+   new for them; waiters tells the writer whether to wake them up. */
+struct broadcast_ring {
+	unsigned int mask;
+	size_t slot_size;
+	struct broadcast_slot *slots;
+	unsigned int head;
+	unsigned int waiters;
+	unsigned int readers; /* Open readers, protected by the shared->mutex of the device */
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+};
+
+/* A reader of the broadcast ring, see hid_broadcast_open() */
+struct hid_broadcast_reader_ {
+	hid_device *dev;
+	struct broadcast_ring *ring;
+	unsigned int cursor; /* The number of the next report to read */
+	unsigned long long overflow;
+};
+
+#ifdef SHARE_DEVICE
+/* The shared memory object of hid_libusb_share(), mapped by the broker
+   and by every client of hid_open_shared(). The Input reports are
+   published in slots the way broadcast_ring does it, each client
+   reading at its own cursor. The Output reports of the clients go the
+   other way through a bounded queue of SHARED_OUTPUT_CELLS cells: a
+   client claims the cell at out_tail with a compare-and-swap and
+   publishes it by setting its seq to the claimed position + 1, the
+   broker frees it by setting seq to the position + SHARED_OUTPUT_CELLS.
+   The clients sleep on head with a futex (umtx on FreeBSD), which the
+   broker wakes without a lock from the libusb event thread, so that a
+   stalled client can't hold up the USB events. The mutex only guards
+   the sleeps of the broker on out_condition. It is robust, so that a
+   client dying while holding it doesn't hang the others. */
+#define SHARED_DEVICE_MAGIC 0x48494453 /* "HIDS" */
+#define SHARED_DEVICE_VERSION 1
+#define SHARED_OUTPUT_CELLS 64
+#define SHARED_DEVICE_MAX_SLOTS 65536
+#define SHARED_DEVICE_MAX_REPORT 65536
+
+struct shared_device_header {
+	uint32_t magic; /* Set last by the broker, once the rest is ready */
+	uint32_t version;
+	uint32_t mask; /* Number of Input slots - 1 */
+	uint32_t slot_size; /* Largest report, in both directions */
+	uint32_t closed; /* Set when the broker stops sharing */
+	int32_t broker_pid;
+	uint32_t head; /* Number of the next Input report */
+	uint32_t waiters; /* Clients sleeping on head */
+	uint32_t out_tail; /* Next Output cell to be claimed */
+	pthread_mutex_t mutex;
+	pthread_cond_t out_condition; /* An Output report was queued */
+};
+
+/* An Input slot or an Output cell, followed by its data */
+struct shared_slot {
+	uint32_t seq;
+	uint32_t number; /* Input only: the report in the slot */
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/* The sharing side of hid_libusb_share(). The geometry is kept here
+   too, as the clients could change the copy in the header. */
+struct device_broker {
+	hid_device *dev;
+	char *name;
+	struct shared_device_header *header;
+	size_t size;
+	uint32_t mask;
+	uint32_t slot_size;
+	uint32_t head;
+	int stop;
+	unsigned char *out_buf;
+	pthread_t thread; /* Writes the Output reports of the clients */
+};
+
+/* A client of a shared device, see hid_open_shared() */
+struct hid_shared_device_ {
+	struct shared_device_header *header;
+	size_t size;
+	uint32_t mask;
+	uint32_t slot_size;
+	pid_t broker_pid;
+	uint32_t cursor;
+};
+#endif
+
+/* The previous Input report of a Report ID in changes-only mode,
+   see hid_set_changes_only(). */
+struct change_filter {
+	unsigned char *data;
+	size_t len; /* 0 until the first report */
+	size_t capacity;
+	unsigned char *mask; /* see hid_set_change_mask() */
+	size_t mask_len;
+};
+
+/* The decimation stage of a Report ID, see hid_set_decimation(). */
+struct report_decimator {
+	struct hid_decimation config;
+	unsigned int skipped; /* HID_DECIMATE_EVERY_NTH: reports since the last one delivered */
+	unsigned char *window; /* The report of the open window */
+	size_t window_len; /* 0 while no window is open */
+	size_t capacity;
+	unsigned int window_count; /* Reports in the open window */
+	uint64_t window_end;
+};
+
+/* A capture file being recorded, see hid_start_capture(). The records
+   are copied into a shared mapping of the file, which is grown and
+   mapped again when full. */
+struct capture_file {
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	size_t used; /* The header and the complete records */
+	uint64_t start_ns;
+};
+
+/* The first size of a capture file, and the largest step it grows by */
+#define CAPTURE_MIN_SIZE (1024 * 1024)
+#define CAPTURE_MAX_STEP (64 * 1024 * 1024)
+
+
+/* A libusb device handle, shared by all hid_device objects opened from
+   the same physical USB device (e.g. several HID interfaces of a composite
+   device). It also owns the thread which handles the libusb events for
+   the transfers of all of those interfaces. */
+struct shared_device {
+	/* The context the device was opened from */
+	hid_context *context;
+
+	libusb_device *usb_dev;
+	libusb_device_handle *device_handle;
+
+	/* Number of hid_device objects using this handle.
+	   Protected by context->shared_devices_mutex. */
+	int refcount;
+
+	/* Event thread objects */
+	pthread_t thread;
+	int thread_started;
+	pthread_mutex_t mutex; /* Protects devices, active_transfers and the input_target of the devices */
+	pthread_barrier_t barrier; /* Ensures correct startup sequence */
+	int shutdown_thread;
+	int active_transfers;
+	int transfers_finished; /* active_transfers == 0 */
+	/* Set once a device of the handle turns batching on, see
+	   flush_batches() */
+	int batching;
+	/* Set once a device of the handle has a time window decimation
+	   stage, see flush_windows() */
+	int windows;
+
+	/* List of hid_device objects opened from this device
+	   (linked through hid_device::next_shared). */
+	struct hid_device_ *devices;
+
+	struct shared_device *next;
+};
+
+
+/* An error reported by hid_error()/hid_error_code(). Only the (static)
+   message and the libusb error code are stored, the wide string is
+   rendered into buf when hid_error() asks for it. */
+struct error_state {
+	const char *msg; /* A string constant, or NULL */
+	int usb_error; /* A libusb_error, or 0 */
+	int code; /* A hid_api_error */
+	wchar_t buf[256];
+};
 
 struct hid_device_ {
-	/* Handle to the actual device. */
+	/* Handle to the actual device (owned by shared). */
 	libusb_device_handle *device_handle;
+	struct shared_device *shared;
+	struct hid_device_ *next_shared;
 
 	/* Endpoint information */
-	int input_endpoint;
+	int input_endpoint; /* The first interrupt IN endpoint */
 	int output_endpoint;
-	int input_ep_max_packet_size;
 
 	/* The interface number of the HID */
 	int interface;
 
+	/* Whether the Report Descriptor declares Report IDs */
+	int uses_numbered_reports;
+
 	/* Indexes of Strings */
 	int manufacturer_index;
 	int product_index;
@@ -162,17 +407,86 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
-	pthread_t thread;
+	/* Read objects. The transfers are handled by the thread of shared. */
 	pthread_mutex_t mutex; /* Protects input_reports */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	int transfer_loop_finished;
-	struct libusb_transfer *transfer;
+	/* One transfer for each interrupt IN endpoint of the interface */
+	struct libusb_transfer *transfers[MAX_INPUT_ENDPOINTS];
+	int num_transfers;
+	int active_transfers; /* Protected by shared->mutex */
 
 	/* List of received input reports. */
 	struct input_report *input_reports;
+	/* Number of reports queued so far, protected by mutex */
+	uint64_t report_seq;
+
+	/* If set, input reports of this device are queued to input_target
+	   instead (see hid_libusb_merge_input()). */
+	struct hid_device_ *input_target;
+
+	/* Interface and endpoint of the last report returned by hid_read_timeout() */
+	int report_interface;
+	int report_endpoint;
+
+	/* Pipe behind hid_get_input_fd(), created on first use. It holds one
+	   byte while input_reports isn't empty or the device is gone.
+	   Protected by mutex. */
+	int input_pipe[2];
+	int input_pipe_ready;
+
+	/* Batched delivery, see hid_set_batching(). The batch_pending
+	   reports queued last are held back from the waiting threads until
+	   there are batch_reports of them or batch_deadline (see
+	   get_microseconds()) has passed. Protected by mutex. */
+	unsigned int batch_reports;
+	unsigned int batch_delay_us;
+	unsigned int batch_pending;
+	uint64_t batch_deadline;
+
+	/* Callbacks of hid_subscribe_report_id(), indexed by Report ID and
+	   allocated on the first subscription. Protected by
+	   subscriptions_mutex, which is held while a callback runs. */
+	struct report_subscription *subscriptions;
+	pthread_mutex_t subscriptions_mutex;
+
+	/* Latest mode, see hid_set_read_latest(). The slots, indexed by
+	   Report ID, are written by read_callback() under shared->mutex.
+	   latest_reports is allocated under mutex by the first call. */
+	int read_latest;
+	struct latest_report **latest_reports;
+
+	/* Changes-only mode, see hid_set_changes_only(). The filters, indexed
+	   by Report ID, and the count are protected by shared->mutex. */
+	int changes_only;
+	struct change_filter *change_filters;
+	unsigned long long unchanged_count;
+
+	/* Stages of hid_set_decimation(), indexed by Report ID and allocated
+	   by the first call, and the end (see get_milliseconds()) of the
+	   first of their windows to end, or 0 if none is open. Protected by
+	   shared->mutex. */
+	struct report_decimator **decimators;
+	uint64_t window_due;
+
+	/* The ring of broadcast mode, see hid_set_broadcast(). Replaced
+	   under shared->mutex. */
+	struct broadcast_ring *broadcast;
+
+#ifdef SHARE_DEVICE
+	/* Set while the device is shared with other processes, see
+	   hid_libusb_share(). Replaced under shared->mutex. */
+	struct device_broker *broker;
+#endif
+
+	/* The capture file of hid_start_capture(). Replaced and written
+	   under capture_mutex. */
+	struct capture_file *capture;
+	pthread_mutex_t capture_mutex;
+
+	/* Last error, see register_device_error_usb() */
+	struct error_state last_error;
 
 	/* Was kernel driver detached by libusb */
 #ifdef DETACH_KERNEL_DRIVER
@@ -186,634 +500,2578 @@ static struct hid_api_version api_version = {
 	.patch = HID_API_VERSION_PATCH
 };
 
-static libusb_context *usb_context = NULL;
+/* A library context, see hid_context_create(). Each context has its
+   own libusb context, so the devices of different contexts share no
+   locks or event threads. */
+struct hid_context_ {
+	libusb_context *usb_context;
+
+	/* Set when usb_context was supplied by the application with
+	   hid_libusb_set_context() instead of being created by hid_init(). */
+	int usb_context_is_external;
+	/* Set when the application handles the libusb events of usb_context,
+	   so no read_thread() is started. */
+	int usb_context_events_external;
+
+	/* All open shared_device objects of the context */
+	struct shared_device *shared_devices;
+	pthread_mutex_t shared_devices_mutex;
+
+	/* The last error, not used by default_context
+	   (which keeps the errors per thread). */
+	struct error_state error;
+};
+
+/* The context of the functions without a context argument */
+static hid_context default_context = {
+	NULL, 0, 0,
+	NULL, PTHREAD_MUTEX_INITIALIZER,
+	{ NULL, 0, 0, { 0 } }
+};
+
+/* Returns the context to use for ctx (NULL is the default one). */
+static hid_context *resolve_context(hid_context *ctx)
+{
+	return ctx? ctx: &default_context;
+}
 
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
 
-static hid_device *new_hid_device(void)
+/* Makes the pipe of hid_get_input_fd() readable exactly when hid_read()
+   wouldn't block. Must be called with dev->mutex locked. */
+static void update_input_fd(hid_device *dev)
 {
-	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
-	dev->blocking = 1;
+	int ready = ((dev->input_reports != NULL && !dev->batch_pending) || dev->shutdown_thread);
+	char c = 0;
 
-	pthread_mutex_init(&dev->mutex, NULL);
-	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	if (dev->input_pipe[0] < 0 || ready == dev->input_pipe_ready)
+		return;
 
-	return dev;
+	if (ready) {
+		if (write(dev->input_pipe[1], &c, 1) != 1)
+			return;
+	}
+	else {
+		if (read(dev->input_pipe[0], &c, 1) != 1)
+			return;
+	}
+	dev->input_pipe_ready = ready;
 }
 
-static void free_hid_device(hid_device *dev)
+/* Allocates a ring of num_slots (a power of two) reports of up to
+   slot_size bytes each. */
+static struct broadcast_ring *new_broadcast_ring(unsigned int num_slots, size_t slot_size)
 {
-	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
-	pthread_cond_destroy(&dev->condition);
-	pthread_mutex_destroy(&dev->mutex);
+	struct broadcast_ring *ring;
+	unsigned char *data;
+	unsigned int i;
 
-	/* Free the device itself */
-	free(dev);
-}
+	if (slot_size > SIZE_MAX / num_slots)
+		return NULL;
 
-#if 0
-/*TODO: Implement this function on hidapi/libusb.. */
-static void register_error(hid_device *dev, const char *op)
-{
+	ring = (struct broadcast_ring*) calloc(1, sizeof(struct broadcast_ring));
+	if (!ring)
+		return NULL;
+	ring->slots = (struct broadcast_slot*) calloc(num_slots, sizeof(struct broadcast_slot));
+	data = (unsigned char*) malloc(num_slots * slot_size);
+	if (!ring->slots || !data) {
+		free(ring->slots);
+		free(data);
+		free(ring);
+		return NULL;
+	}
 
+	for (i = 0; i < num_slots; i++)
+		ring->slots[i].data = data + i * slot_size;
+	ring->mask = num_slots - 1;
+	ring->slot_size = slot_size;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->condition, NULL);
+	return ring;
 }
-#endif
 
-#ifdef INVASIVE_GET_USAGE
-/* Get bytes from a HID Report Descriptor.
-   Only call with a num_bytes of 0, 1, 2, or 4. */
-static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
+static void free_broadcast_ring(struct broadcast_ring *ring)
 {
-	/* Return if there aren't enough bytes. */
-	if (cur + num_bytes >= len)
-		return 0;
+	pthread_cond_destroy(&ring->condition);
+	pthread_mutex_destroy(&ring->mutex);
+	free(ring->slots[0].data);
+	free(ring->slots);
+	free(ring);
+}
 
-	if (num_bytes == 0)
-		return 0;
-	else if (num_bytes == 1) {
-		return rpt[cur+1];
-	}
-	else if (num_bytes == 2) {
-		return (rpt[cur+2] * 256 + rpt[cur+1]);
-	}
-	else if (num_bytes == 4) {
-		return (rpt[cur+4] * 0x01000000 +
-		        rpt[cur+3] * 0x00010000 +
-		        rpt[cur+2] * 0x00000100 +
-		        rpt[cur+1] * 0x00000001);
-	}
-	else
-		return 0;
+/* Wakes the readers sleeping in hid_broadcast_read() */
+static void wake_broadcast_readers(struct broadcast_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	pthread_cond_broadcast(&ring->condition);
+	pthread_mutex_unlock(&ring->mutex);
 }
 
-/* Retrieves the device's Usage Page and Usage from the report
-   descriptor. The algorithm is simple, as it just returns the first
-   Usage and Usage Page that it finds in the descriptor.
-   The return value is 0 on success and -1 on failure. */
-static int get_usage(uint8_t *report_descriptor, size_t size,
-                     unsigned short *usage_page, unsigned short *usage)
+/* Writes a report over the oldest one of the ring. Only called by
+   read_callback(), with shared->mutex locked. The mutex of the ring is only taken when a reader
+   sleeps, to wake it up. */
+static void store_broadcast_report(struct broadcast_ring *ring, const unsigned char *data, size_t length)
 {
-	unsigned int i = 0;
-	int size_code;
-	int data_len, key_size;
-	int usage_found = 0, usage_page_found = 0;
+	unsigned int head = ring->head;
+	struct broadcast_slot *slot = &ring->slots[head & ring->mask];
+
+	if (length > ring->slot_size)
+		length = ring->slot_size;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->number, head, __ATOMIC_RELAXED);
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->len, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	/* Either this sees the waiter, or the waiter sees the new head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+		wake_broadcast_readers(ring);
+}
 
-	while (i < size) {
-		int key = report_descriptor[i];
-		int key_cmd = key & 0xfc;
+/* Copies the next report of a reader, without blocking the writer.
+   Returns 0 if there is none yet. A reader left behind by more than
+   the ring holds skips to the oldest report still in it. */
+static int load_broadcast_report(hid_broadcast_reader *reader, unsigned char *data, size_t length)
+{
+	struct broadcast_ring *ring = reader->ring;
+	struct broadcast_slot *slot;
+	unsigned int head;
+	unsigned int seq;
+	size_t len;
 
-		//printf("key: %02hhx\n", key);
+	for (;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head == reader->cursor)
+			return 0;
 
-		if ((key & 0xf0) == 0xf0) {
-			/* This is a Long Item. The next byte contains the
-			   length of the data section (value) for this key.
-			   See the HID specification, version 1.11, section
-			   6.2.2.3, titled "Long Items." */
-			if (i+1 < size)
-				data_len = report_descriptor[i+1];
-			else
-				data_len = 0; /* malformed report */
-			key_size = 3;
-		}
-		else {
-			/* This is a Short Item. The bottom two bits of the
-			   key contain the size code for the data section
-			   (value) for this key.  Refer to the HID
-			   specification, version 1.11, section 6.2.2.2,
-			   titled "Short Items." */
-			size_code = key & 0x3;
-			switch (size_code) {
-			case 0:
-			case 1:
-			case 2:
-				data_len = size_code;
-				break;
-			case 3:
-				data_len = 4;
-				break;
-			default:
-				/* Can't ever happen since size_code is & 0x3 */
-				data_len = 0;
-				break;
-			};
-			key_size = 1;
+		if (head - reader->cursor > ring->mask + 1) {
+			reader->overflow += head - reader->cursor - (ring->mask + 1);
+			reader->cursor = head - (ring->mask + 1);
 		}
 
-		if (key_cmd == 0x4) {
-			*usage_page  = get_bytes(report_descriptor, size, data_len, i);
-			usage_page_found = 1;
-			//printf("Usage Page: %x\n", (uint32_t)*usage_page);
-		}
-		if (key_cmd == 0x8) {
-			*usage = get_bytes(report_descriptor, size, data_len, i);
-			usage_found = 1;
-			//printf("Usage: %x\n", (uint32_t)*usage);
-		}
+		slot = &ring->slots[reader->cursor & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || __atomic_load_n(&slot->number, __ATOMIC_RELAXED) != reader->cursor)
+			continue; /* Being overwritten, head moves past the cursor */
 
-		if (usage_page_found && usage_found)
-			return 0; /* success */
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
 
-		/* Skip over this key and it's associated data */
-		i += data_len + key_size;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			reader->cursor++;
+			return (int) len;
+		}
 	}
-
-	return -1; /* failure */
 }
-#endif /* INVASIVE_GET_USAGE */
 
-#if defined(__FreeBSD__) && __FreeBSD__ < 10
-/* The libusb version included in FreeBSD < 10 doesn't have this function. In
-   mainline libusb, it's inlined in libusb.h. This function will bear a striking
-   resemblance to that one, because there's about one way to code it.
-
-   Note that the data parameter is Unicode in UTF-16LE encoding.
-   Return value is the number of bytes in data, or LIBUSB_ERROR_*.
- */
-static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
-	uint8_t descriptor_index, uint16_t lang_id,
-	unsigned char *data, int length)
+/* Maps at least size bytes of a capture file, growing the file. The
+   size doubles up to CAPTURE_MAX_STEP at a time. */
+static int grow_capture_file(struct capture_file *capture, size_t size)
 {
-	return libusb_control_transfer(dev,
-		LIBUSB_ENDPOINT_IN | 0x0, /* Endpoint 0 IN */
-		LIBUSB_REQUEST_GET_DESCRIPTOR,
-		(LIBUSB_DT_STRING << 8) | descriptor_index,
-		lang_id, data, (uint16_t) length, 1000);
-}
+	size_t step = capture->map_size < CAPTURE_MAX_STEP? capture->map_size: CAPTURE_MAX_STEP;
+	size_t map_size = capture->map_size + step;
+	unsigned char *map;
 
-#endif
+	if (map_size < size)
+		map_size = size;
+	map_size = (map_size + CAPTURE_MIN_SIZE - 1) & ~((size_t) CAPTURE_MIN_SIZE - 1);
 
+	if (ftruncate(capture->fd, (off_t) map_size) < 0)
+		return -1;
+	map = (unsigned char*) mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	capture->map = map;
+	capture->map_size = map_size;
+	return 0;
+}
+
+/* Appends a record to a capture file. The file was extended with
+   zeroes, so the padding is zero already. */
+static void append_capture_record(struct capture_file *capture, uint16_t type, const unsigned char *data, size_t length)
 {
-	uint16_t buf[32];
-	int len;
+	struct hid_capture_record *record;
+	size_t size = sizeof(struct hid_capture_record) + ((length + 7) & ~(size_t) 7);
+	struct timespec ts;
 
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
+	if (capture->used + size > capture->map_size && grow_capture_file(capture, capture->used + size) < 0)
+		return;
 
-	return buf[1]; /* First two bytes are len and descriptor type. */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record = (struct hid_capture_record*) (capture->map + capture->used);
+	record->timestamp_ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec - capture->start_ns;
+	record->length = (uint32_t) length;
+	record->type = type;
+	memcpy(record + 1, data, length);
+	capture->used += size;
+
+	/* Only now is the record part of the capture */
+	__atomic_store_n(&((struct hid_capture_header*) capture->map)->data_length,
+	                 (uint64_t) (capture->used - sizeof(struct hid_capture_header)), __ATOMIC_RELEASE);
 }
 
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+/* Records a report of dev, if hid_start_capture() was called */
+static void capture_report(hid_device *dev, hid_capture_record_type type, const unsigned char *data, size_t length)
 {
-	uint16_t buf[32];
-	int len;
-	int i;
-
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
+	if (!__atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE))
+		return;
 
+	pthread_mutex_lock(&dev->capture_mutex);
+	if (dev->capture)
+		append_capture_record(dev->capture, (uint16_t) type, data, length);
+	pthread_mutex_unlock(&dev->capture_mutex);
+}
 
-	len /= 2; /* language IDs are two-bytes each. */
-	/* Start at index 1 because there are two bytes of protocol data. */
-	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
+/* Truncates a capture file to its records and closes it */
+static void close_capture_file(struct capture_file *capture)
+{
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	if (capture->used > 0 && ftruncate(capture->fd, (off_t) capture->used) < 0) {
+		/* The zeroes past data_length are ignored anyway */
 	}
-
-	return 0;
+	close(capture->fd);
+	free(capture);
 }
 
-
-/* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+/* Creates a capture file with its header and the strings of info */
+static struct capture_file *create_capture_file(const char *path, const struct hid_device_info *info, int numbered_reports)
 {
-	char buf[512];
-	int len;
-	wchar_t *str = NULL;
+	struct capture_file *capture;
+	struct hid_capture_header *header;
+	struct timespec ts;
 
-#if !defined(__ANDROID__) && !defined(NO_ICONV) /* we don't use iconv on Android, or when it is explicitly disabled */
-	wchar_t wbuf[256];
-	/* iconv variables */
-	iconv_t ic;
-	size_t inbytes;
-	size_t outbytes;
-	size_t res;
-	ICONV_CONST char *inptr;
-	char *outptr;
-#endif
-
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			idx,
-			lang,
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 2) /* we always skip first 2 bytes */
+	capture = (struct capture_file*) calloc(1, sizeof(struct capture_file));
+	if (!capture)
 		return NULL;
 
-#if defined(__ANDROID__) || defined(NO_ICONV)
-
-	/* Bionic does not have iconv support nor wcsdup() function, so it
-	   has to be done manually.  The following code will only work for
-	   code points that can be represented as a single UTF-16 character,
-	   and will incorrectly convert any code points which require more
-	   than one UTF-16 character.
-
-	   Skip over the first character (2-bytes).  */
-	len -= 2;
-	str = (wchar_t*) malloc((len / 2 + 1) * sizeof(wchar_t));
-	int i;
-	for (i = 0; i < len / 2; i++) {
-		str[i] = buf[i * 2 + 2] | (buf[i * 2 + 3] << 8);
+	capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd < 0) {
+		free(capture);
+		return NULL;
 	}
-	str[len / 2] = 0x00000000;
-
-#else
-
-	/* buf does not need to be explicitly NULL-terminated because
-	   it is only passed into iconv() which does not need it. */
 
-	/* Initialize iconv. */
-	ic = iconv_open("WCHAR_T", "UTF-16LE");
-	if (ic == (iconv_t)-1) {
-		LOG("iconv_open() failed\n");
+	if (grow_capture_file(capture, CAPTURE_MIN_SIZE) < 0) {
+		close_capture_file(capture);
 		return NULL;
 	}
 
-	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
-	   Skip the first character (2-bytes). */
-	inptr = buf+2;
-	inbytes = len-2;
-	outptr = (char*) wbuf;
-	outbytes = sizeof(wbuf);
-	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
-	if (res == (size_t)-1) {
-		LOG("iconv() failed\n");
-		goto err;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	capture->start_ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+	capture->used = sizeof(struct hid_capture_header);
+
+	header = (struct hid_capture_header*) capture->map;
+	memcpy(header->magic, HID_CAPTURE_MAGIC, sizeof(HID_CAPTURE_MAGIC));
+	header->version = HID_CAPTURE_VERSION;
+	header->header_size = sizeof(struct hid_capture_header);
+	header->start_time_ns = capture->start_ns;
+	header->interface_number = -1;
+	header->flags = numbered_reports? HID_CAPTURE_NUMBERED_REPORTS: 0;
+
+	if (info) {
+		header->vendor_id = info->vendor_id;
+		header->product_id = info->product_id;
+		header->release_number = info->release_number;
+		header->usage_page = info->usage_page;
+		header->usage = info->usage;
+		header->bus_type = (uint16_t) info->bus_type;
+		header->interface_number = info->interface_number;
+
+		if (info->manufacturer_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_MANUFACTURER, (const unsigned char*) info->manufacturer_string_utf8, strlen(info->manufacturer_string_utf8));
+		if (info->product_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_PRODUCT, (const unsigned char*) info->product_string_utf8, strlen(info->product_string_utf8));
+		if (info->serial_number_utf8)
+			append_capture_record(capture, HID_CAPTURE_SERIAL_NUMBER, (const unsigned char*) info->serial_number_utf8, strlen(info->serial_number_utf8));
 	}
 
-	/* Write the terminating NULL. */
-	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
-	if (outbytes >= sizeof(wbuf[0]))
-		*((wchar_t*)outptr) = 0x00000000;
-
-	/* Allocate and copy the string. */
-	str = wcsdup(wbuf);
+	return capture;
+}
 
-err:
-	iconv_close(ic);
+#ifdef SHARE_DEVICE
+/* Size of an Input slot or an Output cell with its data */
+static size_t get_shared_slot_stride(uint32_t slot_size)
+{
+	return sizeof(struct shared_slot) + (((size_t) slot_size + 7) & ~(size_t) 7);
+}
 
-#endif
+static size_t get_shared_device_size(uint32_t mask, uint32_t slot_size)
+{
+	return sizeof(struct shared_device_header) +
+	       ((size_t) mask + 1 + SHARED_OUTPUT_CELLS) * get_shared_slot_stride(slot_size);
+}
 
-	return str;
+/* The Input slot of report n, or the Output cell of position n */
+static struct shared_slot *get_shared_slot(struct shared_device_header *header, uint32_t mask, uint32_t slot_size, int output, uint32_t n)
+{
+	size_t index = output? (size_t) mask + 1 + (n & (SHARED_OUTPUT_CELLS - 1)): (size_t) (n & mask);
+	return (struct shared_slot*) ((unsigned char*) (header + 1) + index * get_shared_slot_stride(slot_size));
 }
 
-static char *make_path(libusb_device *dev, int interface_number, int config_number)
+/* Locks the mutex of a shared device, making it consistent again if
+   its owner died holding it: it guards no data, only the sleeps. */
+static int lock_shared_device(struct shared_device_header *header)
 {
-	char str[64]; /* max length "000-000.000.000.000.000.000.000:000.000" */
-	/* Note that USB3 port count limit is 7; use 8 here for alignment */
-	uint8_t port_numbers[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-	int num_ports = libusb_get_port_numbers(dev, port_numbers, 8);
+	int res = pthread_mutex_lock(&header->mutex);
+	if (res == EOWNERDEAD) {
+		pthread_mutex_consistent(&header->mutex);
+		res = 0;
+	}
+	return res;
+}
 
-	if (num_ports > 0) {
-		int n = snprintf(str, sizeof("000-000"), "%u-%u", libusb_get_bus_number(dev), port_numbers[0]);
-		for (uint8_t i = 1; i < num_ports; i++) {
-			n += snprintf(&str[n], sizeof(".000"), ".%u", port_numbers[i]);
-		}
-		n += snprintf(&str[n], sizeof(":000.000"), ":%u.%u", (uint8_t)config_number, (uint8_t)interface_number);
-		str[n] = '\0';
-	} else {
-		/* USB3.0 specs limit number of ports to 7 and buffer size here is 8 */
-		if (num_ports == LIBUSB_ERROR_OVERFLOW) {
-			LOG("make_path() failed. buffer overflow error\n");
-		} else {
-			LOG("make_path() failed. unknown error\n");
-		}
-		str[0] = '\0';
+/* pthread_cond_wait() on the mutex of a shared device */
+static int wait_shared_device(struct shared_device_header *header, pthread_cond_t *condition)
+{
+	int res = pthread_cond_wait(condition, &header->mutex);
+	if (res == EOWNERDEAD) {
+		pthread_mutex_consistent(&header->mutex);
+		res = 0;
 	}
-	return strdup(str);
+	return res;
 }
 
-HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
+/* Sleeps until the word at addr, in the shared memory, is no longer
+   val, for at most timeout. May return early. */
+static void wait_shared_word(uint32_t *addr, uint32_t val, const struct timespec *timeout)
 {
-	return &api_version;
+#ifdef __FreeBSD__
+	_umtx_op(addr, UMTX_OP_WAIT_UINT, val, (void*) sizeof(*timeout), (void*) timeout);
+#else
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+#endif
 }
 
-HID_API_EXPORT const char* HID_API_CALL hid_version_str()
+/* Wakes all the processes sleeping in wait_shared_word() on addr */
+static void wake_shared_word(uint32_t *addr)
 {
-	return HID_API_VERSION_STR;
+#ifdef __FreeBSD__
+	_umtx_op(addr, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+#else
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
 }
 
-int HID_API_EXPORT hid_init(void)
+/* Wakes everybody sleeping on a shared device */
+static void wake_shared_device(struct shared_device_header *header)
 {
-	if (!usb_context) {
-		const char *locale;
+	wake_shared_word(&header->head);
+	if (lock_shared_device(header) == 0) {
+		pthread_cond_broadcast(&header->out_condition);
+		pthread_mutex_unlock(&header->mutex);
+	}
+}
 
-		/* Init Libusb */
-		if (libusb_init(&usb_context))
-			return -1;
+/* Publishes an Input report to the clients. Only called on the libusb
+   event thread, with shared->mutex locked: it must not wait for the
+   clients, so they are woken without taking header->mutex. */
+static void store_shared_report(struct device_broker *broker, const unsigned char *data, size_t length)
+{
+	struct shared_device_header *header = broker->header;
+	uint32_t head = broker->head++;
+	struct shared_slot *slot = get_shared_slot(header, broker->mask, broker->slot_size, 0, head);
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+	if (length > broker->slot_size)
+		length = broker->slot_size;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->number, head, __ATOMIC_RELAXED);
+	memcpy(slot + 1, data, length);
+	__atomic_store_n(&slot->len, (uint32_t) length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+	/* Either this sees the waiter, or the waiter sees the new head */
+	__atomic_store_n(&header->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST))
+		wake_shared_word(&header->head);
+}
 
-		/* Set the locale if it's not set. */
-		locale = setlocale(LC_CTYPE, NULL);
-		if (!locale)
-			setlocale(LC_CTYPE, "");
+/* Writes the Output reports queued by the clients, in order, until
+   hid_libusb_share() (or hid_close()) stops the sharing. */
+static void *broker_thread(void *param)
+{
+	struct device_broker *broker = (struct device_broker*) param;
+	struct shared_device_header *header = broker->header;
+	uint32_t pos = 0;
+
+	for (;;) {
+		struct shared_slot *cell = get_shared_slot(header, broker->mask, broker->slot_size, 1, pos);
+
+		if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == pos + 1) {
+			uint32_t len = __atomic_load_n(&cell->len, __ATOMIC_RELAXED);
+			if (len > broker->slot_size)
+				len = broker->slot_size;
+			memcpy(broker->out_buf, cell + 1, len);
+			__atomic_store_n(&cell->seq, pos + SHARED_OUTPUT_CELLS, __ATOMIC_RELEASE);
+			pos++;
+
+			if (len > 0 && hid_write(broker->dev, broker->out_buf, len) < 0)
+				LOG("broker_thread(): hid_write failed\n");
+			continue;
+		}
+
+		if (__atomic_load_n(&broker->stop, __ATOMIC_ACQUIRE) || lock_shared_device(header) != 0)
+			break;
+		while (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1 &&
+		       !__atomic_load_n(&broker->stop, __ATOMIC_ACQUIRE))
+			wait_shared_device(header, &header->out_condition);
+		pthread_mutex_unlock(&header->mutex);
 	}
 
-	return 0;
+	return NULL;
 }
 
-int HID_API_EXPORT hid_exit(void)
+static void free_device_broker(struct device_broker *broker)
 {
-	if (usb_context) {
-		libusb_exit(usb_context);
-		usb_context = NULL;
+	if (broker->header) {
+		munmap(broker->header, broker->size);
+		shm_unlink(broker->name);
 	}
+	free(broker->out_buf);
+	free(broker->name);
+	free(broker);
+}
 
-	return 0;
+/* Stops the sharing of a device, see hid_libusb_share(). The clients
+   get an error once they have read the reports published so far. */
+static void stop_sharing(hid_device *dev)
+{
+	struct device_broker *broker;
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	broker = dev->broker;
+	__atomic_store_n(&dev->broker, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	if (!broker)
+		return;
+
+	__atomic_store_n(&broker->stop, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&broker->header->closed, 1, __ATOMIC_RELEASE);
+	wake_shared_device(broker->header);
+	pthread_join(broker->thread, NULL);
+	free_device_broker(broker);
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Frees the name of a shared memory object left behind by a broker
+   which died without stopping the sharing. Of several processes trying
+   at once, only the one which swaps its pid in as broker_pid removes
+   it, so none removes the object another one created in its place.
+   Returns 1 if the name is free again. */
+static int remove_stale_shared_device(const char *name)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
+	struct shared_device_header *header;
+	struct stat st;
+	int removed = 0;
+	int fd = shm_open(name, O_RDWR, 0);
+
+	if (fd < 0)
+		return errno == ENOENT;
+
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(*header)) {
+		header = (struct shared_device_header*) mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (header != MAP_FAILED) {
+			int32_t pid = __atomic_load_n(&header->broker_pid, __ATOMIC_RELAXED);
+
+			if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == SHARED_DEVICE_MAGIC &&
+			    kill((pid_t) pid, 0) < 0 && errno == ESRCH &&
+			    __atomic_compare_exchange_n(&header->broker_pid, &pid, (int32_t) getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				/* The clients still attached get an error */
+				__atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+				wake_shared_device(header);
+				removed = (shm_unlink(name) == 0 || errno == ENOENT);
+			}
+			munmap(header, sizeof(*header));
+		}
+	}
+	close(fd);
 
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
+	return removed;
+}
 
-	if(hid_init() < 0)
-		return NULL;
+/* Returns 0 once the process sharing the device is gone */
+static int is_broker_alive(hid_shared_device *dev)
+{
+	return !__atomic_load_n(&dev->header->closed, __ATOMIC_ACQUIRE) &&
+	       (kill(dev->broker_pid, 0) == 0 || errno != ESRCH);
+}
 
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
+/* Copies the next Input report of a client, like
+   load_broadcast_report(). Returns 0 if there is none yet and -1 if
+   the broker died in the middle of writing the slot. */
+static int load_shared_report(hid_shared_device *dev, unsigned char *data, size_t length)
+{
+	struct shared_device_header *header = dev->header;
+	struct shared_slot *slot;
+	unsigned int spins = 0;
+	uint32_t head;
+	uint32_t seq;
+	size_t len;
 
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
+	for (;;) {
+		head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (head == dev->cursor)
+			return 0;
 
-		if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
-		    (product_id != 0x0 && product_id != dev_pid)) {
+		if (head - dev->cursor > dev->mask + 1)
+			dev->cursor = head - (dev->mask + 1);
+
+		slot = get_shared_slot(header, dev->mask, dev->slot_size, 0, dev->cursor);
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || __atomic_load_n(&slot->number, __ATOMIC_RELAXED) != dev->cursor) {
+			/* Being overwritten, head moves past the cursor */
+			if (++spins % 4096 == 0 && !is_broker_alive(dev))
+				return -1;
 			continue;
 		}
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						int interface_num = intf_desc->bInterfaceNumber;
-						struct hid_device_info *tmp;
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > dev->slot_size)
+			len = dev->slot_size;
+		if (len > length)
+			len = length;
+		memcpy(data, slot + 1, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			dev->cursor++;
+			return (int) len;
+		}
+	}
+}
+#endif
 
-						/* VID/PID match. Create the record. */
-						tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-						if (cur_dev) {
-							cur_dev->next = tmp;
-						}
-						else {
-							root = tmp;
-						}
-						cur_dev = tmp;
+static hid_device *new_hid_device(void)
+{
+	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
+	dev->blocking = 1;
 
-						/* Fill out the record */
-						cur_dev->next = NULL;
-						cur_dev->path = make_path(dev, interface_num, conf_desc->bConfigurationValue);
+	dev->report_interface = -1;
+	dev->report_endpoint = -1;
+	dev->input_pipe[0] = -1;
+	dev->input_pipe[1] = -1;
 
-						res = libusb_open(dev, &handle);
+	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_cond_init(&dev->condition, NULL);
+	pthread_mutex_init(&dev->subscriptions_mutex, NULL);
+	pthread_mutex_init(&dev->capture_mutex, NULL);
 
-						if (res >= 0) {
-#ifdef __ANDROID__
-							/* There is (a potential) libusb Android backend, in which
-							   device descriptor is not accurate up until the device is opened.
-							   https://github.com/libusb/libusb/pull/874#discussion_r632801373
-							   A workaround is to re-read the descriptor again.
-							   Even if it is not going to be accepted into libusb master,
-							   having it here won't do any harm, since reading the device descriptor
-							   is as cheap as copy 18 bytes of data. */
-							libusb_get_device_descriptor(dev, &desc);
-#endif
+	return dev;
+}
+
+static void free_hid_device(hid_device *dev)
+{
+	if (dev->input_pipe[0] >= 0) {
+		close(dev->input_pipe[0]);
+		close(dev->input_pipe[1]);
+	}
 
-							/* Serial Number */
-							if (desc.iSerialNumber > 0)
-								cur_dev->serial_number =
-									get_usb_string(handle, desc.iSerialNumber);
+	/* Clean up the thread objects */
+	pthread_cond_destroy(&dev->condition);
+	pthread_mutex_destroy(&dev->mutex);
+	pthread_mutex_destroy(&dev->subscriptions_mutex);
+
+	free(dev->subscriptions);
+	if (dev->latest_reports) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			struct latest_report *slot = dev->latest_reports[i];
+			while (slot) {
+				struct latest_report *retired = slot->retired;
+				free(slot);
+				slot = retired;
+			}
+		}
+		free(dev->latest_reports);
+	}
+	if (dev->change_filters) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			free(dev->change_filters[i].data);
+			free(dev->change_filters[i].mask);
+		}
+		free(dev->change_filters);
+	}
+	if (dev->decimators) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			if (dev->decimators[i]) {
+				free(dev->decimators[i]->window);
+				free(dev->decimators[i]);
+			}
+		}
+		free(dev->decimators);
+	}
+	if (dev->broadcast)
+		free_broadcast_ring(dev->broadcast);
+	if (dev->capture)
+		close_capture_file(dev->capture);
+	pthread_mutex_destroy(&dev->capture_mutex);
 
-							/* Manufacturer and Product strings */
-							if (desc.iManufacturer > 0)
-								cur_dev->manufacturer_string =
-									get_usb_string(handle, desc.iManufacturer);
-							if (desc.iProduct > 0)
-								cur_dev->product_string =
-									get_usb_string(handle, desc.iProduct);
+	/* Free the device itself */
+	free(dev);
+}
 
-#ifdef INVASIVE_GET_USAGE
+/* Maps a libusb_error to a hid_api_error code. */
+static int libusb_error_to_error_code(int usb_error)
 {
-						/*
-						This section is removed because it is too
-						invasive on the system. Getting a Usage Page
-						and Usage requires parsing the HID Report
-						descriptor. Getting a HID Report descriptor
-						involves claiming the interface. Claiming the
-						interface involves detaching the kernel driver.
-						Detaching the kernel driver is hard on the system
-						because it will unclaim interfaces (if another
-						app has them claimed) and the re-attachment of
-						the driver will sometimes change /dev entry names.
-						It is for these reasons that this section is
-						#if 0. For composite devices, use the interface
-						field in the hid_device_info struct to distinguish
-						between interfaces. */
-							unsigned char data[256];
-#ifdef DETACH_KERNEL_DRIVER
-							int detached = 0;
-							/* Usage Page and Usage */
-							res = libusb_kernel_driver_active(handle, interface_num);
-							if (res == 1) {
-								res = libusb_detach_kernel_driver(handle, interface_num);
-								if (res < 0)
-									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.\n");
-								else
-									detached = 1;
-							}
-#endif
-							res = libusb_claim_interface(handle, interface_num);
-							if (res >= 0) {
-								/* Get the HID Report Descriptor. */
-								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-								if (res >= 0) {
-									unsigned short page=0, usage=0;
-									/* Parse the usage and usage page
-									   out of the report descriptor. */
-									get_usage(data, res,  &page, &usage);
-									cur_dev->usage_page = page;
-									cur_dev->usage = usage;
-								}
-								else
-									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+	switch (usb_error) {
+		case LIBUSB_SUCCESS:
+			return HID_API_ERROR_SUCCESS;
+		case LIBUSB_ERROR_INVALID_PARAM:
+			return HID_API_ERROR_INVALID_PARAM;
+		case LIBUSB_ERROR_NOT_FOUND:
+			return HID_API_ERROR_NOT_FOUND;
+		case LIBUSB_ERROR_ACCESS:
+			return HID_API_ERROR_ACCESS;
+		case LIBUSB_ERROR_NO_DEVICE:
+			return HID_API_ERROR_NO_DEVICE;
+		case LIBUSB_ERROR_BUSY:
+			return HID_API_ERROR_BUSY;
+		case LIBUSB_ERROR_TIMEOUT:
+			return HID_API_ERROR_TIMEOUT;
+		case LIBUSB_ERROR_INTERRUPTED:
+			return HID_API_ERROR_INTERRUPTED;
+		case LIBUSB_ERROR_NO_MEM:
+			return HID_API_ERROR_NO_MEM;
+		case LIBUSB_ERROR_NOT_SUPPORTED:
+			return HID_API_ERROR_NOT_SUPPORTED;
+		case LIBUSB_ERROR_IO:
+		case LIBUSB_ERROR_PIPE:
+		case LIBUSB_ERROR_OVERFLOW:
+			return HID_API_ERROR_IO;
+		default:
+			return HID_API_ERROR_UNKNOWN;
+	}
+}
 
-								/* Release the interface */
-								res = libusb_release_interface(handle, interface_num);
-								if (res < 0)
-									LOG("Can't release the interface.\n");
-							}
-							else
-								LOG("Can't claim interface %d\n", res);
-#ifdef DETACH_KERNEL_DRIVER
-							/* Re-attach kernel driver if necessary. */
-							if (detached) {
-								res = libusb_attach_kernel_driver(handle, interface_num);
-								if (res < 0)
-									LOG("Couldn't re-attach kernel driver.\n");
-							}
-#endif
+static void set_error(struct error_state *err, int code, const char *msg, int usb_error)
+{
+	err->msg = msg;
+	err->usb_error = usb_error;
+	err->code = code;
 }
-#endif /* INVASIVE_GET_USAGE */
 
-							libusb_close(handle);
-						}
-						/* VID/PID */
-						cur_dev->vendor_id = dev_vid;
-						cur_dev->product_id = dev_pid;
+/* Renders err into its buffer: msg, followed by the description of
+   usb_error if it is non-zero. */
+static const wchar_t *render_error(struct error_state *err)
+{
+	char msg[256];
+	size_t len;
 
-						/* Release Number */
-						cur_dev->release_number = desc.bcdDevice;
+	if (err->msg == NULL && err->usb_error == 0)
+		return L"Success";
 
-						/* Interface Number */
-						cur_dev->interface_number = interface_num;
-					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
-		}
-	}
+	if (err->msg && err->usb_error)
+		snprintf(msg, sizeof(msg), "%s: %s", err->msg, libusb_strerror(err->usb_error));
+	else if (err->msg)
+		snprintf(msg, sizeof(msg), "%s", err->msg);
+	else
+		snprintf(msg, sizeof(msg), "%s", libusb_strerror(err->usb_error));
 
-	libusb_free_device_list(devs, 1);
+	len = mbstowcs(err->buf, msg, sizeof(err->buf) / sizeof(wchar_t));
+	if (len == (size_t) -1)
+		len = 0;
+	if (len >= sizeof(err->buf) / sizeof(wchar_t))
+		len = sizeof(err->buf) / sizeof(wchar_t) - 1;
+	err->buf[len] = L'\0';
 
-	return root;
+	return err->buf;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+/* Set the last error for a device to be reported by hid_error(dev) and
+ * hid_error_code(dev): msg (a string constant, or NULL), followed by the
+ * description of usb_error if it is non-zero.
+ * Nothing is copied or allocated here, so this is cheap enough to be
+ * called by every hid_read()/hid_write().
+ * Use register_device_error(dev, NULL) to indicate "no error". */
+static void register_device_error_usb(hid_device *dev, const char *msg, int usb_error)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
-	}
+	set_error(&dev->last_error, libusb_error_to_error_code(usb_error), msg, usb_error);
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+/* Same as register_device_error_usb, for errors without a libusb error code. */
+static void register_device_error_code(hid_device *dev, int code, const char *msg)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	set_error(&dev->last_error, code, msg, 0);
+}
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (cur_dev->serial_number &&
-				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
+/* Same as register_device_error_code, with HID_API_ERROR_UNKNOWN
+ * (or HID_API_ERROR_SUCCESS if msg is NULL). */
+static void register_device_error(hid_device *dev, const char *msg)
+{
+	register_device_error_code(dev, msg? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, msg);
+}
+
+/* The last global error of a thread, for default_context. Each thread
+   gets its own (allocated on its first error), so that concurrent
+   hid_enumerate()/hid_open() calls don't clobber each other's errors. */
+static pthread_key_t global_error_key;
+static pthread_once_t global_error_key_once = PTHREAD_ONCE_INIT;
+static int global_error_key_valid = 0;
+
+static void create_global_error_key(void)
+{
+	global_error_key_valid = (pthread_key_create(&global_error_key, free) == 0);
+}
+
+/* Returns the last error of ctx, for default_context the one of the
+   calling thread. If the thread has none yet, it is allocated if create
+   is non-zero, otherwise NULL is returned. */
+static struct error_state *get_context_error(hid_context *ctx, int create)
+{
+	struct error_state *err;
+
+	if (ctx != &default_context)
+		return &ctx->error;
+
+	pthread_once(&global_error_key_once, create_global_error_key);
+	if (!global_error_key_valid)
+		return NULL;
+
+	err = (struct error_state*) pthread_getspecific(global_error_key);
+	if (!err && create) {
+		err = (struct error_state*) calloc(1, sizeof(struct error_state));
+		if (err && pthread_setspecific(global_error_key, err) != 0) {
+			free(err);
+			err = NULL;
 		}
-		cur_dev = cur_dev->next;
 	}
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	}
+	return err;
+}
 
-	hid_free_enumeration(devs);
+/* Set the last global error of ctx (for the default context, of the
+ * calling thread), to be reported by hid_context_error(ctx) and
+ * hid_context_error_code(ctx). Same arguments as register_device_error_usb. */
+static void register_global_error_usb(hid_context *ctx, const char *msg, int usb_error)
+{
+	struct error_state *err = get_context_error(ctx, msg != NULL || usb_error != 0);
+	if (err)
+		set_error(err, libusb_error_to_error_code(usb_error), msg, usb_error);
+}
 
-	return handle;
+/* Same as register_global_error_usb, for errors without a libusb error code. */
+static void register_global_error_code(hid_context *ctx, int code, const char *msg)
+{
+	struct error_state *err = get_context_error(ctx, msg != NULL);
+	if (err)
+		set_error(err, code, msg, 0);
 }
 
-static void read_callback(struct libusb_transfer *transfer)
+/* Same as register_global_error_code, with HID_API_ERROR_UNKNOWN
+ * (or HID_API_ERROR_SUCCESS if msg is NULL). */
+static void register_global_error(hid_context *ctx, const char *msg)
 {
-	hid_device *dev = transfer->user_data;
-	int res;
+	register_global_error_code(ctx, msg? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, msg);
+}
 
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+#if defined(__linux__) && !defined(__ANDROID__)
+/* On Linux the kernel exposes the HID Report Descriptor of every bound
+   HID interface through sysfs. Reading it from there gives us Usage Page
+   and Usage in hid_enumerate() without detaching the kernel driver or
+   claiming the interface. */
+#define USAGE_FROM_SYSFS
+#endif
 
-		struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
-		rpt->data = (uint8_t*) malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+/* Same as HID_MAX_DESCRIPTOR_SIZE in the Linux kernel */
+#define MAX_REPORT_DESCRIPTOR_SIZE 4096
+
+/* Size of the buffer for make_path():
+   max length "000-000.000.000.000.000.000.000:000.000" */
+#define MAX_PATH_LENGTH 64
+
+/* Max length (in wide characters) of a string descriptor */
+#define MAX_STRING_LENGTH 256
+
+/* The list returned by hid_enumerate() lives in an arena: its records and
+   strings are carved out of a few large blocks (usually a single one)
+   instead of being allocated one by one, and records of the same device
+   share their strings. The root record always sits at the start of the
+   first block (its slot is reserved when the block is created), which is
+   how hid_free_enumeration() finds the blocks. */
+struct enum_arena_block {
+	struct enum_arena_block *next;
+	size_t size; /* Bytes available after the header */
+	size_t used;
+};
 
-		pthread_mutex_lock(&dev->mutex);
+struct enum_arena {
+	struct enum_arena_block *first;
+	struct enum_arena_block *last;
+	int root_taken; /* The reserved root slot was handed out */
+};
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+/* Size of the first block; every further block doubles it */
+#define ENUM_ARENA_BLOCK_SIZE 16384
+
+/* Size of the root slot at the start of the first block */
+#define ENUM_ARENA_ROOT_SIZE ((sizeof(struct hid_device_info) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+/* Returns zero-initialized, pointer-aligned memory from the arena. */
+static void *enum_arena_alloc(struct enum_arena *arena, size_t size)
+{
+	struct enum_arena_block *block = arena->last;
+	void *ptr;
+
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+	if (!block || block->size - block->used < size) {
+		size_t block_size = block? block->size * 2: ENUM_ARENA_BLOCK_SIZE;
+		struct enum_arena_block *new_block;
+
+		if (block_size < size + ENUM_ARENA_ROOT_SIZE)
+			block_size = size + ENUM_ARENA_ROOT_SIZE;
+		new_block = (struct enum_arena_block*) calloc(1, sizeof(struct enum_arena_block) + block_size);
+		if (!new_block)
+			return NULL;
+		new_block->size = block_size;
+
+		if (block) {
+			block->next = new_block;
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}
+			arena->first = new_block;
+			new_block->used = ENUM_ARENA_ROOT_SIZE;
 		}
-		pthread_mutex_unlock(&dev->mutex);
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
+		arena->last = new_block;
+		block = new_block;
 	}
-	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
+
+	ptr = (char*) (block + 1) + block->used;
+	block->used += size;
+	return ptr;
+}
+
+/* Returns a zero-initialized record from the arena. The first one is
+   the reserved root slot. */
+static struct hid_device_info *enum_arena_alloc_record(struct enum_arena *arena)
+{
+	if (arena->root_taken)
+		return (struct hid_device_info*) enum_arena_alloc(arena, sizeof(struct hid_device_info));
+
+	/* Make sure the first block exists */
+	if (!arena->first && !enum_arena_alloc(arena, 0))
+		return NULL;
+	arena->root_taken = 1;
+	return (struct hid_device_info*) (arena->first + 1);
+}
+
+/* Where the matching records go: the callback of hid_enumerate_visit(),
+   or (if it is NULL) the list built by hid_enumerate_filtered(). */
+struct enum_sink {
+	hid_enumerate_callback callback;
+	void *user_data;
+	int result; /* Value returned by the callback which stopped */
+
+	struct hid_device_info *root;
+	struct hid_device_info *last;
+};
+
+/* Sends a copy of info, with the given usage, to the sink.
+   Returns non-zero if the enumeration must stop. */
+static int enum_sink_add(struct enum_arena *arena, struct enum_sink *sink, const struct hid_device_info *info, unsigned short usage_page, unsigned short usage)
+{
+	struct hid_device_info *tmp;
+
+	if (sink->callback) {
+		struct hid_device_info record = *info;
+		record.next = NULL;
+		record.usage_page = usage_page;
+		record.usage = usage;
+		sink->result = sink->callback(&record, sink->user_data);
+		return sink->result;
+	}
+
+	tmp = enum_arena_alloc_record(arena);
+	if (!tmp)
+		return 0;
+
+	*tmp = *info;
+	tmp->next = NULL;
+	tmp->usage_page = usage_page;
+	tmp->usage = usage;
+
+	if (sink->last)
+		sink->last->next = tmp;
+	else
+		sink->root = tmp;
+	sink->last = tmp;
+	return 0;
+}
+
+/* The predicates of a hid_filter. A NULL filter matches everything. */
+static int filter_match_ids(const struct hid_filter *filter, unsigned short vendor_id, unsigned short product_id)
+{
+	size_t i;
+
+	if (!filter || !filter->ids || filter->num_ids == 0)
+		return 1;
+
+	for (i = 0; i < filter->num_ids; i++) {
+		const struct hid_filter_id *id = &filter->ids[i];
+		if ((id->vendor_id == 0 || id->vendor_id == vendor_id) &&
+		    (id->product_id == 0 || id->product_id == product_id))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int filter_match_usage(const struct hid_filter *filter, unsigned short usage_page, unsigned short usage)
+{
+	return !filter ||
+		((filter->usage_page == 0 || filter->usage_page == usage_page) &&
+		 (filter->usage == 0 || filter->usage == usage));
+}
+
+static int filter_match_interface(const struct hid_filter *filter, int interface_number)
+{
+	return !filter || !filter->match_interface_number || filter->interface_number == interface_number;
+}
+
+static int filter_match_bus(const struct hid_filter *filter, hid_bus_type bus_type)
+{
+	return !filter || filter->bus_type == HID_API_BUS_UNKNOWN || filter->bus_type == bus_type;
+}
+
+static int filter_match_serial(const struct hid_filter *filter, const char *serial_number_utf8)
+{
+	if (!filter || !filter->serial_number_prefix)
+		return 1;
+
+	return serial_number_utf8 &&
+		strncmp(serial_number_utf8, filter->serial_number_prefix, strlen(filter->serial_number_prefix)) == 0;
+}
+
+static void enum_arena_free(struct enum_arena_block *block)
+{
+	while (block) {
+		struct enum_arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+static char *enum_arena_strdup(struct enum_arena *arena, const char *str)
+{
+	char *ret;
+	size_t len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str) + 1;
+	ret = (char*) enum_arena_alloc(arena, len);
+	if (ret)
+		memcpy(ret, str, len);
+	return ret;
+}
+
+static wchar_t *enum_arena_wcsdup(struct enum_arena *arena, const wchar_t *str)
+{
+	wchar_t *ret;
+	size_t len;
+
+	if (!str)
+		return NULL;
+
+	len = (wcslen(str) + 1) * sizeof(wchar_t);
+	ret = (wchar_t*) enum_arena_alloc(arena, len);
+	if (ret)
+		memcpy(ret, str, len);
+	return ret;
+}
+
+/* Upper limit for the size of the input transfer buffer
+   (same as HID_MAX_BUFFER_SIZE in the Linux kernel) */
+#define MAX_INPUT_REPORT_SIZE 16384
+
+/*
+ * Gets the size of the HID item at the given position
+ * Returns 1 if successful, 0 if an invalid key
+ * Sets data_len and key_size when successful
+ */
+static int get_hid_item_size(const uint8_t *report_descriptor, unsigned int pos, size_t size, int *data_len, int *key_size)
+{
+	int key = report_descriptor[pos];
+	int size_code;
+
+	/*
+	 * This is a Long Item. The next byte contains the
+	 * length of the data section (value) for this key.
+	 * See the HID specification, version 1.11, section
+	 * 6.2.2.3, titled "Long Items."
+	 */
+	if ((key & 0xf0) == 0xf0) {
+		if (pos + 1 < size)
+		{
+			*data_len = report_descriptor[pos + 1];
+			*key_size = 3;
+			return 1;
+		}
+		*data_len = 0; /* malformed report */
+		*key_size = 0;
+	}
+
+	/*
+	 * This is a Short Item. The bottom two bits of the
+	 * key contain the size code for the data section
+	 * (value) for this key. Refer to the HID
+	 * specification, version 1.11, section 6.2.2.2,
+	 * titled "Short Items."
+	 */
+	size_code = key & 0x3;
+	switch (size_code) {
+	case 0:
+	case 1:
+	case 2:
+		*data_len = size_code;
+		*key_size = 1;
+		return 1;
+	case 3:
+		*data_len = 4;
+		*key_size = 1;
+		return 1;
+	default:
+		/* Can't ever happen since size_code is & 0x3 */
+		*data_len = 0;
+		*key_size = 0;
+		break;
+	};
+
+	/* malformed report */
+	return 0;
+}
+
+/* Get bytes from a HID Report Descriptor.
+   Only call with a num_bytes of 0, 1, 2, or 4. */
+static uint32_t get_bytes(const uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	/* Return if there aren't enough bytes. */
+	if (cur + num_bytes >= len)
+		return 0;
+
+	if (num_bytes == 0)
+		return 0;
+	else if (num_bytes == 1) {
+		return rpt[cur+1];
+	}
+	else if (num_bytes == 2) {
+		return (rpt[cur+2] * 256 + rpt[cur+1]);
+	}
+	else if (num_bytes == 4) {
+		return (rpt[cur+4] * 0x01000000 +
+		        rpt[cur+3] * 0x00010000 +
+		        rpt[cur+2] * 0x00000100 +
+		        rpt[cur+1] * 0x00000001);
+	}
+	else
+		return 0;
+}
+
+/*
+ * Retrieves the size (in bytes) of the largest Input report in the report
+ * descriptor, including the Report ID byte if the device uses numbered
+ * reports. Returns 0 if the descriptor declares no Input items.
+ * *uses_numbered_reports is set if the descriptor declares Report IDs.
+ */
+static size_t get_max_input_report_size(const uint8_t *report_descriptor, size_t size, int *uses_numbered_reports)
+{
+	/* Global state, saved and restored by Push/Pop (6.2.2.7) */
+	struct report_globals {
+		uint32_t report_size;
+		uint32_t report_count;
+		unsigned char report_id;
+	} globals = { 0, 0, 0 }, stack[8];
+	int stack_depth = 0;
+	int numbered_reports = 0;
+	/* Size of each Input report in bits, indexed by Report ID */
+	uint32_t report_bits[256];
+	uint32_t max_bits = 0;
+	unsigned int pos = 0;
+	int i;
+
+	memset(report_bits, 0, sizeof(report_bits));
+
+	while (pos < size) {
+		int data_len, key_size;
+		int key_cmd = report_descriptor[pos] & 0xfc;
+		uint32_t value;
+
+		if (!get_hid_item_size(report_descriptor, pos, size, &data_len, &key_size))
+			break; /* malformed report */
+
+		value = get_bytes(report_descriptor, size, data_len, pos);
+
+		switch (key_cmd) {
+		case 0x74: /* Report Size 6.2.2.7 (Global) */
+			globals.report_size = value;
+			break;
+
+		case 0x94: /* Report Count 6.2.2.7 (Global) */
+			globals.report_count = value;
+			break;
+
+		case 0x84: /* Report ID 6.2.2.7 (Global) */
+			globals.report_id = (unsigned char) value;
+			numbered_reports = 1;
+			break;
+
+		case 0xa4: /* Push 6.2.2.7 (Global) */
+			if (stack_depth < (int) (sizeof(stack) / sizeof(stack[0])))
+				stack[stack_depth++] = globals;
+			break;
+
+		case 0xb4: /* Pop 6.2.2.7 (Global) */
+			if (stack_depth > 0)
+				globals = stack[--stack_depth];
+			break;
+
+		case 0x80: /* Input 6.2.2.4 (Main) */
+			if (globals.report_size <= MAX_INPUT_REPORT_SIZE * 8 &&
+			    globals.report_count <= MAX_INPUT_REPORT_SIZE * 8) {
+				uint64_t bits = (uint64_t) report_bits[globals.report_id]
+					+ (uint64_t) globals.report_size * globals.report_count;
+				report_bits[globals.report_id] = (bits > MAX_INPUT_REPORT_SIZE * 8)? MAX_INPUT_REPORT_SIZE * 8: (uint32_t) bits;
+			}
+			break;
+		}
+
+		/* Skip over this key and its associated data */
+		pos += data_len + key_size;
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (report_bits[i] > max_bits)
+			max_bits = report_bits[i];
+	}
+
+	*uses_numbered_reports = numbered_reports;
+
+	if (max_bits == 0)
+		return 0;
+
+	return (max_bits + 7) / 8 + (numbered_reports? 1: 0);
+}
+
+#if defined(INVASIVE_GET_USAGE) || defined(USAGE_FROM_SYSFS)
+/*
+ * Retrieves the device's Usage Page and Usage from the report descriptor.
+ * This is the same collection-aware walk as get_next_hid_usage() in
+ * linux/hid.c, so both Linux backends report the same usage pairs:
+ * the current Usage Page/Usage pair is returned whenever a new
+ * Collection is found and a Usage Local Item is currently in scope.
+ *
+ * This function can be called repeatedly until it returns non-0
+ * Usage is found. pos is the starting point (initially 0) and will be updated
+ * to the next search position.
+ *
+ * The return value is 0 when a pair is found.
+ * 1 when finished processing descriptor.
+ * -1 on a malformed report.
+ */
+static int get_next_hid_usage(const uint8_t *report_descriptor, size_t size, unsigned int *pos, unsigned short *usage_page, unsigned short *usage)
+{
+	int data_len, key_size;
+	int initial = *pos == 0; /* Used to handle case where no top-level application collection is defined */
+	int usage_pair_ready = 0;
+
+	/* Usage is a Local Item, it must be set before each Main Item (Collection) before a pair is returned */
+	int usage_found = 0;
+
+	while (*pos < size) {
+		int key = report_descriptor[*pos];
+		int key_cmd = key & 0xfc;
+
+		/* Determine data_len and key_size */
+		if (!get_hid_item_size(report_descriptor, *pos, size, &data_len, &key_size))
+			return -1; /* malformed report */
+
+		switch (key_cmd) {
+		case 0x4: /* Usage Page 6.2.2.7 (Global) */
+			*usage_page = get_bytes(report_descriptor, size, data_len, *pos);
+			break;
+
+		case 0x8: /* Usage 6.2.2.8 (Local) */
+			*usage = get_bytes(report_descriptor, size, data_len, *pos);
+			usage_found = 1;
+			break;
+
+		case 0xa0: /* Collection 6.2.2.4 (Main) */
+			/* A Usage Item (Local) must be found for the pair to be valid */
+			if (usage_found)
+				usage_pair_ready = 1;
+
+			/* Usage is a Local Item, unset it */
+			usage_found = 0;
+			break;
+
+		case 0x80: /* Input 6.2.2.4 (Main) */
+		case 0x90: /* Output 6.2.2.4 (Main) */
+		case 0xb0: /* Feature 6.2.2.4 (Main) */
+		case 0xc0: /* End Collection 6.2.2.4 (Main) */
+			/* Usage is a Local Item, unset it */
+			usage_found = 0;
+			break;
+		}
+
+		/* Skip over this key and its associated data */
+		*pos += data_len + key_size;
+
+		/* Return usage pair */
+		if (usage_pair_ready)
+			return 0;
+	}
+
+	/* If no top-level application collection is found and usage page/usage pair is found, pair is valid
+	   https://docs.microsoft.com/en-us/windows-hardware/drivers/hid/top-level-collections */
+	if (initial && usage_found)
+		return 0; /* success */
+
+	return 1; /* finished processing */
+}
+
+/* Sends a copy of info to the sink for every usage pair of the report
+   descriptor matching the filter (same as the hidraw backend does), or a
+   single one with a zero Usage Page and Usage if there are no pairs.
+   Returns non-zero if the enumeration must stop. */
+static int add_usage_records(struct enum_arena *arena, struct enum_sink *sink, const struct hid_device_info *info, const struct hid_filter *filter, const uint8_t *report_descriptor, size_t size)
+{
+	unsigned short page = 0, usage = 0;
+	unsigned int pos = 0;
+	int found = 0;
+
+	while (!get_next_hid_usage(report_descriptor, size, &pos, &page, &usage)) {
+		if (filter_match_usage(filter, page, usage) &&
+		    enum_sink_add(arena, sink, info, page, usage))
+			return 1;
+		found = 1;
+	}
+
+	if (!found && filter_match_usage(filter, 0, 0))
+		return enum_sink_add(arena, sink, info, 0, 0);
+
+	return 0;
+}
+#endif /* INVASIVE_GET_USAGE || USAGE_FROM_SYSFS */
+
+#ifdef USAGE_FROM_SYSFS
+/* Reads the HID Report Descriptor of an interface from sysfs.
+   intf_path is the interface name in the format returned by make_path(),
+   which is the same as the interface directory name in
+   /sys/bus/usb/devices (e.g. "1-1.2:1.0"). The HID device is a child
+   directory of the interface, named "<bus>:<vid>:<pid>.<id>".
+   Returns the size of the descriptor or -1 on error. */
+static int get_report_descriptor_from_sysfs(const char *intf_path, uint8_t *buf, size_t buf_size)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
+	int res = -1;
+
+	if (!intf_path || !intf_path[0])
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s", intf_path);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while (res < 0 && (entry = readdir(dir)) != NULL) {
+		unsigned int bus, vid, pid, id;
+		int fd;
+		ssize_t len;
+
+		if (sscanf(entry->d_name, "%x:%x:%x.%x", &bus, &vid, &pid, &id) != 4)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s/report_descriptor", intf_path, entry->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		len = read(fd, buf, buf_size);
+		if (len > 0)
+			res = (int) len;
+		close(fd);
+	}
+
+	closedir(dir);
+	return res;
+}
+#endif /* USAGE_FROM_SYSFS */
+
+#if defined(__FreeBSD__) && __FreeBSD__ < 10
+/* The libusb version included in FreeBSD < 10 doesn't have this function. In
+   mainline libusb, it's inlined in libusb.h. This function will bear a striking
+   resemblance to that one, because there's about one way to code it.
+
+   Note that the data parameter is Unicode in UTF-16LE encoding.
+   Return value is the number of bytes in data, or LIBUSB_ERROR_*.
+ */
+static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
+	uint8_t descriptor_index, uint16_t lang_id,
+	unsigned char *data, int length)
+{
+	return libusb_control_transfer(dev,
+		LIBUSB_ENDPOINT_IN | 0x0, /* Endpoint 0 IN */
+		LIBUSB_REQUEST_GET_DESCRIPTOR,
+		(LIBUSB_DT_STRING << 8) | descriptor_index,
+		lang_id, data, (uint16_t) length, 1000);
+}
+
+#endif
+
+
+/* Get the first language the device says it reports. This comes from
+   USB string #0. */
+static uint16_t get_first_language(libusb_device_handle *dev)
+{
+	uint16_t buf[32];
+	int len;
+
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			0x0, /* String ID */
+			0x0, /* Language */
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 4)
+		return 0x0;
+
+	return buf[1]; /* First two bytes are len and descriptor type. */
+}
+
+static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+{
+	uint16_t buf[32];
+	int len;
+	int i;
+
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			0x0, /* String ID */
+			0x0, /* Language */
+			(unsigned char*)buf,
+			sizeof(buf));
+	if (len < 4)
+		return 0x0;
+
+
+	len /= 2; /* language IDs are two-bytes each. */
+	/* Start at index 1 because there are two bytes of protocol data. */
+	for (i = 1; i < len; i++) {
+		if (buf[i] == lang)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Reads the raw string descriptor idx (in the current locale's language
+   if the device supports it) into buf. Returns the length of the
+   descriptor, or a (negative) libusb_error on error. */
+static int get_usb_string_descriptor(libusb_device_handle *dev, uint8_t idx, char *buf, int size)
+{
+	int len;
+
+	/* Determine which language to use. */
+	uint16_t lang;
+	lang = get_usb_code_for_current_locale();
+	if (!is_language_supported(dev, lang))
+		lang = get_first_language(dev);
+
+	/* Get the string from libusb. */
+	len = libusb_get_string_descriptor(dev,
+			idx,
+			lang,
+			(unsigned char*)buf,
+			size);
+	if (len < 0)
+		return len;
+	if (len < 2) /* we always skip first 2 bytes */
+		return LIBUSB_ERROR_IO;
+
+	return len;
+}
+
+/* Converts the UTF-16LE string descriptor buf of len bytes (including
+   the 2 bytes header) to wchar_t in str (at most maxlen wide characters,
+   including the terminating NULL). Returns 0 on success, -1 on error. */
+static int usb_string_to_wchar(char *buf, int len, wchar_t *str, size_t maxlen)
+{
+	int ret = -1;
+
+#if !defined(__ANDROID__) && !defined(NO_ICONV) /* we don't use iconv on Android, or when it is explicitly disabled */
+	wchar_t wbuf[MAX_STRING_LENGTH];
+	/* iconv variables */
+	iconv_t ic;
+	size_t inbytes;
+	size_t outbytes;
+	size_t res;
+	ICONV_CONST char *inptr;
+	char *outptr;
+#endif
+
+	if (maxlen == 0)
+		return -1;
+
+#if defined(__ANDROID__) || defined(NO_ICONV)
+
+	/* Bionic does not have iconv support, so it has to be done
+	   manually.  The following code will only work for code points
+	   that can be represented as a single UTF-16 character, and will
+	   incorrectly convert any code points which require more than one
+	   UTF-16 character.
+
+	   Skip over the first character (2-bytes).  */
+	len -= 2;
+	int i;
+	for (i = 0; i < len / 2 && (size_t) i < maxlen - 1; i++) {
+		str[i] = buf[i * 2 + 2] | (buf[i * 2 + 3] << 8);
+	}
+	str[i] = 0x00000000;
+	ret = 0;
+
+#else
+
+	/* buf does not need to be explicitly NULL-terminated because
+	   it is only passed into iconv() which does not need it. */
+
+	/* Initialize iconv. */
+	ic = iconv_open("WCHAR_T", "UTF-16LE");
+	if (ic == (iconv_t)-1) {
+		LOG("iconv_open() failed\n");
+		return -1;
+	}
+
+	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
+	   Skip the first character (2-bytes). */
+	inptr = buf+2;
+	inbytes = len-2;
+	outptr = (char*) wbuf;
+	outbytes = sizeof(wbuf);
+	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
+	if (res == (size_t)-1) {
+		LOG("iconv() failed\n");
+		goto err;
+	}
+
+	/* Write the terminating NULL. */
+	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
+	if (outbytes >= sizeof(wbuf[0]))
+		*((wchar_t*)outptr) = 0x00000000;
+
+	/* Copy the string. */
+	wcsncpy(str, wbuf, maxlen);
+	str[maxlen-1] = 0x00000000;
+	ret = 0;
+
+err:
+	iconv_close(ic);
+
+#endif
+
+	return ret;
+}
+
+/* Converts the UTF-16LE string descriptor buf of len bytes (including
+   the 2 bytes header) to UTF-8 in str (at most maxlen bytes, including
+   the terminating NULL). The string is truncated at a character
+   boundary, and invalid surrogates are replaced with U+FFFD. */
+static int usb_string_to_utf8(const char *buf, int len, char *str, size_t maxlen)
+{
+	const unsigned char *in = (const unsigned char*) buf + 2;
+	int n = (len - 2) / 2;
+	size_t out = 0;
+	int i;
+
+	if (maxlen == 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		uint32_t c = in[i * 2] | (in[i * 2 + 1] << 8);
+		unsigned char seq[4];
+		size_t seq_len;
+
+		if (c >= 0xd800 && c <= 0xdbff && i + 1 < n) {
+			uint32_t low = in[i * 2 + 2] | (in[i * 2 + 3] << 8);
+			if (low >= 0xdc00 && low <= 0xdfff) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				i++;
+			}
+		}
+		if (c >= 0xd800 && c <= 0xdfff)
+			c = 0xfffd; /* Unpaired surrogate */
+		if (c == 0)
+			break;
+
+		if (c < 0x80) {
+			seq[0] = (unsigned char) c;
+			seq_len = 1;
+		}
+		else if (c < 0x800) {
+			seq[0] = (unsigned char) (0xc0 | (c >> 6));
+			seq[1] = (unsigned char) (0x80 | (c & 0x3f));
+			seq_len = 2;
+		}
+		else if (c < 0x10000) {
+			seq[0] = (unsigned char) (0xe0 | (c >> 12));
+			seq[1] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+			seq[2] = (unsigned char) (0x80 | (c & 0x3f));
+			seq_len = 3;
+		}
+		else {
+			seq[0] = (unsigned char) (0xf0 | (c >> 18));
+			seq[1] = (unsigned char) (0x80 | ((c >> 12) & 0x3f));
+			seq[2] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+			seq[3] = (unsigned char) (0x80 | (c & 0x3f));
+			seq_len = 4;
+		}
+
+		/* Don't cut a character */
+		if (out + seq_len > maxlen - 1)
+			break;
+		memcpy(str + out, seq, seq_len);
+		out += seq_len;
+	}
+	str[out] = '\0';
+
+	return 0;
+}
+
+/* Reads string descriptor idx into the enumeration arena, both as
+   wchar_t (to *str) and as UTF-8 (to *str_utf8), with a single
+   request to the device. */
+static void get_usb_string_to_arena(struct enum_arena *arena, libusb_device_handle *dev, uint8_t idx, wchar_t **str, char **str_utf8)
+{
+	char buf[512];
+	wchar_t wstr[MAX_STRING_LENGTH];
+	char ustr[MAX_STRING_LENGTH * 4];
+	int len = get_usb_string_descriptor(dev, idx, buf, sizeof(buf));
+
+	if (len < 0)
+		return;
+	if (usb_string_to_wchar(buf, len, wstr, MAX_STRING_LENGTH) == 0)
+		*str = enum_arena_wcsdup(arena, wstr);
+	if (usb_string_to_utf8(buf, len, ustr, sizeof(ustr)) == 0)
+		*str_utf8 = enum_arena_strdup(arena, ustr);
+}
+
+/* Writes the path of the interface to str, which must hold at least
+   MAX_PATH_LENGTH characters. */
+static void make_path(libusb_device *dev, int interface_number, int config_number, char *str)
+{
+	/* Note that USB3 port count limit is 7; use 8 here for alignment */
+	uint8_t port_numbers[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	int num_ports = libusb_get_port_numbers(dev, port_numbers, 8);
+
+	if (num_ports > 0) {
+		int n = snprintf(str, sizeof("000-000"), "%u-%u", libusb_get_bus_number(dev), port_numbers[0]);
+		for (uint8_t i = 1; i < num_ports; i++) {
+			n += snprintf(&str[n], sizeof(".000"), ".%u", port_numbers[i]);
+		}
+		n += snprintf(&str[n], sizeof(":000.000"), ":%u.%u", (uint8_t)config_number, (uint8_t)interface_number);
+		str[n] = '\0';
+	} else {
+		/* USB3.0 specs limit number of ports to 7 and buffer size here is 8 */
+		if (num_ports == LIBUSB_ERROR_OVERFLOW) {
+			LOG("make_path() failed. buffer overflow error\n");
+		} else {
+			LOG("make_path() failed. unknown error\n");
+		}
+		str[0] = '\0';
+	}
+}
+
+HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
+{
+	return &api_version;
+}
+
+HID_API_EXPORT const char* HID_API_CALL hid_version_str()
+{
+	return HID_API_VERSION_STR;
+}
+
+/* What hid_init() does, for any context */
+static int init_context(hid_context *ctx)
+{
+	/* Set the global error to none */
+	register_global_error(ctx, NULL);
+
+	if (!ctx->usb_context) {
+		const char *locale;
+		int res;
+
+		/* Init Libusb */
+		res = libusb_init(&ctx->usb_context);
+		if (res < 0) {
+			ctx->usb_context = NULL;
+			register_global_error_usb(ctx, "libusb_init", res);
+			return -1;
+		}
+
+		/* Set the locale if it's not set. */
+		locale = setlocale(LC_CTYPE, NULL);
+		if (!locale)
+			setlocale(LC_CTYPE, "");
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_init(void)
+{
+	return init_context(&default_context);
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	if (default_context.usb_context) {
+		/* A context of the application is only forgotten */
+		if (!default_context.usb_context_is_external)
+			libusb_exit(default_context.usb_context);
+		default_context.usb_context = NULL;
+		default_context.usb_context_is_external = 0;
+		default_context.usb_context_events_external = 0;
+	}
+
+	/* Free the global error message of this thread
+	   (the ones of other threads are freed when they exit) */
+	register_global_error(&default_context, NULL);
+
+	return 0;
+}
+
+hid_context * HID_API_EXPORT hid_context_create(const struct hid_context_options *opts)
+{
+	hid_context *ctx;
+
+	(void) opts;
+
+	ctx = (hid_context*) calloc(1, sizeof(hid_context));
+	if (!ctx) {
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "Couldn't allocate the context");
+		return NULL;
+	}
+
+	pthread_mutex_init(&ctx->shared_devices_mutex, NULL);
+
+	if (init_context(ctx) < 0) {
+		/* Report the failure of libusb_init() in the default context */
+		register_global_error_usb(&default_context, ctx->error.msg, ctx->error.usb_error);
+		pthread_mutex_destroy(&ctx->shared_devices_mutex);
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void HID_API_EXPORT hid_context_destroy(hid_context *ctx)
+{
+	if (!ctx || ctx == &default_context)
+		return;
+
+	/* All the devices of the context must be closed by now */
+	if (ctx->usb_context)
+		libusb_exit(ctx->usb_context);
+	pthread_mutex_destroy(&ctx->shared_devices_mutex);
+	free(ctx);
+}
+
+int HID_API_EXPORT_CALL hid_libusb_set_context(struct libusb_context *ctx, int handles_events)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&default_context.shared_devices_mutex);
+	if (default_context.shared_devices) {
+		/* The open devices use the current context */
+		LOG("hid_libusb_set_context(): devices are still open\n");
+		res = -1;
+	}
+	else {
+		if (default_context.usb_context && !default_context.usb_context_is_external)
+			libusb_exit(default_context.usb_context);
+
+		default_context.usb_context = ctx;
+		default_context.usb_context_is_external = (ctx != NULL);
+		default_context.usb_context_events_external = (ctx != NULL && handles_events);
+	}
+	pthread_mutex_unlock(&default_context.shared_devices_mutex);
+
+	if (res == 0 && ctx && !setlocale(LC_CTYPE, NULL))
+		setlocale(LC_CTYPE, "");
+
+	return res;
+}
+
+/* Sends the devices matching the filter to the sink, until it says
+   to stop. The strings of the records are allocated from the arena.
+   Returns -1 if the system couldn't be scanned. */
+static int enumerate_devices(hid_context *ctx, const struct hid_filter *filter, struct enum_arena *arena, struct enum_sink *sink)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	ssize_t num_devs;
+	int i = 0;
+	int stop = 0;
+
+	if(init_context(ctx) < 0)
+		return -1;
+
+	/* All the devices are on the USB bus */
+	if (!filter_match_bus(filter, HID_API_BUS_USB))
+		return 0;
+
+	num_devs = libusb_get_device_list(ctx->usb_context, &devs);
+	if (num_devs < 0) {
+		register_global_error_usb(ctx, "libusb_get_device_list", (int) num_devs);
+		return -1;
+	}
+	while (!stop && (dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int j, k;
+
+		/* The device is opened (and its strings are read) once, for
+		   its first HID interface. The records of all the interfaces
+		   share the strings. */
+		int opened = 0;
+		wchar_t *serial_number = NULL;
+		wchar_t *manufacturer_string = NULL;
+		wchar_t *product_string = NULL;
+		char *serial_number_utf8 = NULL;
+		char *manufacturer_string_utf8 = NULL;
+		char *product_string_utf8 = NULL;
+
+		int res = libusb_get_device_descriptor(dev, &desc);
+		unsigned short dev_vid = desc.idVendor;
+		unsigned short dev_pid = desc.idProduct;
+
+		if (!filter_match_ids(filter, dev_vid, dev_pid)) {
+			continue;
+		}
+
+		handle = NULL;
+		res = libusb_get_active_config_descriptor(dev, &conf_desc);
+		if (res < 0)
+			libusb_get_config_descriptor(dev, 0, &conf_desc);
+		if (conf_desc) {
+			for (j = 0; !stop && j < conf_desc->bNumInterfaces; j++) {
+				const struct libusb_interface *intf = &conf_desc->interface[j];
+				for (k = 0; !stop && k < intf->num_altsetting; k++) {
+					const struct libusb_interface_descriptor *intf_desc;
+					intf_desc = &intf->altsetting[k];
+					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+						int interface_num = intf_desc->bInterfaceNumber;
+						struct hid_device_info info; /* Fields shared by the records of the interface */
+						char path[MAX_PATH_LENGTH];
+#if defined(INVASIVE_GET_USAGE) || defined(USAGE_FROM_SYSFS)
+						uint8_t report_descriptor[MAX_REPORT_DESCRIPTOR_SIZE];
+						int report_descriptor_size = -1;
+#endif
+
+						/* Checked before the device is opened */
+						if (!filter_match_interface(filter, interface_num))
+							continue;
+
+						if (!opened) {
+							opened = 1;
+							if (libusb_open(dev, &handle) < 0)
+								handle = NULL;
+#ifdef __ANDROID__
+							/* There is (a potential) libusb Android backend, in which
+							   device descriptor is not accurate up until the device is opened.
+							   https://github.com/libusb/libusb/pull/874#discussion_r632801373
+							   A workaround is to re-read the descriptor again.
+							   Even if it is not going to be accepted into libusb master,
+							   having it here won't do any harm, since reading the device descriptor
+							   is as cheap as copy 18 bytes of data. */
+							if (handle)
+								libusb_get_device_descriptor(dev, &desc);
+#endif
+
+							if (handle) {
+								/* Serial Number */
+								if (desc.iSerialNumber > 0)
+									get_usb_string_to_arena(arena, handle, desc.iSerialNumber,
+										&serial_number, &serial_number_utf8);
+
+								/* Manufacturer and Product strings */
+								if (desc.iManufacturer > 0)
+									get_usb_string_to_arena(arena, handle, desc.iManufacturer,
+										&manufacturer_string, &manufacturer_string_utf8);
+								if (desc.iProduct > 0)
+									get_usb_string_to_arena(arena, handle, desc.iProduct,
+										&product_string, &product_string_utf8);
+							}
+						}
+
+						if (!filter_match_serial(filter, serial_number_utf8))
+							continue;
+
+						/* Fill out the record */
+						memset(&info, 0, sizeof(info));
+						make_path(dev, interface_num, conf_desc->bConfigurationValue, path);
+						info.path = enum_arena_strdup(arena, path);
+
+						info.serial_number = serial_number;
+						info.manufacturer_string = manufacturer_string;
+						info.product_string = product_string;
+						info.serial_number_utf8 = serial_number_utf8;
+						info.manufacturer_string_utf8 = manufacturer_string_utf8;
+						info.product_string_utf8 = product_string_utf8;
+
+						if (handle) {
+
+#ifdef INVASIVE_GET_USAGE
+{
+						/*
+						This section is removed because it is too
+						invasive on the system. Getting a Usage Page
+						and Usage requires parsing the HID Report
+						descriptor. Getting a HID Report descriptor
+						involves claiming the interface. Claiming the
+						interface involves detaching the kernel driver.
+						Detaching the kernel driver is hard on the system
+						because it will unclaim interfaces (if another
+						app has them claimed) and the re-attachment of
+						the driver will sometimes change /dev entry names.
+						It is for these reasons that this section is
+						#if 0. For composite devices, use the interface
+						field in the hid_device_info struct to distinguish
+						between interfaces. */
+#ifdef DETACH_KERNEL_DRIVER
+							int detached = 0;
+							/* Usage Page and Usage */
+							res = libusb_kernel_driver_active(handle, interface_num);
+							if (res == 1) {
+								res = libusb_detach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.\n");
+								else
+									detached = 1;
+							}
+#endif
+							res = libusb_claim_interface(handle, interface_num);
+							if (res >= 0) {
+								/* Get the HID Report Descriptor. */
+								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, report_descriptor, sizeof(report_descriptor), 5000);
+								if (res >= 0)
+									report_descriptor_size = res;
+								else
+									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+								/* Release the interface */
+								res = libusb_release_interface(handle, interface_num);
+								if (res < 0)
+									LOG("Can't release the interface.\n");
+							}
+							else
+								LOG("Can't claim interface %d\n", res);
+#ifdef DETACH_KERNEL_DRIVER
+							/* Re-attach kernel driver if necessary. */
+							if (detached) {
+								res = libusb_attach_kernel_driver(handle, interface_num);
+								if (res < 0)
+									LOG("Couldn't re-attach kernel driver.\n");
+							}
+#endif
+}
+#endif /* INVASIVE_GET_USAGE */
+						}
+						/* VID/PID */
+						info.vendor_id = dev_vid;
+						info.product_id = dev_pid;
+
+						/* Release Number */
+						info.release_number = desc.bcdDevice;
+
+						/* Interface Number */
+						info.interface_number = interface_num;
+
+						info.bus_type = HID_API_BUS_USB;
+
+#ifdef USAGE_FROM_SYSFS
+						/* Usage Page and Usage */
+						if (report_descriptor_size < 0)
+							report_descriptor_size = get_report_descriptor_from_sysfs(info.path, report_descriptor, sizeof(report_descriptor));
+#endif
+#if defined(INVASIVE_GET_USAGE) || defined(USAGE_FROM_SYSFS)
+						if (report_descriptor_size > 0) {
+							stop = add_usage_records(arena, sink, &info, filter, report_descriptor, (size_t) report_descriptor_size);
+							continue;
+						}
+#endif
+						/* Usage Page and Usage are unknown */
+						if (filter_match_usage(filter, 0, 0))
+							stop = enum_sink_add(arena, sink, &info, 0, 0);
+					}
+				} /* altsettings */
+			} /* interfaces */
+			libusb_free_config_descriptor(conf_desc);
+		}
+
+		if (handle)
+			libusb_close(handle);
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_context_enumerate(hid_context *ctx, const struct hid_filter *filter)
+{
+	struct enum_sink sink; /* return object */
+	struct enum_arena arena = { NULL, NULL, 0 };
+
+	ctx = resolve_context(ctx);
+
+	memset(&sink, 0, sizeof(sink));
+	if (enumerate_devices(ctx, filter, &arena, &sink) < 0) {
+		/* register_global_error: global error is already set by enumerate_devices */
+	}
+	else if (sink.root == NULL) {
+		if (filter == NULL) {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "No HID devices found in the system.");
+		} else {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "No HID devices matching the filter found in the system.");
+		}
+	}
+
+	if (sink.root == NULL)
+		enum_arena_free(arena.first);
+
+	return sink.root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_filtered(const struct hid_filter *filter)
+{
+	return hid_context_enumerate(NULL, filter);
+}
+
+int HID_API_EXPORT hid_context_enumerate_visit(hid_context *ctx, const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct enum_sink sink;
+	struct enum_arena arena = { NULL, NULL, 0 };
+	int res;
+
+	ctx = resolve_context(ctx);
+
+	if (!callback) {
+		register_global_error_code(ctx, HID_API_ERROR_INVALID_PARAM, "hid_enumerate_visit: NULL callback");
+		return -1;
+	}
+
+	memset(&sink, 0, sizeof(sink));
+	sink.callback = callback;
+	sink.user_data = user_data;
+
+	res = enumerate_devices(ctx, filter, &arena, &sink);
+
+	/* The strings only had to live during the callbacks */
+	enum_arena_free(arena.first);
+
+	return res < 0? -1: sink.result;
+}
+
+int HID_API_EXPORT hid_enumerate_visit(const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	return hid_context_enumerate_visit(NULL, filter, callback, user_data);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_filter_id id;
+	struct hid_filter filter;
+
+	if (vendor_id == 0 && product_id == 0)
+		return hid_enumerate_filtered(NULL);
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	return hid_enumerate_filtered(&filter);
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	/* The root record sits at the start of the first arena block,
+	   all the other records and strings live in the same arena. */
+	if (devs)
+		enum_arena_free((struct enum_arena_block*) devs - 1);
+}
+
+/* State of hid_open(), see open_visitor() */
+struct open_search {
+	unsigned short vendor_id;
+	unsigned short product_id;
+	const wchar_t *serial_number;
+	char *path; /* The path of the device found */
+};
+
+/* Stops at the first device matching the hid_open() arguments */
+static int open_visitor(const struct hid_device_info *info, void *user_data)
+{
+	struct open_search *search = (struct open_search*) user_data;
+
+	if (info->vendor_id != search->vendor_id ||
+	    info->product_id != search->product_id)
+		return 0;
+
+	if (search->serial_number &&
+	    (!info->serial_number || wcscmp(search->serial_number, info->serial_number) != 0))
+		return 0;
+
+	search->path = strdup(info->path);
+	return 1;
+}
+
+hid_device * HID_API_EXPORT hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct open_search search;
+	struct hid_filter_id id;
+	struct hid_filter filter;
+	hid_device *handle = NULL;
+
+	ctx = resolve_context(ctx);
+
+	search.vendor_id = vendor_id;
+	search.product_id = product_id;
+	search.serial_number = serial_number;
+	search.path = NULL;
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	/* register_global_error: global error is reset by hid_context_enumerate_visit */
+	if (hid_context_enumerate_visit(ctx, &filter, open_visitor, &search) < 0) {
+		/* register_global_error: global error is already set by hid_context_enumerate_visit */
+		return NULL;
+	}
+
+	if (search.path) {
+		/* Open the device */
+		handle = hid_context_open_path(ctx, search.path);
+		free(search.path);
+	}
+	else {
+		register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "Device with requested VID/PID/(SerialNumber) not found");
+	}
+
+	return handle;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	return hid_context_open(NULL, vendor_id, product_id, serial_number);
+}
+
+/* Called (from read_callback()) when none of the transfers of dev
+   are going to be re-submitted anymore. */
+static void finish_transfer_loop(hid_device *dev)
+{
+	struct shared_device *shared = dev->shared;
+
+	/* Wake hid_close() and any threads which are waiting on data
+	   (in hid_read_timeout()). Do this under a mutex to make sure that
+	   a thread which is about to go to sleep waiting on the condition
+	   actually will go to sleep before the condition is signaled. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->transfer_loop_finished = 1;
+	pthread_cond_broadcast(&dev->condition);
+	update_input_fd(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	pthread_mutex_lock(&shared->mutex);
+	if (dev->broadcast)
+		wake_broadcast_readers(dev->broadcast);
+#ifdef SHARE_DEVICE
+	if (dev->broker) {
+		__atomic_store_n(&dev->broker->header->closed, 1, __ATOMIC_RELEASE);
+		wake_shared_device(dev->broker->header);
+	}
+#endif
+	if (--shared->active_transfers == 0) {
+		/* All the interfaces are closed or the device is gone,
+		   nothing left for the event thread to do. */
+		shared->transfers_finished = 1;
+		shared->shutdown_thread = 1;
+	}
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+/* Passes a report to the callback subscribed to its Report ID, if any.
+   Returns 1 if the callback consumed the report. */
+static int dispatch_subscribed_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int consumed = 0;
+
+	if (length == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (dev->subscriptions && dev->subscriptions[data[0]].callback) {
+		dev->subscriptions[data[0]].callback(dev, data, length, dev->subscriptions[data[0]].user_data);
+		consumed = 1;
+	}
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	return consumed;
+}
+
+/* Replaces the report in the slot of its Report ID. Only called
+   by read_callback(), with dev->shared->mutex locked. */
+static void store_latest_report(hid_device *dev, int numbered, const unsigned char *data, size_t length)
+{
+	int report_id = (numbered && length > 0)? data[0]: 0;
+	struct latest_report *slot = dev->latest_reports[report_id];
+
+	if (!slot || length > slot->capacity) {
+		/* The first report of this Report ID, or a longer one than
+		   the slot holds: publish a bigger slot. Readers may still be
+		   copying from the old one, which is kept until hid_close(). */
+		struct latest_report *bigger;
+		size_t capacity = length;
+
+		if (slot && capacity < 2 * slot->capacity)
+			capacity = 2 * slot->capacity;
+		bigger = (struct latest_report*) malloc(sizeof(struct latest_report) + capacity);
+		if (!bigger)
+			return;
+		bigger->seq = 0;
+		bigger->len = 0;
+		bigger->capacity = capacity;
+		bigger->data = (unsigned char*) (bigger + 1);
+		bigger->retired = slot;
+		__atomic_store_n(&dev->latest_reports[report_id], bigger, __ATOMIC_RELEASE);
+		slot = bigger;
+	}
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->len, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the report of a slot, without blocking its writer. */
+static int load_latest_report(struct latest_report *slot, unsigned char *data, size_t length)
+{
+	unsigned int seq;
+	size_t len;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue; /* Being written */
+
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return (int) len;
+	}
+}
+
+/* Returns non-zero if a and b differ in the bits set in mask.
+   Compares 16 bytes at a time where the CPU allows it. */
+static int masked_reports_differ(const unsigned char *a, const unsigned char *b, const unsigned char *mask, size_t length)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= length; i += 16) {
+		__m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *) (mask + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+			return 1;
+	}
+#elif defined(__aarch64__)
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		if (vmaxvq_u8(vandq_u8(diff, vld1q_u8(mask + i))))
+			return 1;
+	}
+#endif
+	for (; i < length; i++) {
+		if ((a[i] ^ b[i]) & mask[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* In changes-only mode, returns 1 if the report is the same as the
+   previous one of its Report ID, to be dropped. Otherwise the report
+   becomes the previous one and 0 is returned. Only called
+   by read_callback(), with dev->shared->mutex locked. */
+static int drop_unchanged_report(hid_device *dev, int report_id, const unsigned char *data, size_t length)
+{
+	struct change_filter *filter;
+
+	if (!dev->changes_only || length == 0)
+		return 0;
+
+	filter = &dev->change_filters[report_id];
+	if (filter->len == length) {
+		size_t masked = (filter->mask_len < length)? filter->mask_len: length;
+
+		/* The unmasked rest goes to memcmp(), vectorized by the C library */
+		if (!masked_reports_differ(filter->data, data, filter->mask, masked) &&
+		    memcmp(filter->data + masked, data + masked, length - masked) == 0) {
+			dev->unchanged_count++;
+			return 1;
+		}
+	}
+
+	if (length > filter->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(filter->data, length);
+		if (!buf) {
+			/* Deliver every report of this Report ID instead */
+			filter->len = 0;
+			return 0;
+		}
+		filter->data = buf;
+		filter->capacity = length;
+	}
+	memcpy(filter->data, data, length);
+	filter->len = length;
+
+	return 0;
+}
+
+/* A monotonic time in microseconds */
+static uint64_t get_microseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* A monotonic time in milliseconds */
+static uint64_t get_milliseconds(void)
+{
+	return get_microseconds() / 1000;
+}
+
+/* Called with dev->mutex locked when a report was queued. Returns 1 if
+   the waiting threads are to be woken up now, or 0 if the report waits
+   for the rest of its batch (see hid_set_batching()). */
+static int batch_report_queued(hid_device *dev, int queue_was_empty)
+{
+	if (dev->batch_reports <= 1)
+		return 1;
+
+	/* Nobody waits while the queue holds announced reports */
+	if (!queue_was_empty && !dev->batch_pending)
+		return 1;
+
+	if (dev->batch_pending++ == 0)
+		dev->batch_deadline = get_microseconds() + dev->batch_delay_us;
+	if (dev->batch_pending < dev->batch_reports)
+		return 0;
+
+	dev->batch_pending = 0;
+	return 1;
+}
+
+/* Wakes up the threads waiting on the devices of shared whose batch is
+   due. Returns the microseconds until the next batch is due, or -1 if
+   no report is held back. Only called by read_thread(). */
+static int64_t flush_batches(struct shared_device *shared)
+{
+	hid_device *dev;
+	uint64_t now = get_microseconds();
+	int64_t next = -1;
+
+	pthread_mutex_lock(&shared->mutex);
+	for (dev = shared->devices; dev; dev = dev->next_shared) {
+		pthread_mutex_lock(&dev->mutex);
+		if (dev->batch_pending) {
+			if (now >= dev->batch_deadline) {
+				dev->batch_pending = 0;
+				pthread_cond_broadcast(&dev->condition);
+				update_input_fd(dev);
+			}
+			else if (next < 0 || (int64_t) (dev->batch_deadline - now) < next) {
+				next = (int64_t) (dev->batch_deadline - now);
+			}
+		}
+		pthread_mutex_unlock(&dev->mutex);
+	}
+	pthread_mutex_unlock(&shared->mutex);
+
+	return next;
+}
+
+/* Passes a report through the decimation stage of its Report ID, if
+   any. Returns 1 if nothing is to be delivered. Otherwise the report to
+   deliver is in data: in the window modes it is the report of the
+   window which this one closes, the two being swapped within the
+   capacity of data. Only called
+   by read_callback(), with dev->shared->mutex locked. */
+static int decimate_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	struct report_decimator *d;
+	uint64_t now;
+	int drop = 0;
+
+	d = dev->decimators? dev->decimators[report_id]: NULL;
+	if (!d || *length == 0)
+		goto out;
+
+	if (d->config.mode == HID_DECIMATE_EVERY_NTH) {
+		drop = (d->skipped != 0);
+		if (++d->skipped >= d->config.every)
+			d->skipped = 0;
+		goto out;
+	}
+
+	if (*length > d->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(d->window, *length);
+		if (!buf)
+			goto out; /* Deliver it as is */
+		d->window = buf;
+		d->capacity = *length;
+	}
+
+	now = get_milliseconds();
+	if (d->window_len && now >= d->window_end) {
+		/* Deliver the window, and start the next one with this report */
+		size_t window_len = (d->window_len < capacity)? d->window_len: capacity;
+		size_t n = (*length > window_len)? *length: window_len;
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			unsigned char c = data[i];
+			data[i] = d->window[i];
+			d->window[i] = c;
+		}
+		d->window_len = *length;
+		*length = window_len;
+		d->window_count = 0;
+		d->window_end = now + d->config.window_ms;
+		if (!dev->window_due || d->window_end < dev->window_due)
+			dev->window_due = d->window_end;
+	}
+	else {
+		drop = 1;
+		if (!d->window_len) {
+			d->window_count = 0;
+			d->window_end = now + d->config.window_ms;
+			if (!dev->window_due || d->window_end < dev->window_due)
+				dev->window_due = d->window_end;
+		}
+		if (!d->window_len || d->config.mode == HID_DECIMATE_WINDOW_LATEST) {
+			memcpy(d->window, data, *length);
+			d->window_len = *length;
+		}
+	}
+
+	if (d->config.mode == HID_DECIMATE_WINDOW_REDUCE) {
+		/* The first report of a window is in the window already */
+		if (d->window_count == 0)
+			d->config.reducer(d->window, d->window_len, d->window, d->window_len, 0, d->config.user_data);
+		else
+			d->config.reducer(d->window, d->window_len, data, *length, d->window_count, d->config.user_data);
+	}
+	d->window_count++;
+
+out:
+	return drop;
+}
+
+/* The stages between the arrival of a report and its delivery:
+   changes-only mode, then decimation. Returns 1 if the report is
+   dropped. *length changes when a window is delivered instead. */
+static int filter_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	return drop_unchanged_report(dev, report_id, data, *length) ||
+	       decimate_report(dev, report_id, data, length, capacity);
+}
+
+/* Passes a report which went through filter_report() on to target: to
+   its subscribed callback, its broker, its latest slots, its broadcast
+   ring or its queue. interface and endpoint are where the report came
+   from, see hid_libusb_get_report_endpoint(). Called with
+   target->shared->mutex locked. */
+static void deliver_report(hid_device *target, int numbered, int interface, int endpoint, const unsigned char *data, size_t length)
+{
+	struct input_report *rpt;
+	int queue_was_empty;
+
+	/* Subscribed reports bypass the queue */
+	if (dispatch_subscribed_report(target, data, length))
+		return;
+
+#ifdef SHARE_DEVICE
+	/* A shared device publishes it to the other processes */
+	if (target->broker) {
+		store_shared_report(target->broker, data, length);
+		return;
+	}
+#endif
+
+	/* In latest mode the report replaces the previous one instead */
+	if (__atomic_load_n(&target->read_latest, __ATOMIC_ACQUIRE)) {
+		store_latest_report(target, numbered, data, length);
+		return;
+	}
+
+	/* In broadcast mode it goes to the ring instead */
+	if (target->broadcast) {
+		store_broadcast_report(target->broadcast, data, length);
+		return;
+	}
+
+	rpt = (struct input_report*) malloc(sizeof(*rpt));
+	rpt->data = (uint8_t*) malloc(length);
+	memcpy(rpt->data, data, length);
+	rpt->len = length;
+	rpt->interface = interface;
+	rpt->endpoint = endpoint;
+	rpt->next = NULL;
+
+	pthread_mutex_lock(&target->mutex);
+	rpt->seq = ++target->report_seq;
+	queue_was_empty = (target->input_reports == NULL);
+
+	/* Attach the new report object to the end of the list. */
+	if (target->input_reports == NULL) {
+		/* The list is empty. Put it at the root. */
+		target->input_reports = rpt;
+	}
+	else {
+		/* Find the end of the list and attach. */
+		struct input_report *cur = target->input_reports;
+		int num_queued = 0;
+		while (cur->next != NULL) {
+			cur = cur->next;
+			num_queued++;
+		}
+		cur->next = rpt;
+
+		/* Pop one off if we've reached 30 in the queue. This
+		   way we don't grow forever if the user never reads
+		   anything from the device. */
+		if (num_queued > 30) {
+			return_data(target, NULL, 0);
+		}
+	}
+	if (batch_report_queued(target, queue_was_empty)) {
+		/* hid_transact() waits for a particular report,
+		   not just for the queue to be non-empty. */
+		pthread_cond_broadcast(&target->condition);
+		update_input_fd(target);
+	}
+	pthread_mutex_unlock(&target->mutex);
+}
+
+/* Delivers the windows of the decimation stages of the devices of
+   shared which have ended, instead of waiting for the next report of
+   their Report ID. Returns the microseconds until the next window
+   ends, or -1 if no window is open. Only called by read_thread(). */
+static int64_t flush_windows(struct shared_device *shared)
+{
+	hid_device *dev;
+	uint64_t now = get_microseconds();
+	uint64_t now_ms = now / 1000;
+	int64_t next = -1;
+
+	pthread_mutex_lock(&shared->mutex);
+	for (dev = shared->devices; dev; dev = dev->next_shared) {
+		if (dev->window_due && now_ms >= dev->window_due) {
+			int i;
+
+			dev->window_due = 0;
+			for (i = 0; i < 256; i++) {
+				struct report_decimator *d = dev->decimators[i];
+				if (!d || !d->window_len)
+					continue;
+				if (now_ms >= d->window_end) {
+					/* Attributed to the first endpoint of dev, even
+					   if its reports came from another one or from a
+					   merged interface (see hid_libusb_merge_input()) */
+					deliver_report(dev, dev->uses_numbered_reports, dev->interface, dev->input_endpoint,
+					               d->window, d->window_len);
+					d->window_len = 0;
+				}
+				else if (!dev->window_due || d->window_end < dev->window_due) {
+					dev->window_due = d->window_end;
+				}
+			}
+		}
+		if (dev->window_due) {
+			int64_t due = (int64_t) (dev->window_due * 1000 - now);
+			if (due < 0)
+				due = 0;
+			if (next < 0 || due < next)
+				next = due;
+		}
+	}
+	pthread_mutex_unlock(&shared->mutex);
+
+	return next;
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	hid_device *dev = transfer->user_data;
+	int last_transfer;
+	int res;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		hid_device *target;
+		size_t length = (size_t) transfer->actual_length;
+
+		capture_report(dev, HID_CAPTURE_INPUT, transfer->buffer, length);
+
+		/* input_target may only change under shared->mutex */
+		pthread_mutex_lock(&dev->shared->mutex);
+		target = dev->input_target? dev->input_target: dev;
+
+		/* Repeated and decimated reports go no further */
+		if (!filter_report(target, (dev->uses_numbered_reports && length > 0)? transfer->buffer[0]: 0,
+		                   transfer->buffer, &length, (size_t) transfer->length)) {
+			deliver_report(target, dev->uses_numbered_reports, dev->interface, transfer->endpoint,
+			               transfer->buffer, length);
+		}
+		pthread_mutex_unlock(&dev->shared->mutex);
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		dev->shutdown_thread = 1;
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		dev->shutdown_thread = 1;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
 		//LOG("Timeout (normal)\n");
@@ -822,50 +3080,63 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 
-	if (dev->shutdown_thread) {
-		dev->transfer_loop_finished = 1;
-		return;
-	}
+	if (!dev->shutdown_thread) {
+		/* Re-submit the transfer object. */
+		res = libusb_submit_transfer(transfer);
+		if (res == 0)
+			return;
 
-	/* Re-submit the transfer object. */
-	res = libusb_submit_transfer(transfer);
-	if (res != 0) {
 		LOG("Unable to submit URB. libusb error code: %d\n", res);
 		dev->shutdown_thread = 1;
-		dev->transfer_loop_finished = 1;
 	}
+
+	/* This transfer is done. Stop the ones on the other
+	   endpoints of the interface as well. */
+	pthread_mutex_lock(&dev->shared->mutex);
+	last_transfer = (--dev->active_transfers == 0);
+	if (!last_transfer) {
+		int i;
+		for (i = 0; i < dev->num_transfers; i++) {
+			if (dev->transfers[i] != transfer)
+				libusb_cancel_transfer(dev->transfers[i]);
+		}
+	}
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	if (last_transfer)
+		finish_transfer_loop(dev);
 }
 
 
 static void *read_thread(void *param)
 {
-	hid_device *dev = param;
-	uint8_t *buf;
-	const size_t length = dev->input_ep_max_packet_size;
-
-	/* Set up the transfer object. */
-	buf = (uint8_t*) malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
+	struct shared_device *shared = param;
+	hid_device *dev;
 
 	/* Notify the main thread that the read thread is up and running. */
-	pthread_barrier_wait(&dev->barrier);
+	pthread_barrier_wait(&shared->barrier);
 
 	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
+	while (!shared->shutdown_thread) {
 		int res;
-		res = libusb_handle_events(usb_context);
+		/* A window delivered now may start a batch */
+		int64_t window_due = __atomic_load_n(&shared->windows, __ATOMIC_ACQUIRE)? flush_windows(shared): -1;
+		int64_t batch_due = __atomic_load_n(&shared->batching, __ATOMIC_ACQUIRE)? flush_batches(shared): -1;
+
+		if (window_due >= 0 && (batch_due < 0 || window_due < batch_due))
+			batch_due = window_due;
+
+		if (batch_due >= 0) {
+			/* Wake up for the next batch (see hid_set_batching())
+			   or the end of the next window (see hid_set_decimation()) */
+			struct timeval tv;
+			tv.tv_sec = (time_t) (batch_due / 1000000);
+			tv.tv_usec = (suseconds_t) (batch_due % 1000000);
+			res = libusb_handle_events_timeout_completed(shared->context->usb_context, &tv, NULL);
+		}
+		else {
+			res = libusb_handle_events(shared->context->usb_context);
+		}
 		if (res < 0) {
 			/* There was an error. */
 			LOG("read_thread(): libusb reports error # %d\n", res);
@@ -875,44 +3146,216 @@ static void *read_thread(void *param)
 			    res != LIBUSB_ERROR_TIMEOUT &&
 			    res != LIBUSB_ERROR_OVERFLOW &&
 			    res != LIBUSB_ERROR_INTERRUPTED) {
-				dev->shutdown_thread = 1;
 				break;
 			}
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
+	/* Cancel any transfers that may be pending. These calls will fail
 	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
-
-	while (!dev->transfer_loop_finished)
-		libusb_handle_events_completed(usb_context, &dev->transfer_loop_finished);
+	pthread_mutex_lock(&shared->mutex);
+	shared->shutdown_thread = 1;
+	for (dev = shared->devices; dev; dev = dev->next_shared) {
+		int i;
+		dev->shutdown_thread = 1;
+		for (i = 0; i < dev->num_transfers; i++)
+			libusb_cancel_transfer(dev->transfers[i]);
+	}
+	pthread_mutex_unlock(&shared->mutex);
 
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+	while (!shared->transfers_finished)
+		libusb_handle_events_completed(shared->context->usb_context, &shared->transfers_finished);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+	/* The transfer objects are cleaned up in hid_close(). They are not
+	   cleaned up here because this thread could end either due to a
+	   disconnect or due to the last call to hid_close(). In both cases
+	   the objects can be safely cleaned up after read_callback() is done
+	   with them, but since hid_close() calls libusb_cancel_transfer(),
+	   on these objects, they can not be cleaned up here. */
 
 	return NULL;
 }
 
 
+/* Creates a shared_device for an open libusb handle and adds it to the
+   list of open devices of ctx. Must be called with
+   ctx->shared_devices_mutex locked. */
+static struct shared_device *new_shared_device(hid_context *ctx, libusb_device_handle *handle)
+{
+	struct shared_device *shared = (struct shared_device*) calloc(1, sizeof(struct shared_device));
+	if (!shared)
+		return NULL;
+
+	shared->context = ctx;
+	shared->usb_dev = libusb_ref_device(libusb_get_device(handle));
+	shared->device_handle = handle;
+	shared->refcount = 1;
+	shared->transfers_finished = 1;
+	pthread_mutex_init(&shared->mutex, NULL);
+	pthread_barrier_init(&shared->barrier, NULL, 2);
+
+	shared->next = ctx->shared_devices;
+	ctx->shared_devices = shared;
+
+	return shared;
+}
+
+/* Returns a referenced shared_device for usb_dev, opening the device
+   if none of its interfaces are open yet. */
+static struct shared_device *acquire_shared_device(hid_context *ctx, libusb_device *usb_dev)
+{
+	struct shared_device *shared;
+
+	pthread_mutex_lock(&ctx->shared_devices_mutex);
+	for (shared = ctx->shared_devices; shared; shared = shared->next) {
+		/* Don't reuse a handle of a device which is gone. */
+		if (shared->usb_dev == usb_dev && !shared->shutdown_thread) {
+			shared->refcount++;
+			break;
+		}
+	}
+
+	if (!shared) {
+		libusb_device_handle *handle;
+		int res = libusb_open(usb_dev, &handle);
+		if (res < 0) {
+			LOG("can't open device\n");
+			register_global_error_usb(ctx, "libusb_open", res);
+		}
+		else {
+			shared = new_shared_device(ctx, handle);
+			if (!shared)
+				libusb_close(handle);
+		}
+	}
+	pthread_mutex_unlock(&ctx->shared_devices_mutex);
+
+	return shared;
+}
+
+/* Drops a reference to shared. The last reference stops the event thread
+   and closes the libusb handle. All the transfers of the device have to
+   be finished before the last reference is released. */
+static void release_shared_device(struct shared_device *shared)
+{
+	hid_context *ctx = shared->context;
+	struct shared_device **cur;
+	int last;
+
+	pthread_mutex_lock(&ctx->shared_devices_mutex);
+	last = (--shared->refcount == 0);
+	if (last) {
+		for (cur = &ctx->shared_devices; *cur; cur = &(*cur)->next) {
+			if (*cur == shared) {
+				*cur = shared->next;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&ctx->shared_devices_mutex);
+
+	if (!last)
+		return;
+
+	if (shared->thread_started) {
+		/* read_thread() is already stopping since there are no
+		   transfers left, this just makes sure of it. */
+		pthread_mutex_lock(&shared->mutex);
+		shared->shutdown_thread = 1;
+		pthread_mutex_unlock(&shared->mutex);
+		pthread_join(shared->thread, NULL);
+	}
+
+	libusb_close(shared->device_handle);
+	libusb_unref_device(shared->usb_dev);
+
+	pthread_barrier_destroy(&shared->barrier);
+	pthread_mutex_destroy(&shared->mutex);
+	free(shared);
+}
+
+/* Makes the first submission of the input transfers of dev, and starts
+   the event thread of the shared device if it isn't running yet. Further
+   submissions are made from inside read_callback() */
+static void start_input_transfers(hid_device *dev)
+{
+	struct shared_device *shared = dev->shared;
+	int start_thread = 0;
+	int i;
+
+	pthread_mutex_lock(&shared->mutex);
+	dev->next_shared = shared->devices;
+	shared->devices = dev;
+
+	dev->active_transfers = 0;
+	if (!shared->shutdown_thread) {
+		for (i = 0; i < dev->num_transfers; i++) {
+			if (libusb_submit_transfer(dev->transfers[i]) != 0)
+				break;
+			dev->active_transfers++;
+		}
+		if (dev->active_transfers < dev->num_transfers) {
+			/* Take back the ones which made it */
+			for (i = 0; i < dev->active_transfers; i++)
+				libusb_cancel_transfer(dev->transfers[i]);
+			dev->shutdown_thread = 1;
+		}
+	}
+
+	if (dev->active_transfers == 0) {
+		/* Behave as a disconnected device */
+		dev->shutdown_thread = 1;
+		dev->transfer_loop_finished = 1;
+	}
+	else {
+		shared->active_transfers++;
+		shared->transfers_finished = 0;
+		/* The events are handled by the application
+		   if it asked for that in hid_libusb_set_context() */
+		if (!shared->thread_started && !shared->context->usb_context_events_external) {
+			shared->thread_started = 1;
+			start_thread = 1;
+		}
+	}
+	pthread_mutex_unlock(&shared->mutex);
+
+	if (start_thread) {
+		pthread_create(&shared->thread, NULL, read_thread, shared);
+
+		/* Wait here for the read thread to be initialized. */
+		pthread_barrier_wait(&shared->barrier);
+	}
+}
+
+/* Removes dev from the list of devices of its shared device.
+   The transfers of dev must be finished. */
+static void detach_from_shared_device(hid_device *dev)
+{
+	struct shared_device *shared = dev->shared;
+	hid_device **cur;
+	hid_device *d;
+
+	pthread_mutex_lock(&shared->mutex);
+	for (cur = &shared->devices; *cur; cur = &(*cur)->next_shared) {
+		if (*cur == dev) {
+			*cur = dev->next_shared;
+			break;
+		}
+	}
+	/* Stop merging into this device */
+	for (d = shared->devices; d; d = d->next_shared) {
+		if (d->input_target == dev)
+			d->input_target = NULL;
+	}
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+
 static int hidapi_initialize_device(hid_device *dev, const struct libusb_interface_descriptor *intf_desc)
 {
 	int i =0;
 	int res = 0;
+	size_t max_input_report_size = 0;
 	struct libusb_device_descriptor desc;
 	libusb_get_device_descriptor(libusb_get_device(dev->device_handle), &desc);
 
@@ -924,6 +3367,7 @@ static int hidapi_initialize_device(hid_device *dev, const struct libusb_interfa
 		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
 		if (res < 0) {
 			LOG("Unable to detach Kernel Driver\n");
+			register_global_error_usb(dev->shared->context, "libusb_detach_kernel_driver", res);
 			return 0;
 		}
 		else {
@@ -935,6 +3379,7 @@ static int hidapi_initialize_device(hid_device *dev, const struct libusb_interfa
 	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
 	if (res < 0) {
 		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+		register_global_error_usb(dev->shared->context, "libusb_claim_interface", res);
 		return 0;
 	}
 
@@ -947,11 +3392,26 @@ static int hidapi_initialize_device(hid_device *dev, const struct libusb_interfa
 	dev->interface = intf_desc->bInterfaceNumber;
 
 	dev->input_endpoint = 0;
-	dev->input_ep_max_packet_size = 0;
 	dev->output_endpoint = 0;
+	dev->num_transfers = 0;
+
+	/* Get the size of the largest input report. The transfers are made
+	   large enough to hold it, so that a report which spans several
+	   packets is returned by a single hid_read(). A transfer completes
+	   on the short packet at the end of the report. */
+	{
+		unsigned char report_descriptor[MAX_REPORT_DESCRIPTOR_SIZE];
+		res = libusb_control_transfer(dev->device_handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8), dev->interface, report_descriptor, sizeof(report_descriptor), 5000);
+		if (res > 0) {
+			max_input_report_size = get_max_input_report_size(report_descriptor, (size_t) res, &dev->uses_numbered_reports);
+		}
+		else {
+			LOG("Unable to get the Report Descriptor of interface %d: %d\n", dev->interface, res);
+		}
+	}
 
-	/* Find the INPUT and OUTPUT endpoints. An
-	   OUTPUT endpoint is not required. */
+	/* Find the INPUT and OUTPUT endpoints. Every interrupt IN
+	   endpoint is read. An OUTPUT endpoint is not required. */
 	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
 		const struct libusb_endpoint_descriptor *ep
 			= &intf_desc->endpoint[i];
@@ -969,11 +3429,36 @@ static int hidapi_initialize_device(hid_device *dev, const struct libusb_interfa
 		      == LIBUSB_ENDPOINT_IN;
 
 		/* Decide whether to use it for input or output. */
-		if (dev->input_endpoint == 0 &&
-		    is_interrupt && is_input) {
-			/* Use this endpoint for INPUT */
-			dev->input_endpoint = ep->bEndpointAddress;
-			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		if (is_interrupt && is_input &&
+		    dev->num_transfers < MAX_INPUT_ENDPOINTS) {
+			/* Use this endpoint for INPUT. Bits 10..0 of
+			   wMaxPacketSize are the packet size, bits 12..11
+			   the number of additional transactions per
+			   microframe of a high-bandwidth (high-speed)
+			   endpoint. See USB 2.0 spec, table 9-13. */
+			size_t buffer_size = (ep->wMaxPacketSize & 0x07ff)
+				* (((ep->wMaxPacketSize >> 11) & 0x3) + 1);
+			struct libusb_transfer *transfer;
+
+			if (buffer_size < max_input_report_size)
+				buffer_size = max_input_report_size;
+
+			/* Set up the transfer object. */
+			transfer = libusb_alloc_transfer(0);
+			if (!transfer)
+				continue;
+			libusb_fill_interrupt_transfer(transfer,
+				dev->device_handle,
+				ep->bEndpointAddress,
+				(uint8_t*) malloc(buffer_size),
+				(int) buffer_size,
+				read_callback,
+				dev,
+				5000/*timeout*/);
+			dev->transfers[dev->num_transfers++] = transfer;
+
+			if (dev->input_endpoint == 0)
+				dev->input_endpoint = ep->bEndpointAddress;
 		}
 		if (dev->output_endpoint == 0 &&
 		    is_interrupt && is_output) {
@@ -982,30 +3467,36 @@ static int hidapi_initialize_device(hid_device *dev, const struct libusb_interfa
 		}
 	}
 
-	pthread_create(&dev->thread, NULL, read_thread, dev);
-
-	/* Wait here for the read thread to be initialized. */
-	pthread_barrier_wait(&dev->barrier);
+	start_input_transfers(dev);
 	return 1;
 }
 
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
 {
 	hid_device *dev = NULL;
 
 	libusb_device **devs = NULL;
 	libusb_device *usb_dev = NULL;
-	int res = 0;
+	ssize_t num_devs;
 	int d = 0;
 	int good_open = 0;
+	int found = 0;
 
-	if(hid_init() < 0)
+	ctx = resolve_context(ctx);
+
+	/* register_global_error: global error is reset by init_context */
+	if(init_context(ctx) < 0)
+		return NULL;
+
+	num_devs = libusb_get_device_list(ctx->usb_context, &devs);
+	if (num_devs < 0) {
+		register_global_error_usb(ctx, "libusb_get_device_list", (int) num_devs);
 		return NULL;
+	}
 
 	dev = new_hid_device();
 
-	libusb_get_device_list(usb_context, &devs);
 	while ((usb_dev = devs[d++]) != NULL && !good_open) {
 		struct libusb_config_descriptor *conf_desc = NULL;
 		int j,k;
@@ -1017,22 +3508,24 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 			for (k = 0; k < intf->num_altsetting && !good_open; k++) {
 				const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
 				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber, conf_desc->bConfigurationValue);
+					char dev_path[MAX_PATH_LENGTH];
+					make_path(usb_dev, intf_desc->bInterfaceNumber, conf_desc->bConfigurationValue, dev_path);
 					if (!strcmp(dev_path, path)) {
 						/* Matched Paths. Open this device */
+						found = 1;
 
-						/* OPEN HERE */
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
+						/* OPEN HERE (or reuse the handle of
+						   another open interface of this device) */
+						dev->shared = acquire_shared_device(ctx, usb_dev);
+						if (!dev->shared)
 							break;
-						}
+						dev->device_handle = dev->shared->device_handle;
 						good_open = hidapi_initialize_device(dev, intf_desc);
-						if (!good_open)
-							libusb_close(dev->device_handle);
+						if (!good_open) {
+							release_shared_device(dev->shared);
+							dev->shared = NULL;
+						}
 					}
-					free(dev_path);
 				}
 			}
 		}
@@ -1047,11 +3540,19 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	}
 	else {
 		/* Unable to open any devices. */
+		if (!found)
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "Device with the requested path not found");
+		/* else register_global_error: global error is already set by the failed step */
 		free_hid_device(dev);
 		return NULL;
 	}
 }
 
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_context_open_path(NULL, path);
+}
+
 
 HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys_dev, int interface_num)
 {
@@ -1068,9 +3569,19 @@ HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys
 
 	dev = new_hid_device();
 
-	res = libusb_wrap_sys_device(usb_context, sys_dev, &dev->device_handle);
+	res = libusb_wrap_sys_device(default_context.usb_context, sys_dev, &dev->device_handle);
 	if (res < 0) {
 		LOG("libusb_wrap_sys_device failed: %d %s\n", res, libusb_error_name(res));
+		register_global_error_usb(&default_context, "libusb_wrap_sys_device", res);
+		goto err;
+	}
+
+	pthread_mutex_lock(&default_context.shared_devices_mutex);
+	dev->shared = new_shared_device(&default_context, dev->device_handle);
+	pthread_mutex_unlock(&default_context.shared_devices_mutex);
+	if (!dev->shared) {
+		LOG("Failed to allocate the device handle\n");
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "Failed to allocate the device handle");
 		goto err;
 	}
 
@@ -1080,6 +3591,7 @@ HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys
 
 	if (!conf_desc) {
 		LOG("Failed to get configuration descriptor: %d %s\n", res, libusb_error_name(res));
+		register_global_error_usb(&default_context, "libusb_get_config_descriptor", res);
 		goto err;
 	}
 
@@ -1104,24 +3616,29 @@ HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys
 		else {
 			LOG("Sys USB device doesn't contain a HID interface with number %d\n", interface_num);
 		}
+		register_global_error_code(&default_context, HID_API_ERROR_NOT_FOUND, "Sys USB device doesn't contain a matching HID interface");
 		goto err;
 	}
 
 	if (!hidapi_initialize_device(dev, selected_intf_desc))
 		goto err;
 
+	libusb_free_config_descriptor(conf_desc);
 	return dev;
 
 err:
 	if (conf_desc)
 		libusb_free_config_descriptor(conf_desc);
-	if (dev->device_handle)
+	if (dev->shared)
+		release_shared_device(dev->shared);
+	else if (dev->device_handle)
 		libusb_close(dev->device_handle);
 	free_hid_device(dev);
 #else
 	(void)sys_dev;
 	(void)interface_num;
 	LOG("libusb_wrap_sys_device is not available\n");
+	register_global_error_code(&default_context, HID_API_ERROR_NOT_SUPPORTED, "libusb_wrap_sys_device is not available");
 #endif
 	return NULL;
 }
@@ -1132,8 +3649,11 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	int res;
 	int report_number;
 	int skipped_report_id = 0;
+	const unsigned char *report = data;
+	size_t report_length = length;
 
 	if (!data || (length ==0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
 		return -1;
 	}
 
@@ -1156,8 +3676,13 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			(unsigned char *)data, length,
 			1000/*timeout millis*/);
 
-		if (res < 0)
+		if (res < 0) {
+			register_device_error_usb(dev, "hid_write/libusb_control_transfer", res);
 			return -1;
+		}
+
+		register_device_error(dev, NULL);
+		capture_report(dev, HID_CAPTURE_OUTPUT, report, report_length);
 
 		if (skipped_report_id)
 			length++;
@@ -1173,8 +3698,13 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			length,
 			&actual_length, 1000);
 
-		if (res < 0)
+		if (res < 0) {
+			register_device_error_usb(dev, "hid_write/libusb_interrupt_transfer", res);
 			return -1;
+		}
+
+		register_device_error(dev, NULL);
+		capture_report(dev, HID_CAPTURE_OUTPUT, report, report_length);
 
 		if (skipped_report_id)
 			actual_length++;
@@ -1185,20 +3715,35 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+/* Copies the report *link points to into data and unlinks it from the
+   queue. Must be called with dev->mutex locked. */
+static int take_report(hid_device *dev, struct input_report **link, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	struct input_report *rpt = *link;
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
+	if (data) {
+		dev->report_interface = rpt->interface;
+		dev->report_endpoint = rpt->endpoint;
+	}
+	*link = rpt->next;
 	free(rpt->data);
 	free(rpt);
+	/* Nothing left to hold back */
+	if (!dev->input_reports)
+		dev->batch_pending = 0;
+	update_input_fd(dev);
 	return len;
 }
 
+static int return_data(hid_device *dev, unsigned char *data, size_t length)
+{
+	/* Copy the data out of the first linked list item into the
+	   return buffer (data), and delete the liked list item. */
+	return take_report(dev, &dev->input_reports, data, length);
+}
+
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
@@ -1218,10 +3763,23 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
 	int bytes_read; /* = -1; */
 
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_timeout: not available in broadcast mode");
+		return -1;
+	}
+
+#ifdef SHARE_DEVICE
+	if (__atomic_load_n(&dev->broker, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_timeout: the device is shared, use hid_open_shared()");
+		return -1;
+	}
+#endif
+
 	pthread_mutex_lock(&dev->mutex);
 	pthread_cleanup_push(&cleanup_mutex, dev);
 
 	bytes_read = -1;
+	register_device_error(dev, NULL);
 
 	/* There's an input report queued up. Return it. */
 	if (dev->input_reports) {
@@ -1277,6 +3835,7 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			}
 			else {
 				/* Error. */
+				register_device_error(dev, "hid_read_timeout: pthread_cond_timedwait failed");
 				bytes_read = -1;
 				break;
 			}
@@ -1287,31 +3846,602 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 		bytes_read = 0;
 	}
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+ret:
+	if (bytes_read < 0 && dev->shutdown_thread)
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_read_timeout: device disconnected");
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT_CALL hid_transact(hid_device *dev, const unsigned char *request, size_t request_length, hid_report_match match, void *user_data, unsigned char *response, size_t response_length, int milliseconds)
+{
+	int bytes_read; /* Set after pthread_cleanup_push(), see hid_read_timeout() */
+	uint64_t first_seq;
+	struct timespec ts;
+
+	if (!match || !response || !response_length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: no predicate or response buffer");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: not available in latest mode");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: not available in broadcast mode");
+		return -1;
+	}
+
+#ifdef SHARE_DEVICE
+	if (__atomic_load_n(&dev->broker, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: the device is shared, use hid_open_shared()");
+		return -1;
+	}
+#endif
+
+	/* Only the reports queued from now on can be the response */
+	pthread_mutex_lock(&dev->mutex);
+	first_seq = dev->report_seq + 1;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (hid_write(dev, request, request_length) < 0)
+		return -1;
+
+	if (milliseconds > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	bytes_read = -1;
+	register_device_error(dev, NULL);
+
+	for (;;) {
+		struct input_report **cur;
+		int res;
+
+		/* The first matching report, the others stay queued */
+		for (cur = &dev->input_reports; *cur; cur = &(*cur)->next) {
+			if ((*cur)->seq >= first_seq && match((*cur)->data, (*cur)->len, user_data))
+				break;
+		}
+		if (*cur) {
+			bytes_read = take_report(dev, cur, response, response_length);
+			break;
+		}
+
+		if (dev->shutdown_thread) {
+			register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_transact: device disconnected");
+			break;
+		}
+
+		if (milliseconds == 0) {
+			bytes_read = 0;
+			break;
+		}
+
+		if (milliseconds < 0)
+			res = pthread_cond_wait(&dev->condition, &dev->mutex);
+		else
+			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
+
+		if (res == ETIMEDOUT) {
+			bytes_read = 0;
+			break;
+		}
+		if (res != 0) {
+			register_device_error(dev, "hid_transact: pthread_cond_timedwait failed");
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	dev->blocking = !nonblock;
+
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_input_fd(hid_device *dev)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->input_pipe[0] < 0) {
+		if (pipe(dev->input_pipe) == 0) {
+			int i;
+			for (i = 0; i < 2; i++) {
+				fcntl(dev->input_pipe[i], F_SETFL, fcntl(dev->input_pipe[i], F_GETFL) | O_NONBLOCK);
+				fcntl(dev->input_pipe[i], F_SETFD, FD_CLOEXEC);
+			}
+			dev->input_pipe_ready = 0;
+			update_input_fd(dev);
+		}
+		else {
+			LOG("hid_get_input_fd(): unable to create the pipe: %d\n", errno);
+			register_device_error(dev, "hid_get_input_fd: unable to create the pipe");
+			dev->input_pipe[0] = dev->input_pipe[1] = -1;
+			res = -1;
+		}
+	}
+	if (res == 0) {
+		register_device_error(dev, NULL);
+		res = dev->input_pipe[0];
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+
+int HID_API_EXPORT_CALL hid_set_read_latest(hid_device *dev, int enable)
+{
+	if (enable && __atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_read_latest: not available in broadcast mode");
+		return -1;
+	}
+
+	if (enable) {
+		pthread_mutex_lock(&dev->mutex);
+		if (!dev->latest_reports)
+			dev->latest_reports = (struct latest_report**) calloc(256, sizeof(struct latest_report*));
+		pthread_mutex_unlock(&dev->mutex);
+
+		if (!dev->latest_reports) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_read_latest: out of memory");
+			return -1;
+		}
+	}
+
+	__atomic_store_n(&dev->read_latest, enable? 1: 0, __ATOMIC_RELEASE);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_read_latest(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length)
+{
+	struct latest_report *slot;
+
+	if (!__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_latest: the device is not in latest mode");
+		return -1;
+	}
+
+	if (dev->shutdown_thread) {
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_read_latest: device disconnected");
+		return -1;
+	}
+
+	slot = __atomic_load_n(&dev->latest_reports[report_id], __ATOMIC_ACQUIRE);
+	if (!slot)
+		return 0;
+
+	return load_latest_report(slot, data, length);
+}
+
+int HID_API_EXPORT_CALL hid_set_changes_only(hid_device *dev, int enable)
+{
+	pthread_mutex_lock(&dev->shared->mutex);
+	if (enable) {
+		int i;
+
+		if (!dev->change_filters)
+			dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+		if (!dev->change_filters) {
+			pthread_mutex_unlock(&dev->shared->mutex);
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_changes_only: out of memory");
+			return -1;
+		}
+
+		/* Always deliver the first report of each Report ID */
+		for (i = 0; i < 256; i++)
+			dev->change_filters[i].len = 0;
+	}
+	dev->changes_only = enable? 1: 0;
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length)
+{
+	unsigned char *copy = NULL;
+	unsigned char *old;
+
+	if (mask && length) {
+		copy = (unsigned char*) malloc(length);
+		if (!copy) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_change_mask: out of memory");
+			return -1;
+		}
+		memcpy(copy, mask, length);
+	}
+	else {
+		length = 0;
+	}
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	if (!dev->change_filters)
+		dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+	if (!dev->change_filters) {
+		pthread_mutex_unlock(&dev->shared->mutex);
+		free(copy);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_change_mask: out of memory");
+		return -1;
+	}
+	old = dev->change_filters[report_id].mask;
+	dev->change_filters[report_id].mask = copy;
+	dev->change_filters[report_id].mask_len = length;
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	free(old);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_unchanged_count(hid_device *dev, unsigned long long *count)
+{
+	if (!count) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_get_unchanged_count: count is NULL");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	*count = dev->unchanged_count;
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_decimation(hid_device *dev, unsigned char report_id, const struct hid_decimation *decimation)
+{
+	struct report_decimator *d = NULL;
+	struct report_decimator *old;
+
+	if (decimation && decimation->mode != HID_DECIMATE_OFF) {
+		if ((decimation->mode == HID_DECIMATE_EVERY_NTH && decimation->every == 0) ||
+		    ((decimation->mode == HID_DECIMATE_WINDOW_LATEST || decimation->mode == HID_DECIMATE_WINDOW_REDUCE) && decimation->window_ms == 0) ||
+		    (decimation->mode == HID_DECIMATE_WINDOW_REDUCE && !decimation->reducer) ||
+		    decimation->mode > HID_DECIMATE_WINDOW_REDUCE) {
+			register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_decimation: invalid stage");
+			return -1;
+		}
+
+		d = (struct report_decimator*) calloc(1, sizeof(struct report_decimator));
+		if (!d) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+			return -1;
+		}
+		d->config = *decimation;
+	}
+
+	if (d && (d->config.mode == HID_DECIMATE_WINDOW_LATEST || d->config.mode == HID_DECIMATE_WINDOW_REDUCE))
+		__atomic_store_n(&dev->shared->windows, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	if (d && !dev->decimators)
+		dev->decimators = (struct report_decimator**) calloc(256, sizeof(struct report_decimator*));
+	if (d && !dev->decimators) {
+		pthread_mutex_unlock(&dev->shared->mutex);
+		free(d);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+		return -1;
+	}
+	old = dev->decimators? dev->decimators[report_id]: NULL;
+	if (dev->decimators)
+		dev->decimators[report_id] = d;
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	if (old) {
+		free(old->window);
+		free(old);
+	}
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_batching(hid_device *dev, unsigned int max_reports, unsigned int max_delay_us)
+{
+	if (max_reports > 30 || (max_reports > 1 && max_delay_us == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_batching: invalid batch size or delay");
+		return -1;
+	}
+
+	/* A partial batch is released by the event thread, see
+	   flush_batches(): there is none if the application handles the
+	   events (see hid_libusb_set_context()). */
+	if (max_reports > 1 && dev->shared->context->usb_context_events_external) {
+		register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_set_batching: not supported when the application handles the libusb events");
+		return -1;
+	}
+
+	if (max_reports > 1)
+		__atomic_store_n(&dev->shared->batching, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->batch_reports = max_reports;
+	dev->batch_delay_us = max_delay_us;
+	if (max_reports <= 1 && dev->batch_pending) {
+		/* Release what is held back */
+		dev->batch_pending = 0;
+		pthread_cond_broadcast(&dev->condition);
+		update_input_fd(dev);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_broadcast(hid_device *dev, unsigned int slots, size_t max_report_length)
+{
+	struct broadcast_ring *ring = NULL;
+	struct broadcast_ring *old;
+	unsigned int num_slots = 1;
+
+	if (slots > 65536 || (slots > 0 && max_report_length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: invalid ring size");
+		return -1;
+	}
+
+	if (slots > 0 && __atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: not available in latest mode");
+		return -1;
+	}
+
+	if (slots > 0) {
+		while (num_slots < slots)
+			num_slots <<= 1;
+		ring = new_broadcast_ring(num_slots, max_report_length);
+		if (!ring) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_broadcast: out of memory");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	old = dev->broadcast;
+	if (old && old->readers > 0) {
+		pthread_mutex_unlock(&dev->shared->mutex);
+		if (ring)
+			free_broadcast_ring(ring);
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: readers are open");
+		return -1;
+	}
+	__atomic_store_n(&dev->broadcast, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	if (old)
+		free_broadcast_ring(old);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+HID_API_EXPORT hid_broadcast_reader * HID_API_CALL hid_broadcast_open(hid_device *dev)
+{
+	hid_broadcast_reader *reader = (hid_broadcast_reader*) calloc(1, sizeof(hid_broadcast_reader));
+
+	if (!reader) {
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_broadcast_open: out of memory");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	if (!dev->broadcast) {
+		pthread_mutex_unlock(&dev->shared->mutex);
+		free(reader);
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_broadcast_open: the device is not in broadcast mode");
+		return NULL;
+	}
+	reader->dev = dev;
+	reader->ring = dev->broadcast;
+	reader->ring->readers++;
+	reader->cursor = __atomic_load_n(&reader->ring->head, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	register_device_error(dev, NULL);
+	return reader;
+}
+
+int HID_API_EXPORT_CALL hid_broadcast_read(hid_broadcast_reader *reader, unsigned char *data, size_t length, int milliseconds)
+{
+	struct broadcast_ring *ring = reader->ring;
+	hid_device *dev = reader->dev;
+	struct timespec ts;
+	int res = 0;
+
+	if (!data || !length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_broadcast_read: zero buffer/length");
+		return -1;
+	}
+
+	if (milliseconds > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	for (;;) {
+		int bytes_read = load_broadcast_report(reader, data, length);
+		if (bytes_read > 0 || milliseconds == 0 || res == ETIMEDOUT)
+			return bytes_read;
+
+		if (dev->shutdown_thread) {
+			register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_broadcast_read: device disconnected");
+			return -1;
+		}
+
+		/* Sleep until read_callback() writes the next report */
+		pthread_mutex_lock(&ring->mutex);
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == reader->cursor && !dev->shutdown_thread) {
+			if (milliseconds < 0)
+				res = pthread_cond_wait(&ring->condition, &ring->mutex);
+			else
+				res = pthread_cond_timedwait(&ring->condition, &ring->mutex, &ts);
+		}
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ring->mutex);
+	}
+}
+
+int HID_API_EXPORT_CALL hid_broadcast_get_overflow(hid_broadcast_reader *reader, unsigned long long *count)
+{
+	if (!reader || !count)
+		return -1;
+
+	*count = reader->overflow;
+	return 0;
+}
+
+void HID_API_EXPORT_CALL hid_broadcast_close(hid_broadcast_reader *reader)
+{
+	if (!reader)
+		return;
+
+	pthread_mutex_lock(&reader->dev->shared->mutex);
+	reader->ring->readers--;
+	pthread_mutex_unlock(&reader->dev->shared->mutex);
+	free(reader);
+}
+
+int HID_API_EXPORT_CALL hid_subscribe_report_id(hid_device *dev, unsigned char report_id, hid_report_callback callback, void *user_data)
+{
+	if (report_id == 0 || !callback) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_subscribe_report_id: Report ID 0 or no callback");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (!dev->subscriptions) {
+		dev->subscriptions = (struct report_subscription*) calloc(256, sizeof(struct report_subscription));
+		if (!dev->subscriptions) {
+			pthread_mutex_unlock(&dev->subscriptions_mutex);
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_subscribe_report_id: out of memory");
+			return -1;
+		}
+	}
+	dev->subscriptions[report_id].callback = callback;
+	dev->subscriptions[report_id].user_data = user_data;
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
 
-	return bytes_read;
+	register_device_error(dev, NULL);
+	return 0;
 }
 
-int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT_CALL hid_unsubscribe_report_id(hid_device *dev, unsigned char report_id)
 {
-	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+	int res = -1;
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (dev->subscriptions && dev->subscriptions[report_id].callback) {
+		dev->subscriptions[report_id].callback = NULL;
+		dev->subscriptions[report_id].user_data = NULL;
+		res = 0;
+	}
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	if (res < 0)
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_unsubscribe_report_id: no subscription for this Report ID");
+	else
+		register_device_error(dev, NULL);
+	return res;
 }
 
-int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+int HID_API_EXPORT_CALL hid_start_capture(hid_device *dev, const char *path, const struct hid_device_info *info)
 {
-	dev->blocking = !nonblock;
+	struct capture_file *capture;
+
+	if (!path) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_start_capture: NULL path");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_start_capture: the device is already recorded");
+		return -1;
+	}
+
+	capture = create_capture_file(path, info, dev->uses_numbered_reports);
+	if (!capture) {
+		register_device_error_code(dev, HID_API_ERROR_IO, "hid_start_capture: couldn't create the capture file");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->capture_mutex);
+	if (dev->capture) {
+		pthread_mutex_unlock(&dev->capture_mutex);
+		close_capture_file(capture);
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_start_capture: the device is already recorded");
+		return -1;
+	}
+	__atomic_store_n(&dev->capture, capture, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->capture_mutex);
 
+	register_device_error(dev, NULL);
 	return 0;
 }
 
+int HID_API_EXPORT_CALL hid_stop_capture(hid_device *dev)
+{
+	struct capture_file *capture;
+
+	pthread_mutex_lock(&dev->capture_mutex);
+	capture = dev->capture;
+	__atomic_store_n(&dev->capture, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->capture_mutex);
+
+	if (!capture) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_stop_capture: the device is not recorded");
+		return -1;
+	}
+
+	close_capture_file(capture);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
 
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int res = -1;
 	int skipped_report_id = 0;
 	int report_number = data[0];
+	const unsigned char *report = data;
+	size_t report_length = length;
 
 	if (report_number == 0x0) {
 		data++;
@@ -1327,8 +4457,13 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_device_error_usb(dev, "hid_send_feature_report", res);
 		return -1;
+	}
+
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_FEATURE_SET, report, report_length);
 
 	/* Account for the report ID */
 	if (skipped_report_id)
@@ -1342,6 +4477,7 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 	int res = -1;
 	int skipped_report_id = 0;
 	int report_number = data[0];
+	unsigned char *report = data;
 
 	if (report_number == 0x0) {
 		/* Offset the return buffer by 1, so that the report ID
@@ -1358,11 +4494,16 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_device_error_usb(dev, "hid_get_feature_report", res);
 		return -1;
+	}
+
+	register_device_error(dev, NULL);
 
 	if (skipped_report_id)
 		res++;
+	capture_report(dev, HID_CAPTURE_FEATURE_GET, report, (size_t) res);
 
 	return res;
 }
@@ -1372,6 +4513,7 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 	int res = -1;
 	int skipped_report_id = 0;
 	int report_number = data[0];
+	unsigned char *report = data;
 
 	if (report_number == 0x0) {
 		/* Offset the return buffer by 1, so that the report ID
@@ -1388,31 +4530,55 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 		(unsigned char *)data, length,
 		1000/*timeout millis*/);
 
-	if (res < 0)
+	if (res < 0) {
+		register_device_error_usb(dev, "hid_get_input_report", res);
 		return -1;
+	}
+
+	register_device_error(dev, NULL);
 
 	if (skipped_report_id)
 		res++;
+	capture_report(dev, HID_CAPTURE_INPUT_GET, report, (size_t) res);
 
 	return res;
 }
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
+#ifdef SHARE_DEVICE
+	/* The broker thread writes to the device */
+	stop_sharing(dev);
+#endif
+
+	/* Cause the transfers of this interface to stop. */
+	pthread_mutex_lock(&dev->shared->mutex);
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	for (i = 0; i < dev->num_transfers; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	/* Wait for read_callback() to see it. The events are handled by
+	   read_thread() of the shared device, which keeps running as long as
+	   any of these transfers is active. */
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->transfer_loop_finished)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	detach_from_shared_device(dev);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	dev->transfer->buffer = NULL;
-	libusb_free_transfer(dev->transfer);
+	/* Clean up the Transfer objects allocated in hidapi_initialize_device(). */
+	for (i = 0; i < dev->num_transfers; i++) {
+		free(dev->transfers[i]->buffer);
+		dev->transfers[i]->buffer = NULL;
+		libusb_free_transfer(dev->transfers[i]);
+	}
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1426,8 +4592,8 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	}
 #endif
 
-	/* Close the handle */
-	libusb_close(dev->device_handle);
+	/* Close the handle, if this was the last open interface of the device */
+	release_shared_device(dev->shared);
 
 	/* Clear out the queue of received reports. */
 	pthread_mutex_lock(&dev->mutex);
@@ -1440,6 +4606,370 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 }
 
 
+int HID_API_EXPORT_CALL hid_libusb_merge_input(hid_device *dev, hid_device *target)
+{
+	int res = 0;
+
+	if (!dev)
+		return -1;
+
+	if (target == dev)
+		target = NULL;
+
+	/* Both interfaces have to be opened from the same physical device. */
+	if (target && target->shared != dev->shared)
+		return -1;
+
+	pthread_mutex_lock(&dev->shared->mutex);
+	if (target && target->input_target) {
+		/* Don't chain the merges */
+		res = -1;
+	}
+	else {
+		hid_device *d;
+		for (d = dev->shared->devices; d; d = d->next_shared) {
+			if (target && d->input_target == dev) {
+				/* Other interfaces are merged into dev */
+				res = -1;
+				break;
+			}
+		}
+		if (res == 0)
+			dev->input_target = target;
+	}
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	return res;
+}
+
+
+int HID_API_EXPORT_CALL hid_libusb_get_report_interface(hid_device *dev)
+{
+	return dev->report_interface;
+}
+
+
+int HID_API_EXPORT_CALL hid_libusb_get_report_endpoint(hid_device *dev)
+{
+	return dev->report_endpoint;
+}
+
+
+int HID_API_EXPORT_CALL hid_libusb_share(hid_device *dev, const char *name, unsigned int slots, size_t max_report_length)
+{
+#ifdef SHARE_DEVICE
+	struct device_broker *broker;
+	struct shared_device_header *header;
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	unsigned int num_slots = 1;
+	uint32_t i;
+	int res;
+	int fd;
+
+	if (!name) {
+		stop_sharing(dev);
+		register_device_error(dev, NULL);
+		return 0;
+	}
+
+	if (name[0] != '/' || slots == 0 || slots > SHARED_DEVICE_MAX_SLOTS ||
+	    max_report_length == 0 || max_report_length > SHARED_DEVICE_MAX_REPORT) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_libusb_share: invalid name, number of slots or report length");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->broker, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_libusb_share: the device is already shared");
+		return -1;
+	}
+
+	while (num_slots < slots)
+		num_slots <<= 1;
+
+	broker = (struct device_broker*) calloc(1, sizeof(struct device_broker));
+	if (!broker) {
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_libusb_share: couldn't allocate memory");
+		return -1;
+	}
+	broker->dev = dev;
+	broker->mask = num_slots - 1;
+	broker->slot_size = (uint32_t) max_report_length;
+	broker->size = get_shared_device_size(broker->mask, broker->slot_size);
+	broker->name = strdup(name);
+	broker->out_buf = (unsigned char*) malloc(max_report_length);
+	if (!broker->name || !broker->out_buf) {
+		free_device_broker(broker);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_libusb_share: couldn't allocate memory");
+		return -1;
+	}
+
+	/* Only the processes of the same user can attach */
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		if (remove_stale_shared_device(name))
+			fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		else
+			errno = EEXIST;
+	}
+	if (fd < 0) {
+		free_device_broker(broker);
+		register_device_error_code(dev, errno == EEXIST? HID_API_ERROR_BUSY: HID_API_ERROR_IO, "hid_libusb_share: couldn't create the shared memory object");
+		return -1;
+	}
+
+	/* ftruncate() fills the object with zeroes */
+	if (ftruncate(fd, (off_t) broker->size) < 0) {
+		header = (struct shared_device_header*) MAP_FAILED;
+	}
+	else {
+		header = (struct shared_device_header*) mmap(NULL, broker->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (header == MAP_FAILED) {
+		shm_unlink(name);
+		free_device_broker(broker);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_libusb_share: couldn't map the shared memory object");
+		return -1;
+	}
+	broker->header = header;
+
+	pthread_mutexattr_init(&mutex_attr);
+	res = pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	if (res == 0)
+		res = pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+	if (res == 0)
+		res = pthread_mutex_init(&header->mutex, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+
+	pthread_condattr_init(&cond_attr);
+	if (res == 0)
+		res = pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+	if (res == 0)
+		res = pthread_cond_init(&header->out_condition, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	if (res != 0) {
+		free_device_broker(broker);
+		register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_libusb_share: process-shared locks are not available");
+		return -1;
+	}
+
+	for (i = 0; i < SHARED_OUTPUT_CELLS; i++)
+		get_shared_slot(header, broker->mask, broker->slot_size, 1, i)->seq = i;
+	header->version = SHARED_DEVICE_VERSION;
+	header->mask = broker->mask;
+	header->slot_size = broker->slot_size;
+	header->broker_pid = (int32_t) getpid();
+
+	if (pthread_create(&broker->thread, NULL, broker_thread, broker) != 0) {
+		free_device_broker(broker);
+		register_device_error_code(dev, HID_API_ERROR_UNKNOWN, "hid_libusb_share: couldn't start the broker thread");
+		return -1;
+	}
+
+	/* From now on clients can attach, and read_callback() publishes */
+	__atomic_store_n(&header->magic, SHARED_DEVICE_MAGIC, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&dev->shared->mutex);
+	__atomic_store_n(&dev->broker, broker, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->shared->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+#else
+	(void) name;
+	(void) slots;
+	(void) max_report_length;
+	register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_libusb_share: not supported on this platform");
+	return -1;
+#endif
+}
+
+
+HID_API_EXPORT hid_shared_device * HID_API_CALL hid_open_shared(const char *name)
+{
+#ifdef SHARE_DEVICE
+	hid_shared_device *dev;
+	struct shared_device_header *header;
+	struct stat st;
+	int fd;
+
+	if (!name) {
+		register_global_error_code(&default_context, HID_API_ERROR_INVALID_PARAM, "hid_open_shared: NULL name");
+		return NULL;
+	}
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		register_global_error_code(&default_context, errno == ENOENT? HID_API_ERROR_NOT_FOUND: HID_API_ERROR_ACCESS, "hid_open_shared: couldn't open the shared memory object");
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct shared_device_header)) {
+		close(fd);
+		register_global_error_code(&default_context, HID_API_ERROR_NOT_FOUND, "hid_open_shared: not a shared device");
+		return NULL;
+	}
+
+	header = (struct shared_device_header*) mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "hid_open_shared: couldn't map the shared memory object");
+		return NULL;
+	}
+
+	/* The geometry is checked once and copied: the object is writable
+	   by every client, so nothing read from it later is trusted to be
+	   within the mapping. */
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHARED_DEVICE_MAGIC ||
+	    header->version != SHARED_DEVICE_VERSION ||
+	    header->mask >= SHARED_DEVICE_MAX_SLOTS || (header->mask & (header->mask + 1)) != 0 ||
+	    header->slot_size == 0 || header->slot_size > SHARED_DEVICE_MAX_REPORT ||
+	    get_shared_device_size(header->mask, header->slot_size) > (size_t) st.st_size) {
+		munmap(header, (size_t) st.st_size);
+		register_global_error_code(&default_context, HID_API_ERROR_NOT_FOUND, "hid_open_shared: not a shared device");
+		return NULL;
+	}
+
+	dev = (hid_shared_device*) calloc(1, sizeof(hid_shared_device));
+	if (!dev) {
+		munmap(header, (size_t) st.st_size);
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "hid_open_shared: couldn't allocate memory");
+		return NULL;
+	}
+	dev->header = header;
+	dev->size = (size_t) st.st_size;
+	dev->mask = header->mask;
+	dev->slot_size = header->slot_size;
+	dev->broker_pid = (pid_t) header->broker_pid;
+	dev->cursor = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+	register_global_error(&default_context, NULL);
+	return dev;
+#else
+	(void) name;
+	register_global_error_code(&default_context, HID_API_ERROR_NOT_SUPPORTED, "hid_open_shared: not supported on this platform");
+	return NULL;
+#endif
+}
+
+
+int HID_API_EXPORT_CALL hid_shared_read_timeout(hid_shared_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+#ifdef SHARE_DEVICE
+	struct shared_device_header *header = dev->header;
+	uint64_t deadline = 0;
+
+	if (!data || !length)
+		return -1;
+
+	if (milliseconds > 0)
+		deadline = get_microseconds() + (uint64_t) milliseconds * 1000;
+
+	for (;;) {
+		struct timespec wait;
+		uint32_t head;
+		int bytes_read = load_shared_report(dev, data, length);
+		if (bytes_read != 0 || milliseconds == 0)
+			return bytes_read;
+
+		if (!is_broker_alive(dev))
+			return -1;
+
+		/* Wake up at least every second to see if the broker is still
+		   there: a process killed doesn't get to set closed. */
+		wait.tv_sec = 1;
+		wait.tv_nsec = 0;
+		if (milliseconds > 0) {
+			uint64_t now = get_microseconds();
+			if (now >= deadline)
+				return 0;
+			if (deadline - now < 1000000) {
+				wait.tv_sec = 0;
+				wait.tv_nsec = (long) (deadline - now) * 1000;
+			}
+		}
+
+		/* Either the broker sees the waiter, or this sees the new head */
+		__atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&header->head, __ATOMIC_SEQ_CST);
+		if (head == dev->cursor && !__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+			wait_shared_word(&header->head, head, &wait);
+		__atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+#else
+	(void) dev;
+	(void) data;
+	(void) length;
+	(void) milliseconds;
+	return -1;
+#endif
+}
+
+
+int HID_API_EXPORT_CALL hid_shared_write(hid_shared_device *dev, const unsigned char *data, size_t length)
+{
+#ifdef SHARE_DEVICE
+	struct shared_device_header *header = dev->header;
+	struct shared_slot *cell;
+	uint32_t pos;
+
+	if (!data || length == 0 || length > dev->slot_size || !is_broker_alive(dev))
+		return -1;
+
+	/* Claim the cell at out_tail, unless the broker is a whole queue
+	   behind */
+	pos = __atomic_load_n(&header->out_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		int32_t diff;
+
+		cell = get_shared_slot(header, dev->mask, dev->slot_size, 1, pos);
+		diff = (int32_t) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&header->out_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			return -1;
+		}
+		else {
+			pos = __atomic_load_n(&header->out_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_store_n(&cell->len, (uint32_t) length, __ATOMIC_RELAXED);
+	memcpy(cell + 1, data, length);
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (lock_shared_device(header) == 0) {
+		pthread_cond_signal(&header->out_condition);
+		pthread_mutex_unlock(&header->mutex);
+	}
+
+	return (int) length;
+#else
+	(void) dev;
+	(void) data;
+	(void) length;
+	return -1;
+#endif
+}
+
+
+void HID_API_EXPORT_CALL hid_shared_close(hid_shared_device *dev)
+{
+#ifdef SHARE_DEVICE
+	if (!dev)
+		return;
+
+	munmap(dev->header, dev->size);
+	free(dev);
+#else
+	(void) dev;
+#endif
+}
+
+
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
 	return hid_get_indexed_string(dev, dev->manufacturer_index, string, maxlen);
@@ -1457,24 +4987,100 @@ int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *s
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
 {
-	wchar_t *str;
+	char buf[512];
+	int len;
 
-	str = get_usb_string(dev->device_handle, string_index);
-	if (str) {
-		wcsncpy(string, str, maxlen);
-		string[maxlen-1] = L'\0';
-		free(str);
-		return 0;
+	if (!string || !maxlen) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
 	}
-	else
+
+	len = get_usb_string_descriptor(dev->device_handle, string_index, buf, sizeof(buf));
+	if (len < 0) {
+		register_device_error_usb(dev, "hid_get_indexed_string", len);
+		return -1;
+	}
+
+	if (usb_string_to_wchar(buf, len, string, maxlen) < 0) {
+		register_device_error(dev, "hid_get_indexed_string: string conversion failure");
+		return -1;
+	}
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return hid_get_indexed_string_utf8(dev, dev->manufacturer_index, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return hid_get_indexed_string_utf8(dev, dev->product_index, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return hid_get_indexed_string_utf8(dev, dev->serial_index, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string_utf8(hid_device *dev, int string_index, char *string, size_t maxlen)
+{
+	char buf[512];
+	int len;
+
+	if (!string || !maxlen) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	len = get_usb_string_descriptor(dev->device_handle, string_index, buf, sizeof(buf));
+	if (len < 0) {
+		register_device_error_usb(dev, "hid_get_indexed_string_utf8", len);
+		return -1;
+	}
+
+	if (usb_string_to_utf8(buf, len, string, maxlen) < 0) {
+		register_device_error(dev, "hid_get_indexed_string_utf8: string conversion failure");
 		return -1;
+	}
+
+	register_device_error(dev, NULL);
+	return 0;
 }
 
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	(void)dev;
-	return L"hid_error is not implemented yet";
+	if (dev)
+		return render_error(&dev->last_error);
+
+	return hid_context_error(NULL);
+}
+
+int HID_API_EXPORT_CALL hid_error_code(hid_device *dev)
+{
+	if (dev)
+		return dev->last_error.code;
+
+	return hid_context_error_code(NULL);
+}
+
+HID_API_EXPORT const wchar_t * HID_API_CALL hid_context_error(hid_context *ctx)
+{
+	struct error_state *err = get_context_error(resolve_context(ctx), 0);
+
+	if (err == NULL)
+		return L"Success";
+	return render_error(err);
+}
+
+int HID_API_EXPORT_CALL hid_context_error_code(hid_context *ctx)
+{
+	struct error_state *err = get_context_error(resolve_context(ctx), 0);
+
+	return err? err->code: HID_API_ERROR_SUCCESS;
 }
 
 
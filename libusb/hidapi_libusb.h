@@ -34,6 +34,8 @@
 extern "C" {
 #endif
 
+struct libusb_context;
+
 		/** @brief Open a HID device using libusb_wrap_sys_device.
 			See https://libusb.sourceforge.io/api-1.0/group__libusb__dev.html#ga98f783e115ceff4eaf88a60e6439563c,
 			for details on libusb_wrap_sys_device.
@@ -49,6 +51,219 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys_dev, int interface_num);
 
+		/** @brief Use a libusb context of the application.
+
+			By default hidapi creates its own libusb context in hid_init()
+			and handles its events in a thread of its own. This function
+			makes hidapi use @p ctx instead, so an application which already
+			uses libusb for other devices doesn't run a second context and
+			event loop.
+
+			It has to be called while no device is open, normally before
+			hid_init(). The application keeps the ownership of @p ctx:
+			hid_exit() doesn't call libusb_exit() on it, it only makes hidapi
+			forget about it.
+
+			If @p handles_events is non-zero, hidapi doesn't start a thread
+			to handle the events of @p ctx, and relies on the application to
+			keep calling libusb_handle_events() (or one of its variants) on
+			@p ctx. This is required for hid_read(), hid_read_timeout() and
+			hid_close() to make progress. The devices then don't support
+			hid_set_batching(), and the time windows of hid_set_decimation()
+			are delivered with the next report.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param ctx The libusb context to be used, or NULL to go back
+				to a context created by hid_init().
+			@param handles_events Non-zero if the application handles
+				the events of @p ctx.
+
+			@returns
+				This function returns 0 on success and -1 on error
+				(if a device is open).
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_set_context(struct libusb_context *ctx, int handles_events);
+
+		/** @brief Deliver the input reports of one interface through another one.
+
+			All the HID interfaces of a composite USB device opened with
+			hid_open_path() (or hid_open()) share a single libusb device
+			handle and a single event thread. This function lets the
+			input reports received on @p dev be queued to @p target
+			instead, so that a single hid_read()/hid_read_timeout() call
+			on @p target returns the reports of both interfaces in the
+			order they were received. Use hid_libusb_get_report_interface()
+			to find out which interface a report came from.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param target A device handle opened from the same USB device
+				as @p dev, or NULL to stop merging the reports of @p dev.
+				@p target must not be merged into another device itself.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_merge_input(hid_device *dev, hid_device *target);
+
+		/** @brief Get the interface number the last input report was received on.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				The USB interface number of the report last returned by
+				hid_read()/hid_read_timeout() on @p dev, or -1 if no report
+				has been read yet.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_get_report_interface(hid_device *dev);
+
+		/** @brief Get the endpoint the last input report was received on.
+
+			Input reports are read from every interrupt IN endpoint of
+			the HID interface.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				The address of the interrupt IN endpoint (bit 7 set) of
+				the report last returned by hid_read()/hid_read_timeout()
+				on @p dev, or -1 if no report has been read yet.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_get_report_endpoint(hid_device *dev);
+
+		/** A client of a device shared by another process, see
+			hid_libusb_share() and hid_open_shared().
+		*/
+		typedef struct hid_shared_device_ hid_shared_device;
+
+		/** @brief Share a device with other processes.
+
+			libusb claims the HID interface for a single process. This
+			function makes the calling process a broker for the other
+			processes of the same user: the Input reports of @p dev are
+			published in a POSIX shared memory object named @p name,
+			where each process that opened it with hid_open_shared()
+			reads them at its own pace, and the Output reports the
+			clients write with hid_shared_write() are sent to the
+			device, in order, by a thread of the broker.
+
+			While the device is shared, its Input reports go to the
+			shared memory instead of the queue (or the latest and
+			broadcast modes), and hid_read(), hid_read_timeout() and
+			hid_transact() fail. The callbacks of
+			hid_subscribe_report_id() are still called. A client left
+			behind by more than @p slots reports skips to the oldest
+			one still there.
+
+			Sharing stops when the function is called with a NULL
+			@p name, or on hid_close(). The shared memory object is
+			removed then; the clients get an error once they have read
+			the reports published before. They also notice a broker
+			killed without closing the device, within a second.
+
+			Only available on Linux and FreeBSD.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param name The name of the shared memory object, starting
+				with a '/' (see shm_open()), or NULL to stop sharing.
+				It must not be in use: an object left behind by a
+				broker which died is replaced.
+			@param slots The number of Input reports kept for the
+				clients, rounded up to a power of two, at most 65536.
+			@param max_report_length The largest report, in either
+				direction (including the Report ID), at most 65536
+				bytes. Longer Input reports are truncated.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_share(hid_device *dev, const char *name, unsigned int slots, size_t max_report_length);
+
+		/** @brief Open a device shared by another process.
+
+			See hid_libusb_share(). The client starts with the next
+			Input report published after this call.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param name The name passed to hid_libusb_share().
+
+			@returns
+				This function returns a pointer to a #hid_shared_device
+				object on success or NULL on failure.
+				Call hid_error(NULL) to get the failure reason.
+		*/
+		HID_API_EXPORT hid_shared_device * HID_API_CALL hid_open_shared(const char *name);
+
+		/** @brief Read an Input report of a shared device.
+
+			Like hid_read_timeout(), but for a client of
+			hid_open_shared(). Doesn't block the broker, nor the other
+			clients.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A handle returned from hid_open_shared().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read.
+			@param milliseconds Timeout in milliseconds, or -1 for
+				blocking wait.
+
+			@returns
+				This function returns the actual number of bytes read,
+				0 if no report arrived before the timeout, and -1 on
+				error or once the broker stopped sharing (or died) and
+				every report it published has been read.
+		*/
+		int HID_API_EXPORT_CALL hid_shared_read_timeout(hid_shared_device *dev, unsigned char *data, size_t length, int milliseconds);
+
+		/** @brief Write an Output report to a shared device.
+
+			The report is queued for the broker, which sends it with
+			hid_write(). The function doesn't wait for that: a failure
+			of hid_write() isn't reported to the client.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A handle returned from hid_open_shared().
+			@param data The report, Report ID first (see hid_write()).
+			@param length The length in bytes of @p data, at most the
+				max_report_length of hid_libusb_share().
+
+			@returns
+				This function returns @p length once the report is
+				queued, and -1 if the queue is full (the broker is 64
+				reports behind), on a report too long, or if the broker
+				is gone.
+		*/
+		int HID_API_EXPORT_CALL hid_shared_write(hid_shared_device *dev, const unsigned char *data, size_t length);
+
+		/** @brief Close a handle returned from hid_open_shared().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A handle returned from hid_open_shared().
+		*/
+		void HID_API_EXPORT_CALL hid_shared_close(hid_shared_device *dev);
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,25 +25,58 @@
 #include <string.h>
 #include <stdlib.h>
 #include <locale.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <stdint.h>
 
 /* Unix */
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 /* Linux */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#ifndef HIDAPI_FD_BACKEND
 #include <linux/hidraw.h>
 #include <linux/version.h>
 #include <linux/input.h>
 #include <libudev.h>
+#endif
 
 #include "hidapi.h"
 
+/*
+ * HIDAPI_FD_BACKEND: the replay and mock backends include this file
+ * after defining it to the type of their device state (dev->backend).
+ * They share the reading of the reports and everything built on it,
+ * the enumeration and the errors, and supply in place of hidraw and
+ * udev:
+ *  - the file descriptor the reports are read from (a socket, which
+ *    the backend hangs up on a disconnection), in their
+ *    hid_context_open_path(),
+ *  - enumerate_devices() and get_device_string(),
+ *  - close_backend_device() and exit_backend(),
+ *  - hid_write() and the Feature/Input report functions,
+ *  - BACKEND_NAME for the messages of unsupported functions.
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifndef HIDAPI_FD_BACKEND
+#define BACKEND_NAME "hidraw"
+
 #ifdef HIDAPI_ALLOW_BUILD_WORKAROUND_KERNEL_2_6_39
 /* This definitions first appeared in Linux Kernel 2.6.39 in linux/hidraw.h.
     hidapi doesn't support kernels older than that,
@@ -74,6 +107,7 @@ const char *device_string_names[] = {
 	"product",
 	"serial",
 };
+#endif
 
 /* Symbolic names for the properties above */
 enum device_string_id {
@@ -84,11 +118,176 @@ enum device_string_id {
 	DEVICE_STRING_COUNT,
 };
 
+/* Large enough for any report read from a hidraw node */
+#define MAX_REPORT_SIZE 16384
+
+/* Linked List of input reports held back by hid_transact(). */
+struct input_report {
+	unsigned char *data;
+	size_t len;
+	struct input_report *next;
+};
+
+/* A callback of hid_subscribe_report_id() */
+struct report_subscription {
+	hid_report_callback callback;
+	void *user_data;
+};
+
+/* The newest Input report of a Report ID, see hid_read_latest().
+   Written by one thread at a time and read lock-free by any number of
+   threads: seq is odd while the writer copies the report, and a reader
+   retries when seq changed during its own copy. */
+struct latest_report {
+	unsigned int seq;
+	size_t len;
+	size_t capacity;
+	unsigned char *data;
+	/* The smaller slot this one replaced, see store_latest_report() */
+	struct latest_report *retired;
+};
+
+/* A report in the broadcast ring. Like in latest_report, seq is odd
+   while the report is written; number tells which report it is. */
+struct broadcast_slot {
+	unsigned int seq;
+	unsigned int number;
+	size_t len;
+	unsigned char *data;
+};
+
+/* The ring of broadcast mode, see hid_set_broadcast(). Written by
+   the reader reading from the device for all
+   of them (see hid_broadcast_read()), which never waits for the readers, and read
+   lock-free by each reader at its own cursor. Report n goes to slot
+   n & mask and head is the number of the next report. mutex and
+   condition only put the readers to sleep while the ring has nothing
+   new for them; waiters tells the writer whether to wake them up. */
+struct broadcast_ring {
+	unsigned int mask;
+	size_t slot_size;
+	struct broadcast_slot *slots;
+	unsigned int head;
+	unsigned int waiters;
+	unsigned int readers; /* Open readers, protected by subscriptions_mutex of the device */
+	int pumping; /* A reader reads from the device for the others, protected by mutex */
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+};
+
+/* A reader of the broadcast ring, see hid_broadcast_open() */
+struct hid_broadcast_reader_ {
+	hid_device *dev;
+	struct broadcast_ring *ring;
+	unsigned int cursor; /* The number of the next report to read */
+	unsigned long long overflow;
+};
+
+/* The previous Input report of a Report ID in changes-only mode,
+   see hid_set_changes_only(). */
+struct change_filter {
+	unsigned char *data;
+	size_t len; /* 0 until the first report */
+	size_t capacity;
+	unsigned char *mask; /* see hid_set_change_mask() */
+	size_t mask_len;
+};
+
+/* The decimation stage of a Report ID, see hid_set_decimation(). */
+struct report_decimator {
+	struct hid_decimation config;
+	unsigned int skipped; /* HID_DECIMATE_EVERY_NTH: reports since the last one delivered */
+	unsigned char *window; /* The report of the open window */
+	size_t window_len; /* 0 while no window is open */
+	size_t capacity;
+	unsigned int window_count; /* Reports in the open window */
+	uint64_t window_end;
+};
+
+/* A capture file being recorded, see hid_start_capture(). The records
+   are copied into a shared mapping of the file, which is grown and
+   mapped again when full. */
+struct capture_file {
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	size_t used; /* The header and the complete records */
+	uint64_t start_ns;
+};
+
+/* The first size of a capture file, and the largest step it grows by */
+#define CAPTURE_MIN_SIZE (1024 * 1024)
+#define CAPTURE_MAX_STEP (64 * 1024 * 1024)
+
 struct hid_device_ {
 	int device_handle;
 	int blocking;
 	int uses_numbered_reports;
-	wchar_t *last_error_str;
+
+	/* Callbacks of hid_subscribe_report_id(), indexed by Report ID and
+	   allocated on the first subscription. Protected by
+	   subscriptions_mutex, which is held while a callback runs. */
+	struct report_subscription *subscriptions;
+	pthread_mutex_t subscriptions_mutex;
+
+	/* The reports which may not go to the caller of hid_read_timeout()
+	   (subscribed ones, all of them in latest mode, changes-only mode
+	   or with a decimation stage) are read here. Allocated with
+	   subscriptions, latest_reports, change_filters or decimators,
+	   under subscriptions_mutex, and kept until hid_close(). */
+	unsigned char *read_buf;
+
+	/* Latest mode, see hid_set_read_latest(). The slots, indexed by
+	   Report ID, are written by the thread holding latest_mutex. */
+	int read_latest;
+	struct latest_report **latest_reports;
+	pthread_mutex_t latest_mutex;
+
+	/* Changes-only mode, see hid_set_changes_only(), and the stages of
+	   hid_set_decimation(). The filters and the stages, indexed by
+	   Report ID, and the count are protected by changes_mutex. */
+	int changes_only;
+	struct change_filter *change_filters;
+	unsigned long long unchanged_count;
+	struct report_decimator **decimators;
+	pthread_mutex_t changes_mutex;
+
+	/* The reports hid_transact() read while waiting for its response,
+	   returned by hid_read_timeout() before reading new ones. Only used
+	   by the thread reading from the device. */
+	struct input_report *held_reports;
+
+	/* Behind hid_get_input_fd(), created on first use: an epoll
+	   instance watching the hidraw node and held_event_fd, an eventfd
+	   which is readable while held_reports isn't empty. */
+	int input_epoll_fd;
+	int held_event_fd;
+
+	/* The ring of broadcast mode, see hid_set_broadcast(). Replaced
+	   under subscriptions_mutex. */
+	struct broadcast_ring *broadcast;
+
+	/* Batching, see hid_set_batching(). Set from any thread, read by
+	   the thread reading from the device. */
+	unsigned int batch_reports;
+	unsigned int batch_delay_us;
+
+	/* The capture file of hid_start_capture(). Replaced and written
+	   under capture_mutex. */
+	struct capture_file *capture;
+	pthread_mutex_t capture_mutex;
+
+	/* Last error, see register_device_error_errno(). Only rendered
+	   into last_error_buf when hid_error() asks for it. */
+	const char *last_error_msg;
+	int last_error_errno;
+	int last_error_code;
+	wchar_t last_error_buf[256];
+
+#ifdef HIDAPI_FD_BACKEND
+	/* The state of the backend including this file */
+	HIDAPI_FD_BACKEND *backend;
+#endif
 };
 
 static struct hid_api_version api_version = {
@@ -97,8 +296,358 @@ static struct hid_api_version api_version = {
 	.patch = HID_API_VERSION_PATCH
 };
 
-static wchar_t *last_global_error_str = NULL;
+/* The last global error of a thread, see hid_error(NULL). Each thread
+   gets its own (allocated on its first error), so that concurrent
+   hid_enumerate()/hid_open() calls don't clobber each other's errors. */
+struct global_error {
+	wchar_t *str;
+	int code;
+};
+
+static pthread_key_t global_error_key;
+static pthread_once_t global_error_key_once = PTHREAD_ONCE_INIT;
+static int global_error_key_valid = 0;
+
+static void free_global_error(void *ptr)
+{
+	struct global_error *err = (struct global_error*) ptr;
+	free(err->str);
+	free(err);
+}
+
+static void create_global_error_key(void)
+{
+	global_error_key_valid = (pthread_key_create(&global_error_key, free_global_error) == 0);
+}
+
+/* A library context, see hid_context_create(). */
+struct hid_context_ {
+	/* The last error, not used by default_context (which keeps
+	   the errors per thread). */
+	struct global_error error;
+
+#ifndef HIDAPI_FD_BACKEND
+	/* Reused by the enumerations of the context. NULL for
+	   default_context, since a udev handle isn't thread-safe:
+	   each enumeration creates its own. */
+	struct udev *udev;
+#endif
+};
+
+/* The context of the functions without a context argument */
+static hid_context default_context;
+
+/* Returns the context to use for ctx (NULL is the default one). */
+static hid_context *resolve_context(hid_context *ctx)
+{
+	return ctx? ctx: &default_context;
+}
+
+/* Returns the last error of ctx, for default_context the one of the
+   calling thread. If the thread has none yet, it is allocated if create
+   is non-zero, otherwise NULL is returned. */
+static struct global_error *get_context_error(hid_context *ctx, int create)
+{
+	struct global_error *err;
+
+	if (ctx != &default_context)
+		return &ctx->error;
+
+	pthread_once(&global_error_key_once, create_global_error_key);
+	if (!global_error_key_valid)
+		return NULL;
+
+	err = (struct global_error*) pthread_getspecific(global_error_key);
+	if (!err && create) {
+		err = (struct global_error*) calloc(1, sizeof(struct global_error));
+		if (err && pthread_setspecific(global_error_key, err) != 0) {
+			free(err);
+			err = NULL;
+		}
+	}
+
+	return err;
+}
+
+/* Maps an errno value to a hid_api_error code. */
+static int errno_to_error_code(int err)
+{
+	switch (err) {
+		case 0:
+			return HID_API_ERROR_SUCCESS;
+		case EINVAL:
+			return HID_API_ERROR_INVALID_PARAM;
+		case ENOENT:
+			return HID_API_ERROR_NOT_FOUND;
+		case EACCES:
+		case EPERM:
+			return HID_API_ERROR_ACCESS;
+		case ENODEV:
+		case ENXIO:
+		case ESHUTDOWN:
+			return HID_API_ERROR_NO_DEVICE;
+		case EBUSY:
+			return HID_API_ERROR_BUSY;
+		case ETIMEDOUT:
+			return HID_API_ERROR_TIMEOUT;
+		case EAGAIN:
+			return HID_API_ERROR_AGAIN;
+		case EINTR:
+			return HID_API_ERROR_INTERRUPTED;
+		case ENOMEM:
+			return HID_API_ERROR_NO_MEM;
+		case ENOSYS:
+		case ENOTTY:
+		case EOPNOTSUPP:
+			return HID_API_ERROR_NOT_SUPPORTED;
+		default:
+			return HID_API_ERROR_IO;
+	}
+}
+
+
+/* Allocates a ring of num_slots (a power of two) reports of up to
+   slot_size bytes each. */
+static struct broadcast_ring *new_broadcast_ring(unsigned int num_slots, size_t slot_size)
+{
+	struct broadcast_ring *ring;
+	pthread_condattr_t attr;
+	unsigned char *data;
+	unsigned int i;
+
+	if (slot_size > SIZE_MAX / num_slots)
+		return NULL;
+
+	ring = (struct broadcast_ring*) calloc(1, sizeof(struct broadcast_ring));
+	if (!ring)
+		return NULL;
+	ring->slots = (struct broadcast_slot*) calloc(num_slots, sizeof(struct broadcast_slot));
+	data = (unsigned char*) malloc(num_slots * slot_size);
+	if (!ring->slots || !data) {
+		free(ring->slots);
+		free(data);
+		free(ring);
+		return NULL;
+	}
+
+	for (i = 0; i < num_slots; i++)
+		ring->slots[i].data = data + i * slot_size;
+	ring->mask = num_slots - 1;
+	ring->slot_size = slot_size;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /* For get_deadline() */
+	pthread_cond_init(&ring->condition, &attr);
+	pthread_condattr_destroy(&attr);
+	return ring;
+}
+
+static void free_broadcast_ring(struct broadcast_ring *ring)
+{
+	pthread_cond_destroy(&ring->condition);
+	pthread_mutex_destroy(&ring->mutex);
+	free(ring->slots[0].data);
+	free(ring->slots);
+	free(ring);
+}
+
+/* Wakes the readers sleeping in hid_broadcast_read() */
+static void wake_broadcast_readers(struct broadcast_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	pthread_cond_broadcast(&ring->condition);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Writes a report over the oldest one of the ring. Only called by
+   the reader holding the pumping flag. The mutex of the ring is only taken when a reader
+   sleeps, to wake it up. */
+static void store_broadcast_report(struct broadcast_ring *ring, const unsigned char *data, size_t length)
+{
+	unsigned int head = ring->head;
+	struct broadcast_slot *slot = &ring->slots[head & ring->mask];
+
+	if (length > ring->slot_size)
+		length = ring->slot_size;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->number, head, __ATOMIC_RELAXED);
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->len, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	/* Either this sees the waiter, or the waiter sees the new head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+		wake_broadcast_readers(ring);
+}
+
+/* Copies the next report of a reader, without blocking the writer.
+   Returns 0 if there is none yet. A reader left behind by more than
+   the ring holds skips to the oldest report still in it. */
+static int load_broadcast_report(hid_broadcast_reader *reader, unsigned char *data, size_t length)
+{
+	struct broadcast_ring *ring = reader->ring;
+	struct broadcast_slot *slot;
+	unsigned int head;
+	unsigned int seq;
+	size_t len;
+
+	for (;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head == reader->cursor)
+			return 0;
+
+		if (head - reader->cursor > ring->mask + 1) {
+			reader->overflow += head - reader->cursor - (ring->mask + 1);
+			reader->cursor = head - (ring->mask + 1);
+		}
+
+		slot = &ring->slots[reader->cursor & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || __atomic_load_n(&slot->number, __ATOMIC_RELAXED) != reader->cursor)
+			continue; /* Being overwritten, head moves past the cursor */
+
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			reader->cursor++;
+			return (int) len;
+		}
+	}
+}
+
+/* Maps at least size bytes of a capture file, growing the file. The
+   size doubles up to CAPTURE_MAX_STEP at a time. */
+static int grow_capture_file(struct capture_file *capture, size_t size)
+{
+	size_t step = capture->map_size < CAPTURE_MAX_STEP? capture->map_size: CAPTURE_MAX_STEP;
+	size_t map_size = capture->map_size + step;
+	unsigned char *map;
+
+	if (map_size < size)
+		map_size = size;
+	map_size = (map_size + CAPTURE_MIN_SIZE - 1) & ~((size_t) CAPTURE_MIN_SIZE - 1);
+
+	if (ftruncate(capture->fd, (off_t) map_size) < 0)
+		return -1;
+	map = (unsigned char*) mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	capture->map = map;
+	capture->map_size = map_size;
+	return 0;
+}
+
+/* Appends a record to a capture file. The file was extended with
+   zeroes, so the padding is zero already. */
+static void append_capture_record(struct capture_file *capture, uint16_t type, const unsigned char *data, size_t length)
+{
+	struct hid_capture_record *record;
+	size_t size = sizeof(struct hid_capture_record) + ((length + 7) & ~(size_t) 7);
+	struct timespec ts;
+
+	if (capture->used + size > capture->map_size && grow_capture_file(capture, capture->used + size) < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record = (struct hid_capture_record*) (capture->map + capture->used);
+	record->timestamp_ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec - capture->start_ns;
+	record->length = (uint32_t) length;
+	record->type = type;
+	memcpy(record + 1, data, length);
+	capture->used += size;
+
+	/* Only now is the record part of the capture */
+	__atomic_store_n(&((struct hid_capture_header*) capture->map)->data_length,
+	                 (uint64_t) (capture->used - sizeof(struct hid_capture_header)), __ATOMIC_RELEASE);
+}
+
+/* Records a report of dev, if hid_start_capture() was called */
+static void capture_report(hid_device *dev, hid_capture_record_type type, const unsigned char *data, size_t length)
+{
+	if (!__atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&dev->capture_mutex);
+	if (dev->capture)
+		append_capture_record(dev->capture, (uint16_t) type, data, length);
+	pthread_mutex_unlock(&dev->capture_mutex);
+}
+
+/* Truncates a capture file to its records and closes it */
+static void close_capture_file(struct capture_file *capture)
+{
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	if (capture->used > 0 && ftruncate(capture->fd, (off_t) capture->used) < 0) {
+		/* The zeroes past data_length are ignored anyway */
+	}
+	close(capture->fd);
+	free(capture);
+}
+
+/* Creates a capture file with its header and the strings of info */
+static struct capture_file *create_capture_file(const char *path, const struct hid_device_info *info, int numbered_reports)
+{
+	struct capture_file *capture;
+	struct hid_capture_header *header;
+	struct timespec ts;
+
+	capture = (struct capture_file*) calloc(1, sizeof(struct capture_file));
+	if (!capture)
+		return NULL;
+
+	capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd < 0) {
+		free(capture);
+		return NULL;
+	}
+
+	if (grow_capture_file(capture, CAPTURE_MIN_SIZE) < 0) {
+		close_capture_file(capture);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	capture->start_ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+	capture->used = sizeof(struct hid_capture_header);
+
+	header = (struct hid_capture_header*) capture->map;
+	memcpy(header->magic, HID_CAPTURE_MAGIC, sizeof(HID_CAPTURE_MAGIC));
+	header->version = HID_CAPTURE_VERSION;
+	header->header_size = sizeof(struct hid_capture_header);
+	header->start_time_ns = capture->start_ns;
+	header->interface_number = -1;
+	header->flags = numbered_reports? HID_CAPTURE_NUMBERED_REPORTS: 0;
+
+	if (info) {
+		header->vendor_id = info->vendor_id;
+		header->product_id = info->product_id;
+		header->release_number = info->release_number;
+		header->usage_page = info->usage_page;
+		header->usage = info->usage;
+		header->bus_type = (uint16_t) info->bus_type;
+		header->interface_number = info->interface_number;
+
+		if (info->manufacturer_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_MANUFACTURER, (const unsigned char*) info->manufacturer_string_utf8, strlen(info->manufacturer_string_utf8));
+		if (info->product_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_PRODUCT, (const unsigned char*) info->product_string_utf8, strlen(info->product_string_utf8));
+		if (info->serial_number_utf8)
+			append_capture_record(capture, HID_CAPTURE_SERIAL_NUMBER, (const unsigned char*) info->serial_number_utf8, strlen(info->serial_number_utf8));
+	}
 
+	return capture;
+}
 
 static hid_device *new_hid_device(void)
 {
@@ -106,11 +655,91 @@ static hid_device *new_hid_device(void)
 	dev->device_handle = -1;
 	dev->blocking = 1;
 	dev->uses_numbered_reports = 0;
-	dev->last_error_str = NULL;
+	dev->last_error_msg = NULL;
+	dev->last_error_errno = 0;
+	dev->last_error_code = HID_API_ERROR_SUCCESS;
+	dev->subscriptions = NULL;
+	pthread_mutex_init(&dev->subscriptions_mutex, NULL);
+	dev->read_buf = NULL;
+	dev->read_latest = 0;
+	dev->latest_reports = NULL;
+	pthread_mutex_init(&dev->latest_mutex, NULL);
+	dev->changes_only = 0;
+	dev->change_filters = NULL;
+	dev->unchanged_count = 0;
+	dev->decimators = NULL;
+	pthread_mutex_init(&dev->changes_mutex, NULL);
+	dev->held_reports = NULL;
+	dev->input_epoll_fd = -1;
+	dev->held_event_fd = -1;
+	dev->broadcast = NULL;
+	dev->batch_reports = 0;
+	dev->batch_delay_us = 0;
+	dev->capture = NULL;
+	pthread_mutex_init(&dev->capture_mutex, NULL);
+#ifdef HIDAPI_FD_BACKEND
+	dev->backend = NULL;
+#endif
 
 	return dev;
 }
 
+static void free_hid_device(hid_device *dev)
+{
+	while (dev->held_reports) {
+		struct input_report *next = dev->held_reports->next;
+		free(dev->held_reports->data);
+		free(dev->held_reports);
+		dev->held_reports = next;
+	}
+	if (dev->input_epoll_fd >= 0)
+		close(dev->input_epoll_fd);
+	if (dev->held_event_fd >= 0)
+		close(dev->held_event_fd);
+
+	if (dev->latest_reports) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			struct latest_report *slot = dev->latest_reports[i];
+			while (slot) {
+				struct latest_report *retired = slot->retired;
+				free(slot);
+				slot = retired;
+			}
+		}
+		free(dev->latest_reports);
+	}
+	if (dev->change_filters) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			free(dev->change_filters[i].data);
+			free(dev->change_filters[i].mask);
+		}
+		free(dev->change_filters);
+	}
+	if (dev->decimators) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			if (dev->decimators[i]) {
+				free(dev->decimators[i]->window);
+				free(dev->decimators[i]);
+			}
+		}
+		free(dev->decimators);
+	}
+	if (dev->broadcast)
+		free_broadcast_ring(dev->broadcast);
+	if (dev->capture)
+		close_capture_file(dev->capture);
+	pthread_mutex_destroy(&dev->capture_mutex);
+	pthread_mutex_destroy(&dev->changes_mutex);
+	pthread_mutex_destroy(&dev->latest_mutex);
+	pthread_mutex_destroy(&dev->subscriptions_mutex);
+	free(dev->subscriptions);
+	free(dev->read_buf);
+	free(dev);
+}
+
 
 /* The caller must free the returned string with free(). */
 static wchar_t *utf8_to_wchar_t(const char *utf8)
@@ -154,150 +783,428 @@ static void register_error_str_vformat(wchar_t **error_str, const char *format,
 	register_error_str(error_str, msg);
 }
 
-/* Set the last global error to be reported by hid_error(NULL).
+/* Set the last global error of ctx (for the default context, of the
+ * calling thread), to be reported by hid_context_error(ctx) and
+ * hid_context_error_code(ctx).
  * The given error message will be copied (and decoded according to the
  * currently locale, so do not pass in string constants).
  * The last stored global error message is freed.
- * Use register_global_error(NULL) to indicate "no error". */
-static void register_global_error(const char *msg)
+ * Use register_global_error_code(ctx, HID_API_ERROR_SUCCESS, NULL) to indicate "no error". */
+static void register_global_error_code(hid_context *ctx, int code, const char *msg)
+{
+	struct global_error *err = get_context_error(ctx, msg != NULL);
+	if (!err)
+		return;
+
+	register_error_str(&err->str, msg);
+	err->code = code;
+}
+
+/* Same as register_global_error_code, with HID_API_ERROR_UNKNOWN
+ * (or HID_API_ERROR_SUCCESS if msg is NULL). */
+static void register_global_error(hid_context *ctx, const char *msg)
 {
-	register_error_str(&last_global_error_str, msg);
+	register_global_error_code(ctx, msg? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, msg);
 }
 
-/* Similar to register_global_error, but allows passing a format string into this function. */
-static void register_global_error_format(const char *format, ...)
+/* Similar to register_global_error_code, but allows passing a format string into this function. */
+static void register_global_error_format(hid_context *ctx, int code, const char *format, ...)
 {
+	struct global_error *err = get_context_error(ctx, 1);
 	va_list args;
+
+	if (!err)
+		return;
+
 	va_start(args, format);
-	register_error_str_vformat(&last_global_error_str, format, args);
+	register_error_str_vformat(&err->str, format, args);
 	va_end(args);
+	err->code = code;
 }
 
-/* Set the last error for a device to be reported by hid_error(dev).
- * The given error message will be copied (and decoded according to the
- * currently locale, so do not pass in string constants).
- * The last stored device error message is freed.
+/* Set the last error for a device to be reported by hid_error(dev)
+ * and hid_error_code(dev): msg (a string constant, or NULL), followed
+ * by strerror(err) if err is a non-zero errno value.
+ * Nothing is copied or allocated here, the message is only rendered by
+ * hid_error(), so this is cheap enough to be called by every
+ * hid_read()/hid_write().
  * Use register_device_error(dev, NULL) to indicate "no error". */
-static void register_device_error(hid_device *dev, const char *msg)
+static void register_device_error_errno(hid_device *dev, const char *msg, int err)
 {
-	register_error_str(&dev->last_error_str, msg);
+	dev->last_error_msg = msg;
+	dev->last_error_errno = err;
+	dev->last_error_code = errno_to_error_code(err);
 }
 
-/* Similar to register_device_error, but you can pass a format string into this function. */
-static void register_device_error_format(hid_device *dev, const char *format, ...)
+/* Same as register_device_error_errno, for errors without an errno value. */
+static void register_device_error_code(hid_device *dev, int code, const char *msg)
 {
-	va_list args;
-	va_start(args, format);
-	register_error_str_vformat(&dev->last_error_str, format, args);
-	va_end(args);
+	dev->last_error_msg = msg;
+	dev->last_error_errno = 0;
+	dev->last_error_code = code;
 }
 
-/* Get an attribute value from a udev_device and return it as a whar_t
-   string. The returned string must be freed with free() when done.*/
-static wchar_t *copy_udev_string(struct udev_device *dev, const char *udev_name)
+/* Same as register_device_error_code, with HID_API_ERROR_UNKNOWN
+ * (or HID_API_ERROR_SUCCESS if msg is NULL). */
+static void register_device_error(hid_device *dev, const char *msg)
 {
-	return utf8_to_wchar_t(udev_device_get_sysattr_value(dev, udev_name));
+	register_device_error_code(dev, msg? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, msg);
 }
 
-/*
- * Gets the size of the HID item at the given position
- * Returns 1 if successful, 0 if an invalid key
- * Sets data_len and key_size when successful
- */
-static int get_hid_item_size(__u8 *report_descriptor, unsigned int pos, __u32 size, int *data_len, int *key_size)
+/* Renders the last error of dev into its last_error_buf. */
+static const wchar_t *render_device_error(hid_device *dev)
 {
-	int key = report_descriptor[pos];
-	int size_code;
+	char msg[256];
+	size_t len;
 
-	/*
-	 * This is a Long Item. The next byte contains the
-	 * length of the data section (value) for this key.
-	 * See the HID specification, version 1.11, section
-	 * 6.2.2.3, titled "Long Items."
-	 */
-	if ((key & 0xf0) == 0xf0) {
-		if (pos + 1 < size)
-		{
-			*data_len = report_descriptor[pos + 1];
-			*key_size = 3;
-			return 1;
-		}
-		*data_len = 0; /* malformed report */
-		*key_size = 0;
-	}
+	if (dev->last_error_msg == NULL && dev->last_error_errno == 0)
+		return L"Success";
 
-	/*
-	 * This is a Short Item. The bottom two bits of the
-	 * key contain the size code for the data section
-	 * (value) for this key. Refer to the HID
-	 * specification, version 1.11, section 6.2.2.2,
-	 * titled "Short Items."
-	 */
-	size_code = key & 0x3;
-	switch (size_code) {
-	case 0:
-	case 1:
-	case 2:
-		*data_len = size_code;
-		*key_size = 1;
-		return 1;
-	case 3:
-		*data_len = 4;
-		*key_size = 1;
-		return 1;
-	default:
-		/* Can't ever happen since size_code is & 0x3 */
-		*data_len = 0;
-		*key_size = 0;
-		break;
-	};
+	if (dev->last_error_msg && dev->last_error_errno)
+		snprintf(msg, sizeof(msg), "%s: %s", dev->last_error_msg, strerror(dev->last_error_errno));
+	else if (dev->last_error_msg)
+		snprintf(msg, sizeof(msg), "%s", dev->last_error_msg);
+	else
+		snprintf(msg, sizeof(msg), "%s", strerror(dev->last_error_errno));
 
-	/* malformed report */
-	return 0;
+	/* Decoded according to the current locale, like the global errors */
+	len = mbstowcs(dev->last_error_buf, msg, sizeof(dev->last_error_buf) / sizeof(wchar_t));
+	if (len == (size_t) -1)
+		len = 0;
+	if (len >= sizeof(dev->last_error_buf) / sizeof(wchar_t))
+		len = sizeof(dev->last_error_buf) / sizeof(wchar_t) - 1;
+	dev->last_error_buf[len] = L'\0';
+
+	return dev->last_error_buf;
 }
 
-/* uses_numbered_reports() returns 1 if report_descriptor describes a device
-   which contains numbered reports. */
-static int uses_numbered_reports(__u8 *report_descriptor, __u32 size) {
-	unsigned int i = 0;
-	int data_len, key_size;
+/* The list returned by hid_enumerate() lives in an arena: its records and
+   strings are carved out of a few large blocks (usually a single one)
+   instead of being allocated one by one, and records of the same device
+   share their strings. The root record always sits at the start of the
+   first block (its slot is reserved when the block is created), which is
+   how hid_free_enumeration() finds the blocks. */
+struct enum_arena_block {
+	struct enum_arena_block *next;
+	size_t size; /* Bytes available after the header */
+	size_t used;
+};
 
-	while (i < size) {
-		int key = report_descriptor[i];
+struct enum_arena {
+	struct enum_arena_block *first;
+	struct enum_arena_block *last;
+	int root_taken; /* The reserved root slot was handed out */
+};
 
-		/* Check for the Report ID key */
-		if (key == 0x85/*Report ID*/) {
-			/* This device has a Report ID, which means it uses
-			   numbered reports. */
-			return 1;
-		}
+/* Size of the first block; every further block doubles it */
+#define ENUM_ARENA_BLOCK_SIZE 16384
 
-		/* Determine data_len and key_size */
-		if (!get_hid_item_size(report_descriptor, i, size, &data_len, &key_size))
-			return 0; /* malformed report */
+/* Size of the root slot at the start of the first block */
+#define ENUM_ARENA_ROOT_SIZE ((sizeof(struct hid_device_info) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
 
-		/* Skip over this key and its associated data */
-		i += data_len + key_size;
+/* Returns zero-initialized, pointer-aligned memory from the arena. */
+static void *enum_arena_alloc(struct enum_arena *arena, size_t size)
+{
+	struct enum_arena_block *block = arena->last;
+	void *ptr;
+
+	size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+	if (!block || block->size - block->used < size) {
+		size_t block_size = block? block->size * 2: ENUM_ARENA_BLOCK_SIZE;
+		struct enum_arena_block *new_block;
+
+		if (block_size < size + ENUM_ARENA_ROOT_SIZE)
+			block_size = size + ENUM_ARENA_ROOT_SIZE;
+		new_block = (struct enum_arena_block*) calloc(1, sizeof(struct enum_arena_block) + block_size);
+		if (!new_block)
+			return NULL;
+		new_block->size = block_size;
+
+		if (block) {
+			block->next = new_block;
+		}
+		else {
+			arena->first = new_block;
+			new_block->used = ENUM_ARENA_ROOT_SIZE;
+		}
+		arena->last = new_block;
+		block = new_block;
 	}
 
-	/* Didn't find a Report ID key. Device doesn't use numbered reports. */
-	return 0;
+	ptr = (char*) (block + 1) + block->used;
+	block->used += size;
+	return ptr;
 }
 
-/*
- * Get bytes from a HID Report Descriptor.
- * Only call with a num_bytes of 0, 1, 2, or 4.
- */
-static __u32 get_hid_report_bytes(__u8 *rpt, size_t len, size_t num_bytes, size_t cur)
+/* Returns a zero-initialized record from the arena. The first one is
+   the reserved root slot. */
+static struct hid_device_info *enum_arena_alloc_record(struct enum_arena *arena)
 {
-	/* Return if there aren't enough bytes. */
-	if (cur + num_bytes >= len)
-		return 0;
+	if (arena->root_taken)
+		return (struct hid_device_info*) enum_arena_alloc(arena, sizeof(struct hid_device_info));
 
-	if (num_bytes == 0)
-		return 0;
-	else if (num_bytes == 1)
-		return rpt[cur + 1];
+	/* Make sure the first block exists */
+	if (!arena->first && !enum_arena_alloc(arena, 0))
+		return NULL;
+	arena->root_taken = 1;
+	return (struct hid_device_info*) (arena->first + 1);
+}
+
+static void enum_arena_free(struct enum_arena_block *block)
+{
+	while (block) {
+		struct enum_arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+static char *enum_arena_strdup(struct enum_arena *arena, const char *str)
+{
+	char *ret;
+	size_t len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str) + 1;
+	ret = (char*) enum_arena_alloc(arena, len);
+	if (ret)
+		memcpy(ret, str, len);
+	return ret;
+}
+
+/* Same as utf8_to_wchar_t(), with the string allocated from the arena. */
+static wchar_t *enum_arena_utf8_to_wchar_t(struct enum_arena *arena, const char *utf8)
+{
+	wchar_t *ret = NULL;
+
+	if (utf8) {
+		size_t wlen = mbstowcs(NULL, utf8, 0);
+		if ((size_t) -1 == wlen)
+			wlen = 0;
+		ret = (wchar_t*) enum_arena_alloc(arena, (wlen+1) * sizeof(wchar_t));
+		if (ret == NULL) {
+			/* as much as we can do at this point */
+			return NULL;
+		}
+		if (wlen > 0)
+			mbstowcs(ret, utf8, wlen+1);
+		ret[wlen] = 0x0000;
+	}
+
+	return ret;
+}
+
+/* Where the matching records go: the callback of hid_enumerate_visit(),
+   or (if it is NULL) the list built by hid_enumerate_filtered(). */
+struct enum_sink {
+	hid_enumerate_callback callback;
+	void *user_data;
+	int result; /* Value returned by the callback which stopped */
+
+	struct hid_device_info *root;
+	struct hid_device_info *last;
+};
+
+/* Sends a copy of info, with the given usage, to the sink.
+   Returns non-zero if the enumeration must stop. */
+static int enum_sink_add(struct enum_arena *arena, struct enum_sink *sink, const struct hid_device_info *info, unsigned short usage_page, unsigned short usage)
+{
+	struct hid_device_info *tmp;
+
+	if (sink->callback) {
+		struct hid_device_info record = *info;
+		record.next = NULL;
+		record.usage_page = usage_page;
+		record.usage = usage;
+		sink->result = sink->callback(&record, sink->user_data);
+		return sink->result;
+	}
+
+	tmp = enum_arena_alloc_record(arena);
+	if (!tmp)
+		return 0;
+
+	*tmp = *info;
+	tmp->next = NULL;
+	tmp->usage_page = usage_page;
+	tmp->usage = usage;
+
+	if (sink->last)
+		sink->last->next = tmp;
+	else
+		sink->root = tmp;
+	sink->last = tmp;
+	return 0;
+}
+
+/* The predicates of a hid_filter. A NULL filter matches everything. */
+static int filter_match_ids(const struct hid_filter *filter, unsigned short vendor_id, unsigned short product_id)
+{
+	size_t i;
+
+	if (!filter || !filter->ids || filter->num_ids == 0)
+		return 1;
+
+	for (i = 0; i < filter->num_ids; i++) {
+		const struct hid_filter_id *id = &filter->ids[i];
+		if ((id->vendor_id == 0 || id->vendor_id == vendor_id) &&
+		    (id->product_id == 0 || id->product_id == product_id))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int filter_match_usage(const struct hid_filter *filter, unsigned short usage_page, unsigned short usage)
+{
+	return !filter ||
+		((filter->usage_page == 0 || filter->usage_page == usage_page) &&
+		 (filter->usage == 0 || filter->usage == usage));
+}
+
+static int filter_match_interface(const struct hid_filter *filter, int interface_number)
+{
+	return !filter || !filter->match_interface_number || filter->interface_number == interface_number;
+}
+
+static int filter_match_bus(const struct hid_filter *filter, hid_bus_type bus_type)
+{
+	return !filter || filter->bus_type == HID_API_BUS_UNKNOWN || filter->bus_type == bus_type;
+}
+
+static int filter_match_serial(const struct hid_filter *filter, const char *serial_number_utf8)
+{
+	if (!filter || !filter->serial_number_prefix)
+		return 1;
+
+	return serial_number_utf8 &&
+		strncmp(serial_number_utf8, filter->serial_number_prefix, strlen(filter->serial_number_prefix)) == 0;
+}
+
+/* Stores the Manufacturer and Product strings (given in UTF-8) to both
+   the wchar_t and UTF-8 members of cur_dev. */
+static void set_device_info_strings(struct enum_arena *arena, struct hid_device_info *cur_dev, const char *manufacturer_utf8, const char *product_utf8)
+{
+	cur_dev->manufacturer_string_utf8 = enum_arena_strdup(arena, manufacturer_utf8);
+	cur_dev->manufacturer_string = enum_arena_utf8_to_wchar_t(arena, manufacturer_utf8);
+	cur_dev->product_string_utf8 = enum_arena_strdup(arena, product_utf8);
+	cur_dev->product_string = enum_arena_utf8_to_wchar_t(arena, product_utf8);
+}
+
+#ifdef HIDAPI_FD_BACKEND
+
+/* Supplied by the backend, see HIDAPI_FD_BACKEND */
+static int enumerate_devices(hid_context *ctx, const struct hid_filter *filter, struct enum_arena *arena, struct enum_sink *sink);
+static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, char *string_utf8, size_t maxlen);
+/* Stops what feeds the socket of dev, before it is closed */
+static void close_backend_device(hid_device *dev);
+/* Forgets the devices of the backend, for hid_exit() */
+static void exit_backend(void);
+
+#else
+
+/*
+ * Gets the size of the HID item at the given position
+ * Returns 1 if successful, 0 if an invalid key
+ * Sets data_len and key_size when successful
+ */
+static int get_hid_item_size(__u8 *report_descriptor, unsigned int pos, __u32 size, int *data_len, int *key_size)
+{
+	int key = report_descriptor[pos];
+	int size_code;
+
+	/*
+	 * This is a Long Item. The next byte contains the
+	 * length of the data section (value) for this key.
+	 * See the HID specification, version 1.11, section
+	 * 6.2.2.3, titled "Long Items."
+	 */
+	if ((key & 0xf0) == 0xf0) {
+		if (pos + 1 < size)
+		{
+			*data_len = report_descriptor[pos + 1];
+			*key_size = 3;
+			return 1;
+		}
+		*data_len = 0; /* malformed report */
+		*key_size = 0;
+	}
+
+	/*
+	 * This is a Short Item. The bottom two bits of the
+	 * key contain the size code for the data section
+	 * (value) for this key. Refer to the HID
+	 * specification, version 1.11, section 6.2.2.2,
+	 * titled "Short Items."
+	 */
+	size_code = key & 0x3;
+	switch (size_code) {
+	case 0:
+	case 1:
+	case 2:
+		*data_len = size_code;
+		*key_size = 1;
+		return 1;
+	case 3:
+		*data_len = 4;
+		*key_size = 1;
+		return 1;
+	default:
+		/* Can't ever happen since size_code is & 0x3 */
+		*data_len = 0;
+		*key_size = 0;
+		break;
+	};
+
+	/* malformed report */
+	return 0;
+}
+
+/* uses_numbered_reports() returns 1 if report_descriptor describes a device
+   which contains numbered reports. */
+static int uses_numbered_reports(__u8 *report_descriptor, __u32 size) {
+	unsigned int i = 0;
+	int data_len, key_size;
+
+	while (i < size) {
+		int key = report_descriptor[i];
+
+		/* Check for the Report ID key */
+		if (key == 0x85/*Report ID*/) {
+			/* This device has a Report ID, which means it uses
+			   numbered reports. */
+			return 1;
+		}
+
+		/* Determine data_len and key_size */
+		if (!get_hid_item_size(report_descriptor, i, size, &data_len, &key_size))
+			return 0; /* malformed report */
+
+		/* Skip over this key and its associated data */
+		i += data_len + key_size;
+	}
+
+	/* Didn't find a Report ID key. Device doesn't use numbered reports. */
+	return 0;
+}
+
+/*
+ * Get bytes from a HID Report Descriptor.
+ * Only call with a num_bytes of 0, 1, 2, or 4.
+ */
+static __u32 get_hid_report_bytes(__u8 *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	/* Return if there aren't enough bytes. */
+	if (cur + num_bytes >= len)
+		return 0;
+
+	if (num_bytes == 0)
+		return 0;
+	else if (num_bytes == 1)
+		return rpt[cur + 1];
 	else if (num_bytes == 2)
 		return (rpt[cur + 2] * 256 + rpt[cur + 1]);
 	else if (num_bytes == 4)
@@ -393,14 +1300,14 @@ static int get_next_hid_usage(__u8 *report_descriptor, __u32 size, unsigned int
  * Retrieves the hidraw report descriptor from a file.
  * When using this form, <sysfs_path>/device/report_descriptor, elevated priviledges are not required.
  */
-static int get_hid_report_descriptor(const char *rpt_path, struct hidraw_report_descriptor *rpt_desc)
+static int get_hid_report_descriptor(hid_context *ctx, const char *rpt_path, struct hidraw_report_descriptor *rpt_desc)
 {
 	int rpt_handle;
 	ssize_t res;
 
 	rpt_handle = open(rpt_path, O_RDONLY);
 	if (rpt_handle < 0) {
-		register_global_error_format("open failed (%s): %s", rpt_path, strerror(errno));
+		register_global_error_format(ctx, errno_to_error_code(errno), "open failed (%s): %s", rpt_path, strerror(errno));
 		return -1;
 	}
 
@@ -413,7 +1320,7 @@ static int get_hid_report_descriptor(const char *rpt_path, struct hidraw_report_
 	memset(rpt_desc, 0x0, sizeof(*rpt_desc));
 	res = read(rpt_handle, rpt_desc->value, HID_MAX_DESCRIPTOR_SIZE);
 	if (res < 0) {
-		register_global_error_format("read failed (%s): %s", rpt_path, strerror(errno));
+		register_global_error_format(ctx, errno_to_error_code(errno), "read failed (%s): %s", rpt_path, strerror(errno));
 	}
 	rpt_desc->size = (__u32) res;
 
@@ -421,7 +1328,7 @@ static int get_hid_report_descriptor(const char *rpt_path, struct hidraw_report_
 	return (int) res;
 }
 
-static int get_hid_report_descriptor_from_sysfs(const char *sysfs_path, struct hidraw_report_descriptor *rpt_desc)
+static int get_hid_report_descriptor_from_sysfs(hid_context *ctx, const char *sysfs_path, struct hidraw_report_descriptor *rpt_desc)
 {
 	int res = -1;
 	/* Construct <sysfs_path>/device/report_descriptor */
@@ -429,7 +1336,7 @@ static int get_hid_report_descriptor_from_sysfs(const char *sysfs_path, struct h
 	char* rpt_path = (char*) calloc(1, rpt_path_len);
 	snprintf(rpt_path, rpt_path_len, "%s/device/report_descriptor", sysfs_path);
 
-	res = get_hid_report_descriptor(rpt_path, rpt_desc);
+	res = get_hid_report_descriptor(ctx, rpt_path, rpt_desc);
 	free(rpt_path);
 
 	return res;
@@ -492,8 +1399,48 @@ next_line:
 	return (found_id && found_name && found_serial);
 }
 
+#endif
+
+
+/* Copies the UTF-8 string src to dst (maxlen bytes including the
+   terminating NULL), truncating it at a character boundary. */
+static void copy_utf8_string(char *dst, const char *src, size_t maxlen)
+{
+	size_t len = strlen(src);
+
+	if (len >= maxlen) {
+		len = maxlen - 1;
+		/* Don't cut a multi-byte sequence */
+		while (len > 0 && ((unsigned char) src[len] & 0xc0) == 0x80)
+			len--;
+	}
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+/* Stores the UTF-8 string str either to string (converted to wchar_t)
+   or to string_utf8 (as is), whichever is not NULL. */
+static int store_device_string(const char *str, wchar_t *string, char *string_utf8, size_t maxlen)
+{
+	if (!str)
+		return -1;
+
+	if (string_utf8) {
+		copy_utf8_string(string_utf8, str, maxlen);
+		return 0;
+	}
+
+	/* Convert the string from UTF-8 to wchar_t */
+	if (mbstowcs(string, str, maxlen) == (size_t)-1)
+		return -1;
+	string[maxlen - 1] = L'\0';
+	return 0;
+}
 
-static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, size_t maxlen)
+#ifndef HIDAPI_FD_BACKEND
+/* Gets a device string into either string or string_utf8 (the other one
+   being NULL), both being maxlen long in their character type. */
+static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, char *string_utf8, size_t maxlen)
 {
 	struct udev *udev;
 	struct udev_device *udev_dev, *parent, *hid_dev;
@@ -502,8 +1449,8 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 	char *serial_number_utf8 = NULL;
 	char *product_name_utf8 = NULL;
 
-	if (!string || !maxlen) {
-		register_device_error(dev, "Zero buffer/length");
+	if ((!string && !string_utf8) || !maxlen) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
 		return -1;
 	}
 
@@ -512,7 +1459,7 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 	/* Get the dev_t (major/minor numbers) from the file handle. */
 	ret = fstat(dev->device_handle, &s);
 	if (-1 == ret) {
-		register_device_error(dev, "Failed to stat device handle");
+		register_device_error_errno(dev, "Failed to stat device handle", errno);
 		return ret;
 	}
 
@@ -534,7 +1481,6 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 			unsigned short dev_vid;
 			unsigned short dev_pid;
 			unsigned bus_type;
-			size_t retm;
 
 			ret = parse_uevent_info(
 			           udev_device_get_sysattr_value(hid_dev, "uevent"),
@@ -563,11 +1509,8 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 					}
 
 					str = udev_device_get_sysattr_value(parent, key_str);
-					if (str) {
-						/* Convert the string from UTF-8 to wchar_t */
-						retm = mbstowcs(string, str, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-					}
+					if (str)
+						ret = store_device_string(str, string, string_utf8, maxlen);
 
 					/* USB information parsed */
 					goto end;
@@ -584,16 +1527,13 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 				case BUS_USB:
 					switch (key) {
 						case DEVICE_STRING_MANUFACTURER:
-							wcsncpy(string, L"", maxlen);
-							ret = 0;
+							ret = store_device_string("", string, string_utf8, maxlen);
 							break;
 						case DEVICE_STRING_PRODUCT:
-							retm = mbstowcs(string, product_name_utf8, maxlen);
-							ret = (retm == (size_t)-1)? -1: 0;
+							ret = store_device_string(product_name_utf8, string, string_utf8, maxlen);
 							break;
 						case DEVICE_STRING_SERIAL:
-							retm = mbstowcs(string, serial_number_utf8, maxlen);
-							ret = (retm == (size_t)-1)? -1: 0;
+							ret = store_device_string(serial_number_utf8, string, string_utf8, maxlen);
 							break;
 						case DEVICE_STRING_COUNT:
 						default:
@@ -615,6 +1555,7 @@ end:
 
 	return ret;
 }
+#endif
 
 HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
 {
@@ -626,48 +1567,117 @@ HID_API_EXPORT const char* HID_API_CALL hid_version_str()
 	return HID_API_VERSION_STR;
 }
 
-int HID_API_EXPORT hid_init(void)
+/* What hid_init() does, for any context */
+static void init_context(hid_context *ctx)
 {
 	const char *locale;
 
 	/* indicate no error */
-	register_global_error(NULL);
+	register_global_error(ctx, NULL);
 
 	/* Set the locale if it's not set. */
 	locale = setlocale(LC_CTYPE, NULL);
 	if (!locale)
 		setlocale(LC_CTYPE, "");
+}
+
+int HID_API_EXPORT hid_init(void)
+{
+	init_context(&default_context);
 
 	return 0;
 }
 
 int HID_API_EXPORT hid_exit(void)
 {
-	/* Free global error message */
-	register_global_error(NULL);
+	/* Free the global error message of this thread
+	   (the ones of other threads are freed when they exit) */
+	register_global_error(&default_context, NULL);
+
+#ifdef HIDAPI_FD_BACKEND
+	exit_backend();
+#endif
 
 	return 0;
 }
 
+hid_context * HID_API_EXPORT hid_context_create(const struct hid_context_options *opts)
+{
+	hid_context *ctx;
+
+	(void) opts;
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+	ctx = (hid_context*) calloc(1, sizeof(hid_context));
+	if (!ctx) {
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "Couldn't allocate the context");
+		return NULL;
+	}
+
+#ifndef HIDAPI_FD_BACKEND
+	ctx->udev = udev_new();
+	if (!ctx->udev) {
+		free(ctx);
+		register_global_error(&default_context, "Couldn't create udev context");
+		return NULL;
+	}
+#endif
+
+	init_context(ctx);
+
+	return ctx;
+}
+
+void HID_API_EXPORT hid_context_destroy(hid_context *ctx)
+{
+	if (!ctx || ctx == &default_context)
+		return;
+
+#ifndef HIDAPI_FD_BACKEND
+	udev_unref(ctx->udev);
+#endif
+	free(ctx->error.str);
+	free(ctx);
+}
+
+#ifndef HIDAPI_FD_BACKEND
+/* Returns non-zero if any usage pair of the report descriptor matches
+   the filter (a descriptor without usages counts as a zero pair). */
+static int report_descriptor_matches_usage(const struct hid_filter *filter, struct hidraw_report_descriptor *report_desc)
+{
+	unsigned short page = 0, usage = 0;
+	unsigned int pos = 0;
+	int found = 0;
+
+	if (!filter || (filter->usage_page == 0 && filter->usage == 0))
+		return 1;
+
+	while (!get_next_hid_usage(report_desc->value, report_desc->size, &pos, &page, &usage)) {
+		if (filter_match_usage(filter, page, usage))
+			return 1;
+		found = 1;
+	}
+
+	return !found && filter_match_usage(filter, 0, 0);
+}
+
+/* Sends the devices matching the filter to the sink, until it says
+   to stop. The strings of the records are allocated from the arena.
+   Returns -1 if the system couldn't be scanned. */
+static int enumerate_devices(hid_context *ctx, const struct hid_filter *filter, struct enum_arena *arena, struct enum_sink *sink)
 {
 	struct udev *udev;
 	struct udev_enumerate *enumerate;
 	struct udev_list_entry *devices, *dev_list_entry;
+	int stop = 0;
 
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
-	struct hid_device_info *prev_dev = NULL; /* previous device */
-
-	hid_init();
-	/* register_global_error: global error is reset by hid_init */
+	init_context(ctx);
+	/* register_global_error: global error is reset by init_context */
 
-	/* Create the udev object */
-	udev = udev_new();
+	/* Use the udev object of the context, or create one */
+	udev = ctx->udev? udev_ref(ctx->udev): udev_new();
 	if (!udev) {
-		register_global_error("Couldn't create udev context");
-		return NULL;
+		register_global_error(ctx, "Couldn't create udev context");
+		return -1;
 	}
 
 	/* Create a list of the devices in the 'hidraw' subsystem. */
@@ -675,7 +1685,7 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
 	udev_enumerate_scan_devices(enumerate);
 	devices = udev_enumerate_get_list_entry(enumerate);
-	/* For each item, see if it matches the vid/pid, and if so
+	/* For each item, see if it matches the filter, and if so
 	   create a udev_device record for it */
 	udev_list_entry_foreach(dev_list_entry, devices) {
 		const char *sysfs_path;
@@ -683,15 +1693,20 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		const char *str;
 		struct udev_device *raw_dev; /* The device's hidraw udev node. */
 		struct udev_device *hid_dev; /* The device's HID udev node. */
-		struct udev_device *usb_dev; /* The device's USB udev node. */
+		struct udev_device *usb_dev = NULL; /* The device's USB udev node. */
 		struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
 		unsigned short dev_vid;
 		unsigned short dev_pid;
 		char *serial_number_utf8 = NULL;
 		char *product_name_utf8 = NULL;
 		unsigned bus_type;
+		hid_bus_type hid_bus;
 		int result;
 		struct hidraw_report_descriptor report_desc;
+		struct hid_device_info info; /* Fields shared by the records of the device */
+		unsigned short page = 0, usage = 0;
+		unsigned int pos = 0;
+		int found;
 
 		/* Get the filename of the /sys entry for the device
 		   and create a udev_device object (dev) representing it */
@@ -725,357 +1740,1529 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		/* Filter out unhandled devices right away */
 		switch (bus_type) {
 			case BUS_BLUETOOTH:
+				hid_bus = HID_API_BUS_BLUETOOTH;
+				break;
 			case BUS_I2C:
+				hid_bus = HID_API_BUS_I2C;
+				break;
 			case BUS_USB:
+				hid_bus = HID_API_BUS_USB;
 				break;
 
 			default:
 				goto next;
 		}
 
-		/* Check the VID/PID against the arguments */
-		if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-		    (product_id == 0x0 || product_id == dev_pid)) {
-			struct hid_device_info *tmp;
+		/* Everything the uevent tells is checked before anything
+		   else is read from sysfs or converted */
+		if (!filter_match_bus(filter, hid_bus) ||
+		    !filter_match_ids(filter, dev_vid, dev_pid) ||
+		    !filter_match_serial(filter, serial_number_utf8))
+			goto next;
+
+		memset(&info, 0, sizeof(info));
+		info.vendor_id = dev_vid;
+		info.product_id = dev_pid;
+		info.release_number = 0x0;
+		info.interface_number = -1;
+		info.bus_type = hid_bus;
+
+		if (bus_type == BUS_USB) {
+			/* The device pointed to by raw_dev contains information about
+			   the hidraw device. In order to get information about the
+			   USB device, get the parent device with the
+			   subsystem/devtype pair of "usb"/"usb_device". This will
+			   be several levels up the tree, but the function will find
+			   it.
+			   uhid USB devices have none: since this is a virtual hid
+			   interface, no USB information will be available. */
+			usb_dev = udev_device_get_parent_with_subsystem_devtype(
+					raw_dev,
+					"usb",
+					"usb_device");
+
+			if (usb_dev) {
+				/* Get a handle to the interface's udev node. */
+				intf_dev = udev_device_get_parent_with_subsystem_devtype(
+						raw_dev,
+						"usb",
+						"usb_interface");
+				if (intf_dev) {
+					str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
+					info.interface_number = (str)? strtol(str, NULL, 16): -1;
+				}
+			}
+		}
+
+		if (!filter_match_interface(filter, info.interface_number))
+			goto next;
+
+		/* Usage Page and Usage */
+		result = get_hid_report_descriptor_from_sysfs(ctx, sysfs_path, &report_desc);
+		if (result < 0)
+			report_desc.size = 0;
+
+		if (!report_descriptor_matches_usage(filter, &report_desc))
+			goto next;
+
+		/* The device matches. Fill out the rest of the record. */
+		info.path = enum_arena_strdup(arena, dev_path);
+
+		/* Serial Number */
+		info.serial_number_utf8 = enum_arena_strdup(arena, serial_number_utf8);
+		info.serial_number = enum_arena_utf8_to_wchar_t(arena, serial_number_utf8);
+
+		if (usb_dev) {
+			/* Manufacturer and Product strings */
+			set_device_info_strings(arena, &info,
+				udev_device_get_sysattr_value(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]),
+				udev_device_get_sysattr_value(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]));
+
+			/* Release Number */
+			str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
+			info.release_number = (str)? strtol(str, NULL, 16): 0x0;
+		}
+		else {
+			/* Bluetooth, I2C and uhid devices */
+			set_device_info_strings(arena, &info, "", product_name_utf8);
+		}
+
+		/*
+		 * Create a record for each usage and usage page
+		 * parsed out of the report descriptor which matches
+		 * the filter. The strings are shared by the records.
+		 */
+		found = 0;
+		while (!stop && !get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+			if (filter_match_usage(filter, page, usage))
+				stop = enum_sink_add(arena, sink, &info, page, usage);
+			found = 1;
+		}
+		if (!found)
+			stop = enum_sink_add(arena, sink, &info, 0, 0);
+
+	next:
+		free(serial_number_utf8);
+		free(product_name_utf8);
+		udev_device_unref(raw_dev);
+		/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
+		   unref()d.  It will cause a double-free() error.  I'm not
+		   sure why.  */
+		if (stop)
+			break;
+	}
+	/* Free the enumerator and udev objects. */
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+
+	return 0;
+}
+#endif
+
+struct hid_device_info  HID_API_EXPORT *hid_context_enumerate(hid_context *ctx, const struct hid_filter *filter)
+{
+	struct enum_sink sink; /* return object */
+	struct enum_arena arena = { NULL, NULL, 0 };
+
+	ctx = resolve_context(ctx);
+
+	memset(&sink, 0, sizeof(sink));
+	if (enumerate_devices(ctx, filter, &arena, &sink) < 0) {
+		enum_arena_free(arena.first);
+		return NULL;
+	}
+
+	if (sink.root == NULL) {
+		enum_arena_free(arena.first);
+		if (!filter) {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "No HID devices found in the system.");
+		} else {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "No HID devices matching the filter found in the system.");
+		}
+	}
+
+	return sink.root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_filtered(const struct hid_filter *filter)
+{
+	return hid_context_enumerate(NULL, filter);
+}
+
+int HID_API_EXPORT hid_context_enumerate_visit(hid_context *ctx, const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct enum_sink sink;
+	struct enum_arena arena = { NULL, NULL, 0 };
+	int res;
+
+	ctx = resolve_context(ctx);
+
+	if (!callback) {
+		register_global_error_code(ctx, HID_API_ERROR_INVALID_PARAM, "hid_enumerate_visit: NULL callback");
+		return -1;
+	}
+
+	memset(&sink, 0, sizeof(sink));
+	sink.callback = callback;
+	sink.user_data = user_data;
+
+	res = enumerate_devices(ctx, filter, &arena, &sink);
+
+	/* The strings only had to live during the callbacks */
+	enum_arena_free(arena.first);
+
+	return res < 0? -1: sink.result;
+}
+
+int HID_API_EXPORT hid_enumerate_visit(const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	return hid_context_enumerate_visit(NULL, filter, callback, user_data);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_filter_id id;
+	struct hid_filter filter;
+
+	if (vendor_id == 0 && product_id == 0)
+		return hid_enumerate_filtered(NULL);
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	return hid_enumerate_filtered(&filter);
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	/* The root record sits at the start of the first arena block,
+	   all the other records and strings live in the same arena. */
+	if (devs)
+		enum_arena_free((struct enum_arena_block*) devs - 1);
+}
+
+/* State of hid_open(), see open_visitor() */
+struct open_search {
+	unsigned short vendor_id;
+	unsigned short product_id;
+	const wchar_t *serial_number;
+	char *path; /* The path of the device found */
+};
+
+/* Stops at the first device matching the hid_open() arguments */
+static int open_visitor(const struct hid_device_info *info, void *user_data)
+{
+	struct open_search *search = (struct open_search*) user_data;
+
+	if (info->vendor_id != search->vendor_id ||
+	    info->product_id != search->product_id)
+		return 0;
+
+	if (search->serial_number &&
+	    (!info->serial_number || wcscmp(search->serial_number, info->serial_number) != 0))
+		return 0;
+
+	search->path = strdup(info->path);
+	return 1;
+}
+
+hid_device * HID_API_EXPORT hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct open_search search;
+	struct hid_filter_id id;
+	struct hid_filter filter;
+	hid_device *handle = NULL;
+
+	ctx = resolve_context(ctx);
+
+	search.vendor_id = vendor_id;
+	search.product_id = product_id;
+	search.serial_number = serial_number;
+	search.path = NULL;
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	/* register_global_error: global error is reset by hid_context_enumerate_visit */
+	if (hid_context_enumerate_visit(ctx, &filter, open_visitor, &search) < 0) {
+		/* register_global_error: global error is already set by hid_context_enumerate_visit */
+		return NULL;
+	}
+
+	if (search.path) {
+		/* Open the device */
+		handle = hid_context_open_path(ctx, search.path);
+		free(search.path);
+	} else {
+		register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "Device with requested VID/PID/(SerialNumber) not found");
+	}
+
+	return handle;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	return hid_context_open(NULL, vendor_id, product_id, serial_number);
+}
+
+#ifndef HIDAPI_FD_BACKEND
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
+{
+	hid_device *dev = NULL;
+
+	ctx = resolve_context(ctx);
+
+	init_context(ctx);
+	/* register_global_error: global error is reset by init_context */
+
+	dev = new_hid_device();
+
+	dev->device_handle = open(path, O_RDWR);
+
+	/* If we have a good handle, return it. */
+	if (dev->device_handle >= 0) {
+		/* Get the report descriptor */
+		int res, desc_size = 0;
+		struct hidraw_report_descriptor rpt_desc;
+
+		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+
+		/* Get Report Descriptor Size */
+		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
+		if (res < 0)
+			register_device_error_errno(dev, "ioctl (GRDESCSIZE)", errno);
+
+		/* Get Report Descriptor */
+		rpt_desc.size = desc_size;
+		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
+		if (res < 0) {
+			register_device_error_errno(dev, "ioctl (GRDESC)", errno);
+		} else {
+			/* Determine if this device uses numbered reports. */
+			dev->uses_numbered_reports =
+				uses_numbered_reports(rpt_desc.value,
+				                      rpt_desc.size);
+		}
+
+		return dev;
+	}
+	else {
+		/* Unable to open a device. */
+		int err = errno;
+		free_hid_device(dev);
+		register_global_error_format(ctx, errno_to_error_code(err), "Failed to open a device with path '%s': %s", path, strerror(err));
+		return NULL;
+	}
+}
+#endif
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_context_open_path(NULL, path);
+}
+
+#ifndef HIDAPI_FD_BACKEND
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int bytes_written;
+
+	if (!data || (length == 0)) {
+		errno = EINVAL;
+		register_device_error_errno(dev, NULL, errno);
+		return -1;
+	}
+
+	bytes_written = write(dev->device_handle, data, length);
+
+	register_device_error_errno(dev, NULL, (bytes_written == -1)? errno: 0);
+	if (bytes_written > 0)
+		capture_report(dev, HID_CAPTURE_OUTPUT, data, (size_t) bytes_written);
+
+	return bytes_written;
+}
+#endif
+
+
+/* Reads the next report from the hidraw node, or the socket of an
+   HIDAPI_FD_BACKEND */
+static int read_report(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	int bytes_read;
+
+	if (milliseconds >= 0) {
+		/* Milliseconds is either 0 (non-blocking) or > 0 (contains
+		   a valid timeout). In both cases we want to call poll()
+		   and wait for data to arrive.  Don't rely on non-blocking
+		   operation (O_NONBLOCK) since some kernels don't seem to
+		   properly report device disconnection through read() when
+		   in non-blocking mode.  */
+		int ret;
+		struct pollfd fds;
+
+		fds.fd = dev->device_handle;
+		fds.events = POLLIN;
+		fds.revents = 0;
+		ret = poll(&fds, 1, milliseconds);
+		if (ret == 0) {
+			/* Timeout */
+			return ret;
+		}
+		if (ret == -1) {
+			/* Error */
+			register_device_error_errno(dev, NULL, errno);
+			return ret;
+		}
+		else {
+			/* Check for errors on the file descriptor. This will
+			   indicate a device disconnection. */
+#ifdef HIDAPI_FD_BACKEND
+			/* The reports sent before a socket hung up are still read */
+			if (!(fds.revents & POLLIN) && (fds.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+#else
+			if (fds.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+#endif
+				// We cannot use strerror() here as no -1 was returned from poll().
+				register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_read_timeout: unexpected poll error (device disconnected)");
+				return -1;
+			}
+		}
+	}
+
+	bytes_read = read(dev->device_handle, data, length);
+	if (bytes_read < 0) {
+		if (errno == EAGAIN || errno == EINPROGRESS)
+			bytes_read = 0;
+		else
+			register_device_error_errno(dev, NULL, errno);
+	}
+#ifdef HIDAPI_FD_BACKEND
+	else if (bytes_read == 0) {
+		/* Reports are never empty: the socket hung up */
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_read_timeout: device disconnected");
+		bytes_read = -1;
+	}
+#endif
+	else if (bytes_read > 0) {
+		capture_report(dev, HID_CAPTURE_INPUT, data, (size_t) bytes_read);
+	}
+
+	return bytes_read;
+}
+
+/* Passes a report to the callback subscribed to its Report ID, if any.
+   Returns 1 if the callback consumed the report. */
+static int dispatch_subscribed_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int consumed = 0;
+
+	if (length == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (dev->subscriptions && dev->subscriptions[data[0]].callback) {
+		dev->subscriptions[data[0]].callback(dev, data, length, dev->subscriptions[data[0]].user_data);
+		consumed = 1;
+	}
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	return consumed;
+}
+
+/* Replaces the report in the slot of its Report ID.
+   Must be called with dev->latest_mutex locked. */
+static void store_latest_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int report_id = dev->uses_numbered_reports? data[0]: 0;
+	struct latest_report *slot = dev->latest_reports[report_id];
+
+	if (!slot || length > slot->capacity) {
+		/* The first report of this Report ID, or a longer one than
+		   the slot holds: publish a bigger slot. Readers may still be
+		   copying from the old one, which is kept until hid_close(). */
+		struct latest_report *bigger;
+		size_t capacity = length;
+
+		if (slot && capacity < 2 * slot->capacity)
+			capacity = 2 * slot->capacity;
+		bigger = (struct latest_report*) malloc(sizeof(struct latest_report) + capacity);
+		if (!bigger)
+			return;
+		bigger->seq = 0;
+		bigger->len = 0;
+		bigger->capacity = capacity;
+		bigger->data = (unsigned char*) (bigger + 1);
+		bigger->retired = slot;
+		__atomic_store_n(&dev->latest_reports[report_id], bigger, __ATOMIC_RELEASE);
+		slot = bigger;
+	}
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->len, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the report of a slot, without blocking its writer. */
+static int load_latest_report(struct latest_report *slot, unsigned char *data, size_t length)
+{
+	unsigned int seq;
+	size_t len;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue; /* Being written */
+
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return (int) len;
+	}
+}
+
+/* Returns non-zero if a and b differ in the bits set in mask.
+   Compares 16 bytes at a time where the CPU allows it. */
+static int masked_reports_differ(const unsigned char *a, const unsigned char *b, const unsigned char *mask, size_t length)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= length; i += 16) {
+		__m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *) (mask + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+			return 1;
+	}
+#elif defined(__aarch64__)
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		if (vmaxvq_u8(vandq_u8(diff, vld1q_u8(mask + i))))
+			return 1;
+	}
+#endif
+	for (; i < length; i++) {
+		if ((a[i] ^ b[i]) & mask[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* In changes-only mode, returns 1 if the report is the same as the
+   previous one of its Report ID, to be dropped. Otherwise the report
+   becomes the previous one and 0 is returned. Locks
+   dev->changes_mutex. */
+static int drop_unchanged_report(hid_device *dev, int report_id, const unsigned char *data, size_t length)
+{
+	struct change_filter *filter;
+	int unchanged = 0;
+
+	if (length == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (!dev->changes_only)
+		goto out;
+
+	filter = &dev->change_filters[report_id];
+	if (filter->len == length) {
+		size_t masked = (filter->mask_len < length)? filter->mask_len: length;
+
+		/* The unmasked rest goes to memcmp(), vectorized by the C library */
+		if (!masked_reports_differ(filter->data, data, filter->mask, masked) &&
+		    memcmp(filter->data + masked, data + masked, length - masked) == 0) {
+			dev->unchanged_count++;
+			unchanged = 1;
+			goto out;
+		}
+	}
+
+	if (length > filter->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(filter->data, length);
+		if (!buf) {
+			/* Deliver every report of this Report ID instead */
+			filter->len = 0;
+			goto out;
+		}
+		filter->data = buf;
+		filter->capacity = length;
+	}
+	memcpy(filter->data, data, length);
+	filter->len = length;
+
+out:
+	pthread_mutex_unlock(&dev->changes_mutex);
+	return unchanged;
+}
+
+/* A monotonic time in milliseconds */
+static uint64_t get_milliseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* Passes a report through the decimation stage of its Report ID, if
+   any. Returns 1 if nothing is to be delivered. Otherwise the report to
+   deliver is in data: in the window modes it is the report of the
+   window which this one closes, the two being swapped within the
+   capacity of data. Locks
+   dev->changes_mutex. */
+static int decimate_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	struct report_decimator *d;
+	uint64_t now;
+	int drop = 0;
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	d = dev->decimators? dev->decimators[report_id]: NULL;
+	if (!d || *length == 0)
+		goto out;
+
+	if (d->config.mode == HID_DECIMATE_EVERY_NTH) {
+		drop = (d->skipped != 0);
+		if (++d->skipped >= d->config.every)
+			d->skipped = 0;
+		goto out;
+	}
+
+	if (*length > d->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(d->window, *length);
+		if (!buf)
+			goto out; /* Deliver it as is */
+		d->window = buf;
+		d->capacity = *length;
+	}
+
+	now = get_milliseconds();
+	if (d->window_len && now >= d->window_end) {
+		/* Deliver the window, and start the next one with this report */
+		size_t window_len = (d->window_len < capacity)? d->window_len: capacity;
+		size_t n = (*length > window_len)? *length: window_len;
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			unsigned char c = data[i];
+			data[i] = d->window[i];
+			d->window[i] = c;
+		}
+		d->window_len = *length;
+		*length = window_len;
+		d->window_count = 0;
+		d->window_end = now + d->config.window_ms;
+	}
+	else {
+		drop = 1;
+		if (!d->window_len) {
+			d->window_count = 0;
+			d->window_end = now + d->config.window_ms;
+		}
+		if (!d->window_len || d->config.mode == HID_DECIMATE_WINDOW_LATEST) {
+			memcpy(d->window, data, *length);
+			d->window_len = *length;
+		}
+	}
+
+	if (d->config.mode == HID_DECIMATE_WINDOW_REDUCE) {
+		/* The first report of a window is in the window already */
+		if (d->window_count == 0)
+			d->config.reducer(d->window, d->window_len, d->window, d->window_len, 0, d->config.user_data);
+		else
+			d->config.reducer(d->window, d->window_len, data, *length, d->window_count, d->config.user_data);
+	}
+	d->window_count++;
+
+out:
+	pthread_mutex_unlock(&dev->changes_mutex);
+	return drop;
+}
+
+/* The stages between the arrival of a report and its delivery:
+   changes-only mode, then decimation. Returns 1 if the report is
+   dropped. *length changes when a window is delivered instead. */
+static int filter_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	return drop_unchanged_report(dev, report_id, data, *length) ||
+	       decimate_report(dev, report_id, data, length, capacity);
+}
+
+/* Sets *deadline to milliseconds from now. */
+static void get_deadline(struct timespec *deadline, int milliseconds)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += milliseconds / 1000;
+	deadline->tv_nsec += (milliseconds % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* The time left until deadline. Once the time is up, 0 (only
+   fetch what's already there) rather than a negative timeout. */
+static int get_remaining_milliseconds(const struct timespec *deadline)
+{
+	struct timespec now;
+	long remaining;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining = (long) (deadline->tv_sec - now.tv_sec) * 1000 +
+	            (deadline->tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+	return remaining > 0? (int) remaining: 0;
+}
+
+/* Makes held_event_fd readable if held_reports isn't empty, and
+   clears it otherwise. Called when held_reports becomes empty or
+   stops being empty. */
+static void update_held_event(hid_device *dev)
+{
+	int fd = __atomic_load_n(&dev->held_event_fd, __ATOMIC_ACQUIRE);
+	uint64_t count = 1;
+
+	if (fd < 0)
+		return;
+
+	if (dev->held_reports) {
+		if (write(fd, &count, sizeof(count)) < 0) {
+			/* The counter can't overflow from single increments */
+		}
+	}
+	else {
+		if (read(fd, &count, sizeof(count)) < 0) {
+			/* Already cleared */
+		}
+	}
+}
+
+/* Appends a report to held_reports. Returns -1 if out of memory. */
+static int hold_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	struct input_report **cur = &dev->held_reports;
+	int num_queued = 0;
+	struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
+
+	if (!rpt)
+		return -1;
+	rpt->data = (unsigned char*) malloc(length);
+	if (!rpt->data) {
+		free(rpt);
+		return -1;
+	}
+	memcpy(rpt->data, data, length);
+	rpt->len = length;
+	rpt->next = NULL;
+
+	while (*cur) {
+		cur = &(*cur)->next;
+		num_queued++;
+	}
+	*cur = rpt;
+
+	/* Drop the oldest one past 30, like the queues of the other backends */
+	if (num_queued >= 30) {
+		rpt = dev->held_reports;
+		dev->held_reports = rpt->next;
+		free(rpt->data);
+		free(rpt);
+	}
+	else if (num_queued == 0) {
+		update_held_event(dev);
+	}
+
+	return 0;
+}
+
+/* Returns the first report of held_reports. */
+static int return_held_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	struct input_report *rpt = dev->held_reports;
+	size_t len = (length < rpt->len)? length: rpt->len;
+
+	memcpy(data, rpt->data, len);
+	dev->held_reports = rpt->next;
+	free(rpt->data);
+	free(rpt);
+	if (!dev->held_reports)
+		update_held_event(dev);
+	return (int) len;
+}
+
+/* Reads reports into read_buf for up to milliseconds. The subscribed
+   ones go to their callback; in latest mode all the others go to
+   their slot (and 0 is returned at the end of the timeout), otherwise
+   the first of the others is returned in data, or appended to
+   held_reports when data is NULL. In broadcast mode the first report
+   goes to the ring, see hid_broadcast_read(). */
+static int pump_reports(hid_device *dev, unsigned char *read_buf, int latest, unsigned char *data, size_t length, int milliseconds)
+{
+	struct timespec deadline;
+	int bytes_read;
+	size_t report_len;
+
+	if (milliseconds > 0)
+		get_deadline(&deadline, milliseconds);
+
+	for (;;) {
+		bytes_read = read_report(dev, read_buf, MAX_REPORT_SIZE, milliseconds);
+		if (bytes_read <= 0)
+			return bytes_read;
+
+		report_len = (size_t) bytes_read;
+		if (filter_report(dev, dev->uses_numbered_reports? read_buf[0]: 0, read_buf, &report_len, MAX_REPORT_SIZE)) {
+			/* Repeated or decimated */
+		}
+		else if (dispatch_subscribed_report(dev, read_buf, report_len)) {
+			/* Consumed */
+		}
+		else if (latest) {
+			store_latest_report(dev, read_buf, report_len);
+		}
+		else if (dev->broadcast) {
+			store_broadcast_report(dev->broadcast, read_buf, report_len);
+			return (int) report_len;
+		}
+		else if (!data) {
+			if (hold_report(dev, read_buf, report_len) < 0) {
+				register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_read_timeout: out of memory");
+				return -1;
+			}
+			return (int) report_len;
+		}
+		else {
+			if (report_len > length)
+				report_len = length;
+			memcpy(data, read_buf, report_len);
+			return (int) report_len;
+		}
+
+		if (milliseconds > 0)
+			milliseconds = get_remaining_milliseconds(&deadline);
+	}
+}
+
+/* Reads a batch, see hid_set_batching(). The first report is returned
+   in data; hidraw wakes us up for each report, so keep reading the
+   others into held_reports until the batch is full, max_delay_us has
+   passed since the first one or the caller's timeout is up, whichever
+   comes first. */
+static int read_batch(hid_device *dev, unsigned char *read_buf, unsigned int max_reports, unsigned int max_delay_us, unsigned char *data, size_t length, int milliseconds)
+{
+	struct timespec deadline, batch_end;
+	unsigned int num_reports = 1;
+	int bytes_read, res, timeout;
+
+	if (milliseconds > 0)
+		get_deadline(&deadline, milliseconds);
+
+	bytes_read = pump_reports(dev, read_buf, 0, data, length, milliseconds);
+	if (bytes_read <= 0)
+		return bytes_read;
+
+	clock_gettime(CLOCK_MONOTONIC, &batch_end);
+	batch_end.tv_sec += max_delay_us / 1000000;
+	batch_end.tv_nsec += (long) (max_delay_us % 1000000) * 1000;
+	if (batch_end.tv_nsec >= 1000000000L) {
+		batch_end.tv_sec++;
+		batch_end.tv_nsec -= 1000000000L;
+	}
+
+	while (num_reports < max_reports) {
+		/* A non-blocking call only takes what's already there */
+		timeout = 0;
+		if (milliseconds != 0) {
+			timeout = get_remaining_milliseconds(&batch_end);
+			if (milliseconds > 0) {
+				res = get_remaining_milliseconds(&deadline);
+				if (res < timeout)
+					timeout = res;
+			}
+		}
+
+		res = pump_reports(dev, read_buf, 0, NULL, 0, timeout);
+		if (res < 0 || (res == 0 && timeout == 0))
+			break;
+		if (res > 0)
+			num_reports++;
+	}
+
+	/* The first report is delivered either way */
+	register_device_error(dev, NULL);
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	unsigned char *read_buf;
+	unsigned int batch_reports;
+	int bytes_read;
+
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_timeout: not available in broadcast mode");
+		return -1;
+	}
+
+	/* The reports held back by hid_transact() or a batch come first */
+	if (dev->held_reports)
+		return return_held_report(dev, data, length);
+
+	/* Once allocated, read_buf stays until hid_close() */
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	read_buf = dev->read_buf;
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	if (!read_buf)
+		return read_report(dev, data, length, milliseconds);
+
+	if (__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&dev->latest_mutex);
+		bytes_read = pump_reports(dev, read_buf, 1, NULL, 0, milliseconds);
+		pthread_mutex_unlock(&dev->latest_mutex);
+		return bytes_read;
+	}
+
+	batch_reports = __atomic_load_n(&dev->batch_reports, __ATOMIC_RELAXED);
+	if (batch_reports > 1)
+		return read_batch(dev, read_buf, batch_reports, __atomic_load_n(&dev->batch_delay_us, __ATOMIC_RELAXED), data, length, milliseconds);
+
+	return pump_reports(dev, read_buf, 0, data, length, milliseconds);
+}
+
+int HID_API_EXPORT_CALL hid_set_read_latest(hid_device *dev, int enable)
+{
+	if (enable && __atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_read_latest: not available in broadcast mode");
+		return -1;
+	}
+
+	if (enable) {
+		pthread_mutex_lock(&dev->subscriptions_mutex);
+		if (!dev->read_buf)
+			dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+		if (!dev->latest_reports)
+			dev->latest_reports = (struct latest_report**) calloc(256, sizeof(struct latest_report*));
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+		if (!dev->read_buf || !dev->latest_reports) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_read_latest: out of memory");
+			return -1;
+		}
+	}
+
+	__atomic_store_n(&dev->read_latest, enable? 1: 0, __ATOMIC_RELEASE);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_read_latest(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length)
+{
+	struct latest_report *slot;
+
+	if (!__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_latest: the device is not in latest mode");
+		return -1;
+	}
+
+	/* Only a copy: the reports are stored by hid_read_timeout() */
+	slot = __atomic_load_n(&dev->latest_reports[report_id], __ATOMIC_ACQUIRE);
+	if (!slot)
+		return 0;
+
+	return load_latest_report(slot, data, length);
+}
+
+int HID_API_EXPORT_CALL hid_set_changes_only(hid_device *dev, int enable)
+{
+	if (enable) {
+		/* The reports are compared whole, in read_buf */
+		pthread_mutex_lock(&dev->subscriptions_mutex);
+		if (!dev->read_buf)
+			dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+		if (!dev->read_buf) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_changes_only: out of memory");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (enable) {
+		int i;
+
+		if (!dev->change_filters)
+			dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+		if (!dev->change_filters) {
+			pthread_mutex_unlock(&dev->changes_mutex);
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_changes_only: out of memory");
+			return -1;
+		}
+
+		/* Always deliver the first report of each Report ID */
+		for (i = 0; i < 256; i++)
+			dev->change_filters[i].len = 0;
+	}
+	dev->changes_only = enable? 1: 0;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length)
+{
+	unsigned char *copy = NULL;
+	unsigned char *old;
+
+	if (mask && length) {
+		copy = (unsigned char*) malloc(length);
+		if (!copy) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_change_mask: out of memory");
+			return -1;
+		}
+		memcpy(copy, mask, length);
+	}
+	else {
+		length = 0;
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (!dev->change_filters)
+		dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+	if (!dev->change_filters) {
+		pthread_mutex_unlock(&dev->changes_mutex);
+		free(copy);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_change_mask: out of memory");
+		return -1;
+	}
+	old = dev->change_filters[report_id].mask;
+	dev->change_filters[report_id].mask = copy;
+	dev->change_filters[report_id].mask_len = length;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	free(old);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_unchanged_count(hid_device *dev, unsigned long long *count)
+{
+	if (!count) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_get_unchanged_count: count is NULL");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	*count = dev->unchanged_count;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_decimation(hid_device *dev, unsigned char report_id, const struct hid_decimation *decimation)
+{
+	struct report_decimator *d = NULL;
+	struct report_decimator *old;
+
+	if (decimation && decimation->mode != HID_DECIMATE_OFF) {
+		if ((decimation->mode == HID_DECIMATE_EVERY_NTH && decimation->every == 0) ||
+		    ((decimation->mode == HID_DECIMATE_WINDOW_LATEST || decimation->mode == HID_DECIMATE_WINDOW_REDUCE) && decimation->window_ms == 0) ||
+		    (decimation->mode == HID_DECIMATE_WINDOW_REDUCE && !decimation->reducer) ||
+		    decimation->mode > HID_DECIMATE_WINDOW_REDUCE) {
+			register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_decimation: invalid stage");
+			return -1;
+		}
+
+		d = (struct report_decimator*) calloc(1, sizeof(struct report_decimator));
+		if (!d) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+			return -1;
+		}
+		d->config = *decimation;
+
+		/* The reports go through the stage in read_buf */
+		pthread_mutex_lock(&dev->subscriptions_mutex);
+		if (!dev->read_buf)
+			dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+		if (!dev->read_buf) {
+			free(d);
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (d && !dev->decimators)
+		dev->decimators = (struct report_decimator**) calloc(256, sizeof(struct report_decimator*));
+	if (d && !dev->decimators) {
+		pthread_mutex_unlock(&dev->changes_mutex);
+		free(d);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+		return -1;
+	}
+	old = dev->decimators? dev->decimators[report_id]: NULL;
+	if (dev->decimators)
+		dev->decimators[report_id] = d;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	if (old) {
+		free(old->window);
+		free(old);
+	}
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_transact(hid_device *dev, const unsigned char *request, size_t request_length, hid_report_match match, void *user_data, unsigned char *response, size_t response_length, int milliseconds)
+{
+	struct timespec deadline;
+	unsigned char *read_buf;
+	int bytes_read;
+	size_t report_len;
+
+	if (!match || !response || !response_length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: no predicate or response buffer");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: not available in latest mode");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: not available in broadcast mode");
+		return -1;
+	}
 
-			/* VID/PID match. Create the record. */
-			tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
-			}
-			prev_dev = cur_dev;
-			cur_dev = tmp;
+	/* The reports which don't match are held whole */
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (!dev->read_buf)
+		dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+	read_buf = dev->read_buf;
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
 
-			/* Fill out the record */
-			cur_dev->next = NULL;
-			cur_dev->path = dev_path? strdup(dev_path): NULL;
+	if (!read_buf) {
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_transact: out of memory");
+		return -1;
+	}
 
-			/* VID/PID */
-			cur_dev->vendor_id = dev_vid;
-			cur_dev->product_id = dev_pid;
+	if (hid_write(dev, request, request_length) < 0)
+		return -1;
 
-			/* Serial Number */
-			cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+	register_device_error(dev, NULL);
 
-			/* Release Number */
-			cur_dev->release_number = 0x0;
+	if (milliseconds > 0)
+		get_deadline(&deadline, milliseconds);
 
-			/* Interface Number */
-			cur_dev->interface_number = -1;
+	for (;;) {
+		bytes_read = read_report(dev, read_buf, MAX_REPORT_SIZE, milliseconds);
+		if (bytes_read <= 0)
+			return bytes_read;
 
-			switch (bus_type) {
-				case BUS_USB:
-					/* The device pointed to by raw_dev contains information about
-					   the hidraw device. In order to get information about the
-					   USB device, get the parent device with the
-					   subsystem/devtype pair of "usb"/"usb_device". This will
-					   be several levels up the tree, but the function will find
-					   it. */
-					usb_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_device");
-
-					/* uhid USB devices
-					   Since this is a virtual hid interface, no USB information will
-					   be available. */
-					if (!usb_dev) {
-						/* Manufacturer and Product strings */
-						cur_dev->manufacturer_string = wcsdup(L"");
-						cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
-						break;
-					}
+		report_len = (size_t) bytes_read;
+		if (filter_report(dev, dev->uses_numbered_reports? read_buf[0]: 0, read_buf, &report_len, MAX_REPORT_SIZE)) {
+			/* Repeated or decimated */
+		}
+		else if (dispatch_subscribed_report(dev, read_buf, report_len)) {
+			/* Consumed */
+		}
+		else if (match(read_buf, report_len, user_data)) {
+			if (report_len > response_length)
+				report_len = response_length;
+			memcpy(response, read_buf, report_len);
+			return (int) report_len;
+		}
+		else if (hold_report(dev, read_buf, report_len) < 0) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_transact: out of memory");
+			return -1;
+		}
 
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
-					cur_dev->product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
-
-					/* Release Number */
-					str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
-					cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
-
-					/* Get a handle to the interface's udev node. */
-					intf_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_interface");
-					if (intf_dev) {
-						str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
-						cur_dev->interface_number = (str)? strtol(str, NULL, 16): -1;
-					}
+		if (milliseconds > 0)
+			milliseconds = get_remaining_milliseconds(&deadline);
+	}
+}
 
-					break;
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
+}
 
-				case BUS_BLUETOOTH:
-				case BUS_I2C:
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = wcsdup(L"");
-					cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	/* Do all non-blocking in userspace using poll(), since it looks
+	   like there's a bug in the kernel in some versions where
+	   read() will not return -1 on disconnection of the USB device */
 
-					break;
+	dev->blocking = !nonblock;
+	return 0; /* Success */
+}
 
-				default:
-					/* Unknown device type - this should never happen, as we
-					 * check for USB and Bluetooth devices above */
-					break;
-			}
+int HID_API_EXPORT_CALL hid_get_input_fd(hid_device *dev)
+{
+	/* The hidraw node (or the socket of an HIDAPI_FD_BACKEND) becomes
+	   readable when a report arrives, and reports POLLERR/POLLHUP on
+	   disconnection, but the reports held back by hid_transact() or a
+	   batch don't make it readable: watch it together with
+	   held_event_fd. */
+	struct epoll_event ev;
+	int epoll_fd, event_fd;
 
-			/* Usage Page and Usage */
-			result = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc);
-			if (result >= 0) {
-				unsigned short page = 0, usage = 0;
-				unsigned int pos = 0;
-				/*
-				 * Parse the first usage and usage page
-				 * out of the report descriptor.
-				 */
-				if (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
+	register_device_error(dev, NULL);
 
-				/*
-				 * Parse any additional usage and usage pages
-				 * out of the report descriptor.
-				 */
-				while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					/* Create new record for additional usage pairs */
-					tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-					cur_dev->next = tmp;
-					prev_dev = cur_dev;
-					cur_dev = tmp;
-
-					/* Update fields */
-					cur_dev->path = strdup(dev_path);
-					cur_dev->vendor_id = dev_vid;
-					cur_dev->product_id = dev_pid;
-					cur_dev->serial_number = prev_dev->serial_number? wcsdup(prev_dev->serial_number): NULL;
-					cur_dev->release_number = prev_dev->release_number;
-					cur_dev->interface_number = prev_dev->interface_number;
-					cur_dev->manufacturer_string = prev_dev->manufacturer_string? wcsdup(prev_dev->manufacturer_string): NULL;
-					cur_dev->product_string = prev_dev->product_string? wcsdup(prev_dev->product_string): NULL;
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
-			}
-		}
+	if (dev->input_epoll_fd >= 0)
+		return dev->input_epoll_fd;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (epoll_fd < 0 || event_fd < 0)
+		goto err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = dev->device_handle;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev->device_handle, &ev) < 0)
+		goto err;
+	ev.data.fd = event_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) < 0)
+		goto err;
+
+	dev->input_epoll_fd = epoll_fd;
+	__atomic_store_n(&dev->held_event_fd, event_fd, __ATOMIC_RELEASE);
+	update_held_event(dev);
+
+	return epoll_fd;
+
+err:
+	register_device_error_errno(dev, "hid_get_input_fd", errno);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (event_fd >= 0)
+		close(event_fd);
+	return -1;
+}
 
-	next:
-		free(serial_number_utf8);
-		free(product_name_utf8);
-		udev_device_unref(raw_dev);
-		/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
-		   unref()d.  It will cause a double-free() error.  I'm not
-		   sure why.  */
+int HID_API_EXPORT_CALL hid_set_batching(hid_device *dev, unsigned int max_reports, unsigned int max_delay_us)
+{
+	if (max_reports > 30 || (max_reports > 1 && max_delay_us == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_batching: invalid batch size or delay");
+		return -1;
 	}
-	/* Free the enumerator and udev objects. */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
 
-	if (root == NULL) {
-		if (vendor_id == 0 && product_id == 0) {
-			register_global_error("No HID devices found in the system.");
-		} else {
-			register_global_error("No HID devices with requested VID/PID found in the system.");
+	if (max_reports > 1) {
+		/* The batch is read through read_buf */
+		pthread_mutex_lock(&dev->subscriptions_mutex);
+		if (!dev->read_buf)
+			dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+		if (!dev->read_buf) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_batching: out of memory");
+			return -1;
 		}
 	}
 
-	return root;
-}
+	__atomic_store_n(&dev->batch_delay_us, max_delay_us, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->batch_reports, max_reports, __ATOMIC_RELAXED);
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
-{
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
-	}
+	register_device_error(dev, NULL);
+	return 0;
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+
+int HID_API_EXPORT_CALL hid_set_broadcast(hid_device *dev, unsigned int slots, size_t max_report_length)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	struct broadcast_ring *ring = NULL;
+	struct broadcast_ring *old;
+	unsigned int num_slots = 1;
 
-	/* register_global_error: global error is reset by hid_enumerate/hid_init */
-	devs = hid_enumerate(vendor_id, product_id);
-	if (devs == NULL) {
-		/* register_global_error: global error is already set by hid_enumerate */
-		return NULL;
+	if (slots > 65536 || (slots > 0 && max_report_length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: invalid ring size");
+		return -1;
 	}
 
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
+	if (slots > 0 && __atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: not available in latest mode");
+		return -1;
+	}
+
+	if (slots > 0) {
+		while (num_slots < slots)
+			num_slots <<= 1;
+		ring = new_broadcast_ring(num_slots, max_report_length);
+		if (!ring) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_broadcast: out of memory");
+			return -1;
 		}
-		cur_dev = cur_dev->next;
 	}
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	} else {
-		register_global_error("Device with requested VID/PID/(SerialNumber) not found");
+	/* The reports are read through read_buf */
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (ring && !dev->read_buf)
+		dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	if (ring && !dev->read_buf) {
+		free_broadcast_ring(ring);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_broadcast: out of memory");
+		return -1;
 	}
 
-	hid_free_enumeration(devs);
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	old = dev->broadcast;
+	if (old && old->readers > 0) {
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+		if (ring)
+			free_broadcast_ring(ring);
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: readers are open");
+		return -1;
+	}
+	__atomic_store_n(&dev->broadcast, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
 
-	return handle;
+	if (old)
+		free_broadcast_ring(old);
+
+	register_device_error(dev, NULL);
+	return 0;
 }
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+HID_API_EXPORT hid_broadcast_reader * HID_API_CALL hid_broadcast_open(hid_device *dev)
 {
-	hid_device *dev = NULL;
+	hid_broadcast_reader *reader = (hid_broadcast_reader*) calloc(1, sizeof(hid_broadcast_reader));
 
-	hid_init();
-	/* register_global_error: global error is reset by hid_init */
+	if (!reader) {
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_broadcast_open: out of memory");
+		return NULL;
+	}
 
-	dev = new_hid_device();
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (!dev->broadcast) {
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+		free(reader);
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_broadcast_open: the device is not in broadcast mode");
+		return NULL;
+	}
+	reader->dev = dev;
+	reader->ring = dev->broadcast;
+	reader->ring->readers++;
+	reader->cursor = __atomic_load_n(&reader->ring->head, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
 
-	dev->device_handle = open(path, O_RDWR);
+	register_device_error(dev, NULL);
+	return reader;
+}
 
-	/* If we have a good handle, return it. */
-	if (dev->device_handle >= 0) {
-		/* Get the report descriptor */
-		int res, desc_size = 0;
-		struct hidraw_report_descriptor rpt_desc;
+int HID_API_EXPORT_CALL hid_broadcast_read(hid_broadcast_reader *reader, unsigned char *data, size_t length, int milliseconds)
+{
+	struct broadcast_ring *ring = reader->ring;
+	hid_device *dev = reader->dev;
+	struct timespec deadline;
+	int res = 0;
 
-		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+	if (!data || !length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_broadcast_read: zero buffer/length");
+		return -1;
+	}
 
-		/* Get Report Descriptor Size */
-		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
-		if (res < 0)
-			register_device_error_format(dev, "ioctl (GRDESCSIZE): %s", strerror(errno));
+	if (milliseconds > 0)
+		get_deadline(&deadline, milliseconds);
 
-		/* Get Report Descriptor */
-		rpt_desc.size = desc_size;
-		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
-		if (res < 0) {
-			register_device_error_format(dev, "ioctl (GRDESC): %s", strerror(errno));
-		} else {
-			/* Determine if this device uses numbered reports. */
-			dev->uses_numbered_reports =
-				uses_numbered_reports(rpt_desc.value,
-				                      rpt_desc.size);
+	for (;;) {
+		int bytes_read = load_broadcast_report(reader, data, length);
+		if (bytes_read > 0 || res == ETIMEDOUT)
+			return bytes_read;
+
+		pthread_mutex_lock(&ring->mutex);
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != reader->cursor) {
+			/* Written meanwhile */
+		}
+		else if (!ring->pumping) {
+			/* Nobody reads from the device: read the next report
+			   for all the readers. read_buf is only used by the
+			   reader holding the pumping flag. */
+			ring->pumping = 1;
+			__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&ring->mutex);
+
+			bytes_read = pump_reports(dev, dev->read_buf, 0, NULL, 0, milliseconds);
+
+			/* Let a sleeping reader take over */
+			pthread_mutex_lock(&ring->mutex);
+			ring->pumping = 0;
+			pthread_cond_broadcast(&ring->condition);
+			pthread_mutex_unlock(&ring->mutex);
+
+			if (bytes_read <= 0)
+				return bytes_read;
+			if (milliseconds > 0)
+				milliseconds = get_remaining_milliseconds(&deadline);
+			continue;
+		}
+		else if (milliseconds < 0) {
+			/* Another reader reads from the device */
+			res = pthread_cond_wait(&ring->condition, &ring->mutex);
+		}
+		else if (milliseconds > 0) {
+			res = pthread_cond_timedwait(&ring->condition, &ring->mutex, &deadline);
+		}
+		else {
+			res = ETIMEDOUT;
 		}
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ring->mutex);
 
-		return dev;
-	}
-	else {
-		/* Unable to open a device. */
-		free(dev);
-		register_global_error_format("Failed to open a device with path '%s': %s", path, strerror(errno));
-		return NULL;
+		if (milliseconds > 0)
+			milliseconds = get_remaining_milliseconds(&deadline);
 	}
 }
 
+int HID_API_EXPORT_CALL hid_broadcast_get_overflow(hid_broadcast_reader *reader, unsigned long long *count)
+{
+	if (!reader || !count)
+		return -1;
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+	*count = reader->overflow;
+	return 0;
+}
+
+void HID_API_EXPORT_CALL hid_broadcast_close(hid_broadcast_reader *reader)
 {
-	int bytes_written;
+	if (!reader)
+		return;
 
-	if (!data || (length == 0)) {
-		errno = EINVAL;
-		register_device_error(dev, strerror(errno));
+	pthread_mutex_lock(&reader->dev->subscriptions_mutex);
+	reader->ring->readers--;
+	pthread_mutex_unlock(&reader->dev->subscriptions_mutex);
+	free(reader);
+}
+
+int HID_API_EXPORT_CALL hid_subscribe_report_id(hid_device *dev, unsigned char report_id, hid_report_callback callback, void *user_data)
+{
+	if (report_id == 0 || !callback) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_subscribe_report_id: Report ID 0 or no callback");
 		return -1;
 	}
 
-	bytes_written = write(dev->device_handle, data, length);
+	if (!dev->uses_numbered_reports) {
+		register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_subscribe_report_id: the device doesn't use numbered reports");
+		return -1;
+	}
 
-	register_device_error(dev, (bytes_written == -1)? strerror(errno): NULL);
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (!dev->read_buf)
+		dev->read_buf = (unsigned char*) malloc(MAX_REPORT_SIZE);
+	if (!dev->subscriptions)
+		dev->subscriptions = (struct report_subscription*) calloc(256, sizeof(struct report_subscription));
+	if (!dev->read_buf || !dev->subscriptions) {
+		pthread_mutex_unlock(&dev->subscriptions_mutex);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_subscribe_report_id: out of memory");
+		return -1;
+	}
+	dev->subscriptions[report_id].callback = callback;
+	dev->subscriptions[report_id].user_data = user_data;
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
 
-	return bytes_written;
+	register_device_error(dev, NULL);
+	return 0;
 }
 
+int HID_API_EXPORT_CALL hid_unsubscribe_report_id(hid_device *dev, unsigned char report_id)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (dev->subscriptions && dev->subscriptions[report_id].callback) {
+		dev->subscriptions[report_id].callback = NULL;
+		dev->subscriptions[report_id].user_data = NULL;
+		res = 0;
+	}
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+	if (res < 0)
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_unsubscribe_report_id: no subscription for this Report ID");
+	else
+		register_device_error(dev, NULL);
+	return res;
+}
+
+int HID_API_EXPORT_CALL hid_start_capture(hid_device *dev, const char *path, const struct hid_device_info *info)
 {
-	/* Set device error to none */
-	register_device_error(dev, NULL);
+	struct capture_file *capture;
 
-	int bytes_read;
+	if (!path) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_start_capture: NULL path");
+		return -1;
+	}
 
-	if (milliseconds >= 0) {
-		/* Milliseconds is either 0 (non-blocking) or > 0 (contains
-		   a valid timeout). In both cases we want to call poll()
-		   and wait for data to arrive.  Don't rely on non-blocking
-		   operation (O_NONBLOCK) since some kernels don't seem to
-		   properly report device disconnection through read() when
-		   in non-blocking mode.  */
-		int ret;
-		struct pollfd fds;
+	if (__atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_start_capture: the device is already recorded");
+		return -1;
+	}
 
-		fds.fd = dev->device_handle;
-		fds.events = POLLIN;
-		fds.revents = 0;
-		ret = poll(&fds, 1, milliseconds);
-		if (ret == 0) {
-			/* Timeout */
-			return ret;
-		}
-		if (ret == -1) {
-			/* Error */
-			register_device_error(dev, strerror(errno));
-			return ret;
-		}
-		else {
-			/* Check for errors on the file descriptor. This will
-			   indicate a device disconnection. */
-			if (fds.revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				// We cannot use strerror() here as no -1 was returned from poll().
-				register_device_error(dev, "hid_read_timeout: unexpected poll error (device disconnected)");
-				return -1;
-			}
-		}
+	capture = create_capture_file(path, info, dev->uses_numbered_reports);
+	if (!capture) {
+		register_device_error_errno(dev, "hid_start_capture: couldn't create the capture file", errno);
+		return -1;
 	}
 
-	bytes_read = read(dev->device_handle, data, length);
-	if (bytes_read < 0) {
-		if (errno == EAGAIN || errno == EINPROGRESS)
-			bytes_read = 0;
-		else
-			register_device_error(dev, strerror(errno));
+	pthread_mutex_lock(&dev->capture_mutex);
+	if (dev->capture) {
+		pthread_mutex_unlock(&dev->capture_mutex);
+		close_capture_file(capture);
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_start_capture: the device is already recorded");
+		return -1;
 	}
+	__atomic_store_n(&dev->capture, capture, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->capture_mutex);
 
-	return bytes_read;
+	register_device_error(dev, NULL);
+	return 0;
 }
 
-int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT_CALL hid_stop_capture(hid_device *dev)
 {
-	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
-}
+	struct capture_file *capture;
 
-int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
-{
-	/* Do all non-blocking in userspace using poll(), since it looks
-	   like there's a bug in the kernel in some versions where
-	   read() will not return -1 on disconnection of the USB device */
+	pthread_mutex_lock(&dev->capture_mutex);
+	capture = dev->capture;
+	__atomic_store_n(&dev->capture, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->capture_mutex);
 
-	dev->blocking = !nonblock;
-	return 0; /* Success */
-}
+	if (!capture) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_stop_capture: the device is not recorded");
+		return -1;
+	}
+
+	close_capture_file(capture);
 
+	register_device_error(dev, NULL);
+	return 0;
+}
 
+#ifndef HIDAPI_FD_BACKEND
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	int res;
@@ -1084,7 +3271,9 @@ int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char
 
 	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
 	if (res < 0)
-		register_device_error_format(dev, "ioctl (SFEATURE): %s", strerror(errno));
+		register_device_error_errno(dev, "ioctl (SFEATURE)", errno);
+	else
+		capture_report(dev, HID_CAPTURE_FEATURE_SET, data, length);
 
 	return res;
 }
@@ -1097,7 +3286,9 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 	res = ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
 	if (res < 0)
-		register_device_error_format(dev, "ioctl (GFEATURE): %s", strerror(errno));
+		register_device_error_errno(dev, "ioctl (GFEATURE)", errno);
+	else
+		capture_report(dev, HID_CAPTURE_FEATURE_GET, data, (size_t) res);
 
 	return res;
 }
@@ -1110,38 +3301,44 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 
 	res = ioctl(dev->device_handle, HIDIOCGINPUT(length), data);
 	if (res < 0)
-		register_device_error_format(dev, "ioctl (GINPUT): %s", strerror(errno));
+		register_device_error_errno(dev, "ioctl (GINPUT)", errno);
+	else
+		capture_report(dev, HID_CAPTURE_INPUT_GET, data, (size_t) res);
 
 	return res;
 }
+#endif
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
 
+#ifdef HIDAPI_FD_BACKEND
+	close_backend_device(dev);
+#endif
 	close(dev->device_handle);
 
 	/* Free the device error message */
 	register_device_error(dev, NULL);
 
-	free(dev);
+	free_hid_device(dev);
 }
 
 
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return get_device_string(dev, DEVICE_STRING_MANUFACTURER, string, maxlen);
+	return get_device_string(dev, DEVICE_STRING_MANUFACTURER, string, NULL, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return get_device_string(dev, DEVICE_STRING_PRODUCT, string, maxlen);
+	return get_device_string(dev, DEVICE_STRING_PRODUCT, string, NULL, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return get_device_string(dev, DEVICE_STRING_SERIAL, string, maxlen);
+	return get_device_string(dev, DEVICE_STRING_SERIAL, string, NULL, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
@@ -1150,7 +3347,33 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 	(void)string;
 	(void)maxlen;
 
-	register_device_error(dev, "hid_get_indexed_string: not supported by hidraw");
+	register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_get_indexed_string: not supported by " BACKEND_NAME);
+
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return get_device_string(dev, DEVICE_STRING_MANUFACTURER, NULL, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return get_device_string(dev, DEVICE_STRING_PRODUCT, NULL, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return get_device_string(dev, DEVICE_STRING_SERIAL, NULL, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string_utf8(hid_device *dev, int string_index, char *string, size_t maxlen)
+{
+	(void)string_index;
+	(void)string;
+	(void)maxlen;
+
+	register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_get_indexed_string_utf8: not supported by " BACKEND_NAME);
 
 	return -1;
 }
@@ -1159,13 +3382,32 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 /* Passing in NULL means asking for the last global error message. */
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	if (dev) {
-		if (dev->last_error_str == NULL)
-			return L"Success";
-		return dev->last_error_str;
-	}
+	if (dev)
+		return render_device_error(dev);
+
+	return hid_context_error(NULL);
+}
+
+int HID_API_EXPORT_CALL hid_error_code(hid_device *dev)
+{
+	if (dev)
+		return dev->last_error_code;
 
-	if (last_global_error_str == NULL)
+	return hid_context_error_code(NULL);
+}
+
+HID_API_EXPORT const wchar_t * HID_API_CALL hid_context_error(hid_context *ctx)
+{
+	struct global_error *err = get_context_error(resolve_context(ctx), 0);
+
+	if (err == NULL || err->str == NULL)
 		return L"Success";
-	return last_global_error_str;
+	return err->str;
+}
+
+int HID_API_EXPORT_CALL hid_context_error_code(hid_context *ctx)
+{
+	struct global_error *err = get_context_error(resolve_context(ctx), 0);
+
+	return err? err->code: HID_API_ERROR_SUCCESS;
 }
@@ -27,12 +27,22 @@
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/USBSpec.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_error.h>
+#include <stdarg.h>
 #include <wchar.h>
 #include <locale.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dlfcn.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "hidapi_darwin.h"
 
@@ -105,17 +115,170 @@ static int return_data(hid_device *dev, unsigned char *data, size_t length);
 struct input_report {
 	uint8_t *data;
 	size_t len;
+	uint64_t seq; /* Arrival number, see hid_device::report_seq */
 	struct input_report *next;
 };
 
+/* A callback of hid_subscribe_report_id() */
+struct report_subscription {
+	hid_report_callback callback;
+	void *user_data;
+};
+
+/* The newest Input report of a Report ID, see hid_read_latest().
+   Written by one thread at a time and read lock-free by any number of
+   threads: seq is odd while the writer copies the report, and a reader
+   retries when seq changed during its own copy. */
+struct latest_report {
+	unsigned int seq;
+	size_t len;
+	size_t capacity;
+	unsigned char *data;
+	/* The smaller slot this one replaced, see store_latest_report() */
+	struct latest_report *retired;
+};
+
+/* A report in the broadcast ring. Like in latest_report, seq is odd
+   while the report is written; number tells which report it is. */
+struct broadcast_slot {
+	unsigned int seq;
+	unsigned int number;
+	size_t len;
+	unsigned char *data;
+};
+
+/* The ring of broadcast mode, see hid_set_broadcast(). Written by
+   hid_input_report_callback() under the mutex of
+   the device, which never waits for the readers, and read
+   lock-free by each reader at its own cursor. Report n goes to slot
+   n & mask and head is the number of the next report. mutex and
+   condition only put the readers to sleep while the ring has nothing
+   new for them; waiters tells the writer whether to wake them up. */
+struct broadcast_ring {
+	unsigned int mask;
+	size_t slot_size;
+	struct broadcast_slot *slots;
+	unsigned int head;
+	unsigned int waiters;
+	unsigned int readers; /* Open readers, protected by the mutex of the device */
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+};
+
+/* A reader of the broadcast ring, see hid_broadcast_open() */
+struct hid_broadcast_reader_ {
+	hid_device *dev;
+	struct broadcast_ring *ring;
+	unsigned int cursor; /* The number of the next report to read */
+	unsigned long long overflow;
+};
+
+/* The previous Input report of a Report ID in changes-only mode,
+   see hid_set_changes_only(). */
+struct change_filter {
+	unsigned char *data;
+	size_t len; /* 0 until the first report */
+	size_t capacity;
+	unsigned char *mask; /* see hid_set_change_mask() */
+	size_t mask_len;
+};
+
+/* The decimation stage of a Report ID, see hid_set_decimation(). */
+struct report_decimator {
+	struct hid_decimation config;
+	unsigned int skipped; /* HID_DECIMATE_EVERY_NTH: reports since the last one delivered */
+	unsigned char *window; /* The report of the open window */
+	size_t window_len; /* 0 while no window is open */
+	size_t capacity;
+	unsigned int window_count; /* Reports in the open window */
+	uint64_t window_end;
+};
+
+/* A capture file being recorded, see hid_start_capture(). The records
+   are copied into a shared mapping of the file, which is grown and
+   mapped again when full. */
+struct capture_file {
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	size_t used; /* The header and the complete records */
+	uint64_t start_ns;
+};
+
+/* The first size of a capture file, and the largest step it grows by */
+#define CAPTURE_MIN_SIZE (1024 * 1024)
+#define CAPTURE_MAX_STEP (64 * 1024 * 1024)
+
 static struct hid_api_version api_version = {
 	.major = HID_API_VERSION_MAJOR,
 	.minor = HID_API_VERSION_MINOR,
 	.patch = HID_API_VERSION_PATCH
 };
 
+/* The last global error of a thread, see hid_error(NULL). Each thread
+   gets its own (allocated on its first error), so that concurrent
+   hid_enumerate()/hid_open() calls don't clobber each other's errors. */
+struct global_error {
+	wchar_t *str;
+	int code;
+};
+
+static pthread_key_t global_error_key;
+static pthread_once_t global_error_key_once = PTHREAD_ONCE_INIT;
+static int global_error_key_valid = 0;
+
+static void free_global_error(void *ptr)
+{
+	struct global_error *err = (struct global_error*) ptr;
+	free(err->str);
+	free(err);
+}
+
+static void create_global_error_key(void)
+{
+	global_error_key_valid = (pthread_key_create(&global_error_key, free_global_error) == 0);
+}
+
 /* - Run context - */
-static	IOHIDManagerRef hid_mgr = 0x0;
+/* A library context, see hid_context_create(). Each context has its
+   own IOHIDManager, scheduled on the run loop of the thread which
+   initialized it. */
+struct hid_context_ {
+	IOHIDManagerRef hid_mgr;
+
+	/* The last error, not used by default_context (which keeps
+	   the errors per thread). */
+	struct global_error error;
+};
+
+/* The context of the functions without a context argument */
+static	hid_context default_context = { 0x0 };
+
+/* Returns the last error of ctx, for default_context the one of the
+   calling thread. If the thread has none yet, it is allocated if create
+   is non-zero, otherwise NULL is returned. */
+static struct global_error *get_context_error(hid_context *ctx, int create)
+{
+	struct global_error *err;
+
+	if (ctx != &default_context)
+		return &ctx->error;
+
+	pthread_once(&global_error_key_once, create_global_error_key);
+	if (!global_error_key_valid)
+		return NULL;
+
+	err = (struct global_error*) pthread_getspecific(global_error_key);
+	if (!err && create) {
+		err = (struct global_error*) calloc(1, sizeof(struct global_error));
+		if (err && pthread_setspecific(global_error_key, err) != 0) {
+			free(err);
+			err = NULL;
+		}
+	}
+
+	return err;
+}
 static	int is_macos_10_10_or_greater = 0;
 static	IOOptionBits device_open_options = 0;
 /* --- */
@@ -132,6 +295,8 @@ struct hid_device_ {
 	uint8_t *input_report_buf;
 	CFIndex max_input_report_len;
 	struct input_report *input_reports;
+	/* Number of reports queued so far, protected by mutex */
+	uint64_t report_seq;
 
 	pthread_t thread;
 	pthread_mutex_t mutex; /* Protects input_reports */
@@ -139,8 +304,525 @@ struct hid_device_ {
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	pthread_barrier_t shutdown_barrier; /* Ensures correct shutdown sequence */
 	int shutdown_thread;
+
+	/* Pipe behind hid_get_input_fd(), created on first use. It holds one
+	   byte while input_reports isn't empty or the device is gone.
+	   Protected by mutex. */
+	int input_pipe[2];
+	int input_pipe_ready;
+
+	/* Batched delivery, see hid_set_batching(). The batch_pending
+	   reports queued last are held back from the waiting threads until
+	   there are batch_reports of them or batch_timer fires. Protected
+	   by mutex; batch_timer is only armed on the run loop. */
+	unsigned int batch_reports;
+	unsigned int batch_delay_us;
+	unsigned int batch_pending;
+	CFRunLoopTimerRef batch_timer;
+
+	/* Callbacks of hid_subscribe_report_id(), indexed by Report ID and
+	   allocated on the first subscription. Protected by
+	   subscriptions_mutex, which is held while a callback runs. */
+	struct report_subscription *subscriptions;
+	pthread_mutex_t subscriptions_mutex;
+
+	/* Latest mode, see hid_set_read_latest(). The slots, indexed by
+	   Report ID, are written by hid_input_report_callback() on the run loop
+	   of the read thread. latest_reports is allocated under mutex by
+	   the first call. */
+	int read_latest;
+	struct latest_report **latest_reports;
+
+	/* Changes-only mode, see hid_set_changes_only(), and the stages of
+	   hid_set_decimation(). The filters and the stages, indexed by
+	   Report ID, and the count are protected by changes_mutex. */
+	int changes_only;
+	struct change_filter *change_filters;
+	unsigned long long unchanged_count;
+	struct report_decimator **decimators;
+	pthread_mutex_t changes_mutex;
+
+	/* Fires on the run loop when the first open window of the stages
+	   ends, at window_due (see get_milliseconds(), 0 while no window
+	   is open). window_due is protected by changes_mutex. */
+	CFRunLoopTimerRef window_timer;
+	uint64_t window_due;
+
+	/* The ring of broadcast mode, see hid_set_broadcast(). Replaced
+	   under mutex. */
+	struct broadcast_ring *broadcast;
+
+	/* The capture file of hid_start_capture(). Replaced and written
+	   under capture_mutex. */
+	struct capture_file *capture;
+	pthread_mutex_t capture_mutex;
+
+	/* Last error, see register_device_error_ioreturn(). Only rendered
+	   into last_error_buf when hid_error() asks for it. */
+	const char *last_error_msg;
+	int last_error_errno;
+	IOReturn last_error_ioreturn;
+	int last_error_code;
+	wchar_t last_error_buf[256];
 };
 
+/* Maps an errno value to a hid_api_error code. */
+static int errno_to_error_code(int err)
+{
+	switch (err) {
+		case 0:
+			return HID_API_ERROR_SUCCESS;
+		case EINVAL:
+			return HID_API_ERROR_INVALID_PARAM;
+		case ENOENT:
+			return HID_API_ERROR_NOT_FOUND;
+		case EACCES:
+		case EPERM:
+			return HID_API_ERROR_ACCESS;
+		case ENODEV:
+		case ENXIO:
+			return HID_API_ERROR_NO_DEVICE;
+		case EBUSY:
+			return HID_API_ERROR_BUSY;
+		case ETIMEDOUT:
+			return HID_API_ERROR_TIMEOUT;
+		case EAGAIN:
+			return HID_API_ERROR_AGAIN;
+		case EINTR:
+			return HID_API_ERROR_INTERRUPTED;
+		case ENOMEM:
+			return HID_API_ERROR_NO_MEM;
+		case ENOSYS:
+		case ENOTSUP:
+			return HID_API_ERROR_NOT_SUPPORTED;
+		default:
+			return HID_API_ERROR_IO;
+	}
+}
+
+/* Maps an IOReturn value to a hid_api_error code. */
+static int ioreturn_to_error_code(IOReturn ret)
+{
+	switch (ret) {
+		case kIOReturnSuccess:
+			return HID_API_ERROR_SUCCESS;
+		case kIOReturnBadArgument:
+			return HID_API_ERROR_INVALID_PARAM;
+		case kIOReturnNotFound:
+			return HID_API_ERROR_NOT_FOUND;
+		case kIOReturnNotPrivileged:
+		case kIOReturnNotPermitted:
+			return HID_API_ERROR_ACCESS;
+		case kIOReturnNoDevice:
+		case kIOReturnNotAttached:
+		case kIOReturnOffline:
+			return HID_API_ERROR_NO_DEVICE;
+		case kIOReturnBusy:
+		case kIOReturnExclusiveAccess:
+			return HID_API_ERROR_BUSY;
+		case kIOReturnTimeout:
+			return HID_API_ERROR_TIMEOUT;
+		case kIOReturnAborted:
+			return HID_API_ERROR_INTERRUPTED;
+		case kIOReturnNoMemory:
+			return HID_API_ERROR_NO_MEM;
+		case kIOReturnUnsupported:
+			return HID_API_ERROR_NOT_SUPPORTED;
+		default:
+			return HID_API_ERROR_IO;
+	}
+}
+
+static wchar_t *utf8_to_wchar_t(const char *utf8)
+{
+	wchar_t *ret = NULL;
+
+	if (utf8) {
+		size_t wlen = mbstowcs(NULL, utf8, 0);
+		if ((size_t) -1 == wlen) {
+			return (wchar_t*) calloc(1, sizeof(wchar_t));
+		}
+		ret = (wchar_t*) calloc(wlen+1, sizeof(wchar_t));
+		if (ret == NULL) {
+			/* as much as we can do at this point */
+			return NULL;
+		}
+		mbstowcs(ret, utf8, wlen+1);
+		ret[wlen] = 0x0000;
+	}
+
+	return ret;
+}
+
+/* Set the last global error of ctx (for the default context, of the
+ * calling thread), to be reported by hid_context_error(ctx) and
+ * hid_context_error_code(ctx).
+ * The given error message will be copied (and decoded according to the
+ * currently locale, so do not pass in string constants).
+ * The last stored global error message is freed.
+ * Use register_global_error_code(ctx, HID_API_ERROR_SUCCESS, NULL) to indicate "no error". */
+static void register_global_error_code(hid_context *ctx, int code, const char *msg)
+{
+	struct global_error *err = get_context_error(ctx, msg != NULL);
+	if (!err)
+		return;
+
+	free(err->str);
+	err->str = utf8_to_wchar_t(msg);
+	err->code = code;
+}
+
+/* Same as register_global_error_code, with HID_API_ERROR_UNKNOWN
+ * (or HID_API_ERROR_SUCCESS if msg is NULL). */
+static void register_global_error(hid_context *ctx, const char *msg)
+{
+	register_global_error_code(ctx, msg? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, msg);
+}
+
+/* Similar to register_global_error_code, but allows passing a format string into this function. */
+static void register_global_error_format(hid_context *ctx, int code, const char *format, ...)
+{
+	char msg[256];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+
+	register_global_error_code(ctx, code, msg);
+}
+
+/* Set the last error for a device to be reported by hid_error(dev)
+ * and hid_error_code(dev): msg (a string constant, or NULL), followed
+ * by the description of ret if it isn't kIOReturnSuccess.
+ * Nothing is copied or allocated here, the message is only rendered by
+ * hid_error(), so this is cheap enough to be called by every
+ * hid_read()/hid_write().
+ * Use register_device_error(dev, NULL) to indicate "no error". */
+static void register_device_error_ioreturn(hid_device *dev, const char *msg, IOReturn ret)
+{
+	dev->last_error_msg = msg;
+	dev->last_error_errno = 0;
+	dev->last_error_ioreturn = ret;
+	dev->last_error_code = ioreturn_to_error_code(ret);
+}
+
+/* Same as register_device_error_ioreturn, for an errno value. */
+static void register_device_error_errno(hid_device *dev, const char *msg, int err)
+{
+	dev->last_error_msg = msg;
+	dev->last_error_errno = err;
+	dev->last_error_ioreturn = kIOReturnSuccess;
+	dev->last_error_code = errno_to_error_code(err);
+}
+
+/* Same as register_device_error_ioreturn, for errors without an
+ * IOReturn or errno value. */
+static void register_device_error_code(hid_device *dev, int code, const char *msg)
+{
+	dev->last_error_msg = msg;
+	dev->last_error_errno = 0;
+	dev->last_error_ioreturn = kIOReturnSuccess;
+	dev->last_error_code = code;
+}
+
+/* Same as register_device_error_code, with HID_API_ERROR_UNKNOWN
+ * (or HID_API_ERROR_SUCCESS if msg is NULL). */
+static void register_device_error(hid_device *dev, const char *msg)
+{
+	register_device_error_code(dev, msg? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, msg);
+}
+
+/* Renders the last error of dev into its last_error_buf. */
+static const wchar_t *render_device_error(hid_device *dev)
+{
+	char msg[256];
+	const char *prefix = dev->last_error_msg? dev->last_error_msg: "";
+	const char *separator = dev->last_error_msg? ": ": "";
+	size_t len;
+
+	if (dev->last_error_msg == NULL && dev->last_error_errno == 0 && dev->last_error_ioreturn == kIOReturnSuccess)
+		return L"Success";
+
+	if (dev->last_error_ioreturn != kIOReturnSuccess)
+		snprintf(msg, sizeof(msg), "%s%s%s (0x%08X)", prefix, separator, mach_error_string(dev->last_error_ioreturn), (unsigned int) dev->last_error_ioreturn);
+	else if (dev->last_error_errno)
+		snprintf(msg, sizeof(msg), "%s%s%s", prefix, separator, strerror(dev->last_error_errno));
+	else
+		snprintf(msg, sizeof(msg), "%s", prefix);
+
+	/* Decoded according to the current locale, like the global errors */
+	len = mbstowcs(dev->last_error_buf, msg, sizeof(dev->last_error_buf) / sizeof(wchar_t));
+	if (len == (size_t) -1)
+		len = 0;
+	if (len >= sizeof(dev->last_error_buf) / sizeof(wchar_t))
+		len = sizeof(dev->last_error_buf) / sizeof(wchar_t) - 1;
+	dev->last_error_buf[len] = L'\0';
+
+	return dev->last_error_buf;
+}
+
+/* Makes the pipe of hid_get_input_fd() readable exactly when hid_read()
+   wouldn't block. Must be called with dev->mutex locked. */
+static void update_input_fd(hid_device *dev)
+{
+	int ready = ((dev->input_reports != NULL && !dev->batch_pending) || dev->shutdown_thread || dev->disconnected);
+	char c = 0;
+
+	if (dev->input_pipe[0] < 0 || ready == dev->input_pipe_ready)
+		return;
+
+	if (ready) {
+		if (write(dev->input_pipe[1], &c, 1) != 1)
+			return;
+	}
+	else {
+		if (read(dev->input_pipe[0], &c, 1) != 1)
+			return;
+	}
+	dev->input_pipe_ready = ready;
+}
+
+/* Allocates a ring of num_slots (a power of two) reports of up to
+   slot_size bytes each. */
+static struct broadcast_ring *new_broadcast_ring(unsigned int num_slots, size_t slot_size)
+{
+	struct broadcast_ring *ring;
+	unsigned char *data;
+	unsigned int i;
+
+	if (slot_size > SIZE_MAX / num_slots)
+		return NULL;
+
+	ring = (struct broadcast_ring*) calloc(1, sizeof(struct broadcast_ring));
+	if (!ring)
+		return NULL;
+	ring->slots = (struct broadcast_slot*) calloc(num_slots, sizeof(struct broadcast_slot));
+	data = (unsigned char*) malloc(num_slots * slot_size);
+	if (!ring->slots || !data) {
+		free(ring->slots);
+		free(data);
+		free(ring);
+		return NULL;
+	}
+
+	for (i = 0; i < num_slots; i++)
+		ring->slots[i].data = data + i * slot_size;
+	ring->mask = num_slots - 1;
+	ring->slot_size = slot_size;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->condition, NULL);
+	return ring;
+}
+
+static void free_broadcast_ring(struct broadcast_ring *ring)
+{
+	pthread_cond_destroy(&ring->condition);
+	pthread_mutex_destroy(&ring->mutex);
+	free(ring->slots[0].data);
+	free(ring->slots);
+	free(ring);
+}
+
+/* Wakes the readers sleeping in hid_broadcast_read() */
+static void wake_broadcast_readers(struct broadcast_ring *ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	pthread_cond_broadcast(&ring->condition);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/* Writes a report over the oldest one of the ring. Only called by
+   hid_input_report_callback(), with the mutex of
+   the device locked. The mutex of the ring is only taken when a reader
+   sleeps, to wake it up. */
+static void store_broadcast_report(struct broadcast_ring *ring, const unsigned char *data, size_t length)
+{
+	unsigned int head = ring->head;
+	struct broadcast_slot *slot = &ring->slots[head & ring->mask];
+
+	if (length > ring->slot_size)
+		length = ring->slot_size;
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->number, head, __ATOMIC_RELAXED);
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->len, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	/* Either this sees the waiter, or the waiter sees the new head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+		wake_broadcast_readers(ring);
+}
+
+/* Copies the next report of a reader, without blocking the writer.
+   Returns 0 if there is none yet. A reader left behind by more than
+   the ring holds skips to the oldest report still in it. */
+static int load_broadcast_report(hid_broadcast_reader *reader, unsigned char *data, size_t length)
+{
+	struct broadcast_ring *ring = reader->ring;
+	struct broadcast_slot *slot;
+	unsigned int head;
+	unsigned int seq;
+	size_t len;
+
+	for (;;) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head == reader->cursor)
+			return 0;
+
+		if (head - reader->cursor > ring->mask + 1) {
+			reader->overflow += head - reader->cursor - (ring->mask + 1);
+			reader->cursor = head - (ring->mask + 1);
+		}
+
+		slot = &ring->slots[reader->cursor & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || __atomic_load_n(&slot->number, __ATOMIC_RELAXED) != reader->cursor)
+			continue; /* Being overwritten, head moves past the cursor */
+
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			reader->cursor++;
+			return (int) len;
+		}
+	}
+}
+
+/* Maps at least size bytes of a capture file, growing the file. The
+   size doubles up to CAPTURE_MAX_STEP at a time. */
+static int grow_capture_file(struct capture_file *capture, size_t size)
+{
+	size_t step = capture->map_size < CAPTURE_MAX_STEP? capture->map_size: CAPTURE_MAX_STEP;
+	size_t map_size = capture->map_size + step;
+	unsigned char *map;
+
+	if (map_size < size)
+		map_size = size;
+	map_size = (map_size + CAPTURE_MIN_SIZE - 1) & ~((size_t) CAPTURE_MIN_SIZE - 1);
+
+	if (ftruncate(capture->fd, (off_t) map_size) < 0)
+		return -1;
+	map = (unsigned char*) mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	capture->map = map;
+	capture->map_size = map_size;
+	return 0;
+}
+
+/* Appends a record to a capture file. The file was extended with
+   zeroes, so the padding is zero already. */
+static void append_capture_record(struct capture_file *capture, uint16_t type, const unsigned char *data, size_t length)
+{
+	struct hid_capture_record *record;
+	size_t size = sizeof(struct hid_capture_record) + ((length + 7) & ~(size_t) 7);
+	struct timespec ts;
+
+	if (capture->used + size > capture->map_size && grow_capture_file(capture, capture->used + size) < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record = (struct hid_capture_record*) (capture->map + capture->used);
+	record->timestamp_ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec - capture->start_ns;
+	record->length = (uint32_t) length;
+	record->type = type;
+	memcpy(record + 1, data, length);
+	capture->used += size;
+
+	/* Only now is the record part of the capture */
+	__atomic_store_n(&((struct hid_capture_header*) capture->map)->data_length,
+	                 (uint64_t) (capture->used - sizeof(struct hid_capture_header)), __ATOMIC_RELEASE);
+}
+
+/* Records a report of dev, if hid_start_capture() was called */
+static void capture_report(hid_device *dev, hid_capture_record_type type, const unsigned char *data, size_t length)
+{
+	if (!__atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&dev->capture_mutex);
+	if (dev->capture)
+		append_capture_record(dev->capture, (uint16_t) type, data, length);
+	pthread_mutex_unlock(&dev->capture_mutex);
+}
+
+/* Truncates a capture file to its records and closes it */
+static void close_capture_file(struct capture_file *capture)
+{
+	if (capture->map)
+		munmap(capture->map, capture->map_size);
+	if (capture->used > 0 && ftruncate(capture->fd, (off_t) capture->used) < 0) {
+		/* The zeroes past data_length are ignored anyway */
+	}
+	close(capture->fd);
+	free(capture);
+}
+
+/* Creates a capture file with its header and the strings of info */
+static struct capture_file *create_capture_file(const char *path, const struct hid_device_info *info, int numbered_reports)
+{
+	struct capture_file *capture;
+	struct hid_capture_header *header;
+	struct timespec ts;
+
+	capture = (struct capture_file*) calloc(1, sizeof(struct capture_file));
+	if (!capture)
+		return NULL;
+
+	capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd < 0) {
+		free(capture);
+		return NULL;
+	}
+
+	if (grow_capture_file(capture, CAPTURE_MIN_SIZE) < 0) {
+		close_capture_file(capture);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	capture->start_ns = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+	capture->used = sizeof(struct hid_capture_header);
+
+	header = (struct hid_capture_header*) capture->map;
+	memcpy(header->magic, HID_CAPTURE_MAGIC, sizeof(HID_CAPTURE_MAGIC));
+	header->version = HID_CAPTURE_VERSION;
+	header->header_size = sizeof(struct hid_capture_header);
+	header->start_time_ns = capture->start_ns;
+	header->interface_number = -1;
+	header->flags = numbered_reports? HID_CAPTURE_NUMBERED_REPORTS: 0;
+
+	if (info) {
+		header->vendor_id = info->vendor_id;
+		header->product_id = info->product_id;
+		header->release_number = info->release_number;
+		header->usage_page = info->usage_page;
+		header->usage = info->usage;
+		header->bus_type = (uint16_t) info->bus_type;
+		header->interface_number = info->interface_number;
+
+		if (info->manufacturer_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_MANUFACTURER, (const unsigned char*) info->manufacturer_string_utf8, strlen(info->manufacturer_string_utf8));
+		if (info->product_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_PRODUCT, (const unsigned char*) info->product_string_utf8, strlen(info->product_string_utf8));
+		if (info->serial_number_utf8)
+			append_capture_record(capture, HID_CAPTURE_SERIAL_NUMBER, (const unsigned char*) info->serial_number_utf8, strlen(info->serial_number_utf8));
+	}
+
+	return capture;
+}
+
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
@@ -155,10 +837,34 @@ static hid_device *new_hid_device(void)
 	dev->input_report_buf = NULL;
 	dev->input_reports = NULL;
 	dev->shutdown_thread = 0;
+	dev->input_pipe[0] = -1;
+	dev->input_pipe[1] = -1;
+	dev->input_pipe_ready = 0;
+	dev->batch_reports = 0;
+	dev->batch_delay_us = 0;
+	dev->batch_pending = 0;
+	dev->batch_timer = NULL;
+	dev->subscriptions = NULL;
+	dev->read_latest = 0;
+	dev->latest_reports = NULL;
+	dev->changes_only = 0;
+	dev->change_filters = NULL;
+	dev->unchanged_count = 0;
+	dev->decimators = NULL;
+	dev->window_timer = NULL;
+	dev->window_due = 0;
+	dev->capture = NULL;
+	dev->last_error_msg = NULL;
+	dev->last_error_errno = 0;
+	dev->last_error_ioreturn = kIOReturnSuccess;
+	dev->last_error_code = HID_API_ERROR_SUCCESS;
 
 	/* Thread objects */
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
+	pthread_mutex_init(&dev->subscriptions_mutex, NULL);
+	pthread_mutex_init(&dev->changes_mutex, NULL);
+	pthread_mutex_init(&dev->capture_mutex, NULL);
 	pthread_barrier_init(&dev->barrier, NULL, 2);
 	pthread_barrier_init(&dev->shutdown_barrier, NULL, 2);
 
@@ -170,6 +876,11 @@ static void free_hid_device(hid_device *dev)
 	if (!dev)
 		return;
 
+	if (dev->input_pipe[0] >= 0) {
+		close(dev->input_pipe[0]);
+		close(dev->input_pipe[1]);
+	}
+
 	/* Delete any input reports still left over. */
 	struct input_report *rpt = dev->input_reports;
 	while (rpt) {
@@ -186,13 +897,59 @@ static void free_hid_device(hid_device *dev)
 		CFRelease(dev->run_loop_mode);
 	if (dev->source)
 		CFRelease(dev->source);
+	if (dev->batch_timer) {
+		CFRunLoopTimerInvalidate(dev->batch_timer);
+		CFRelease(dev->batch_timer);
+	}
+	if (dev->window_timer) {
+		CFRunLoopTimerInvalidate(dev->window_timer);
+		CFRelease(dev->window_timer);
+	}
 	free(dev->input_report_buf);
+	free(dev->subscriptions);
+	if (dev->latest_reports) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			struct latest_report *slot = dev->latest_reports[i];
+			while (slot) {
+				struct latest_report *retired = slot->retired;
+				free(slot);
+				slot = retired;
+			}
+		}
+		free(dev->latest_reports);
+	}
+	if (dev->change_filters) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			free(dev->change_filters[i].data);
+			free(dev->change_filters[i].mask);
+		}
+		free(dev->change_filters);
+	}
+	if (dev->decimators) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			if (dev->decimators[i]) {
+				free(dev->decimators[i]->window);
+				free(dev->decimators[i]);
+			}
+		}
+		free(dev->decimators);
+	}
+	if (dev->broadcast)
+		free_broadcast_ring(dev->broadcast);
+	if (dev->capture)
+		close_capture_file(dev->capture);
 
 	/* Clean up the thread objects */
 	pthread_barrier_destroy(&dev->shutdown_barrier);
 	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
+	pthread_mutex_destroy(&dev->subscriptions_mutex);
+	pthread_mutex_destroy(&dev->changes_mutex);
+	pthread_mutex_destroy(&dev->capture_mutex);
 
 	/* Free the structure itself. */
 	free(dev);
@@ -285,6 +1042,47 @@ static int get_string_property(IOHIDDeviceRef device, CFStringRef prop, wchar_t
 
 }
 
+/* Same as get_string_property(), as UTF-8 (len is in bytes).
+   CFStringGetBytes() only converts whole characters, so a truncated
+   string never ends with a partial multi-byte sequence. */
+static int get_string_property_utf8(IOHIDDeviceRef device, CFStringRef prop, char *buf, size_t len)
+{
+	CFStringRef str;
+
+	if (!len)
+		return 0;
+
+	str = (CFStringRef) IOHIDDeviceGetProperty(device, prop);
+
+	buf[0] = 0;
+
+	if (str) {
+		CFRange range;
+		CFIndex used_buf_len = 0;
+		CFIndex chars_copied;
+
+		range.location = 0;
+		range.length = CFStringGetLength(str);
+		chars_copied = CFStringGetBytes(str,
+			range,
+			kCFStringEncodingUTF8,
+			(char) '?',
+			FALSE,
+			(UInt8*)buf,
+			len - 1,
+			&used_buf_len);
+
+		if (chars_copied <= 0)
+			buf[0] = 0;
+		else
+			buf[used_buf_len] = 0;
+
+		return 0;
+	}
+	else
+		return -1;
+}
+
 static int get_serial_number(IOHIDDeviceRef device, wchar_t *buf, size_t len)
 {
 	return get_string_property(device, CFSTR(kIOHIDSerialNumberKey), buf, len);
@@ -301,6 +1099,77 @@ static int get_product_string(IOHIDDeviceRef device, wchar_t *buf, size_t len)
 }
 
 
+static hid_bus_type get_bus_type(IOHIDDeviceRef device)
+{
+	/* The values of kIOHIDTransportKey */
+	CFTypeRef transport = IOHIDDeviceGetProperty(device, CFSTR(kIOHIDTransportKey));
+
+	if (transport == NULL || CFGetTypeID(transport) != CFStringGetTypeID())
+		return HID_API_BUS_UNKNOWN;
+
+	if (CFStringCompare((CFStringRef) transport, CFSTR("USB"), 0) == kCFCompareEqualTo)
+		return HID_API_BUS_USB;
+	/* "Bluetooth" and "Bluetooth Low Energy" */
+	if (CFStringHasPrefix((CFStringRef) transport, CFSTR("Bluetooth")))
+		return HID_API_BUS_BLUETOOTH;
+	if (CFStringCompare((CFStringRef) transport, CFSTR("I2C"), 0) == kCFCompareEqualTo)
+		return HID_API_BUS_I2C;
+	if (CFStringCompare((CFStringRef) transport, CFSTR("SPI"), 0) == kCFCompareEqualTo)
+		return HID_API_BUS_SPI;
+
+	return HID_API_BUS_UNKNOWN;
+}
+
+/* We can only retrieve the interface number for USB HID devices.
+ * IOKit always seems to return 0 when querying a standard USB device
+ * for its interface. */
+static int get_interface_number(IOHIDDeviceRef device)
+{
+	int is_usb_hid = get_int_property(device, CFSTR(kUSBInterfaceClass)) == kUSBHIDClass;
+	if (is_usb_hid) {
+		/* Get the interface number */
+		return get_int_property(device, CFSTR(kUSBInterfaceNumber));
+	}
+
+	return -1;
+}
+
+/* The predicates of a hid_filter. A NULL filter matches everything. */
+static int filter_match_usage(const struct hid_filter *filter, int32_t usage_page, int32_t usage)
+{
+	return !filter ||
+		((filter->usage_page == 0 || filter->usage_page == usage_page) &&
+		 (filter->usage == 0 || filter->usage == usage));
+}
+
+static int filter_match_interface(const struct hid_filter *filter, int interface_number)
+{
+	return !filter || !filter->match_interface_number || filter->interface_number == interface_number;
+}
+
+static int filter_match_bus(const struct hid_filter *filter, hid_bus_type bus_type)
+{
+	return !filter || filter->bus_type == HID_API_BUS_UNKNOWN || filter->bus_type == bus_type;
+}
+
+static int filter_match_serial(const struct hid_filter *filter, IOHIDDeviceRef device)
+{
+	char serial_number[256 * 4];
+	size_t len;
+
+	if (!filter || !filter->serial_number_prefix)
+		return 1;
+
+	len = strlen(filter->serial_number_prefix);
+	if (len >= sizeof(serial_number))
+		return 0;
+	/* Only the prefix needs to be converted */
+	if (get_string_property_utf8(device, CFSTR(kIOHIDSerialNumberKey), serial_number, len + 1) < 0)
+		return 0;
+
+	return strncmp(serial_number, filter->serial_number_prefix, len) == 0;
+}
+
 /* Implementation of wcsdup() for Mac. */
 static wchar_t *dup_wcs(const wchar_t *s)
 {
@@ -311,20 +1180,37 @@ static wchar_t *dup_wcs(const wchar_t *s)
 	return ret;
 }
 
-/* Initialize the IOHIDManager. Return 0 for success and -1 for failure. */
-static int init_hid_manager(void)
+/* Returns the context to use for ctx (NULL is the default one). */
+static hid_context *resolve_context(hid_context *ctx)
+{
+	return ctx? ctx: &default_context;
+}
+
+/* Initialize the IOHIDManager of ctx. Return 0 for success and -1 for failure. */
+static int init_hid_manager(hid_context *ctx)
 {
 	/* Initialize all the HID Manager Objects */
-	hid_mgr = IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone);
-	if (hid_mgr) {
-		IOHIDManagerSetDeviceMatching(hid_mgr, NULL);
-		IOHIDManagerScheduleWithRunLoop(hid_mgr, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+	ctx->hid_mgr = IOHIDManagerCreate(kCFAllocatorDefault, kIOHIDOptionsTypeNone);
+	if (ctx->hid_mgr) {
+		IOHIDManagerSetDeviceMatching(ctx->hid_mgr, NULL);
+		IOHIDManagerScheduleWithRunLoop(ctx->hid_mgr, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
 		return 0;
 	}
 
 	return -1;
 }
 
+/* Closes the IOHIDManager of ctx, if it has one. */
+static void close_hid_manager(hid_context *ctx)
+{
+	if (ctx->hid_mgr) {
+		/* Close the HID manager. */
+		IOHIDManagerClose(ctx->hid_mgr, kIOHIDOptionsTypeNone);
+		CFRelease(ctx->hid_mgr);
+		ctx->hid_mgr = NULL;
+	}
+}
+
 HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
 {
 	return &api_version;
@@ -335,33 +1221,82 @@ HID_API_EXPORT const char* HID_API_CALL hid_version_str()
 	return HID_API_VERSION_STR;
 }
 
-/* Initialize the IOHIDManager if necessary. This is the public function, and
-   it is safe to call this function repeatedly. Return 0 for success and -1
-   for failure. */
-int HID_API_EXPORT hid_init(void)
+/* What hid_init() does, for any context. The process-wide settings
+   are made with the IOHIDManager of the default context. */
+static int init_context(hid_context *ctx)
 {
-	if (!hid_mgr) {
+	/* indicate no error */
+	register_global_error(ctx, NULL);
+
+	if (!default_context.hid_mgr) {
 		is_macos_10_10_or_greater = (NSAppKitVersionNumber >= 1343); /* NSAppKitVersionNumber10_10 */
 		hid_darwin_set_open_exclusive(1); /* Backward compatibility */
-		return init_hid_manager();
+		if (init_hid_manager(&default_context) < 0) {
+			register_global_error(ctx, "Failed to create IOHIDManager");
+			return -1;
+		}
+	}
+
+	if (!ctx->hid_mgr && init_hid_manager(ctx) < 0) {
+		register_global_error(ctx, "Failed to create IOHIDManager");
+		return -1;
 	}
 
-	/* Already initialized. */
 	return 0;
 }
 
+/* Initialize the IOHIDManager if necessary. This is the public function, and
+   it is safe to call this function repeatedly. Return 0 for success and -1
+   for failure. */
+int HID_API_EXPORT hid_init(void)
+{
+	return init_context(&default_context);
+}
+
 int HID_API_EXPORT hid_exit(void)
 {
-	if (hid_mgr) {
-		/* Close the HID manager. */
-		IOHIDManagerClose(hid_mgr, kIOHIDOptionsTypeNone);
-		CFRelease(hid_mgr);
-		hid_mgr = NULL;
-	}
+	close_hid_manager(&default_context);
+
+	/* Free the global error message of this thread
+	   (the ones of other threads are freed when they exit) */
+	register_global_error(&default_context, NULL);
 
 	return 0;
 }
 
+hid_context * HID_API_EXPORT hid_context_create(const struct hid_context_options *opts)
+{
+	hid_context *ctx;
+
+	(void) opts;
+
+	ctx = (hid_context*) calloc(1, sizeof(hid_context));
+	if (!ctx) {
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "Couldn't allocate the context");
+		return NULL;
+	}
+
+	if (init_context(ctx) < 0) {
+		close_hid_manager(ctx);
+		free(ctx->error.str);
+		free(ctx);
+		register_global_error(&default_context, "Failed to create IOHIDManager");
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void HID_API_EXPORT hid_context_destroy(hid_context *ctx)
+{
+	if (!ctx || ctx == &default_context)
+		return;
+
+	close_hid_manager(ctx);
+	free(ctx->error.str);
+	free(ctx);
+}
+
 static void process_pending_events(void) {
 	SInt32 res;
 	do {
@@ -375,6 +1310,7 @@ static struct hid_device_info *create_device_info_with_usage(IOHIDDeviceRef dev,
 	unsigned short dev_pid;
 	int BUF_LEN = 256;
 	wchar_t buf[BUF_LEN];
+	char buf_utf8[BUF_LEN * 4];
 
 	struct hid_device_info *cur_dev;
 	io_object_t iokit_dev;
@@ -434,6 +1370,14 @@ static struct hid_device_info *create_device_info_with_usage(IOHIDDeviceRef dev,
 	get_product_string(dev, buf, BUF_LEN);
 	cur_dev->product_string = dup_wcs(buf);
 
+	/* The same strings, as UTF-8 */
+	get_string_property_utf8(dev, CFSTR(kIOHIDSerialNumberKey), buf_utf8, sizeof(buf_utf8));
+	cur_dev->serial_number_utf8 = strdup(buf_utf8);
+	get_string_property_utf8(dev, CFSTR(kIOHIDManufacturerKey), buf_utf8, sizeof(buf_utf8));
+	cur_dev->manufacturer_string_utf8 = strdup(buf_utf8);
+	get_string_property_utf8(dev, CFSTR(kIOHIDProductKey), buf_utf8, sizeof(buf_utf8));
+	cur_dev->product_string_utf8 = strdup(buf_utf8);
+
 	/* VID/PID */
 	cur_dev->vendor_id = dev_vid;
 	cur_dev->product_id = dev_pid;
@@ -442,31 +1386,29 @@ static struct hid_device_info *create_device_info_with_usage(IOHIDDeviceRef dev,
 	cur_dev->release_number = get_int_property(dev, CFSTR(kIOHIDVersionNumberKey));
 
 	/* Interface Number */
-	/* We can only retrieve the interface number for USB HID devices.
-	 * IOKit always seems to return 0 when querying a standard USB device
-	 * for its interface. */
-	int is_usb_hid = get_int_property(dev, CFSTR(kUSBInterfaceClass)) == kUSBHIDClass;
-	if (is_usb_hid) {
-		/* Get the interface number */
-		cur_dev->interface_number = get_int_property(dev, CFSTR(kUSBInterfaceNumber));
-	} else {
-		cur_dev->interface_number = -1;
-	}
+	cur_dev->interface_number = get_interface_number(dev);
+
+	/* Bus Type */
+	cur_dev->bus_type = get_bus_type(dev);
 
 	return cur_dev;
 }
 
-static struct hid_device_info *create_device_info(IOHIDDeviceRef device)
+/* Creates a record for each usage pair of the device matching the filter.
+   Returns the first one, or NULL if none matches. */
+static struct hid_device_info *create_device_info(IOHIDDeviceRef device, const struct hid_filter *filter)
 {
 	const int32_t primary_usage_page = get_int_property(device, CFSTR(kIOHIDPrimaryUsagePageKey));
 	const int32_t primary_usage = get_int_property(device, CFSTR(kIOHIDPrimaryUsageKey));
 
 	/* Primary should always be first, to match previous behavior. */
-	struct hid_device_info *root = create_device_info_with_usage(device, primary_usage_page, primary_usage);
-	struct hid_device_info *cur = root;
+	struct hid_device_info *root = NULL;
+	struct hid_device_info *cur = NULL;
 
-	if (!root)
-		return NULL;
+	if (filter_match_usage(filter, primary_usage_page, primary_usage)) {
+		root = create_device_info_with_usage(device, primary_usage_page, primary_usage);
+		cur = root;
+	}
 
 	CFArrayRef usage_pairs = get_usage_pairs(device);
 
@@ -491,62 +1433,155 @@ static struct hid_device_info *create_device_info(IOHIDDeviceRef device)
 			}
 			if (usage_page == primary_usage_page && usage == primary_usage)
 				continue; /* Already added. */
+			if (!filter_match_usage(filter, usage_page, usage))
+				continue;
 
 			next = create_device_info_with_usage(device, usage_page, usage);
-			cur->next = next;
-			if (next != NULL) {
-				cur = next;
-			}
+			if (next == NULL)
+				continue;
+			if (cur)
+				cur->next = next;
+			else
+				root = next;
+			cur = next;
 		}
 	}
 
 	return root;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Creates the IOHIDManager matching dictionary of a VID/PID pair,
+   and of the Usage Page and Usage of the filter. */
+static CFMutableDictionaryRef create_matching_dictionary(const struct hid_filter *filter, const struct hid_filter_id *id)
+{
+	CFMutableDictionaryRef matching = CFDictionaryCreateMutable(kCFAllocatorDefault, kIOHIDOptionsTypeNone, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	unsigned short usage_page = filter->usage_page;
+	unsigned short usage = filter->usage;
+
+	if (!matching)
+		return NULL;
+
+	if (id && id->vendor_id != 0) {
+		CFNumberRef v = CFNumberCreate(kCFAllocatorDefault, kCFNumberShortType, &id->vendor_id);
+		CFDictionarySetValue(matching, CFSTR(kIOHIDVendorIDKey), v);
+		CFRelease(v);
+	}
+
+	if (id && id->product_id != 0) {
+		CFNumberRef p = CFNumberCreate(kCFAllocatorDefault, kCFNumberShortType, &id->product_id);
+		CFDictionarySetValue(matching, CFSTR(kIOHIDProductIDKey), p);
+		CFRelease(p);
+	}
+
+	/* Matched against any of the usage pairs of the device */
+	if (usage_page != 0) {
+		CFNumberRef u = CFNumberCreate(kCFAllocatorDefault, kCFNumberShortType, &usage_page);
+		CFDictionarySetValue(matching, CFSTR(kIOHIDDeviceUsagePageKey), u);
+		CFRelease(u);
+	}
+
+	if (usage != 0) {
+		CFNumberRef u = CFNumberCreate(kCFAllocatorDefault, kCFNumberShortType, &usage);
+		CFDictionarySetValue(matching, CFSTR(kIOHIDDeviceUsageKey), u);
+		CFRelease(u);
+	}
+
+	return matching;
+}
+
+/* Where the matching records go: the callback of hid_enumerate_visit(),
+   or (if it is NULL) the list built by hid_enumerate_filtered(). */
+struct enum_sink {
+	hid_enumerate_callback callback;
+	void *user_data;
+	int result; /* Value returned by the callback which stopped */
+
+	struct hid_device_info *root;
+	struct hid_device_info *last;
+};
+
+/* Sends the records of devs (as returned by create_device_info()) to
+   the sink, which takes their ownership. Returns non-zero if the
+   enumeration must stop. */
+static int enum_sink_add(struct enum_sink *sink, struct hid_device_info *devs)
+{
+	if (sink->callback) {
+		struct hid_device_info *d;
+		for (d = devs; d && !sink->result; d = d->next) {
+			struct hid_device_info record = *d;
+			record.next = NULL;
+			sink->result = sink->callback(&record, sink->user_data);
+		}
+		hid_free_enumeration(devs);
+		return sink->result;
+	}
+
+	if (sink->last) {
+		sink->last->next = devs;
+	}
+	else {
+		sink->root = devs;
+	}
+	sink->last = devs;
+
+	/* move the pointer to the tail of returnd list */
+	while (sink->last->next != NULL) {
+		sink->last = sink->last->next;
+	}
+	return 0;
+}
+
+/* Sends the devices matching the filter to the sink, until it says
+   to stop. Returns -1 if the system couldn't be scanned. */
+static int enumerate_devices(hid_context *ctx, const struct hid_filter *filter, struct enum_sink *sink)
 {
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
 	CFIndex num_devices;
 	int i;
 
 	/* Set up the HID Manager if it hasn't been done */
-	if (hid_init() < 0)
-		return NULL;
+	if (init_context(ctx) < 0)
+		return -1;
 
 	/* give the IOHIDManager a chance to update itself */
 	process_pending_events();
 
-	/* Get a list of the Devices */
-	CFMutableDictionaryRef matching = NULL;
-	if (vendor_id != 0 || product_id != 0) {
-		matching = CFDictionaryCreateMutable(kCFAllocatorDefault, kIOHIDOptionsTypeNone, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-
-		if (matching && vendor_id != 0) {
-			CFNumberRef v = CFNumberCreate(kCFAllocatorDefault, kCFNumberShortType, &vendor_id);
-			CFDictionarySetValue(matching, CFSTR(kIOHIDVendorIDKey), v);
-			CFRelease(v);
+	/* Get a list of the Devices. The VID/PID pairs and the usage
+	   are matched by the IOHIDManager: one dictionary per pair. */
+	if (filter) {
+		CFMutableArrayRef matching = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+		size_t n = (filter->ids && filter->num_ids > 0)? filter->num_ids: 1;
+		size_t j;
+
+		for (j = 0; matching && j < n; j++) {
+			CFMutableDictionaryRef dict = create_matching_dictionary(filter, filter->ids? &filter->ids[j]: NULL);
+			if (dict) {
+				CFArrayAppendValue(matching, dict);
+				CFRelease(dict);
+			}
 		}
-
-		if (matching && product_id != 0) {
-			CFNumberRef p = CFNumberCreate(kCFAllocatorDefault, kCFNumberShortType, &product_id);
-			CFDictionarySetValue(matching, CFSTR(kIOHIDProductIDKey), p);
-			CFRelease(p);
+		IOHIDManagerSetDeviceMatchingMultiple(ctx->hid_mgr, matching);
+		if (matching != NULL) {
+			CFRelease(matching);
 		}
 	}
-	IOHIDManagerSetDeviceMatching(hid_mgr, matching);
-	if (matching != NULL) {
-		CFRelease(matching);
+	else {
+		IOHIDManagerSetDeviceMatching(ctx->hid_mgr, NULL);
 	}
 
-	CFSetRef device_set = IOHIDManagerCopyDevices(hid_mgr);
+	/* NULL when no device matches */
+	CFSetRef device_set = IOHIDManagerCopyDevices(ctx->hid_mgr);
 	if (device_set == NULL) {
-		return NULL;
+		return 0;
 	}
 
 	/* Convert the list into a C array so we can iterate easily. */
 	num_devices = CFSetGetCount(device_set);
 	IOHIDDeviceRef *device_array = (IOHIDDeviceRef*) calloc(num_devices, sizeof(IOHIDDeviceRef));
+	if (device_array == NULL) {
+		CFRelease(device_set);
+		register_global_error_code(ctx, HID_API_ERROR_NO_MEM, "hid_enumerate: out of memory");
+		return -1;
+	}
 	CFSetGetValues(device_set, (const void **) device_array);
 
 	/* Iterate over each device, making an entry for it. */
@@ -557,29 +1592,97 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 			continue;
 		}
 
-		struct hid_device_info *tmp = create_device_info(dev);
-		if (tmp == NULL) {
+		/* The rest of the filter is checked before any string
+		   is converted */
+		if (!filter_match_bus(filter, get_bus_type(dev)) ||
+		    !filter_match_interface(filter, get_interface_number(dev)) ||
+		    !filter_match_serial(filter, dev)) {
 			continue;
 		}
 
-		if (cur_dev) {
-			cur_dev->next = tmp;
-		}
-		else {
-			root = tmp;
+		struct hid_device_info *tmp = create_device_info(dev, filter);
+		if (tmp == NULL) {
+			continue;
 		}
-		cur_dev = tmp;
 
-		/* move the pointer to the tail of returnd list */
-		while (cur_dev->next != NULL) {
-			cur_dev = cur_dev->next;
+		if (enum_sink_add(sink, tmp)) {
+			break;
 		}
 	}
 
 	free(device_array);
 	CFRelease(device_set);
 
-	return root;
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_context_enumerate(hid_context *ctx, const struct hid_filter *filter)
+{
+	struct enum_sink sink; /* return object */
+
+	ctx = resolve_context(ctx);
+
+	memset(&sink, 0, sizeof(sink));
+	if (enumerate_devices(ctx, filter, &sink) < 0)
+		return NULL;
+
+	if (sink.root == NULL) {
+		if (!filter) {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "No HID devices found in the system.");
+		} else {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, "No HID devices matching the filter found in the system.");
+		}
+	}
+
+	return sink.root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_filtered(const struct hid_filter *filter)
+{
+	return hid_context_enumerate(NULL, filter);
+}
+
+int HID_API_EXPORT hid_context_enumerate_visit(hid_context *ctx, const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct enum_sink sink;
+
+	ctx = resolve_context(ctx);
+
+	if (!callback) {
+		register_global_error_code(ctx, HID_API_ERROR_INVALID_PARAM, "hid_enumerate_visit: NULL callback");
+		return -1;
+	}
+
+	memset(&sink, 0, sizeof(sink));
+	sink.callback = callback;
+	sink.user_data = user_data;
+
+	if (enumerate_devices(ctx, filter, &sink) < 0)
+		return -1;
+
+	return sink.result;
+}
+
+int HID_API_EXPORT hid_enumerate_visit(const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	return hid_context_enumerate_visit(NULL, filter, callback, user_data);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_filter_id id;
+	struct hid_filter filter;
+
+	if (vendor_id == 0 && product_id == 0)
+		return hid_enumerate_filtered(NULL);
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	return hid_enumerate_filtered(&filter);
 }
 
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
@@ -592,47 +1695,79 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 		free(d->serial_number);
 		free(d->manufacturer_string);
 		free(d->product_string);
+		free(d->serial_number_utf8);
+		free(d->manufacturer_string_utf8);
+		free(d->product_string_utf8);
 		free(d);
 		d = next;
 	}
 }
 
-hid_device * HID_API_EXPORT hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+/* State of hid_open(), see open_visitor() */
+struct open_search {
+	unsigned short vendor_id;
+	unsigned short product_id;
+	const wchar_t *serial_number;
+	char *path; /* The path of the device found */
+};
+
+/* Stops at the first device matching the hid_open() arguments */
+static int open_visitor(const struct hid_device_info *info, void *user_data)
 {
-	/* This function is identical to the Linux version. Platform independent. */
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
+	struct open_search *search = (struct open_search*) user_data;
+
+	if (info->vendor_id != search->vendor_id ||
+	    info->product_id != search->product_id)
+		return 0;
+
+	if (search->serial_number &&
+	    (!info->serial_number || wcscmp(search->serial_number, info->serial_number) != 0))
+		return 0;
+
+	search->path = strdup(info->path);
+	return 1;
+}
+
+hid_device * HID_API_EXPORT hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct open_search search;
+	struct hid_filter_id id;
+	struct hid_filter filter;
 	hid_device * handle = NULL;
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
+	search.vendor_id = vendor_id;
+	search.product_id = product_id;
+	search.serial_number = serial_number;
+	search.path = NULL;
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	/* register_global_error: global error is reset by hid_context_enumerate_visit */
+	if (hid_context_enumerate_visit(ctx, &filter, open_visitor, &search) < 0) {
+		/* register_global_error: global error is already set by hid_context_enumerate_visit */
+		return NULL;
 	}
 
-	if (path_to_open) {
+	if (search.path) {
 		/* Open the device */
-		handle = hid_open_path(path_to_open);
+		handle = hid_context_open_path(ctx, search.path);
+		free(search.path);
+	} else {
+		register_global_error_code(resolve_context(ctx), HID_API_ERROR_NOT_FOUND, "Device with requested VID/PID/(SerialNumber) not found");
 	}
 
-	hid_free_enumeration(devs);
-
 	return handle;
 }
 
+hid_device * HID_API_EXPORT hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	return hid_context_open(NULL, vendor_id, product_id, serial_number);
+}
+
 static void hid_device_removal_callback(void *context, IOReturn result,
                                         void *sender)
 {
@@ -646,30 +1781,345 @@ static void hid_device_removal_callback(void *context, IOReturn result,
 	CFRunLoopStop(d->run_loop);
 }
 
-/* The Run Loop calls this function for each input report received.
-   This function puts the data into a linked list to be picked up by
-   hid_read(). */
-static void hid_report_callback(void *context, IOReturn result, void *sender,
-                         IOHIDReportType report_type, uint32_t report_id,
-                         uint8_t *report, CFIndex report_length)
+/* Passes a report to the callback subscribed to its Report ID, if any.
+   Returns 1 if the callback consumed the report. */
+static int dispatch_subscribed_report(hid_device *dev, const unsigned char *data, size_t length)
 {
-	(void) result;
-	(void) sender;
-	(void) report_type;
-	(void) report_id;
+	int consumed = 0;
+
+	if (length == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (dev->subscriptions && dev->subscriptions[data[0]].callback) {
+		dev->subscriptions[data[0]].callback(dev, data, length, dev->subscriptions[data[0]].user_data);
+		consumed = 1;
+	}
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	return consumed;
+}
+
+/* Returns non-zero if a and b differ in the bits set in mask.
+   Compares 16 bytes at a time where the CPU allows it. */
+static int masked_reports_differ(const unsigned char *a, const unsigned char *b, const unsigned char *mask, size_t length)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= length; i += 16) {
+		__m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *) (mask + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+			return 1;
+	}
+#elif defined(__aarch64__)
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		if (vmaxvq_u8(vandq_u8(diff, vld1q_u8(mask + i))))
+			return 1;
+	}
+#endif
+	for (; i < length; i++) {
+		if ((a[i] ^ b[i]) & mask[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* In changes-only mode, returns 1 if the report is the same as the
+   previous one of its Report ID, to be dropped. Otherwise the report
+   becomes the previous one and 0 is returned. Locks
+   dev->changes_mutex. */
+static int drop_unchanged_report(hid_device *dev, int report_id, const unsigned char *data, size_t length)
+{
+	struct change_filter *filter;
+	int unchanged = 0;
+
+	if (length == 0)
+		return 0;
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (!dev->changes_only)
+		goto out;
+
+	filter = &dev->change_filters[report_id];
+	if (filter->len == length) {
+		size_t masked = (filter->mask_len < length)? filter->mask_len: length;
+
+		/* The unmasked rest goes to memcmp(), vectorized by the C library */
+		if (!masked_reports_differ(filter->data, data, filter->mask, masked) &&
+		    memcmp(filter->data + masked, data + masked, length - masked) == 0) {
+			dev->unchanged_count++;
+			unchanged = 1;
+			goto out;
+		}
+	}
+
+	if (length > filter->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(filter->data, length);
+		if (!buf) {
+			/* Deliver every report of this Report ID instead */
+			filter->len = 0;
+			goto out;
+		}
+		filter->data = buf;
+		filter->capacity = length;
+	}
+	memcpy(filter->data, data, length);
+	filter->len = length;
+
+out:
+	pthread_mutex_unlock(&dev->changes_mutex);
+	return unchanged;
+}
+
+/* The time in milliseconds */
+static uint64_t get_milliseconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000 + (uint64_t) tv.tv_usec / 1000;
+}
+
+/* Arms window_timer for a window ending at window_end, unless another
+   one ends first. Called on the run loop with dev->changes_mutex
+   locked. */
+static void schedule_window(hid_device *dev, uint64_t window_end)
+{
+	uint64_t now;
+
+	if (dev->window_due && dev->window_due <= window_end)
+		return;
+
+	dev->window_due = window_end;
+	now = get_milliseconds();
+	CFRunLoopTimerSetNextFireDate(dev->window_timer,
+		CFAbsoluteTimeGetCurrent() + (window_end > now? window_end - now: 0) / 1000.0);
+}
+
+/* Passes a report through the decimation stage of its Report ID, if
+   any. Returns 1 if nothing is to be delivered. Otherwise the report to
+   deliver is in data: in the window modes it is the report of the
+   window which this one closes, the two being swapped within the
+   capacity of data. Locks
+   dev->changes_mutex. */
+static int decimate_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	struct report_decimator *d;
+	uint64_t now;
+	int drop = 0;
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	d = dev->decimators? dev->decimators[report_id]: NULL;
+	if (!d || *length == 0)
+		goto out;
+
+	if (d->config.mode == HID_DECIMATE_EVERY_NTH) {
+		drop = (d->skipped != 0);
+		if (++d->skipped >= d->config.every)
+			d->skipped = 0;
+		goto out;
+	}
+
+	if (*length > d->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(d->window, *length);
+		if (!buf)
+			goto out; /* Deliver it as is */
+		d->window = buf;
+		d->capacity = *length;
+	}
+
+	now = get_milliseconds();
+	if (d->window_len && now >= d->window_end) {
+		/* Deliver the window, and start the next one with this report */
+		size_t window_len = (d->window_len < capacity)? d->window_len: capacity;
+		size_t n = (*length > window_len)? *length: window_len;
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			unsigned char c = data[i];
+			data[i] = d->window[i];
+			d->window[i] = c;
+		}
+		d->window_len = *length;
+		*length = window_len;
+		d->window_count = 0;
+		d->window_end = now + d->config.window_ms;
+		schedule_window(dev, d->window_end);
+	}
+	else {
+		drop = 1;
+		if (!d->window_len) {
+			d->window_count = 0;
+			d->window_end = now + d->config.window_ms;
+			schedule_window(dev, d->window_end);
+		}
+		if (!d->window_len || d->config.mode == HID_DECIMATE_WINDOW_LATEST) {
+			memcpy(d->window, data, *length);
+			d->window_len = *length;
+		}
+	}
+
+	if (d->config.mode == HID_DECIMATE_WINDOW_REDUCE) {
+		/* The first report of a window is in the window already */
+		if (d->window_count == 0)
+			d->config.reducer(d->window, d->window_len, d->window, d->window_len, 0, d->config.user_data);
+		else
+			d->config.reducer(d->window, d->window_len, data, *length, d->window_count, d->config.user_data);
+	}
+	d->window_count++;
+
+out:
+	pthread_mutex_unlock(&dev->changes_mutex);
+	return drop;
+}
+
+/* The stages between the arrival of a report and its delivery:
+   changes-only mode, then decimation. Returns 1 if the report is
+   dropped. *length changes when a window is delivered instead. */
+static int filter_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	return drop_unchanged_report(dev, report_id, data, *length) ||
+	       decimate_report(dev, report_id, data, length, capacity);
+}
+
+/* Replaces the report in the slot of its Report ID. Only
+   called by hid_input_report_callback(). */
+static void store_latest_report(hid_device *dev, uint32_t report_id, const unsigned char *data, size_t length)
+{
+	struct latest_report *slot = dev->latest_reports[report_id & 0xff];
+
+	if (!slot || length > slot->capacity) {
+		/* The first report of this Report ID, or a longer one than
+		   the slot holds: publish a bigger slot. Readers may still be
+		   copying from the old one, which is kept until hid_close(). */
+		struct latest_report *bigger;
+		size_t capacity = length;
+
+		if (slot && capacity < 2 * slot->capacity)
+			capacity = 2 * slot->capacity;
+		bigger = (struct latest_report*) malloc(sizeof(struct latest_report) + capacity);
+		if (!bigger)
+			return;
+		bigger->seq = 0;
+		bigger->len = 0;
+		bigger->capacity = capacity;
+		bigger->data = (unsigned char*) (bigger + 1);
+		bigger->retired = slot;
+		__atomic_store_n(&dev->latest_reports[report_id & 0xff], bigger, __ATOMIC_RELEASE);
+		slot = bigger;
+	}
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->len, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the report of a slot, without blocking its writer. */
+static int load_latest_report(struct latest_report *slot, unsigned char *data, size_t length)
+{
+	unsigned int seq;
+	size_t len;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue; /* Being written */
+
+		len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return (int) len;
+	}
+}
+
+/* Called with dev->mutex locked when a report was queued. Returns 1 if
+   the waiting threads are to be woken up now, or 0 if the report waits
+   for the rest of its batch (see hid_set_batching()). Only called on
+   the run loop of the read thread. */
+static int batch_report_queued(hid_device *dev, int queue_was_empty)
+{
+	if (dev->batch_reports <= 1)
+		return 1;
+
+	/* Nobody waits while the queue holds announced reports */
+	if (!queue_was_empty && !dev->batch_pending)
+		return 1;
+
+	if (dev->batch_pending++ == 0)
+		CFRunLoopTimerSetNextFireDate(dev->batch_timer, CFAbsoluteTimeGetCurrent() + dev->batch_delay_us / 1000000.0);
+	if (dev->batch_pending < dev->batch_reports)
+		return 0;
+
+	dev->batch_pending = 0;
+	return 1;
+}
+
+/* Fires on the run loop of the read thread when a batch is due. */
+static void batch_timer_callback(CFRunLoopTimerRef timer, void *info)
+{
+	hid_device *dev = (hid_device*) info;
+	(void) timer;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->batch_pending) {
+		dev->batch_pending = 0;
+		pthread_cond_broadcast(&dev->condition);
+		update_input_fd(dev);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+}
 
+/* Passes a report which went through filter_report() on to its
+   subscribed callback, its latest slot, the broadcast ring or the queue
+   of hid_read(). Only called on the run loop of the read thread. */
+static void deliver_report(hid_device *dev, uint32_t report_id, const unsigned char *report, size_t length)
+{
 	struct input_report *rpt;
-	hid_device *dev = (hid_device*) context;
+	int queue_was_empty;
+
+	/* Subscribed reports bypass the queue */
+	if (dispatch_subscribed_report(dev, report, length))
+		return;
+
+	/* In latest mode the report replaces the previous one instead */
+	if (__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		store_latest_report(dev, report_id, report, length);
+		return;
+	}
+
+	/* In broadcast mode it goes to the ring instead. The ring is
+	   only replaced under the mutex. */
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&dev->mutex);
+		if (dev->broadcast) {
+			store_broadcast_report(dev->broadcast, report, length);
+			pthread_mutex_unlock(&dev->mutex);
+			return;
+		}
+		pthread_mutex_unlock(&dev->mutex);
+	}
 
 	/* Make a new Input Report object */
 	rpt = (struct input_report*) calloc(1, sizeof(struct input_report));
-	rpt->data = (uint8_t*) calloc(1, report_length);
-	memcpy(rpt->data, report, report_length);
-	rpt->len = report_length;
+	rpt->data = (uint8_t*) calloc(1, length);
+	memcpy(rpt->data, report, length);
+	rpt->len = length;
 	rpt->next = NULL;
 
 	/* Lock this section */
 	pthread_mutex_lock(&dev->mutex);
+	rpt->seq = ++dev->report_seq;
+	queue_was_empty = (dev->input_reports == NULL);
 
 	/* Attach the new report object to the end of the list. */
 	if (dev->input_reports == NULL) {
@@ -694,12 +2144,84 @@ static void hid_report_callback(void *context, IOReturn result, void *sender,
 		}
 	}
 
-	/* Signal a waiting thread that there is data. */
-	pthread_cond_signal(&dev->condition);
+	/* Signal the waiting threads that there is data. hid_transact()
+	   waits for a particular report, so wake all of them. */
+	if (batch_report_queued(dev, queue_was_empty)) {
+		pthread_cond_broadcast(&dev->condition);
+		update_input_fd(dev);
+	}
 
 	/* Unlock */
 	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* The Run Loop calls this function for each input report received.
+   This function puts the data into a linked list to be picked up by
+   hid_read(). */
+static void hid_input_report_callback(void *context, IOReturn result, void *sender,
+                               IOHIDReportType report_type, uint32_t report_id,
+                               uint8_t *report, CFIndex report_length)
+{
+	(void) result;
+	(void) sender;
+	(void) report_type;
+
+	hid_device *dev = (hid_device*) context;
+	size_t length = (size_t) report_length;
+
+	capture_report(dev, HID_CAPTURE_INPUT, report, length);
+
+	/* Repeated and decimated reports go no further. The report is in
+	   input_report_buf, which has room for the largest one. */
+	if (filter_report(dev, report_id & 0xff, report, &length, (size_t) dev->max_input_report_len))
+		return;
+
+	deliver_report(dev, report_id, report, length);
+}
+
+/* Fires on the run loop of the read thread when a window of the
+   decimation stages ends: delivers the windows which ended, instead
+   of waiting for the next report of their Report ID. */
+static void window_timer_callback(CFRunLoopTimerRef timer, void *info)
+{
+	hid_device *dev = (hid_device*) info;
+	(void) timer;
+
+	for (;;) {
+		uint64_t now = get_milliseconds();
+		unsigned char *window = NULL;
+		size_t window_len = 0;
+		int report_id = 0;
+		int i;
+
+		/* Take the windows out one at a time, the delivery may
+		   call a subscribed callback */
+		pthread_mutex_lock(&dev->changes_mutex);
+		dev->window_due = 0;
+		for (i = 0; dev->decimators && i < 256; i++) {
+			struct report_decimator *d = dev->decimators[i];
+			if (!d || !d->window_len)
+				continue;
+			if (!window && now >= d->window_end) {
+				window = (unsigned char*) malloc(d->window_len);
+				if (window) {
+					memcpy(window, d->window, d->window_len);
+					window_len = d->window_len;
+					report_id = i;
+				}
+				d->window_len = 0;
+			}
+			else {
+				schedule_window(dev, d->window_end);
+			}
+		}
+		pthread_mutex_unlock(&dev->changes_mutex);
 
+		if (!window)
+			break;
+		deliver_report(dev, (uint32_t) report_id, window, window_len);
+		free(window);
+	}
 }
 
 /* This gets called when the read_thread's run loop gets signaled by
@@ -728,6 +2250,18 @@ static void *read_thread(void *param)
 	dev->source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0/*order*/, &ctx);
 	CFRunLoopAddSource(CFRunLoopGetCurrent(), dev->source, dev->run_loop_mode);
 
+	/* Create the timer of hid_set_batching(). It is only armed (with
+	   CFRunLoopTimerSetNextFireDate()) while reports are held back. */
+	CFRunLoopTimerContext timer_ctx;
+	memset(&timer_ctx, 0, sizeof(timer_ctx));
+	timer_ctx.info = dev;
+	dev->batch_timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + 1.0e10, 1.0e10, 0, 0, &batch_timer_callback, &timer_ctx);
+	CFRunLoopAddTimer(CFRunLoopGetCurrent(), dev->batch_timer, dev->run_loop_mode);
+
+	/* Same for the windows of hid_set_decimation(), see schedule_window() */
+	dev->window_timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + 1.0e10, 1.0e10, 0, 0, &window_timer_callback, &timer_ctx);
+	CFRunLoopAddTimer(CFRunLoopGetCurrent(), dev->window_timer, dev->run_loop_mode);
+
 	/* Store off the Run Loop so it can be stopped from hid_close()
 	   and on device disconnection. */
 	dev->run_loop = CFRunLoopGetCurrent();
@@ -736,7 +2270,7 @@ static void *read_thread(void *param)
 	pthread_barrier_wait(&dev->barrier);
 
 	/* Run the Event Loop. CFRunLoopRunInMode() will dispatch HID input
-	   reports into the hid_report_callback(). */
+	   reports into the hid_input_report_callback(). */
 	while (!dev->shutdown_thread && !dev->disconnected) {
 		code = CFRunLoopRunInMode(dev->run_loop_mode, 1000/*sec*/, FALSE);
 		/* Return if the device has been disconnected */
@@ -764,6 +2298,9 @@ static void *read_thread(void *param)
 	   signaled. */
 	pthread_mutex_lock(&dev->mutex);
 	pthread_cond_broadcast(&dev->condition);
+	update_input_fd(dev);
+	if (dev->broadcast)
+		wake_broadcast_readers(dev->broadcast);
 	pthread_mutex_unlock(&dev->mutex);
 
 	/* Wait here until hid_close() is called and makes it past
@@ -801,22 +2338,30 @@ static io_registry_entry_t hid_open_service_registry_from_path(const char *path)
 	return MACH_PORT_NULL;
 }
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
 {
 	hid_device *dev = NULL;
 	io_registry_entry_t entry = MACH_PORT_NULL;
 	IOReturn ret = kIOReturnInvalid;
 
+	ctx = resolve_context(ctx);
+
 	/* Set up the HID Manager if it hasn't been done */
-	if (hid_init() < 0)
+	if (init_context(ctx) < 0)
 		goto return_error;
+	/* register_global_error: global error is reset by init_context */
 
 	dev = new_hid_device();
+	if (!dev) {
+		register_global_error_code(ctx, HID_API_ERROR_NO_MEM, "hid_open_path: out of memory");
+		goto return_error;
+	}
 
 	/* Get the IORegistry entry for the given path */
 	entry = hid_open_service_registry_from_path(path);
 	if (entry == MACH_PORT_NULL) {
 		/* Path wasn't valid (maybe device was removed?) */
+		register_global_error_format(ctx, HID_API_ERROR_NOT_FOUND, "Failed to open a device with path '%s': no such IORegistry entry", path);
 		goto return_error;
 	}
 
@@ -824,6 +2369,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	dev->device_handle = IOHIDDeviceCreate(kCFAllocatorDefault, entry);
 	if (dev->device_handle == NULL) {
 		/* Error creating the HID device */
+		register_global_error_format(ctx, HID_API_ERROR_IO, "Failed to open a device with path '%s': IOHIDDeviceCreate failed", path);
 		goto return_error;
 	}
 
@@ -845,7 +2391,7 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 		/* Attach the device to a Run Loop */
 		IOHIDDeviceRegisterInputReportCallback(
 			dev->device_handle, dev->input_report_buf, dev->max_input_report_len,
-			&hid_report_callback, dev);
+			&hid_input_report_callback, dev);
 		IOHIDDeviceRegisterRemovalCallback(dev->device_handle, hid_device_removal_callback, dev);
 
 		/* Start the read thread */
@@ -858,11 +2404,12 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 		return dev;
 	}
 	else {
+		register_global_error_format(ctx, ioreturn_to_error_code(ret), "Failed to open a device with path '%s': %s (0x%08X)", path, mach_error_string(ret), (unsigned int) ret);
 		goto return_error;
 	}
 
 return_error:
-	if (dev->device_handle != NULL)
+	if (dev && dev->device_handle != NULL)
 		CFRelease(dev->device_handle);
 
 	if (entry != MACH_PORT_NULL)
@@ -880,6 +2427,7 @@ static int set_report(hid_device *dev, IOHIDReportType type, const unsigned char
 	unsigned char report_id;
 
 	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
 		return -1;
 	}
 
@@ -894,6 +2442,7 @@ static int set_report(hid_device *dev, IOHIDReportType type, const unsigned char
 
 	/* Avoid crash if the device has been unplugged. */
 	if (dev->disconnected) {
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "Device is disconnected");
 		return -1;
 	}
 
@@ -903,9 +2452,12 @@ static int set_report(hid_device *dev, IOHIDReportType type, const unsigned char
 	                           data_to_send, length_to_send);
 
 	if (res == kIOReturnSuccess) {
+		capture_report(dev, type == kIOHIDReportTypeFeature? HID_CAPTURE_FEATURE_SET: HID_CAPTURE_OUTPUT, data, length);
+		register_device_error(dev, NULL);
 		return (int) length;
 	}
 
+	register_device_error_ioreturn(dev, "IOHIDDeviceSetReport failed", res);
 	return -1;
 }
 
@@ -914,7 +2466,14 @@ static int get_report(hid_device *dev, IOHIDReportType type, unsigned char *data
 	unsigned char *report = data;
 	CFIndex report_length = length;
 	IOReturn res = kIOReturnSuccess;
-	const unsigned char report_id = data[0];
+	unsigned char report_id;
+
+	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	report_id = data[0];
 
 	if (report_id == 0x0) {
 		/* Not using numbered Reports.
@@ -925,6 +2484,7 @@ static int get_report(hid_device *dev, IOHIDReportType type, unsigned char *data
 
 	/* Avoid crash if the device has been unplugged. */
 	if (dev->disconnected) {
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "Device is disconnected");
 		return -1;
 	}
 
@@ -937,9 +2497,12 @@ static int get_report(hid_device *dev, IOHIDReportType type, unsigned char *data
 		if (report_id == 0x0) { /* 0 report number still present at the beginning */
 			report_length++;
 		}
+		capture_report(dev, type == kIOHIDReportTypeFeature? HID_CAPTURE_FEATURE_GET: HID_CAPTURE_INPUT_GET, data, (size_t) report_length);
+		register_device_error(dev, NULL);
 		return (int) report_length;
 	}
 
+	register_device_error_ioreturn(dev, "IOHIDDeviceGetReport failed", res);
 	return -1;
 }
 
@@ -948,20 +2511,32 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	return set_report(dev, kIOHIDReportTypeOutput, data, length);
 }
 
-/* Helper function, so that this isn't duplicated in hid_read(). */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+/* Copies the report *link points to into data and unlinks it from the
+   queue. Must be called with dev->mutex locked. */
+static int take_report(hid_device *dev, struct input_report **link, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	struct input_report *rpt = *link;
 	size_t len = (length < rpt->len)? length: rpt->len;
-	memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
+	if (len > 0)
+		memcpy(data, rpt->data, len);
+	*link = rpt->next;
 	free(rpt->data);
 	free(rpt);
+	/* Nothing left to hold back */
+	if (!dev->input_reports)
+		dev->batch_pending = 0;
+	update_input_fd(dev);
 	return (int) len;
 }
 
+/* Helper function, so that this isn't duplicated in hid_read(). */
+static int return_data(hid_device *dev, unsigned char *data, size_t length)
+{
+	/* Copy the data out of the first linked list item into the
+	   return buffer (data), and delete the liked list item. */
+	return take_report(dev, &dev->input_reports, data, length);
+}
+
 static int cond_wait(const hid_device *dev, pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
 	while (!dev->input_reports) {
@@ -1007,6 +2582,16 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 {
 	int bytes_read = -1;
 
+	if (!data || !length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_timeout: not available in broadcast mode");
+		return -1;
+	}
+
 	/* Lock the access to the report list. */
 	pthread_mutex_lock(&dev->mutex);
 
@@ -1072,11 +2657,109 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	}
 
 ret:
+	if (bytes_read >= 0)
+		register_device_error(dev, NULL);
+	else if (dev->shutdown_thread && !dev->disconnected)
+		register_device_error_code(dev, HID_API_ERROR_INTERRUPTED, "hid_read_timeout: the device is being closed");
+	else
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_read_timeout: device disconnected");
+
 	/* Unlock */
 	pthread_mutex_unlock(&dev->mutex);
 	return bytes_read;
 }
 
+int HID_API_EXPORT_CALL hid_transact(hid_device *dev, const unsigned char *request, size_t request_length, hid_report_match match, void *user_data, unsigned char *response, size_t response_length, int milliseconds)
+{
+	int bytes_read = -1;
+	uint64_t first_seq;
+	struct timespec ts;
+
+	if (!match || !response || !response_length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: no predicate or response buffer");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: not available in latest mode");
+		return -1;
+	}
+
+	if (__atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_transact: not available in broadcast mode");
+		return -1;
+	}
+
+	/* Only the reports queued from now on can be the response */
+	pthread_mutex_lock(&dev->mutex);
+	first_seq = dev->report_seq + 1;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (hid_write(dev, request, request_length) < 0)
+		return -1;
+
+	if (milliseconds > 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		TIMEVAL_TO_TIMESPEC(&tv, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+
+	for (;;) {
+		struct input_report **cur;
+		int res;
+
+		/* The first matching report, the others stay queued */
+		for (cur = &dev->input_reports; *cur; cur = &(*cur)->next) {
+			if ((*cur)->seq >= first_seq && match((*cur)->data, (*cur)->len, user_data))
+				break;
+		}
+		if (*cur) {
+			bytes_read = take_report(dev, cur, response, response_length);
+			break;
+		}
+
+		/* The device has been disconnected or closed */
+		if (dev->disconnected || dev->shutdown_thread) {
+			register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_transact: device disconnected");
+			break;
+		}
+
+		if (milliseconds == 0) {
+			bytes_read = 0;
+			break;
+		}
+
+		if (milliseconds < 0)
+			res = pthread_cond_wait(&dev->condition, &dev->mutex);
+		else
+			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
+
+		if (res == ETIMEDOUT) {
+			bytes_read = 0;
+			break;
+		}
+		if (res != 0) {
+			register_device_error_errno(dev, "hid_transact", res);
+			break;
+		}
+	}
+
+	if (bytes_read >= 0)
+		register_device_error(dev, NULL);
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return bytes_read;
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
@@ -1087,6 +2770,459 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	/* All Nonblocking operation is handled by the library. */
 	dev->blocking = !nonblock;
 
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_input_fd(hid_device *dev)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->input_pipe[0] < 0) {
+		if (pipe(dev->input_pipe) == 0) {
+			int i;
+			for (i = 0; i < 2; i++) {
+				fcntl(dev->input_pipe[i], F_SETFL, fcntl(dev->input_pipe[i], F_GETFL) | O_NONBLOCK);
+				fcntl(dev->input_pipe[i], F_SETFD, FD_CLOEXEC);
+			}
+			dev->input_pipe_ready = 0;
+			update_input_fd(dev);
+		}
+		else {
+			register_device_error_errno(dev, "hid_get_input_fd", errno);
+			dev->input_pipe[0] = dev->input_pipe[1] = -1;
+			res = -1;
+		}
+	}
+	if (res == 0) {
+		res = dev->input_pipe[0];
+		register_device_error(dev, NULL);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+int HID_API_EXPORT_CALL hid_set_read_latest(hid_device *dev, int enable)
+{
+	if (enable && __atomic_load_n(&dev->broadcast, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_read_latest: not available in broadcast mode");
+		return -1;
+	}
+
+	if (enable) {
+		pthread_mutex_lock(&dev->mutex);
+		if (!dev->latest_reports)
+			dev->latest_reports = (struct latest_report**) calloc(256, sizeof(struct latest_report*));
+		pthread_mutex_unlock(&dev->mutex);
+
+		if (!dev->latest_reports) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_read_latest: out of memory");
+			return -1;
+		}
+	}
+
+	__atomic_store_n(&dev->read_latest, enable? 1: 0, __ATOMIC_RELEASE);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_read_latest(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length)
+{
+	struct latest_report *slot;
+
+	if (!__atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_read_latest: the device is not in latest mode");
+		return -1;
+	}
+
+	if (dev->disconnected) {
+		register_device_error_code(dev, HID_API_ERROR_NO_DEVICE, "hid_read_latest: device disconnected");
+		return -1;
+	}
+
+	slot = __atomic_load_n(&dev->latest_reports[report_id], __ATOMIC_ACQUIRE);
+	if (!slot)
+		return 0;
+
+	return load_latest_report(slot, data, length);
+}
+
+int HID_API_EXPORT_CALL hid_set_changes_only(hid_device *dev, int enable)
+{
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (enable) {
+		int i;
+
+		if (!dev->change_filters)
+			dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+		if (!dev->change_filters) {
+			pthread_mutex_unlock(&dev->changes_mutex);
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_changes_only: out of memory");
+			return -1;
+		}
+
+		/* Always deliver the first report of each Report ID */
+		for (i = 0; i < 256; i++)
+			dev->change_filters[i].len = 0;
+	}
+	dev->changes_only = enable? 1: 0;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length)
+{
+	unsigned char *copy = NULL;
+	unsigned char *old;
+
+	if (mask && length) {
+		copy = (unsigned char*) malloc(length);
+		if (!copy) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_change_mask: out of memory");
+			return -1;
+		}
+		memcpy(copy, mask, length);
+	}
+	else {
+		length = 0;
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (!dev->change_filters)
+		dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+	if (!dev->change_filters) {
+		pthread_mutex_unlock(&dev->changes_mutex);
+		free(copy);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_change_mask: out of memory");
+		return -1;
+	}
+	old = dev->change_filters[report_id].mask;
+	dev->change_filters[report_id].mask = copy;
+	dev->change_filters[report_id].mask_len = length;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	free(old);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_unchanged_count(hid_device *dev, unsigned long long *count)
+{
+	if (!count) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_get_unchanged_count: count is NULL");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	*count = dev->unchanged_count;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_decimation(hid_device *dev, unsigned char report_id, const struct hid_decimation *decimation)
+{
+	struct report_decimator *d = NULL;
+	struct report_decimator *old;
+
+	if (decimation && decimation->mode != HID_DECIMATE_OFF) {
+		if ((decimation->mode == HID_DECIMATE_EVERY_NTH && decimation->every == 0) ||
+		    ((decimation->mode == HID_DECIMATE_WINDOW_LATEST || decimation->mode == HID_DECIMATE_WINDOW_REDUCE) && decimation->window_ms == 0) ||
+		    (decimation->mode == HID_DECIMATE_WINDOW_REDUCE && !decimation->reducer) ||
+		    decimation->mode > HID_DECIMATE_WINDOW_REDUCE) {
+			register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_decimation: invalid stage");
+			return -1;
+		}
+
+		d = (struct report_decimator*) calloc(1, sizeof(struct report_decimator));
+		if (!d) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+			return -1;
+		}
+		d->config = *decimation;
+	}
+
+	pthread_mutex_lock(&dev->changes_mutex);
+	if (d && !dev->decimators)
+		dev->decimators = (struct report_decimator**) calloc(256, sizeof(struct report_decimator*));
+	if (d && !dev->decimators) {
+		pthread_mutex_unlock(&dev->changes_mutex);
+		free(d);
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_decimation: out of memory");
+		return -1;
+	}
+	old = dev->decimators? dev->decimators[report_id]: NULL;
+	if (dev->decimators)
+		dev->decimators[report_id] = d;
+	pthread_mutex_unlock(&dev->changes_mutex);
+
+	if (old) {
+		free(old->window);
+		free(old);
+	}
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_batching(hid_device *dev, unsigned int max_reports, unsigned int max_delay_us)
+{
+	if (max_reports > 30 || (max_reports > 1 && max_delay_us == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_batching: invalid batch size or delay");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->batch_reports = max_reports;
+	dev->batch_delay_us = max_delay_us;
+	if (max_reports <= 1 && dev->batch_pending) {
+		/* Release what is held back */
+		dev->batch_pending = 0;
+		pthread_cond_broadcast(&dev->condition);
+		update_input_fd(dev);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_broadcast(hid_device *dev, unsigned int slots, size_t max_report_length)
+{
+	struct broadcast_ring *ring = NULL;
+	struct broadcast_ring *old;
+	unsigned int num_slots = 1;
+
+	if (slots > 65536 || (slots > 0 && max_report_length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: invalid ring size");
+		return -1;
+	}
+
+	if (slots > 0 && __atomic_load_n(&dev->read_latest, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: not available in latest mode");
+		return -1;
+	}
+
+	if (slots > 0) {
+		while (num_slots < slots)
+			num_slots <<= 1;
+		ring = new_broadcast_ring(num_slots, max_report_length);
+		if (!ring) {
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_set_broadcast: out of memory");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	old = dev->broadcast;
+	if (old && old->readers > 0) {
+		pthread_mutex_unlock(&dev->mutex);
+		if (ring)
+			free_broadcast_ring(ring);
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_set_broadcast: readers are open");
+		return -1;
+	}
+	__atomic_store_n(&dev->broadcast, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (old)
+		free_broadcast_ring(old);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+HID_API_EXPORT hid_broadcast_reader * HID_API_CALL hid_broadcast_open(hid_device *dev)
+{
+	hid_broadcast_reader *reader = (hid_broadcast_reader*) calloc(1, sizeof(hid_broadcast_reader));
+
+	if (!reader) {
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_broadcast_open: out of memory");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	if (!dev->broadcast) {
+		pthread_mutex_unlock(&dev->mutex);
+		free(reader);
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_broadcast_open: the device is not in broadcast mode");
+		return NULL;
+	}
+	reader->dev = dev;
+	reader->ring = dev->broadcast;
+	reader->ring->readers++;
+	reader->cursor = __atomic_load_n(&reader->ring->head, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&dev->mutex);
+
+	register_device_error(dev, NULL);
+	return reader;
+}
+
+int HID_API_EXPORT_CALL hid_broadcast_read(hid_broadcast_reader *reader, unsigned char *data, size_t length, int milliseconds)
+{
+	struct broadcast_ring *ring = reader->ring;
+	hid_device *dev = reader->dev;
+	struct timespec ts;
+	int res = 0;
+
+	if (!data || !length) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_broadcast_read: zero buffer/length");
+		return -1;
+	}
+
+	if (milliseconds > 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		TIMEVAL_TO_TIMESPEC(&tv, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	for (;;) {
+		int bytes_read = load_broadcast_report(reader, data, length);
+		if (bytes_read > 0 || milliseconds == 0 || res == ETIMEDOUT)
+			return bytes_read;
+
+		if (dev->shutdown_thread || dev->disconnected)
+			return -1;
+
+		/* Sleep until hid_input_report_callback() writes the next report */
+		pthread_mutex_lock(&ring->mutex);
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == reader->cursor && !dev->shutdown_thread && !dev->disconnected) {
+			if (milliseconds < 0)
+				res = pthread_cond_wait(&ring->condition, &ring->mutex);
+			else
+				res = pthread_cond_timedwait(&ring->condition, &ring->mutex, &ts);
+		}
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ring->mutex);
+	}
+}
+
+int HID_API_EXPORT_CALL hid_broadcast_get_overflow(hid_broadcast_reader *reader, unsigned long long *count)
+{
+	if (!reader || !count)
+		return -1;
+
+	*count = reader->overflow;
+	return 0;
+}
+
+void HID_API_EXPORT_CALL hid_broadcast_close(hid_broadcast_reader *reader)
+{
+	if (!reader)
+		return;
+
+	pthread_mutex_lock(&reader->dev->mutex);
+	reader->ring->readers--;
+	pthread_mutex_unlock(&reader->dev->mutex);
+	free(reader);
+}
+
+int HID_API_EXPORT_CALL hid_subscribe_report_id(hid_device *dev, unsigned char report_id, hid_report_callback callback, void *user_data)
+{
+	if (report_id == 0 || !callback) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_subscribe_report_id: Report ID 0 or no callback");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (!dev->subscriptions) {
+		dev->subscriptions = (struct report_subscription*) calloc(256, sizeof(struct report_subscription));
+		if (!dev->subscriptions) {
+			pthread_mutex_unlock(&dev->subscriptions_mutex);
+			register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_subscribe_report_id: out of memory");
+			return -1;
+		}
+	}
+	dev->subscriptions[report_id].callback = callback;
+	dev->subscriptions[report_id].user_data = user_data;
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_unsubscribe_report_id(hid_device *dev, unsigned char report_id)
+{
+	int res = -1;
+
+	pthread_mutex_lock(&dev->subscriptions_mutex);
+	if (dev->subscriptions && dev->subscriptions[report_id].callback) {
+		dev->subscriptions[report_id].callback = NULL;
+		dev->subscriptions[report_id].user_data = NULL;
+		res = 0;
+	}
+	pthread_mutex_unlock(&dev->subscriptions_mutex);
+
+	if (res < 0)
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_unsubscribe_report_id: no subscription for this Report ID");
+	else
+		register_device_error(dev, NULL);
+	return res;
+}
+
+int HID_API_EXPORT_CALL hid_start_capture(hid_device *dev, const char *path, const struct hid_device_info *info)
+{
+	struct capture_file *capture;
+
+	if (!path) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_start_capture: NULL path");
+		return -1;
+	}
+	if (__atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE)) {
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_start_capture: the device is already recorded");
+		return -1;
+	}
+
+	capture = create_capture_file(path, info, dev->uses_numbered_reports);
+	if (!capture) {
+		register_device_error_errno(dev, "hid_start_capture: couldn't create the capture file", errno);
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->capture_mutex);
+	if (dev->capture) {
+		pthread_mutex_unlock(&dev->capture_mutex);
+		close_capture_file(capture);
+		register_device_error_code(dev, HID_API_ERROR_BUSY, "hid_start_capture: the device is already recorded");
+		return -1;
+	}
+	__atomic_store_n(&dev->capture, capture, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->capture_mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_stop_capture(hid_device *dev)
+{
+	struct capture_file *capture;
+
+	pthread_mutex_lock(&dev->capture_mutex);
+	capture = dev->capture;
+	__atomic_store_n(&dev->capture, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->capture_mutex);
+
+	if (!capture) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "hid_stop_capture: the device is not recorded");
+		return -1;
+	}
+
+	close_capture_file(capture);
+	register_device_error(dev, NULL);
 	return 0;
 }
 
@@ -1159,31 +3295,69 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	free_hid_device(dev);
 }
 
+/* Registers the result of a string getter: res is -1 if the
+   device has no such string. */
+static int register_string_result(hid_device *dev, int res)
+{
+	if (res < 0)
+		register_device_error_code(dev, HID_API_ERROR_NOT_FOUND, "The device has no such string");
+	else
+		register_device_error(dev, NULL);
+
+	return res;
+}
+
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return get_manufacturer_string(dev->device_handle, string, maxlen);
+	return register_string_result(dev, get_manufacturer_string(dev->device_handle, string, maxlen));
 }
 
 int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return get_product_string(dev->device_handle, string, maxlen);
+	return register_string_result(dev, get_product_string(dev->device_handle, string, maxlen));
 }
 
 int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return get_serial_number(dev->device_handle, string, maxlen);
+	return register_string_result(dev, get_serial_number(dev->device_handle, string, maxlen));
 }
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
 {
-	(void) dev;
 	(void) string_index;
 	(void) string;
 	(void) maxlen;
 
-	/* TODO: */
+	/* IOKit only exposes the manufacturer, product and serial number strings */
+	register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_get_indexed_string: not supported on macOS");
 
-	return 0;
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return register_string_result(dev, get_string_property_utf8(dev->device_handle, CFSTR(kIOHIDManufacturerKey), string, maxlen));
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return register_string_result(dev, get_string_property_utf8(dev->device_handle, CFSTR(kIOHIDProductKey), string, maxlen));
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	return register_string_result(dev, get_string_property_utf8(dev->device_handle, CFSTR(kIOHIDSerialNumberKey), string, maxlen));
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string_utf8(hid_device *dev, int string_index, char *string, size_t maxlen)
+{
+	(void) string_index;
+	(void) string;
+	(void) maxlen;
+
+	register_device_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, "hid_get_indexed_string_utf8: not supported on macOS");
+
+	return -1;
 }
 
 int HID_API_EXPORT_CALL hid_darwin_get_location_id(hid_device *dev, uint32_t *location_id)
@@ -1191,8 +3365,10 @@ int HID_API_EXPORT_CALL hid_darwin_get_location_id(hid_device *dev, uint32_t *lo
 	int res = get_int_property(dev->device_handle, CFSTR(kIOHIDLocationIDKey));
 	if (res != 0) {
 		*location_id = (uint32_t) res;
+		register_device_error(dev, NULL);
 		return 0;
 	} else {
+		register_device_error_code(dev, HID_API_ERROR_NOT_FOUND, "The device has no location ID");
 		return -1;
 	}
 }
@@ -1215,10 +3391,35 @@ int HID_API_EXPORT_CALL hid_darwin_is_device_open_exclusive(hid_device *dev)
 	return (dev->open_options == kIOHIDOptionsTypeSeizeDevice) ? 1 : 0;
 }
 
+/* Passing in NULL means asking for the last global error message. */
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
-	(void) dev;
-	/* TODO: */
+	if (dev)
+		return render_device_error(dev);
+
+	return hid_context_error(NULL);
+}
+
+int HID_API_EXPORT_CALL hid_error_code(hid_device *dev)
+{
+	if (dev)
+		return dev->last_error_code;
+
+	return hid_context_error_code(NULL);
+}
+
+HID_API_EXPORT const wchar_t * HID_API_CALL hid_context_error(hid_context *ctx)
+{
+	struct global_error *err = get_context_error(resolve_context(ctx), 0);
+
+	if (err == NULL || err->str == NULL)
+		return L"Success";
+	return err->str;
+}
+
+int HID_API_EXPORT_CALL hid_context_error_code(hid_context *ctx)
+{
+	struct global_error *err = get_context_error(resolve_context(ctx), 0);
 
-	return L"hid_error is not implemented yet";
+	return err? err->code: HID_API_ERROR_SUCCESS;
 }
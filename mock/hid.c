@@ -0,0 +1,706 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Alan Ott
+ Signal 11 Software
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/* Unix */
+#include <sys/socket.h>
+
+#include "hidapi_mock.h"
+
+/* The reports are read, filtered and handed out by the code of the
+   hidraw backend, from a socket the generator thread sends them to. */
+#define HIDAPI_FD_BACKEND struct report_generator
+#define BACKEND_NAME "virtual devices"
+#include "../linux/hid.c"
+
+/* A virtual device, see hid_mock_add_device(). The list only grows (at
+   its tail) until hid_exit(), so it is walked without locking. A device
+   still open at hid_exit() is only unlinked, and freed by the last
+   hid_close() of it. */
+struct mock_device {
+	struct mock_device *next;
+	unsigned int index; /* The path of the device is "mock:<index>" */
+	struct hid_mock_device config; /* Without the pointers, see below */
+	char *strings[DEVICE_STRING_COUNT];
+	unsigned char report_ids[256];
+
+	/* The open handles of the device, and whether hid_exit() unlinked
+	   it. Protected by mock_devices_mutex. */
+	unsigned int refs;
+	int forgotten;
+};
+
+static struct mock_device *mock_devices = NULL;
+static struct mock_device *mock_devices_tail = NULL;
+static unsigned int num_mock_devices = 0;
+static int mock_environment_added = 0; /* The devices of HIDAPI_MOCK */
+static pthread_mutex_t mock_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Generates the Input reports of an open virtual device into the
+   socket the device reads from, see generator_thread(). */
+struct report_generator {
+	struct mock_device *device; /* Referenced until hid_close() */
+	int fd; /* The other end of the device_handle socket */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition; /* Signalled on hid_close() and hid_mock_disconnect() */
+	int stop;
+	int disconnect;
+
+	/* The reports generated, and the ones the reader wasn't fast
+	   enough for. Written by the generator thread only. */
+	unsigned long long generated;
+	unsigned long long dropped;
+
+	/* The Feature reports the application set, indexed by Report
+	   ID and returned by hid_get_feature_report(). Protected by mutex. */
+	unsigned char *features[256];
+	size_t feature_lengths[256];
+};
+
+/* Gets a device string into either string or string_utf8 (the other one
+   being NULL), both being maxlen long in their character type. */
+static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, char *string_utf8, size_t maxlen)
+{
+	if ((!string && !string_utf8) || !maxlen) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	register_device_error(dev, NULL);
+
+	if (store_device_string(dev->backend->device->strings[key], string, string_utf8, maxlen) < 0) {
+		register_device_error_code(dev, HID_API_ERROR_NOT_FOUND, "The virtual device doesn't have this string");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The monotonic clock in nanoseconds */
+static uint64_t get_nanoseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Adds a copy of config to the virtual devices. Returns -1 with errno
+   set on failure. */
+static int add_mock_device(const struct hid_mock_device *config)
+{
+	struct mock_device *device;
+	const char *strings[DEVICE_STRING_COUNT];
+	size_t i;
+
+	if (config->report_size > MAX_REPORT_SIZE || config->num_report_ids > 255 ||
+	    (config->num_report_ids > 0 && !config->report_ids)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < config->num_report_ids; i++) {
+		if (config->report_ids[i] == 0x0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	device = (struct mock_device*) calloc(1, sizeof(struct mock_device));
+	if (!device)
+		return -1;
+
+	device->config = *config;
+	if (device->config.report_size == 0)
+		device->config.report_size = 64;
+	if (device->config.num_report_ids > 0 && device->config.report_size < 2)
+		device->config.report_size = 2;
+	if (config->num_report_ids > 0)
+		memcpy(device->report_ids, config->report_ids, config->num_report_ids);
+	device->config.report_ids = NULL;
+
+	strings[DEVICE_STRING_MANUFACTURER] = config->manufacturer_string;
+	strings[DEVICE_STRING_PRODUCT] = config->product_string;
+	strings[DEVICE_STRING_SERIAL] = config->serial_number;
+	device->config.manufacturer_string = NULL;
+	device->config.product_string = NULL;
+	device->config.serial_number = NULL;
+	for (i = 0; i < DEVICE_STRING_COUNT; i++) {
+		if (strings[i] && !(device->strings[i] = strdup(strings[i]))) {
+			while (i-- > 0)
+				free(device->strings[i]);
+			free(device);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&mock_devices_mutex);
+	device->index = num_mock_devices++;
+	if (mock_devices_tail)
+		__atomic_store_n(&mock_devices_tail->next, device, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&mock_devices, device, __ATOMIC_RELEASE);
+	mock_devices_tail = device;
+	pthread_mutex_unlock(&mock_devices_mutex);
+
+	return 0;
+}
+
+/* Adds the devices of the HIDAPI_MOCK environment variable, the first
+   time. Devices are separated by ';', each one is "VID:PID" (in hex)
+   followed by ",name=value" options: rate, size, ids (Report IDs
+   separated by '+'), latency (in microseconds), disconnect, usage_page,
+   usage, interface, manufacturer, product and serial. */
+static void add_environment_devices(void)
+{
+	const char *env;
+	char *spec, *device_saveptr = NULL, *device_spec;
+
+	pthread_mutex_lock(&mock_devices_mutex);
+	if (mock_environment_added) {
+		pthread_mutex_unlock(&mock_devices_mutex);
+		return;
+	}
+	mock_environment_added = 1;
+	pthread_mutex_unlock(&mock_devices_mutex);
+
+	env = getenv("HIDAPI_MOCK");
+	if (!env || !(spec = strdup(env)))
+		return;
+
+	for (device_spec = strtok_r(spec, ";", &device_saveptr); device_spec; device_spec = strtok_r(NULL, ";", &device_saveptr)) {
+		struct hid_mock_device config;
+		unsigned char report_ids[255];
+		char *saveptr = NULL, *option, *end;
+
+		memset(&config, 0, sizeof(config));
+		config.interface_number = -1;
+		config.bus_type = HID_API_BUS_USB;
+
+		option = strtok_r(device_spec, ",", &saveptr);
+		if (!option)
+			continue;
+		config.vendor_id = (unsigned short) strtoul(option, &end, 16);
+		if (*end == ':')
+			config.product_id = (unsigned short) strtoul(end + 1, NULL, 16);
+
+		while ((option = strtok_r(NULL, ",", &saveptr)) != NULL) {
+			char *value = strchr(option, '=');
+
+			if (!value)
+				continue;
+			*value++ = '\0';
+
+			if (strcmp(option, "rate") == 0)
+				config.rate = (unsigned int) strtoul(value, NULL, 10);
+			else if (strcmp(option, "size") == 0)
+				config.report_size = (size_t) strtoul(value, NULL, 10);
+			else if (strcmp(option, "latency") == 0)
+				config.write_latency_us = (unsigned int) strtoul(value, NULL, 10);
+			else if (strcmp(option, "disconnect") == 0)
+				config.disconnect_after = strtoull(value, NULL, 10);
+			else if (strcmp(option, "usage_page") == 0)
+				config.usage_page = (unsigned short) strtoul(value, NULL, 0);
+			else if (strcmp(option, "usage") == 0)
+				config.usage = (unsigned short) strtoul(value, NULL, 0);
+			else if (strcmp(option, "interface") == 0)
+				config.interface_number = (int) strtol(value, NULL, 10);
+			else if (strcmp(option, "manufacturer") == 0)
+				config.manufacturer_string = value;
+			else if (strcmp(option, "product") == 0)
+				config.product_string = value;
+			else if (strcmp(option, "serial") == 0)
+				config.serial_number = value;
+			else if (strcmp(option, "ids") == 0) {
+				char *id_saveptr = NULL, *id;
+				config.num_report_ids = 0;
+				for (id = strtok_r(value, "+", &id_saveptr); id && config.num_report_ids < sizeof(report_ids); id = strtok_r(NULL, "+", &id_saveptr))
+					report_ids[config.num_report_ids++] = (unsigned char) strtoul(id, NULL, 0);
+				config.report_ids = report_ids;
+			}
+		}
+
+		add_mock_device(&config);
+	}
+
+	free(spec);
+}
+
+static void free_mock_device(struct mock_device *device)
+{
+	int i;
+
+	for (i = 0; i < DEVICE_STRING_COUNT; i++)
+		free(device->strings[i]);
+	free(device);
+}
+
+/* Returns the virtual device of a "mock:<index>" path with a reference
+   taken, or NULL. See release_mock_device(). */
+static struct mock_device *acquire_mock_device(const char *path)
+{
+	struct mock_device *device;
+	unsigned long index;
+	char *end;
+
+	if (strncmp(path, "mock:", 5) != 0)
+		return NULL;
+	index = strtoul(path + 5, &end, 10);
+	if (end == path + 5 || *end != '\0')
+		return NULL;
+
+	pthread_mutex_lock(&mock_devices_mutex);
+	for (device = mock_devices; device; device = device->next) {
+		if (device->index == index) {
+			device->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mock_devices_mutex);
+
+	return device;
+}
+
+/* Drops a reference taken by acquire_mock_device(), freeing the device
+   if hid_exit() already forgot it */
+static void release_mock_device(struct mock_device *device)
+{
+	int free_device;
+
+	pthread_mutex_lock(&mock_devices_mutex);
+	free_device = --device->refs == 0 && device->forgotten;
+	pthread_mutex_unlock(&mock_devices_mutex);
+
+	if (free_device)
+		free_mock_device(device);
+}
+
+/* Fills a report of the device: the Report ID (if numbered), then the
+   sequence number (little-endian, as many bytes as fit), then zeroes. */
+static size_t make_report(const struct mock_device *device, unsigned char report_id, unsigned long long sequence, unsigned char *data, size_t length)
+{
+	size_t size = device->config.report_size < length? device->config.report_size: length;
+	size_t pos = 0;
+
+	memset(data, 0, size);
+	if (device->config.num_report_ids > 0)
+		data[pos++] = report_id;
+	for (; pos < size && sequence; pos++) {
+		data[pos] = (unsigned char) sequence;
+		sequence >>= 8;
+	}
+
+	return size;
+}
+
+/* Sleeps for the write latency of the device */
+static void wait_write_latency(const struct mock_device *device)
+{
+	struct timespec ts;
+
+	if (device->config.write_latency_us == 0)
+		return;
+
+	ts.tv_sec = device->config.write_latency_us / 1000000;
+	ts.tv_nsec = (long) (device->config.write_latency_us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/* Sends the Input reports of the device at its rate (cycling through
+   its Report IDs), or as fast as the reader takes them. Then shuts the
+   socket down, which the reader sees as a disconnection. */
+static void *generator_thread(void *param)
+{
+	struct report_generator *generator = (struct report_generator*) param;
+	const struct mock_device *device = generator->device;
+	unsigned char report[MAX_REPORT_SIZE];
+	uint64_t interval = device->config.rate? 1000000000 / device->config.rate: 0;
+	uint64_t due = get_nanoseconds();
+	unsigned long long sequence = 0;
+	size_t next_id = 0;
+
+	pthread_mutex_lock(&generator->mutex);
+	while (!generator->stop && !generator->disconnect) {
+		unsigned char report_id = 0x0;
+		size_t size;
+		ssize_t res;
+
+		if (device->config.disconnect_after && sequence >= device->config.disconnect_after)
+			break;
+
+		/* Reports late for their slot go at once, keeping the rate */
+		if (interval) {
+			due += interval;
+			while (!generator->stop && !generator->disconnect && get_nanoseconds() < due) {
+				struct timespec deadline;
+				deadline.tv_sec = (time_t) (due / 1000000000);
+				deadline.tv_nsec = (long) (due % 1000000000);
+				pthread_cond_timedwait(&generator->condition, &generator->mutex, &deadline);
+			}
+			if (generator->stop || generator->disconnect)
+				break;
+		}
+		pthread_mutex_unlock(&generator->mutex);
+
+		if (device->config.num_report_ids > 0) {
+			report_id = device->report_ids[next_id];
+			next_id = (next_id + 1) % device->config.num_report_ids;
+		}
+		size = make_report(device, report_id, sequence, report, sizeof(report));
+
+		/* At a given rate, a reader falling behind loses reports like
+		   it would with a device */
+		res = send(generator->fd, report, size, MSG_NOSIGNAL | (interval? MSG_DONTWAIT: 0));
+		sequence++;
+		__atomic_store_n(&generator->generated, sequence, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&generator->mutex);
+		if (res < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break; /* The device is being closed */
+			__atomic_store_n(&generator->dropped, generator->dropped + 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&generator->mutex);
+
+	shutdown(generator->fd, SHUT_WR);
+	return NULL;
+}
+
+static void free_report_generator(struct report_generator *generator)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		free(generator->features[i]);
+	pthread_cond_destroy(&generator->condition);
+	pthread_mutex_destroy(&generator->mutex);
+	free(generator);
+}
+
+static struct report_generator *new_report_generator(struct mock_device *device)
+{
+	struct report_generator *generator;
+	pthread_condattr_t attr;
+
+	generator = (struct report_generator*) calloc(1, sizeof(struct report_generator));
+	if (!generator)
+		return NULL;
+
+	generator->device = device;
+	generator->fd = -1;
+	pthread_mutex_init(&generator->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /* For generator_thread() */
+	pthread_cond_init(&generator->condition, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return generator;
+}
+
+/* Stops the generator thread of dev, which may be blocked sending */
+static void stop_report_generator(hid_device *dev)
+{
+	struct report_generator *generator = dev->backend;
+
+	shutdown(dev->device_handle, SHUT_RDWR);
+
+	pthread_mutex_lock(&generator->mutex);
+	generator->stop = 1;
+	pthread_cond_signal(&generator->condition);
+	pthread_mutex_unlock(&generator->mutex);
+
+	pthread_join(generator->thread, NULL);
+	close(generator->fd);
+}
+
+/* Stops the generator of dev before its socket is closed */
+static void close_backend_device(hid_device *dev)
+{
+	struct mock_device *device = dev->backend->device;
+
+	stop_report_generator(dev);
+	free_report_generator(dev->backend);
+	release_mock_device(device);
+}
+
+/* Forgets the virtual devices. The ones still open are freed by their
+   last hid_close(), as their generator threads keep using them. */
+static void exit_backend(void)
+{
+	pthread_mutex_lock(&mock_devices_mutex);
+	while (mock_devices) {
+		struct mock_device *next = mock_devices->next;
+		mock_devices->next = NULL;
+		if (mock_devices->refs > 0)
+			mock_devices->forgotten = 1;
+		else
+			free_mock_device(mock_devices);
+		mock_devices = next;
+	}
+	mock_devices_tail = NULL;
+	num_mock_devices = 0;
+	mock_environment_added = 0;
+	pthread_mutex_unlock(&mock_devices_mutex);
+}
+
+/* Sends the virtual devices matching the filter to the sink, until it
+   says to stop. The strings of the records are allocated from the
+   arena. */
+static int enumerate_devices(hid_context *ctx, const struct hid_filter *filter, struct enum_arena *arena, struct enum_sink *sink)
+{
+	const struct mock_device *device;
+	int stop = 0;
+
+	init_context(ctx);
+	/* register_global_error: global error is reset by init_context */
+
+	add_environment_devices();
+
+	for (device = __atomic_load_n(&mock_devices, __ATOMIC_ACQUIRE); device && !stop; device = __atomic_load_n(&device->next, __ATOMIC_ACQUIRE)) {
+		const struct hid_mock_device *config = &device->config;
+		struct hid_device_info info;
+		char path[32];
+
+		if (!filter_match_bus(filter, config->bus_type) ||
+		    !filter_match_ids(filter, config->vendor_id, config->product_id) ||
+		    !filter_match_serial(filter, device->strings[DEVICE_STRING_SERIAL]) ||
+		    !filter_match_interface(filter, config->interface_number) ||
+		    !filter_match_usage(filter, config->usage_page, config->usage))
+			continue;
+
+		snprintf(path, sizeof(path), "mock:%u", device->index);
+
+		memset(&info, 0, sizeof(info));
+		info.path = enum_arena_strdup(arena, path);
+		info.vendor_id = config->vendor_id;
+		info.product_id = config->product_id;
+		info.release_number = config->release_number;
+		info.interface_number = config->interface_number;
+		info.bus_type = config->bus_type;
+		info.serial_number_utf8 = enum_arena_strdup(arena, device->strings[DEVICE_STRING_SERIAL]);
+		info.serial_number = enum_arena_utf8_to_wchar_t(arena, device->strings[DEVICE_STRING_SERIAL]);
+		set_device_info_strings(arena, &info, device->strings[DEVICE_STRING_MANUFACTURER], device->strings[DEVICE_STRING_PRODUCT]);
+
+		stop = enum_sink_add(arena, sink, &info, config->usage_page, config->usage);
+	}
+
+	return 0;
+}
+
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
+{
+	hid_device *dev = NULL;
+	struct mock_device *device;
+	struct report_generator *generator;
+	int fds[2];
+	int err;
+
+	ctx = resolve_context(ctx);
+
+	init_context(ctx);
+	/* register_global_error: global error is reset by init_context */
+
+	add_environment_devices();
+
+	device = acquire_mock_device(path);
+	if (!device) {
+		register_global_error_format(ctx, HID_API_ERROR_NOT_FOUND, "Failed to open a device with path '%s': no such virtual device", path);
+		return NULL;
+	}
+
+	generator = new_report_generator(device);
+	if (!generator) {
+		release_mock_device(device);
+		register_global_error_code(ctx, HID_API_ERROR_NO_MEM, "Couldn't allocate the report generator");
+		return NULL;
+	}
+
+	/* The reports keep their boundaries, like with a hidraw node */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		err = errno;
+		free_report_generator(generator);
+		release_mock_device(device);
+		register_global_error_format(ctx, errno_to_error_code(err), "socketpair failed: %s", strerror(err));
+		return NULL;
+	}
+
+	dev = new_hid_device();
+	dev->device_handle = fds[0];
+	dev->uses_numbered_reports = device->config.num_report_ids > 0;
+	dev->backend = generator;
+	generator->fd = fds[1];
+
+	if (pthread_create(&generator->thread, NULL, generator_thread, generator) != 0) {
+		close(fds[1]);
+		close(fds[0]);
+		free_report_generator(generator);
+		release_mock_device(device);
+		free_hid_device(dev);
+		register_global_error(ctx, "Couldn't start the generator thread");
+		return NULL;
+	}
+
+	return dev;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	if (!data || (length == 0)) {
+		errno = EINVAL;
+		register_device_error_errno(dev, NULL, errno);
+		return -1;
+	}
+
+	/* The Output reports go nowhere, after the write latency */
+	wait_write_latency(dev->backend->device);
+
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_OUTPUT, data, length);
+
+	return (int) length;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	struct report_generator *generator = dev->backend;
+	unsigned char *copy;
+
+	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	copy = (unsigned char*) malloc(length);
+	if (!copy) {
+		register_device_error_code(dev, HID_API_ERROR_NO_MEM, "hid_send_feature_report: out of memory");
+		return -1;
+	}
+	memcpy(copy, data, length);
+
+	wait_write_latency(generator->device);
+
+	/* Kept for hid_get_feature_report() */
+	pthread_mutex_lock(&generator->mutex);
+	free(generator->features[data[0]]);
+	generator->features[data[0]] = copy;
+	generator->feature_lengths[data[0]] = length;
+	pthread_mutex_unlock(&generator->mutex);
+
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_FEATURE_SET, data, length);
+
+	return (int) length;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	struct report_generator *generator = dev->backend;
+	size_t len;
+
+	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	wait_write_latency(generator->device);
+
+	/* The last one set, or else zeroes */
+	pthread_mutex_lock(&generator->mutex);
+	if (generator->features[data[0]]) {
+		len = (length < generator->feature_lengths[data[0]])? length: generator->feature_lengths[data[0]];
+		memcpy(data, generator->features[data[0]], len);
+	}
+	else {
+		len = make_report(generator->device, data[0], 0, data, length);
+	}
+	pthread_mutex_unlock(&generator->mutex);
+
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_FEATURE_GET, data, len);
+
+	return (int) len;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	struct report_generator *generator = dev->backend;
+	size_t len;
+
+	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	wait_write_latency(generator->device);
+
+	/* Numbered like the last report generated */
+	len = make_report(generator->device, data[0], __atomic_load_n(&generator->generated, __ATOMIC_RELAXED), data, length);
+
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_INPUT_GET, data, len);
+
+	return (int) len;
+}
+
+int HID_API_EXPORT_CALL hid_mock_add_device(const struct hid_mock_device *device)
+{
+	if (!device) {
+		register_global_error_code(&default_context, HID_API_ERROR_INVALID_PARAM, "hid_mock_add_device: NULL device");
+		return -1;
+	}
+
+	add_environment_devices();
+
+	if (add_mock_device(device) < 0) {
+		if (errno == EINVAL)
+			register_global_error_code(&default_context, HID_API_ERROR_INVALID_PARAM, "hid_mock_add_device: invalid report size or Report IDs");
+		else
+			register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "hid_mock_add_device: out of memory");
+		return -1;
+	}
+
+	register_global_error(&default_context, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_mock_disconnect(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->backend->mutex);
+	dev->backend->disconnect = 1;
+	pthread_cond_signal(&dev->backend->condition);
+	pthread_mutex_unlock(&dev->backend->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_mock_get_stats(hid_device *dev, unsigned long long *generated, unsigned long long *dropped)
+{
+	if (generated)
+		*generated = __atomic_load_n(&dev->backend->generated, __ATOMIC_RELAXED);
+	if (dropped)
+		*dropped = __atomic_load_n(&dev->backend->dropped, __ATOMIC_RELAXED);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
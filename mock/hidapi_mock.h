@@ -0,0 +1,154 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/** @file
+ * @defgroup API hidapi API
+
+ * Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0).
+ */
+
+#ifndef HIDAPI_MOCK_H__
+#define HIDAPI_MOCK_H__
+
+#include <stddef.h>
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+		/** @brief A virtual device of the mock backend, see hid_mock_add_device().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+		*/
+		struct hid_mock_device {
+			/** Device Vendor ID, Product ID and Release Number */
+			unsigned short vendor_id;
+			unsigned short product_id;
+			unsigned short release_number;
+			/** Usage Page and Usage of the device */
+			unsigned short usage_page;
+			unsigned short usage;
+			/** The USB interface, or -1 */
+			int interface_number;
+			/** The bus the device pretends to be on */
+			hid_bus_type bus_type;
+			/** The strings of the device in UTF-8, or NULL */
+			const char *manufacturer_string;
+			const char *product_string;
+			const char *serial_number;
+			/** Input reports generated per second. With 0, they are
+			    generated as fast as the application reads them. */
+			unsigned int rate;
+			/** The size of the Input reports, including the Report ID
+			    if numbered. 0 for 64. */
+			size_t report_size;
+			/** The Report IDs the Input reports cycle through, or NULL
+			    (and 0) for unnumbered reports. */
+			const unsigned char *report_ids;
+			size_t num_report_ids;
+			/** The time hid_write() and the Feature/Input report
+			    functions take, in microseconds */
+			unsigned int write_latency_us;
+			/** The number of Input reports after which the device
+			    disconnects, 0 for never */
+			unsigned long long disconnect_after;
+		};
+
+		/** @brief Add a virtual device to the mock backend.
+
+			The mock backend (hidapi-mock) implements the hidapi API
+			on top of virtual devices generating Input reports, so the
+			reading paths of an application (and of hidapi) can be
+			loaded without hardware. An application links it instead
+			of hidapi-hidraw or hidapi-libusb.
+
+			Each Input report holds the Report ID (if numbered), then
+			the number of the report (little-endian, in as many bytes
+			as fit), then zeroes. A report the application wasn't fast
+			enough for is lost like with a device, which shows as a gap
+			in the numbers (see hid_mock_get_stats()). Output reports
+			are dropped, Feature reports are kept for
+			hid_get_feature_report().
+
+			The virtual devices of the HIDAPI_MOCK environment variable
+			come first, so unmodified applications can be run against
+			the backend. Devices are separated by ';', each one being
+			"VID:PID" (in hex) followed by ",name=value" options: rate,
+			size, ids (Report IDs separated by '+'), latency (in
+			microseconds), disconnect, usage_page, usage, interface,
+			manufacturer, product and serial. For example
+			"046d:c52b,rate=10000,size=16,ids=1+2".
+
+			The path of a virtual device is "mock:" followed by its
+			number in the order they were added, starting from 0. The
+			devices are forgotten by hid_exit(), the ones still open
+			staying usable until they are closed.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param device The configuration of the device, copied
+				with its strings and Report IDs.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_mock_add_device(const struct hid_mock_device *device);
+
+		/** @brief Disconnect a virtual device.
+
+			The device stops generating Input reports. Once the
+			application read the ones already generated, the reading
+			functions fail like for a device which was unplugged.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_mock_disconnect(hid_device *dev);
+
+		/** @brief Get the Input report counts of a virtual device.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param generated The number of Input reports generated since
+				the device was opened, or NULL.
+			@param dropped How many of them were lost because the
+				application didn't read them in time, or NULL.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_mock_get_stats(hid_device *dev, unsigned long long *generated, unsigned long long *dropped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
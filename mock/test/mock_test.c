@@ -0,0 +1,356 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/* Checks the reading paths of the hidraw code against the virtual
+   devices of the mock backend. Exits with 1 if a check fails. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "hidapi_mock.h"
+
+#define TEST_VENDOR_ID 0x1d50
+
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/* The monotonic clock in milliseconds */
+static long long get_milliseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Adds a virtual device with the test Vendor ID and opens it */
+static hid_device *open_mock_device(struct hid_mock_device *config, unsigned short product_id)
+{
+	hid_device *dev;
+
+	config->vendor_id = TEST_VENDOR_ID;
+	config->product_id = product_id;
+	config->interface_number = -1;
+	config->bus_type = HID_API_BUS_USB;
+
+	if (hid_mock_add_device(config) < 0) {
+		fprintf(stderr, "hid_mock_add_device: %ls\n", hid_error(NULL));
+		return NULL;
+	}
+
+	dev = hid_open(TEST_VENDOR_ID, product_id, NULL);
+	if (!dev)
+		fprintf(stderr, "hid_open %04hx:%04hx: %ls\n", TEST_VENDOR_ID, product_id, hid_error(NULL));
+	return dev;
+}
+
+/* The sequence number of a report of size bytes, see hid_mock_add_device() */
+static unsigned long report_sequence(const unsigned char *data, size_t size, int numbered)
+{
+	unsigned long sequence = 0;
+	size_t i;
+
+	for (i = size; i-- > (numbered? 1: 0);)
+		sequence = (sequence << 8) | data[i];
+	return sequence;
+}
+
+struct subscription {
+	int calls;
+	int wrong_id;
+};
+
+static void HID_API_CALL count_report(hid_device *dev, const unsigned char *data, size_t length, void *user_data)
+{
+	struct subscription *subscription = (struct subscription*) user_data;
+
+	(void) dev;
+	subscription->calls++;
+	if (length < 1 || data[0] != 0x2)
+		subscription->wrong_id++;
+}
+
+/* The reports of a subscribed Report ID go to its callback only */
+static void test_subscription(void)
+{
+	struct hid_mock_device config;
+	struct subscription subscription = { 0, 0 };
+	static const unsigned char report_ids[] = { 0x1, 0x2 };
+	unsigned char data[16];
+	hid_device *dev;
+	int i, res;
+
+	memset(&config, 0, sizeof(config));
+	config.report_size = 8;
+	config.report_ids = report_ids;
+	config.num_report_ids = sizeof(report_ids);
+	dev = open_mock_device(&config, 0x0001);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	CHECK(hid_subscribe_report_id(dev, 0x2, count_report, &subscription) == 0);
+	for (i = 0; i < 20; i++) {
+		res = hid_read_timeout(dev, data, sizeof(data), 1000);
+		CHECK(res == 8);
+		CHECK(data[0] == 0x1);
+	}
+	CHECK(subscription.calls >= 19);
+	CHECK(subscription.wrong_id == 0);
+
+	/* Queued for hid_read() again */
+	CHECK(hid_unsubscribe_report_id(dev, 0x2) == 0);
+	for (i = 0, res = 0; i < 4; i++) {
+		if (hid_read_timeout(dev, data, sizeof(data), 1000) == 8 && data[0] == 0x2)
+			res = 1;
+	}
+	CHECK(res);
+	CHECK(hid_unsubscribe_report_id(dev, 0x2) < 0);
+
+	hid_close(dev);
+}
+
+/* Latest mode stores the reports instead of returning them */
+static void test_latest(void)
+{
+	struct hid_mock_device config;
+	unsigned char data[16];
+	unsigned long first, second;
+	hid_device *dev;
+
+	memset(&config, 0, sizeof(config));
+	config.report_size = 8;
+	config.rate = 1000;
+	dev = open_mock_device(&config, 0x0002);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	CHECK(hid_read_latest(dev, 0x0, data, sizeof(data)) < 0);
+	CHECK(hid_set_read_latest(dev, 1) == 0);
+	CHECK(hid_read_latest(dev, 0x0, data, sizeof(data)) == 0);
+
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 50) == 0);
+	CHECK(hid_read_latest(dev, 0x0, data, sizeof(data)) == 8);
+	first = report_sequence(data, 8, 0);
+	CHECK(first > 0);
+
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 50) == 0);
+	CHECK(hid_read_latest(dev, 0x0, data, sizeof(data)) == 8);
+	second = report_sequence(data, 8, 0);
+	CHECK(second > first);
+
+	/* Truncated to the buffer */
+	CHECK(hid_read_latest(dev, 0x0, data, 4) == 4);
+
+	CHECK(hid_set_read_latest(dev, 0) == 0);
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 8);
+
+	hid_close(dev);
+}
+
+/* Changes-only mode drops and counts the reports equal under the mask */
+static void test_changes_only(void)
+{
+	struct hid_mock_device config;
+	static const unsigned char report_ids[] = { 0x3 };
+	/* Only the Report ID is compared, the sequence numbers aren't */
+	static const unsigned char mask[] = { 0xff, 0x00, 0x00, 0x00 };
+	unsigned char data[16];
+	unsigned long long unchanged = 0, generated = 0;
+	hid_device *dev;
+
+	memset(&config, 0, sizeof(config));
+	config.report_size = 4;
+	config.rate = 1000;
+	config.report_ids = report_ids;
+	config.num_report_ids = sizeof(report_ids);
+	dev = open_mock_device(&config, 0x0003);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	CHECK(hid_set_change_mask(dev, 0x3, mask, sizeof(mask)) == 0);
+	CHECK(hid_set_changes_only(dev, 1) == 0);
+
+	/* The first report goes through, the following ones don't */
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 4);
+	CHECK(data[0] == 0x3);
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 100) == 0);
+
+	CHECK(hid_get_unchanged_count(dev, &unchanged) == 0);
+	CHECK(hid_mock_get_stats(dev, &generated, NULL) == 0);
+	CHECK(unchanged > 0);
+	CHECK(unchanged < generated);
+
+	/* Compared entirely, every report differs */
+	CHECK(hid_set_change_mask(dev, 0x3, NULL, 0) == 0);
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 4);
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 4);
+
+	CHECK(hid_set_changes_only(dev, 0) == 0);
+	hid_close(dev);
+}
+
+/* A batch ends at its size, long before its delay */
+static void test_batching(void)
+{
+	struct hid_mock_device config;
+	unsigned char data[16];
+	unsigned long previous, sequence;
+	long long start, elapsed;
+	hid_device *dev;
+	int i;
+
+	memset(&config, 0, sizeof(config));
+	config.report_size = 8;
+	config.rate = 1000;
+	dev = open_mock_device(&config, 0x0004);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	CHECK(hid_set_batching(dev, 5, 0) < 0);
+	CHECK(hid_set_batching(dev, 5, 5000000) == 0);
+
+	start = get_milliseconds();
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 10000) == 8);
+	elapsed = get_milliseconds() - start;
+	CHECK(elapsed < 2500);
+	previous = report_sequence(data, 8, 0);
+
+	/* The rest of the batch is there already, in order */
+	for (i = 0; i < 4; i++) {
+		CHECK(hid_read_timeout(dev, data, sizeof(data), 0) == 8);
+		sequence = report_sequence(data, 8, 0);
+		CHECK(sequence > previous);
+		previous = sequence;
+	}
+
+	/* The caller's timeout still ends a batch */
+	CHECK(hid_set_batching(dev, 30, 5000000) == 0);
+	start = get_milliseconds();
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 100) == 8);
+	elapsed = get_milliseconds() - start;
+	CHECK(elapsed < 2500);
+
+	CHECK(hid_set_batching(dev, 0, 0) == 0);
+	hid_close(dev);
+}
+
+/* A disconnected device fails its reads once drained */
+static void test_disconnect(void)
+{
+	struct hid_mock_device config;
+	unsigned char data[16];
+	hid_device *dev;
+	int i, res = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.report_size = 8;
+	config.rate = 1000;
+	dev = open_mock_device(&config, 0x0005);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 8);
+	CHECK(hid_mock_disconnect(dev) == 0);
+	for (i = 0; i < 1000; i++) {
+		res = hid_read_timeout(dev, data, sizeof(data), 1000);
+		if (res <= 0)
+			break;
+	}
+	CHECK(res < 0);
+	CHECK(hid_error_code(dev) == HID_API_ERROR_NO_DEVICE);
+	hid_close(dev);
+
+	/* After a number of reports */
+	memset(&config, 0, sizeof(config));
+	config.report_size = 8;
+	config.disconnect_after = 10;
+	dev = open_mock_device(&config, 0x0006);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	for (i = 0; i < 10; i++)
+		CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 8);
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) < 0);
+	CHECK(hid_error_code(dev) == HID_API_ERROR_NO_DEVICE);
+	hid_close(dev);
+}
+
+/* A device still open at hid_exit() stays usable until closed */
+static void test_exit_while_open(void)
+{
+	struct hid_mock_device config;
+	unsigned char data[16];
+	wchar_t string[32];
+	hid_device *dev;
+
+	memset(&config, 0, sizeof(config));
+	config.report_size = 8;
+	config.rate = 1000;
+	config.product_string = "Mock";
+	dev = open_mock_device(&config, 0x0007);
+	CHECK(dev != NULL);
+	if (!dev)
+		return;
+
+	hid_exit();
+	CHECK(hid_open(TEST_VENDOR_ID, 0x0007, NULL) == NULL);
+
+	CHECK(hid_read_timeout(dev, data, sizeof(data), 1000) == 8);
+	CHECK(hid_get_product_string(dev, string, sizeof(string) / sizeof(string[0])) == 0);
+	CHECK(wcscmp(string, L"Mock") == 0);
+	hid_close(dev);
+}
+
+int main(void)
+{
+	if (hid_init() < 0) {
+		fprintf(stderr, "hid_init: %ls\n", hid_error(NULL));
+		return 1;
+	}
+
+	test_subscription();
+	test_latest();
+	test_changes_only();
+	test_batching();
+	test_disconnect();
+	test_exit_while_open();
+
+	hid_exit();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
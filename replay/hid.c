@@ -0,0 +1,634 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Alan Ott
+ Signal 11 Software
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/* Unix */
+#include <sys/socket.h>
+
+#include "hidapi_replay.h"
+
+/* The reports are read, filtered and handed out by the code of the
+   hidraw backend, from a socket the player thread sends them to. */
+#define HIDAPI_FD_BACKEND struct capture_player
+#define BACKEND_NAME "captures"
+#include "../linux/hid.c"
+
+/* A capture file mapped for reading, see map_capture_file() */
+struct capture_map {
+	unsigned char *data;
+	size_t size;
+	const struct hid_capture_header *header;
+	const unsigned char *records; /* The first record */
+	size_t records_length;
+};
+
+/* Plays the Input reports of a capture into the socket the device
+   reads from, see player_thread(). */
+struct capture_player {
+	struct capture_map map;
+	int fd; /* The other end of the device_handle socket */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition; /* Signalled on hid_close() and speed changes */
+	int stop;
+	unsigned int speed; /* Percent of the recorded pace, 0 for no delays */
+	int loop;
+
+	/* The last Feature and Input report the player passed for each
+	   Report ID, for hid_get_feature_report() and hid_get_input_report().
+	   Until then the first one of the capture. Protected by mutex. */
+	const struct hid_capture_record *features[256];
+	const struct hid_capture_record *inputs[256];
+
+	/* The strings of the capture, NULL for missing ones */
+	char *strings[DEVICE_STRING_COUNT];
+};
+
+/* A capture added by hid_replay_add_capture(). The list only grows
+   (at its head) until hid_exit(), so it is walked without locking. */
+struct capture_path {
+	struct capture_path *next;
+	char *path;
+};
+
+static struct capture_path *capture_paths = NULL;
+static pthread_mutex_t capture_paths_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Maps the capture file at path for reading. Returns -1 with errno set
+   (to EINVAL if the file isn't a capture) on failure. */
+static int map_capture_file(const char *path, struct capture_map *map)
+{
+	const struct hid_capture_header *header;
+	struct stat st;
+	void *data;
+	uint64_t data_length;
+	int fd, err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	if ((size_t) st.st_size < sizeof(struct hid_capture_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (data == MAP_FAILED) {
+		errno = err;
+		return -1;
+	}
+
+	header = (const struct hid_capture_header*) data;
+	if (memcmp(header->magic, HID_CAPTURE_MAGIC, sizeof(HID_CAPTURE_MAGIC)) != 0 ||
+	    header->version != HID_CAPTURE_VERSION ||
+	    header->header_size < sizeof(struct hid_capture_header) ||
+	    header->header_size > (size_t) st.st_size) {
+		munmap(data, (size_t) st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map->data = (unsigned char*) data;
+	map->size = (size_t) st.st_size;
+	map->header = header;
+	map->records = map->data + header->header_size;
+	map->records_length = map->size - header->header_size;
+
+	/* A capture still being recorded ends with zeroes */
+	data_length = __atomic_load_n(&header->data_length, __ATOMIC_ACQUIRE);
+	if (data_length < map->records_length)
+		map->records_length = (size_t) data_length;
+
+	return 0;
+}
+
+static void unmap_capture_file(struct capture_map *map)
+{
+	munmap(map->data, map->size);
+}
+
+/* Returns the record at *pos and moves *pos to the next one, or returns
+   NULL at the end of the capture. */
+static const struct hid_capture_record *next_capture_record(const struct capture_map *map, size_t *pos)
+{
+	const struct hid_capture_record *record;
+	size_t left;
+
+	if (*pos >= map->records_length || map->records_length - *pos < sizeof(struct hid_capture_record))
+		return NULL;
+
+	record = (const struct hid_capture_record*) (map->records + *pos);
+	left = map->records_length - *pos - sizeof(struct hid_capture_record);
+	if (record->length > left)
+		return NULL;
+
+	*pos += sizeof(struct hid_capture_record) + ((record->length + (size_t) 7) & ~(size_t) 7);
+	return record;
+}
+
+/* Copies the strings of a capture, which come before its reports */
+static void get_capture_strings(const struct capture_map *map, char **strings)
+{
+	const struct hid_capture_record *record;
+	size_t pos = 0;
+	int i;
+
+	for (i = 0; i < DEVICE_STRING_COUNT; i++)
+		strings[i] = NULL;
+
+	while ((record = next_capture_record(map, &pos)) != NULL) {
+		switch (record->type) {
+			case HID_CAPTURE_MANUFACTURER:
+				i = DEVICE_STRING_MANUFACTURER;
+				break;
+			case HID_CAPTURE_PRODUCT:
+				i = DEVICE_STRING_PRODUCT;
+				break;
+			case HID_CAPTURE_SERIAL_NUMBER:
+				i = DEVICE_STRING_SERIAL;
+				break;
+			default:
+				return;
+		}
+
+		if (!strings[i])
+			strings[i] = strndup((const char*) (record + 1), record->length);
+	}
+}
+
+static void free_capture_strings(char **strings)
+{
+	int i;
+
+	for (i = 0; i < DEVICE_STRING_COUNT; i++)
+		free(strings[i]);
+}
+
+/* Gets a device string into either string or string_utf8 (the other one
+   being NULL), both being maxlen long in their character type. */
+static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, char *string_utf8, size_t maxlen)
+{
+	if ((!string && !string_utf8) || !maxlen) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	register_device_error(dev, NULL);
+
+	if (store_device_string(dev->backend->strings[key], string, string_utf8, maxlen) < 0) {
+		register_device_error_code(dev, HID_API_ERROR_NOT_FOUND, "The capture doesn't have this string");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The monotonic clock in nanoseconds */
+static uint64_t get_nanoseconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Sends the Input reports of the capture to the device, at the recorded
+   pace scaled by the speed, or as fast as the reader takes them. Then
+   shuts the socket down, which the reader sees as a disconnection. */
+static void *player_thread(void *param)
+{
+	struct capture_player *player = (struct capture_player*) param;
+	const struct hid_capture_record *record;
+	uint64_t due = 0;
+	uint64_t last_timestamp = 0;
+	size_t pos = 0;
+	int first = 1;
+	int played = 0;
+
+	pthread_mutex_lock(&player->mutex);
+	while (!player->stop) {
+		unsigned int speed;
+		ssize_t res;
+
+		record = next_capture_record(&player->map, &pos);
+		if (!record) {
+			/* Looping a capture without Input reports would spin */
+			if (!player->loop || !played)
+				break;
+			pos = 0;
+			first = 1;
+			played = 0;
+			continue;
+		}
+
+		/* Feature and Input reports read by the application are
+		   returned as they were at this point of the capture */
+		if (record->length > 0 && record->type == HID_CAPTURE_FEATURE_GET)
+			player->features[((const unsigned char*) (record + 1))[0]] = record;
+		if (record->length > 0 && record->type == HID_CAPTURE_INPUT_GET)
+			player->inputs[((const unsigned char*) (record + 1))[0]] = record;
+
+		if (record->type != HID_CAPTURE_INPUT)
+			continue;
+
+		/* The schedule follows speed changes from here on */
+		if (first || player->speed == 0)
+			due = get_nanoseconds();
+		else if (record->timestamp_ns > last_timestamp)
+			due += (record->timestamp_ns - last_timestamp) * 100 / player->speed;
+		last_timestamp = record->timestamp_ns;
+		first = 0;
+
+		while (!player->stop && player->speed > 0 && get_nanoseconds() < due) {
+			struct timespec deadline;
+			deadline.tv_sec = (time_t) (due / 1000000000);
+			deadline.tv_nsec = (long) (due % 1000000000);
+			pthread_cond_timedwait(&player->condition, &player->mutex, &deadline);
+		}
+		if (player->stop)
+			break;
+		speed = player->speed;
+		pthread_mutex_unlock(&player->mutex);
+
+		/* At the recorded pace, a reader falling behind loses reports
+		   like it would with a device */
+		res = send(player->fd, record + 1, record->length, MSG_NOSIGNAL | (speed? MSG_DONTWAIT: 0));
+
+		pthread_mutex_lock(&player->mutex);
+		if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			break; /* The device is being closed */
+		played = 1;
+	}
+	pthread_mutex_unlock(&player->mutex);
+
+	shutdown(player->fd, SHUT_WR);
+	return NULL;
+}
+
+static void free_capture_player(struct capture_player *player)
+{
+	free_capture_strings(player->strings);
+	unmap_capture_file(&player->map);
+	pthread_cond_destroy(&player->condition);
+	pthread_mutex_destroy(&player->mutex);
+	free(player);
+}
+
+/* Prepares the playback of the capture at path. The defaults of
+   hid_replay_set_speed() and hid_replay_set_loop() come from the
+   environment. Returns NULL with errno set on failure. */
+static struct capture_player *new_capture_player(const char *path)
+{
+	struct capture_player *player;
+	const struct hid_capture_record *record;
+	pthread_condattr_t attr;
+	const char *env;
+	size_t pos = 0;
+
+	player = (struct capture_player*) calloc(1, sizeof(struct capture_player));
+	if (!player)
+		return NULL;
+
+	if (map_capture_file(path, &player->map) < 0) {
+		int err = errno;
+		free(player);
+		errno = err;
+		return NULL;
+	}
+
+	get_capture_strings(&player->map, player->strings);
+
+	/* Until the player passes one, the first report is returned */
+	while ((record = next_capture_record(&player->map, &pos)) != NULL) {
+		const struct hid_capture_record **table;
+
+		if (record->type == HID_CAPTURE_FEATURE_GET)
+			table = player->features;
+		else if (record->type == HID_CAPTURE_INPUT_GET)
+			table = player->inputs;
+		else
+			continue;
+
+		if (record->length > 0 && !table[((const unsigned char*) (record + 1))[0]])
+			table[((const unsigned char*) (record + 1))[0]] = record;
+	}
+
+	player->fd = -1;
+	pthread_mutex_init(&player->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); /* For player_thread() */
+	pthread_cond_init(&player->condition, &attr);
+	pthread_condattr_destroy(&attr);
+
+	env = getenv("HIDAPI_REPLAY_SPEED");
+	player->speed = (env && *env)? (unsigned int) strtoul(env, NULL, 10): 100;
+	env = getenv("HIDAPI_REPLAY_LOOP");
+	player->loop = env && *env && strcmp(env, "0") != 0;
+
+	return player;
+}
+
+/* Stops the player thread of dev, which may be blocked sending */
+static void stop_capture_player(hid_device *dev)
+{
+	struct capture_player *player = dev->backend;
+
+	shutdown(dev->device_handle, SHUT_RDWR);
+
+	pthread_mutex_lock(&player->mutex);
+	player->stop = 1;
+	pthread_cond_signal(&player->condition);
+	pthread_mutex_unlock(&player->mutex);
+
+	pthread_join(player->thread, NULL);
+	close(player->fd);
+}
+
+/* Returns the report with the Report ID data[0] from table, see
+   struct capture_player. */
+static int get_played_report(hid_device *dev, const struct hid_capture_record **table, hid_capture_record_type type, unsigned char *data, size_t length)
+{
+	const struct hid_capture_record *record;
+	size_t len = 0;
+
+	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	register_device_error(dev, NULL);
+
+	pthread_mutex_lock(&dev->backend->mutex);
+	record = table[data[0]];
+	if (record) {
+		len = (length < record->length)? length: record->length;
+		memcpy(data, record + 1, len);
+	}
+	pthread_mutex_unlock(&dev->backend->mutex);
+
+	if (!record) {
+		register_device_error_code(dev, HID_API_ERROR_NOT_FOUND, "The capture has no report with this Report ID");
+		return -1;
+	}
+
+	capture_report(dev, type, data, len);
+	return (int) len;
+}
+
+/* Stops the player of dev before its socket is closed */
+static void close_backend_device(hid_device *dev)
+{
+	stop_capture_player(dev);
+	free_capture_player(dev->backend);
+}
+
+/* Forgets the captures of hid_replay_add_capture() */
+static void exit_backend(void)
+{
+	pthread_mutex_lock(&capture_paths_mutex);
+	while (capture_paths) {
+		struct capture_path *next = capture_paths->next;
+		free(capture_paths->path);
+		free(capture_paths);
+		capture_paths = next;
+	}
+	pthread_mutex_unlock(&capture_paths_mutex);
+}
+
+
+/* Sends the record of the capture at path to the sink if it matches
+   the filter. Files which aren't captures are skipped. Returns non-zero
+   if the enumeration must stop. */
+static int enumerate_capture(const char *path, const struct hid_filter *filter, struct enum_arena *arena, struct enum_sink *sink)
+{
+	const struct hid_capture_header *header;
+	struct capture_map map;
+	struct hid_device_info info;
+	char *strings[DEVICE_STRING_COUNT];
+	int stop = 0;
+
+	if (map_capture_file(path, &map) < 0)
+		return 0;
+
+	header = map.header;
+	get_capture_strings(&map, strings);
+
+	if (filter_match_bus(filter, (hid_bus_type) header->bus_type) &&
+	    filter_match_ids(filter, header->vendor_id, header->product_id) &&
+	    filter_match_serial(filter, strings[DEVICE_STRING_SERIAL]) &&
+	    filter_match_interface(filter, header->interface_number) &&
+	    filter_match_usage(filter, header->usage_page, header->usage)) {
+		memset(&info, 0, sizeof(info));
+		info.path = enum_arena_strdup(arena, path);
+		info.vendor_id = header->vendor_id;
+		info.product_id = header->product_id;
+		info.release_number = header->release_number;
+		info.interface_number = header->interface_number;
+		info.bus_type = (hid_bus_type) header->bus_type;
+		info.serial_number_utf8 = enum_arena_strdup(arena, strings[DEVICE_STRING_SERIAL]);
+		info.serial_number = enum_arena_utf8_to_wchar_t(arena, strings[DEVICE_STRING_SERIAL]);
+		set_device_info_strings(arena, &info, strings[DEVICE_STRING_MANUFACTURER], strings[DEVICE_STRING_PRODUCT]);
+
+		stop = enum_sink_add(arena, sink, &info, header->usage_page, header->usage);
+	}
+
+	free_capture_strings(strings);
+	unmap_capture_file(&map);
+	return stop;
+}
+
+/* Sends the captures matching the filter to the sink, until it says
+   to stop: the ones of the HIDAPI_REPLAY environment variable (a list
+   separated by ':'), then the ones of hid_replay_add_capture(). The
+   strings of the records are allocated from the arena. */
+static int enumerate_devices(hid_context *ctx, const struct hid_filter *filter, struct enum_arena *arena, struct enum_sink *sink)
+{
+	struct capture_path *cur;
+	const char *env;
+	int stop = 0;
+
+	init_context(ctx);
+	/* register_global_error: global error is reset by init_context */
+
+	env = getenv("HIDAPI_REPLAY");
+	if (env) {
+		char *paths = strdup(env);
+		char *saveptr = NULL;
+		char *path;
+
+		if (!paths) {
+			register_global_error_code(ctx, HID_API_ERROR_NO_MEM, "Couldn't copy HIDAPI_REPLAY");
+			return -1;
+		}
+
+		for (path = strtok_r(paths, ":", &saveptr); path && !stop; path = strtok_r(NULL, ":", &saveptr))
+			stop = enumerate_capture(path, filter, arena, sink);
+		free(paths);
+	}
+
+	for (cur = __atomic_load_n(&capture_paths, __ATOMIC_ACQUIRE); cur && !stop; cur = cur->next)
+		stop = enumerate_capture(cur->path, filter, arena, sink);
+
+	return 0;
+}
+
+hid_device * HID_API_EXPORT hid_context_open_path(hid_context *ctx, const char *path)
+{
+	hid_device *dev = NULL;
+	struct capture_player *player;
+	int fds[2];
+	int err;
+
+	ctx = resolve_context(ctx);
+
+	init_context(ctx);
+	/* register_global_error: global error is reset by init_context */
+
+	player = new_capture_player(path);
+	if (!player) {
+		err = errno;
+		register_global_error_format(ctx, errno_to_error_code(err), "Failed to open a capture with path '%s': %s", path, strerror(err));
+		return NULL;
+	}
+
+	/* The reports keep their boundaries, like with a hidraw node */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		err = errno;
+		free_capture_player(player);
+		register_global_error_format(ctx, errno_to_error_code(err), "socketpair failed: %s", strerror(err));
+		return NULL;
+	}
+
+	dev = new_hid_device();
+	dev->device_handle = fds[0];
+	dev->uses_numbered_reports = (player->map.header->flags & HID_CAPTURE_NUMBERED_REPORTS) != 0;
+	dev->backend = player;
+	player->fd = fds[1];
+
+	if (pthread_create(&player->thread, NULL, player_thread, player) != 0) {
+		close(fds[1]);
+		close(fds[0]);
+		free_capture_player(player);
+		free_hid_device(dev);
+		register_global_error(ctx, "Couldn't start the player thread");
+		return NULL;
+	}
+
+	return dev;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	if (!data || (length == 0)) {
+		errno = EINVAL;
+		register_device_error_errno(dev, NULL, errno);
+		return -1;
+	}
+
+	/* The Output reports of the capture aren't played, the ones of
+	   the application go nowhere */
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_OUTPUT, data, length);
+
+	return (int) length;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	if (!data || (length == 0)) {
+		register_device_error_code(dev, HID_API_ERROR_INVALID_PARAM, "Zero buffer/length");
+		return -1;
+	}
+
+	register_device_error(dev, NULL);
+	capture_report(dev, HID_CAPTURE_FEATURE_SET, data, length);
+
+	return (int) length;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	return get_played_report(dev, dev->backend->features, HID_CAPTURE_FEATURE_GET, data, length);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	return get_played_report(dev, dev->backend->inputs, HID_CAPTURE_INPUT_GET, data, length);
+}
+
+int HID_API_EXPORT_CALL hid_replay_add_capture(const char *path)
+{
+	struct capture_path *cur;
+
+	if (!path) {
+		register_global_error_code(&default_context, HID_API_ERROR_INVALID_PARAM, "hid_replay_add_capture: NULL path");
+		return -1;
+	}
+
+	cur = (struct capture_path*) calloc(1, sizeof(struct capture_path));
+	if (cur)
+		cur->path = strdup(path);
+	if (!cur || !cur->path) {
+		free(cur);
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, "hid_replay_add_capture: out of memory");
+		return -1;
+	}
+
+	pthread_mutex_lock(&capture_paths_mutex);
+	cur->next = capture_paths;
+	__atomic_store_n(&capture_paths, cur, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&capture_paths_mutex);
+
+	register_global_error(&default_context, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_replay_set_speed(hid_device *dev, unsigned int percent)
+{
+	pthread_mutex_lock(&dev->backend->mutex);
+	dev->backend->speed = percent;
+	pthread_cond_signal(&dev->backend->condition);
+	pthread_mutex_unlock(&dev->backend->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_replay_set_loop(hid_device *dev, int loop)
+{
+	pthread_mutex_lock(&dev->backend->mutex);
+	dev->backend->loop = loop;
+	pthread_mutex_unlock(&dev->backend->mutex);
+
+	register_device_error(dev, NULL);
+	return 0;
+}
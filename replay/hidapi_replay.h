@@ -0,0 +1,112 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/** @file
+ * @defgroup API hidapi API
+
+ * Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0).
+ */
+
+#ifndef HIDAPI_REPLAY_H__
+#define HIDAPI_REPLAY_H__
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+		/** @brief Add a capture file to the devices of the replay backend.
+
+			The replay backend (hidapi-replay) implements the hidapi API
+			on top of capture files recorded with hid_start_capture(),
+			so an application can be run against a recorded session
+			instead of a device. hid_enumerate() lists a device for each
+			capture: the ones given in the HIDAPI_REPLAY environment
+			variable (paths separated by ':') and the ones added with
+			this function. The path of a device is the path of its
+			capture, which can also be passed to hid_open_path()
+			directly.
+
+			An opened device plays the Input reports of its capture to
+			hid_read() and the other reading functions, then reports a
+			disconnection at its end (unless looping, see
+			hid_replay_set_loop()). hid_get_feature_report() and
+			hid_get_input_report() return the last report of the Report
+			ID read during the recording before that point of the
+			capture, or the first one. Output and Feature reports the
+			application sends are accepted and dropped. The strings
+			and the Report ID numbering come from the capture.
+
+			The captures added are forgotten by hid_exit().
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param path The path of the capture file.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+				Files which aren't captures are skipped by hid_enumerate().
+		*/
+		int HID_API_EXPORT_CALL hid_replay_add_capture(const char *path);
+
+		/** @brief Set the pace of the playback.
+
+			By default the reports are played at the pace they were
+			recorded, or at the percentage given in the
+			HIDAPI_REPLAY_SPEED environment variable. An application
+			reading slower than that loses reports, like it would with
+			the device. With a speed of 0 the reports are played as fast
+			as the application reads them, and none is lost.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param percent The speed in percent of the recorded one
+				(200 plays twice as fast), or 0.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_replay_set_speed(hid_device *dev, unsigned int percent);
+
+		/** @brief Play the capture again from its start when it ends.
+
+			The default comes from the HIDAPI_REPLAY_LOOP environment
+			variable (set and not "0" to loop). Once the end was
+			reached without looping, the device stays disconnected.
+
+			Since version 0.13.0, @ref HID_API_VERSION >= HID_API_MAKE_VERSION(0, 13, 0)
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param loop Non-zero to loop, 0 to stop at the end.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_replay_set_loop(hid_device *dev, int loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
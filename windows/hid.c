@@ -60,6 +60,12 @@ typedef LONG NTSTATUS;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 #ifdef MIN
 #undef MIN
@@ -170,6 +176,106 @@ err:
 
 #endif /* HIDAPI_USE_DDK */
 
+/* A callback of hid_subscribe_report_id() */
+struct report_subscription {
+	hid_report_callback callback;
+	void *user_data;
+};
+
+/* Linked List of input reports held back by hid_transact(). */
+struct input_report {
+	unsigned char *data;
+	size_t len;
+	struct input_report *next;
+};
+
+/* The newest Input report of a Report ID, see hid_read_latest().
+   Written by one thread at a time and read lock-free by any number of
+   threads: seq is odd while the writer copies the report, and a reader
+   retries when seq changed during its own copy. */
+struct latest_report {
+	volatile LONG seq;
+	volatile size_t len;
+	size_t capacity;
+	unsigned char *data;
+	/* The smaller slot this one replaced, see store_latest_report() */
+	struct latest_report *retired;
+};
+
+/* A report in the broadcast ring. Like in latest_report, seq is odd
+   while the report is written; number tells which report it is. */
+struct broadcast_slot {
+	volatile LONG seq;
+	volatile LONG number;
+	volatile size_t len;
+	unsigned char *data;
+};
+
+/* The ring of broadcast mode, see hid_set_broadcast(). Written by
+   the reader reading from the device for all of them (see
+   hid_broadcast_read()), which never waits for the others, and read
+   lock-free by each reader at its own cursor. Report n goes to slot
+   n & mask and head is the number of the next report. lock and
+   condition only put the readers to sleep while the ring has nothing
+   new for them; waiters tells the writer whether to wake them up. */
+struct broadcast_ring {
+	ULONG mask;
+	size_t slot_size;
+	struct broadcast_slot *slots;
+	volatile LONG head;
+	volatile LONG waiters;
+	unsigned int readers; /* Open readers, protected by subscriptions_lock of the device */
+	BOOL pumping; /* A reader reads from the device for the others, protected by lock */
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE condition;
+};
+
+/* A reader of the broadcast ring, see hid_broadcast_open() */
+struct hid_broadcast_reader_ {
+	hid_device *dev;
+	struct broadcast_ring *ring;
+	ULONG cursor; /* The number of the next report to read */
+	unsigned long long overflow;
+};
+
+/* The previous Input report of a Report ID in changes-only mode,
+   see hid_set_changes_only(). */
+struct change_filter {
+	unsigned char *data;
+	size_t len; /* 0 until the first report */
+	size_t capacity;
+	unsigned char *mask; /* see hid_set_change_mask() */
+	size_t mask_len;
+};
+
+/* The decimation stage of a Report ID, see hid_set_decimation(). */
+struct report_decimator {
+	struct hid_decimation config;
+	unsigned int skipped; /* HID_DECIMATE_EVERY_NTH: reports since the last one delivered */
+	unsigned char *window; /* The report of the open window */
+	size_t window_len; /* 0 while no window is open */
+	size_t capacity;
+	unsigned int window_count; /* Reports in the open window */
+	DWORD window_end;
+};
+
+/* A capture file being recorded, see hid_start_capture(). The records
+   are copied into a view of the file, which is grown and mapped again
+   when full. */
+struct capture_file {
+	HANDLE file;
+	HANDLE mapping;
+	unsigned char *map;
+	size_t map_size;
+	size_t used; /* The header and the complete records */
+	LONGLONG frequency; /* Of QueryPerformanceCounter() */
+	ULONGLONG start_ns;
+};
+
+/* The first size of a capture file, and the largest step it grows by */
+#define CAPTURE_MIN_SIZE (1024 * 1024)
+#define CAPTURE_MAX_STEP (64 * 1024 * 1024)
+
 struct hid_device_ {
 		HANDLE device_handle;
 		BOOL blocking;
@@ -179,13 +285,262 @@ struct hid_device_ {
 		USHORT feature_report_length;
 		unsigned char *feature_buf;
 		wchar_t *last_error_str;
+		int last_error_code;
 		BOOL read_pending;
 		char *read_buf;
 		OVERLAPPED ol;
 		OVERLAPPED write_ol;
 		struct hid_device_info* device_info;
+		/* Callbacks of hid_subscribe_report_id(), indexed by Report ID and
+		   allocated on the first subscription. Protected by
+		   subscriptions_lock, which is held while a callback runs. */
+		struct report_subscription *subscriptions;
+		CRITICAL_SECTION subscriptions_lock;
+		/* Latest mode, see hid_set_read_latest(). The slots, indexed by
+		   Report ID, are written by the thread holding latest_lock.
+		   latest_reports is allocated by the first call. */
+		volatile LONG read_latest;
+		struct latest_report **latest_reports;
+		CRITICAL_SECTION latest_lock;
+		/* Changes-only mode, see hid_set_changes_only(), and the stages
+		   of hid_set_decimation(). The filters and the stages, indexed
+		   by Report ID, and the count are protected by changes_lock. */
+		int changes_only;
+		struct change_filter *change_filters;
+		unsigned long long unchanged_count;
+		struct report_decimator **decimators;
+		CRITICAL_SECTION changes_lock;
+		/* The reports hid_transact() read while waiting for its response,
+		   returned by hid_read_timeout() before reading new ones. Only
+		   used by the thread reading from the device. */
+		struct input_report *held_reports;
+		/* The ring of broadcast mode, see hid_set_broadcast().
+		   Replaced under subscriptions_lock. */
+		struct broadcast_ring *broadcast;
+		/* Batching, see hid_set_batching(). batch_delay_us is set
+		   before batch_reports, which is read first. */
+		volatile LONG batch_reports;
+		unsigned int batch_delay_us;
+		/* The capture file of hid_start_capture(). Replaced and
+		   written under capture_lock. */
+		struct capture_file *capture;
+		CRITICAL_SECTION capture_lock;
 };
 
+/* Allocates a ring of num_slots (a power of two) reports of up to
+   slot_size bytes each. */
+static struct broadcast_ring *new_broadcast_ring(unsigned int num_slots, size_t slot_size)
+{
+	struct broadcast_ring *ring;
+	unsigned char *data;
+	unsigned int i;
+
+	if (slot_size > SIZE_MAX / num_slots)
+		return NULL;
+
+	ring = (struct broadcast_ring*) calloc(1, sizeof(struct broadcast_ring));
+	if (!ring)
+		return NULL;
+	ring->slots = (struct broadcast_slot*) calloc(num_slots, sizeof(struct broadcast_slot));
+	data = (unsigned char*) malloc(num_slots * slot_size);
+	if (!ring->slots || !data) {
+		free(ring->slots);
+		free(data);
+		free(ring);
+		return NULL;
+	}
+
+	for (i = 0; i < num_slots; i++)
+		ring->slots[i].data = data + i * slot_size;
+	ring->mask = num_slots - 1;
+	ring->slot_size = slot_size;
+	InitializeCriticalSection(&ring->lock);
+	InitializeConditionVariable(&ring->condition);
+	return ring;
+}
+
+static void free_broadcast_ring(struct broadcast_ring *ring)
+{
+	DeleteCriticalSection(&ring->lock);
+	free(ring->slots[0].data);
+	free(ring->slots);
+	free(ring);
+}
+
+/* Maps at least size bytes of a capture file, growing the file. The
+   size doubles up to CAPTURE_MAX_STEP at a time. */
+static BOOL grow_capture_file(struct capture_file *capture, size_t size)
+{
+	size_t step = capture->map_size < CAPTURE_MAX_STEP? capture->map_size: CAPTURE_MAX_STEP;
+	size_t map_size = capture->map_size + step;
+	ULONGLONG map_size64;
+	HANDLE mapping;
+	unsigned char *map;
+
+	if (map_size < size)
+		map_size = size;
+	map_size = (map_size + CAPTURE_MIN_SIZE - 1) & ~((size_t) CAPTURE_MIN_SIZE - 1);
+	map_size64 = (ULONGLONG) map_size;
+
+	/* Mapping past the end of the file extends it with zeroes */
+	mapping = CreateFileMappingW(capture->file, NULL, PAGE_READWRITE, (DWORD) (map_size64 >> 32), (DWORD) map_size64, NULL);
+	if (!mapping)
+		return FALSE;
+	map = (unsigned char*) MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, map_size);
+	if (!map) {
+		CloseHandle(mapping);
+		return FALSE;
+	}
+
+	if (capture->map) {
+		UnmapViewOfFile(capture->map);
+		CloseHandle(capture->mapping);
+	}
+	capture->mapping = mapping;
+	capture->map = map;
+	capture->map_size = map_size;
+	return TRUE;
+}
+
+/* The time since the capture started, in nanoseconds */
+static ULONGLONG capture_time_ns(struct capture_file *capture)
+{
+	LARGE_INTEGER count;
+
+	QueryPerformanceCounter(&count);
+	return (ULONGLONG) (count.QuadPart / capture->frequency) * 1000000000 +
+	       (ULONGLONG) (count.QuadPart % capture->frequency) * 1000000000 / capture->frequency;
+}
+
+/* Appends a record to a capture file. The file was extended with
+   zeroes, so the padding is zero already. */
+static void append_capture_record(struct capture_file *capture, USHORT type, const unsigned char *data, size_t length)
+{
+	struct hid_capture_record *record;
+	size_t size = sizeof(struct hid_capture_record) + ((length + 7) & ~(size_t) 7);
+
+	if (capture->used + size > capture->map_size && !grow_capture_file(capture, capture->used + size))
+		return;
+
+	record = (struct hid_capture_record*) (capture->map + capture->used);
+	record->timestamp_ns = capture_time_ns(capture) - capture->start_ns;
+	record->length = (uint32_t) length;
+	record->type = type;
+	memcpy(record + 1, data, length);
+	capture->used += size;
+
+	/* Only now is the record part of the capture */
+	MemoryBarrier();
+	((struct hid_capture_header*) capture->map)->data_length = (uint64_t) (capture->used - sizeof(struct hid_capture_header));
+}
+
+/* Records a report of dev, if hid_start_capture() was called. data
+   starts with the Report ID, 0x0 for unnumbered reports, which Input
+   reports are recorded without, like hid_read() returns them. */
+static void capture_report(hid_device *dev, hid_capture_record_type type, const unsigned char *data, size_t length)
+{
+	if (!InterlockedCompareExchangePointer((PVOID volatile *) &dev->capture, NULL, NULL))
+		return;
+
+	EnterCriticalSection(&dev->capture_lock);
+	if (dev->capture) {
+		/* Windows doesn't tell, the Report IDs do */
+		if (data[0] != 0x0)
+			((struct hid_capture_header*) dev->capture->map)->flags |= HID_CAPTURE_NUMBERED_REPORTS;
+		if (type == HID_CAPTURE_INPUT && data[0] == 0x0) {
+			data++;
+			length--;
+		}
+		append_capture_record(dev->capture, (USHORT) type, data, length);
+	}
+	LeaveCriticalSection(&dev->capture_lock);
+}
+
+/* Truncates a capture file to its records and closes it */
+static void close_capture_file(struct capture_file *capture)
+{
+	if (capture->map) {
+		LARGE_INTEGER end;
+
+		UnmapViewOfFile(capture->map);
+		CloseHandle(capture->mapping);
+
+		end.QuadPart = (LONGLONG) capture->used;
+		if (SetFilePointerEx(capture->file, end, NULL, FILE_BEGIN))
+			SetEndOfFile(capture->file);
+	}
+	CloseHandle(capture->file);
+	free(capture);
+}
+
+/* Creates a capture file with its header and the strings of info.
+   The path is UTF-8. */
+static struct capture_file *create_capture_file(const char *path, const struct hid_device_info *info)
+{
+	struct capture_file *capture;
+	struct hid_capture_header *header;
+	LARGE_INTEGER frequency;
+	wchar_t *wpath;
+	int len;
+
+	len = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, NULL, 0);
+	if (!len)
+		return NULL;
+	wpath = (wchar_t*) calloc(len, sizeof(wchar_t));
+	if (!wpath)
+		return NULL;
+	MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, wpath, len);
+
+	capture = (struct capture_file*) calloc(1, sizeof(struct capture_file));
+	if (!capture) {
+		free(wpath);
+		return NULL;
+	}
+
+	capture->file = CreateFileW(wpath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	free(wpath);
+	if (capture->file == INVALID_HANDLE_VALUE) {
+		free(capture);
+		return NULL;
+	}
+
+	if (!grow_capture_file(capture, CAPTURE_MIN_SIZE)) {
+		close_capture_file(capture);
+		return NULL;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	capture->frequency = frequency.QuadPart;
+	capture->start_ns = capture_time_ns(capture);
+	capture->used = sizeof(struct hid_capture_header);
+
+	header = (struct hid_capture_header*) capture->map;
+	memcpy(header->magic, HID_CAPTURE_MAGIC, sizeof(HID_CAPTURE_MAGIC));
+	header->version = HID_CAPTURE_VERSION;
+	header->header_size = sizeof(struct hid_capture_header);
+	header->start_time_ns = capture->start_ns;
+	header->interface_number = -1;
+
+	if (info) {
+		header->vendor_id = info->vendor_id;
+		header->product_id = info->product_id;
+		header->release_number = info->release_number;
+		header->usage_page = info->usage_page;
+		header->usage = info->usage;
+		header->bus_type = (uint16_t) info->bus_type;
+		header->interface_number = info->interface_number;
+
+		if (info->manufacturer_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_MANUFACTURER, (const unsigned char*) info->manufacturer_string_utf8, strlen(info->manufacturer_string_utf8));
+		if (info->product_string_utf8)
+			append_capture_record(capture, HID_CAPTURE_PRODUCT, (const unsigned char*) info->product_string_utf8, strlen(info->product_string_utf8));
+		if (info->serial_number_utf8)
+			append_capture_record(capture, HID_CAPTURE_SERIAL_NUMBER, (const unsigned char*) info->serial_number_utf8, strlen(info->serial_number_utf8));
+	}
+
+	return capture;
+}
+
 static hid_device *new_hid_device()
 {
 	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
@@ -202,6 +557,7 @@ static hid_device *new_hid_device()
 	dev->feature_report_length = 0;
 	dev->feature_buf = NULL;
 	dev->last_error_str = NULL;
+	dev->last_error_code = HID_API_ERROR_SUCCESS;
 	dev->read_pending = FALSE;
 	dev->read_buf = NULL;
 	memset(&dev->ol, 0, sizeof(dev->ol));
@@ -209,6 +565,22 @@ static hid_device *new_hid_device()
 	memset(&dev->write_ol, 0, sizeof(dev->write_ol));
 	dev->write_ol.hEvent = CreateEvent(NULL, FALSE, FALSE /*inital state f=nonsignaled*/, NULL);
 	dev->device_info = NULL;
+	dev->subscriptions = NULL;
+	InitializeCriticalSection(&dev->subscriptions_lock);
+	dev->read_latest = 0;
+	dev->latest_reports = NULL;
+	InitializeCriticalSection(&dev->latest_lock);
+	dev->changes_only = 0;
+	dev->change_filters = NULL;
+	dev->unchanged_count = 0;
+	dev->decimators = NULL;
+	InitializeCriticalSection(&dev->changes_lock);
+	dev->held_reports = NULL;
+	dev->broadcast = NULL;
+	dev->batch_reports = 0;
+	dev->batch_delay_us = 0;
+	dev->capture = NULL;
+	InitializeCriticalSection(&dev->capture_lock);
 
 	return dev;
 }
@@ -224,10 +596,92 @@ static void free_hid_device(hid_device *dev)
 	free(dev->feature_buf);
 	free(dev->read_buf);
 	hid_free_enumeration(dev->device_info);
+	free(dev->subscriptions);
+	DeleteCriticalSection(&dev->subscriptions_lock);
+	if (dev->latest_reports) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			struct latest_report *slot = dev->latest_reports[i];
+			while (slot) {
+				struct latest_report *retired = slot->retired;
+				free(slot);
+				slot = retired;
+			}
+		}
+		free(dev->latest_reports);
+	}
+	DeleteCriticalSection(&dev->latest_lock);
+	if (dev->change_filters) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			free(dev->change_filters[i].data);
+			free(dev->change_filters[i].mask);
+		}
+		free(dev->change_filters);
+	}
+	if (dev->decimators) {
+		int i;
+		for (i = 0; i < 256; i++) {
+			if (dev->decimators[i]) {
+				free(dev->decimators[i]->window);
+				free(dev->decimators[i]);
+			}
+		}
+		free(dev->decimators);
+	}
+	DeleteCriticalSection(&dev->changes_lock);
+	if (dev->broadcast)
+		free_broadcast_ring(dev->broadcast);
+	if (dev->capture)
+		close_capture_file(dev->capture);
+	DeleteCriticalSection(&dev->capture_lock);
+	while (dev->held_reports) {
+		struct input_report *next = dev->held_reports->next;
+		free(dev->held_reports->data);
+		free(dev->held_reports);
+		dev->held_reports = next;
+	}
 	free(dev);
 }
 
-static void register_winapi_error_to_buffer(wchar_t **error_buffer, const WCHAR *op)
+/* Maps a GetLastError() value to a hid_api_error code. */
+static int winapi_error_to_error_code(DWORD error_code)
+{
+	switch (error_code) {
+		case ERROR_SUCCESS:
+			return HID_API_ERROR_SUCCESS;
+		case ERROR_INVALID_PARAMETER:
+		case ERROR_INVALID_USER_BUFFER:
+			return HID_API_ERROR_INVALID_PARAM;
+		case ERROR_FILE_NOT_FOUND:
+		case ERROR_PATH_NOT_FOUND:
+			return HID_API_ERROR_NOT_FOUND;
+		case ERROR_ACCESS_DENIED:
+			return HID_API_ERROR_ACCESS;
+		case ERROR_DEVICE_NOT_CONNECTED:
+		case ERROR_DEV_NOT_EXIST:
+		case ERROR_BAD_COMMAND:
+			return HID_API_ERROR_NO_DEVICE;
+		case ERROR_SHARING_VIOLATION:
+		case ERROR_BUSY:
+			return HID_API_ERROR_BUSY;
+		case WAIT_TIMEOUT:
+		case ERROR_SEM_TIMEOUT:
+			return HID_API_ERROR_TIMEOUT;
+		case ERROR_OPERATION_ABORTED:
+			return HID_API_ERROR_INTERRUPTED;
+		case ERROR_NOT_ENOUGH_MEMORY:
+		case ERROR_OUTOFMEMORY:
+			return HID_API_ERROR_NO_MEM;
+		case ERROR_NOT_SUPPORTED:
+		case ERROR_INVALID_FUNCTION:
+			return HID_API_ERROR_NOT_SUPPORTED;
+		default:
+			return HID_API_ERROR_IO;
+	}
+}
+
+static void register_winapi_error_to_buffer(wchar_t **error_buffer, const WCHAR *op, DWORD error_code)
 {
 	free(*error_buffer);
 	*error_buffer = NULL;
@@ -238,7 +692,6 @@ static void register_winapi_error_to_buffer(wchar_t **error_buffer, const WCHAR
 	}
 
 	WCHAR system_err_buf[1024];
-	DWORD error_code = GetLastError();
 
 	DWORD system_err_len = FormatMessageW(
 		FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
@@ -295,24 +748,126 @@ static void register_string_error_to_buffer(wchar_t **error_buffer, const WCHAR
 
 static void register_winapi_error(hid_device *dev, const WCHAR *op)
 {
-	register_winapi_error_to_buffer(&dev->last_error_str, op);
+	DWORD error_code = GetLastError();
+
+	register_winapi_error_to_buffer(&dev->last_error_str, op, error_code);
+	dev->last_error_code = winapi_error_to_error_code(error_code);
+}
+
+static void register_string_error_code(hid_device *dev, int code, const WCHAR *string_error)
+{
+	register_string_error_to_buffer(&dev->last_error_str, string_error);
+	dev->last_error_code = code;
 }
 
 static void register_string_error(hid_device *dev, const WCHAR *string_error)
 {
-	register_string_error_to_buffer(&dev->last_error_str, string_error);
+	register_string_error_code(dev, string_error? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, string_error);
+}
+
+/* The last global error of a thread, see hid_error(NULL). Each thread
+   gets its own (allocated on its first error), so that concurrent
+   hid_enumerate()/hid_open() calls don't clobber each other's errors.
+   A fiber local storage slot is used, since (unlike TLS) it gets a
+   callback to free the error when the thread exits. */
+struct global_error {
+	wchar_t *str;
+	int code;
+};
+
+static INIT_ONCE global_error_index_once = INIT_ONCE_STATIC_INIT;
+static DWORD global_error_index = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI free_global_error(PVOID ptr)
+{
+	struct global_error *err = (struct global_error*) ptr;
+	if (err) {
+		free(err->str);
+		free(err);
+	}
+}
+
+static BOOL CALLBACK create_global_error_index(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	(void)once;
+	(void)param;
+	(void)context;
+
+	global_error_index = FlsAlloc(free_global_error);
+	return TRUE;
+}
+
+/* A library context, see hid_context_create(). The only state of this
+   backend which isn't process-wide (the functions of the DLLs are) is
+   the last error. */
+struct hid_context_ {
+	/* Not used by default_context, which keeps the errors per thread */
+	struct global_error error;
+};
+
+/* The context of the functions without a context argument */
+static hid_context default_context;
+
+/* Returns the context to use for ctx (NULL is the default one). */
+static hid_context *resolve_context(hid_context *ctx)
+{
+	return ctx? ctx: &default_context;
+}
+
+/* Returns the last error of ctx, for default_context the one of the
+   calling thread. If the thread has none yet, it is allocated if create
+   is non-zero, otherwise NULL is returned.
+   Note: this may change the value of GetLastError(). */
+static struct global_error *get_context_error(hid_context *ctx, int create)
+{
+	struct global_error *err;
+
+	if (ctx != &default_context)
+		return &ctx->error;
+
+	InitOnceExecuteOnce(&global_error_index_once, create_global_error_index, NULL, NULL);
+	if (global_error_index == FLS_OUT_OF_INDEXES)
+		return NULL;
+
+	err = (struct global_error*) FlsGetValue(global_error_index);
+	if (!err && create) {
+		err = (struct global_error*) calloc(1, sizeof(struct global_error));
+		if (err && !FlsSetValue(global_error_index, err)) {
+			free(err);
+			err = NULL;
+		}
+	}
+
+	return err;
 }
 
-static wchar_t *last_global_error_str = NULL;
+static void register_global_winapi_error(hid_context *ctx, const WCHAR *op)
+{
+	/* Read it first, get_context_error() may overwrite it */
+	DWORD error_code = GetLastError();
+	struct global_error *err = get_context_error(ctx, op != NULL);
+
+	if (!err)
+		return;
 
-static void register_global_winapi_error(const WCHAR *op)
+	register_winapi_error_to_buffer(&err->str, op, error_code);
+	err->code = winapi_error_to_error_code(error_code);
+}
+
+static void register_global_error_code(hid_context *ctx, int code, const WCHAR *string_error)
 {
-	register_winapi_error_to_buffer(&last_global_error_str, op);
+	struct global_error *err = get_context_error(ctx, string_error != NULL);
+
+	if (!err)
+		return;
+
+	register_string_error_to_buffer(&err->str, string_error);
+	err->code = code;
 }
 
-static void register_global_error(const WCHAR *string_error)
+static void register_global_error(hid_context *ctx, const WCHAR *string_error)
 {
-	register_string_error_to_buffer(&last_global_error_str, string_error);
+	register_global_error_code(ctx, string_error? HID_API_ERROR_UNKNOWN: HID_API_ERROR_SUCCESS, string_error);
 }
 
 static HANDLE open_device(const wchar_t *path, BOOL open_rw)
@@ -342,13 +897,14 @@ HID_API_EXPORT const char* HID_API_CALL hid_version_str()
 	return HID_API_VERSION_STR;
 }
 
-int HID_API_EXPORT hid_init(void)
+/* What hid_init() does, for any context */
+static int init_context(hid_context *ctx)
 {
-	register_global_error(NULL);
+	register_global_error(ctx, NULL);
 #ifndef HIDAPI_USE_DDK
 	if (!hidapi_initialized) {
 		if (lookup_functions() < 0) {
-			register_global_winapi_error(L"resolve DLL functions");
+			register_global_winapi_error(ctx, L"resolve DLL functions");
 			return -1;
 		}
 		hidapi_initialized = TRUE;
@@ -357,16 +913,51 @@ int HID_API_EXPORT hid_init(void)
 	return 0;
 }
 
+int HID_API_EXPORT hid_init(void)
+{
+	return init_context(&default_context);
+}
+
 int HID_API_EXPORT hid_exit(void)
 {
 #ifndef HIDAPI_USE_DDK
 	free_library_handles();
 	hidapi_initialized = FALSE;
 #endif
-	register_global_error(NULL);
+	/* Free the global error message of this thread
+	   (the ones of other threads are freed when they exit) */
+	register_global_error(&default_context, NULL);
 	return 0;
 }
 
+HID_API_EXPORT hid_context * HID_API_CALL hid_context_create(const struct hid_context_options *opts)
+{
+	hid_context *ctx;
+
+	(void)opts;
+
+	/* Load the DLLs, if that wasn't done yet */
+	if (hid_init() < 0)
+		return NULL;
+
+	ctx = (hid_context*) calloc(1, sizeof(hid_context));
+	if (!ctx) {
+		register_global_error_code(&default_context, HID_API_ERROR_NO_MEM, L"Couldn't allocate the context");
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_context_destroy(hid_context *ctx)
+{
+	if (!ctx || ctx == &default_context)
+		return;
+
+	free(ctx->error.str);
+	free(ctx);
+}
+
 static void* hid_internal_get_devnode_property(DEVINST dev_node, const DEVPROPKEY* property_key, DEVPROPTYPE expected_property_type)
 {
 	ULONG len = 0;
@@ -510,8 +1101,38 @@ static void hid_internal_get_info(const wchar_t* interface_path, struct hid_devi
 		/* Normalize to upper case */
 		for (wchar_t* p = compatible_id; *p; ++p) *p = towupper(*p);
 
+		/* USB devices
+		   https://docs.microsoft.com/windows-hardware/drivers/hid/plug-and-play-support
+		   https://docs.microsoft.com/windows-hardware/drivers/install/standard-usb-identifiers */
+		if (wcsstr(compatible_id, L"USB") != NULL) {
+			dev->bus_type = HID_API_BUS_USB;
+			break;
+		}
+
+		/* Bluetooth devices
+		   https://docs.microsoft.com/windows-hardware/drivers/bluetooth/installing-a-bluetooth-device */
+		if (wcsstr(compatible_id, L"BTHENUM") != NULL) {
+			dev->bus_type = HID_API_BUS_BLUETOOTH;
+			break;
+		}
+
+		/* I2C devices
+		   https://docs.microsoft.com/windows-hardware/drivers/hid/plug-and-play-support-and-power-management */
+		if (wcsstr(compatible_id, L"PNP0C50") != NULL) {
+			dev->bus_type = HID_API_BUS_I2C;
+			break;
+		}
+
+		/* SPI devices
+		   https://docs.microsoft.com/windows-hardware/drivers/hid/plug-and-play-for-spi */
+		if (wcsstr(compatible_id, L"PNP0C51") != NULL) {
+			dev->bus_type = HID_API_BUS_SPI;
+			break;
+		}
+
 		/* Bluetooth LE devices */
 		if (wcsstr(compatible_id, L"BTHLEDEVICE") != NULL) {
+			dev->bus_type = HID_API_BUS_BLUETOOTH;
 			/* HidD_GetProductString/HidD_GetManufacturerString/HidD_GetSerialNumberString is not working for BLE HID devices
 			   Request this info via dev node properties instead.
 			   https://docs.microsoft.com/answers/questions/401236/hidd-getproductstring-with-ble-hid-device.html */
@@ -610,21 +1231,102 @@ static struct hid_device_info *hid_internal_get_device_info(const wchar_t *path,
 
 	hid_internal_get_info(path, dev);
 
+	/* The same strings, as UTF-8 (after hid_internal_get_info,
+	   which may have replaced them) */
+	dev->serial_number_utf8 = hid_internal_UTF16toUTF8(dev->serial_number);
+	dev->manufacturer_string_utf8 = hid_internal_UTF16toUTF8(dev->manufacturer_string);
+	dev->product_string_utf8 = hid_internal_UTF16toUTF8(dev->product_string);
+
 	return dev;
 }
 
-struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* The predicates of a hid_filter. A NULL filter matches everything. */
+static int filter_match_ids(const struct hid_filter *filter, unsigned short vendor_id, unsigned short product_id)
+{
+	size_t i;
+
+	if (!filter || !filter->ids || filter->num_ids == 0)
+		return 1;
+
+	for (i = 0; i < filter->num_ids; i++) {
+		const struct hid_filter_id *id = &filter->ids[i];
+		if ((id->vendor_id == 0 || id->vendor_id == vendor_id) &&
+		    (id->product_id == 0 || id->product_id == product_id))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Checks the criteria which need the device properties read by
+   hid_internal_get_device_info(). */
+static int filter_match_device_info(const struct hid_filter *filter, const struct hid_device_info *info)
+{
+	if (!filter)
+		return 1;
+
+	if ((filter->usage_page != 0 && filter->usage_page != info->usage_page) ||
+	    (filter->usage != 0 && filter->usage != info->usage))
+		return 0;
+
+	if (filter->match_interface_number && filter->interface_number != info->interface_number)
+		return 0;
+
+	if (filter->bus_type != HID_API_BUS_UNKNOWN && filter->bus_type != info->bus_type)
+		return 0;
+
+	if (filter->serial_number_prefix &&
+	    (!info->serial_number_utf8 ||
+	     strncmp(info->serial_number_utf8, filter->serial_number_prefix, strlen(filter->serial_number_prefix)) != 0))
+		return 0;
+
+	return 1;
+}
+
+/* Where the matching records go: the callback of hid_enumerate_visit(),
+   or (if it is NULL) the list built by hid_enumerate_filtered(). */
+struct enum_sink {
+	hid_enumerate_callback callback;
+	void *user_data;
+	int result; /* Value returned by the callback which stopped */
+
+	struct hid_device_info *root;
+	struct hid_device_info *last;
+};
+
+/* Sends the record dev to the sink, which takes its ownership.
+   Returns non-zero if the enumeration must stop. */
+static int enum_sink_add(struct enum_sink *sink, struct hid_device_info *dev)
+{
+	if (sink->callback) {
+		sink->result = sink->callback(dev, sink->user_data);
+		hid_free_enumeration(dev);
+		return sink->result;
+	}
+
+	if (sink->last) {
+		sink->last->next = dev;
+	}
+	else {
+		sink->root = dev;
+	}
+	sink->last = dev;
+	return 0;
+}
+
+/* Sends the devices matching the filter to the sink, until it says
+   to stop. Returns -1 if the system couldn't be scanned. */
+static int hid_internal_enumerate(hid_context *ctx, const struct hid_filter *filter, struct enum_sink *sink)
 {
-	struct hid_device_info *root = NULL; /* return object */
-	struct hid_device_info *cur_dev = NULL;
 	GUID interface_class_guid;
 	CONFIGRET cr;
 	wchar_t* device_interface_list = NULL;
 	DWORD len;
+	int res = -1;
 
-	if (hid_init() < 0) {
-		/* register_global_error: global error is reset by hid_init */
-		return NULL;
+	if (init_context(ctx) < 0) {
+		/* register_global_error: global error is reset by init_context */
+		return -1;
 	}
 
 	/* Retrieve HID Interface Class GUID
@@ -637,7 +1339,7 @@ struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned shor
 	do {
 		cr = CM_Get_Device_Interface_List_SizeW(&len, &interface_class_guid, NULL, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
 		if (cr != CR_SUCCESS) {
-			register_global_error(L"Failed to get size of HID device interface list");
+			register_global_error(ctx, L"Failed to get size of HID device interface list");
 			break;
 		}
 
@@ -647,12 +1349,12 @@ struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned shor
 
 		device_interface_list = (wchar_t*)calloc(len, sizeof(wchar_t));
 		if (device_interface_list == NULL) {
-			register_global_error(L"Failed to allocate memory for HID device interface list");
-			return NULL;
+			register_global_error_code(ctx, HID_API_ERROR_NO_MEM, L"Failed to allocate memory for HID device interface list");
+			return -1;
 		}
 		cr = CM_Get_Device_Interface_ListW(&interface_class_guid, NULL, device_interface_list, len, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
 		if (cr != CR_SUCCESS && cr != CR_BUFFER_SMALL) {
-			register_global_error(L"Failed to get HID device interface list");
+			register_global_error(ctx, L"Failed to get HID device interface list");
 		}
 	} while (cr == CR_BUFFER_SMALL);
 
@@ -660,10 +1362,13 @@ struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned shor
 		goto end_of_function;
 	}
 
+	res = 0;
+
 	/* Iterate over each device interface in the HID class, looking for the right one. */
 	for (wchar_t* device_interface = device_interface_list; *device_interface; device_interface += wcslen(device_interface) + 1) {
 		HANDLE device_handle = INVALID_HANDLE_VALUE;
 		HIDD_ATTRIBUTES attrib;
+		int stop = 0;
 
 		/* Open read-only handle to the device */
 		device_handle = open_device(device_interface, FALSE);
@@ -682,8 +1387,7 @@ struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned shor
 
 		/* Check the VID/PID to see if we should add this
 		   device to the enumeration list. */
-		if ((vendor_id == 0x0 || attrib.VendorID == vendor_id) &&
-		    (product_id == 0x0 || attrib.ProductID == product_id)) {
+		if (filter_match_ids(filter, attrib.VendorID, attrib.ProductID)) {
 
 			/* VID/PID match. Create the record. */
 			struct hid_device_info *tmp = hid_internal_get_device_info(device_interface, device_handle);
@@ -692,31 +1396,96 @@ struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned shor
 				goto cont_close;
 			}
 
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
+			if (!filter_match_device_info(filter, tmp)) {
+				hid_free_enumeration(tmp);
+				goto cont_close;
 			}
-			cur_dev = tmp;
+
+			stop = enum_sink_add(sink, tmp);
 		}
 
 cont_close:
 		CloseHandle(device_handle);
+
+		if (stop)
+			break;
+	}
+
+end_of_function:
+	free(device_interface_list);
+
+	return res;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_context_enumerate(hid_context *ctx, const struct hid_filter *filter)
+{
+	struct enum_sink sink; /* return object */
+
+	ctx = resolve_context(ctx);
+
+	memset(&sink, 0, sizeof(sink));
+	if (hid_internal_enumerate(ctx, filter, &sink) < 0) {
+		/* register_global_error: global error is already set by hid_internal_enumerate */
+		return NULL;
 	}
 
-	if (root == NULL) {
-		if (vendor_id == 0 && product_id == 0) {
-			register_global_error(L"No HID devices found in the system.");
+	if (sink.root == NULL) {
+		if (!filter) {
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, L"No HID devices found in the system.");
 		} else {
-			register_global_error(L"No HID devices with requested VID/PID found in the system.");
+			register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, L"No HID devices matching the filter found in the system.");
 		}
 	}
 
-end_of_function:
-	free(device_interface_list);
+	return sink.root;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_filtered(const struct hid_filter *filter)
+{
+	return hid_context_enumerate(NULL, filter);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_context_enumerate_visit(hid_context *ctx, const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct enum_sink sink;
+
+	ctx = resolve_context(ctx);
+
+	if (!callback) {
+		register_global_error_code(ctx, HID_API_ERROR_INVALID_PARAM, L"hid_enumerate_visit: NULL callback");
+		return -1;
+	}
+
+	memset(&sink, 0, sizeof(sink));
+	sink.callback = callback;
+	sink.user_data = user_data;
+
+	if (hid_internal_enumerate(ctx, filter, &sink) < 0)
+		return -1;
+
+	return sink.result;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_enumerate_visit(const struct hid_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	return hid_context_enumerate_visit(NULL, filter, callback, user_data);
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_filter_id id;
+	struct hid_filter filter;
 
-	return root;
+	if (vendor_id == 0 && product_id == 0)
+		return hid_enumerate_filtered(NULL);
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	return hid_enumerate_filtered(&filter);
 }
 
 void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs)
@@ -729,56 +1498,82 @@ void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *d
 		free(d->serial_number);
 		free(d->manufacturer_string);
 		free(d->product_string);
+		free(d->serial_number_utf8);
+		free(d->manufacturer_string_utf8);
+		free(d->product_string_utf8);
 		free(d);
 		d = next;
 	}
 }
 
-HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
-{
-	/* TODO: Merge this functions with the Linux version. This function should be platform independent. */
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
-
-	/* register_global_error: global error is reset by hid_enumerate/hid_init */
-	devs = hid_enumerate(vendor_id, product_id);
-	if (!devs) {
-		/* register_global_error: global error is already set by hid_enumerate */
-		return NULL;
-	}
+/* State of hid_open(), see hid_internal_open_visitor() */
+struct open_search {
+	unsigned short vendor_id;
+	unsigned short product_id;
+	const wchar_t *serial_number;
+	char *path; /* The path of the device found */
+};
 
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (cur_dev->serial_number && wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
-	}
+/* Stops at the first device matching the hid_open() arguments */
+static int HID_API_CALL hid_internal_open_visitor(const struct hid_device_info *info, void *user_data)
+{
+	struct open_search *search = (struct open_search*) user_data;
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	} else {
-		register_global_error(L"Device with requested VID/PID/(SerialNumber) not found");
-	}
+	if (info->vendor_id != search->vendor_id ||
+	    info->product_id != search->product_id)
+		return 0;
 
-	hid_free_enumeration(devs);
+	if (search->serial_number &&
+	    (!info->serial_number || wcscmp(search->serial_number, info->serial_number) != 0))
+		return 0;
 
-	return handle;
+	search->path = _strdup(info->path);
+	return 1;
 }
 
-HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path)
+HID_API_EXPORT hid_device * HID_API_CALL hid_context_open(hid_context *ctx, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct open_search search;
+	struct hid_filter_id id;
+	struct hid_filter filter;
+	hid_device *handle = NULL;
+
+	ctx = resolve_context(ctx);
+
+	search.vendor_id = vendor_id;
+	search.product_id = product_id;
+	search.serial_number = serial_number;
+	search.path = NULL;
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+	memset(&filter, 0, sizeof(filter));
+	filter.ids = &id;
+	filter.num_ids = 1;
+
+	/* register_global_error: global error is reset by hid_context_enumerate_visit */
+	if (hid_context_enumerate_visit(ctx, &filter, hid_internal_open_visitor, &search) < 0) {
+		/* register_global_error: global error is already set by hid_context_enumerate_visit */
+		return NULL;
+	}
+
+	if (search.path) {
+		/* Open the device */
+		handle = hid_context_open_path(ctx, search.path);
+		free(search.path);
+	} else {
+		register_global_error_code(ctx, HID_API_ERROR_NOT_FOUND, L"Device with requested VID/PID/(SerialNumber) not found");
+	}
+
+	return handle;
+}
+
+HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	return hid_context_open(NULL, vendor_id, product_id, serial_number);
+}
+
+HID_API_EXPORT hid_device * HID_API_CALL hid_context_open_path(hid_context *ctx, const char *path)
 {
 	hid_device *dev = NULL;
 	wchar_t* interface_path = NULL;
@@ -786,14 +1581,16 @@ HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path)
 	PHIDP_PREPARSED_DATA pp_data = NULL;
 	HIDP_CAPS caps;
 
-	if (hid_init() < 0) {
-		/* register_global_error: global error is reset by hid_init */
+	ctx = resolve_context(ctx);
+
+	if (init_context(ctx) < 0) {
+		/* register_global_error: global error is reset by init_context */
 		goto end_of_function;
 	}
 
 	interface_path = hid_internal_UTF8toUTF16(path);
 	if (!interface_path) {
-		register_string_error(dev, L"Path conversion failure");
+		register_global_error(ctx, L"Path conversion failure");
 		goto end_of_function;
 	}
 
@@ -811,32 +1608,32 @@ HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path)
 
 		/* Check the validity of the limited device_handle. */
 		if (device_handle == INVALID_HANDLE_VALUE) {
-			register_global_winapi_error(L"open_device");
+			register_global_winapi_error(ctx, L"open_device");
 			goto end_of_function;
 		}
 	}
 
 	/* Set the Input Report buffer size to 64 reports. */
 	if (!HidD_SetNumInputBuffers(device_handle, 64)) {
-		register_global_winapi_error(L"set input buffers");
+		register_global_winapi_error(ctx, L"set input buffers");
 		goto end_of_function;
 	}
 
 	/* Get the Input Report length for the device. */
 	if (!HidD_GetPreparsedData(device_handle, &pp_data)) {
-		register_global_winapi_error(L"get preparsed data");
+		register_global_winapi_error(ctx, L"get preparsed data");
 		goto end_of_function;
 	}
 
 	if (HidP_GetCaps(pp_data, &caps) != HIDP_STATUS_SUCCESS) {
-		register_global_error(L"HidP_GetCaps");
+		register_global_error(ctx, L"HidP_GetCaps");
 		goto end_of_function;
 	}
 
 	dev = new_hid_device();
 
 	if (dev == NULL) {
-		register_global_error(L"hid_device allocation error");
+		register_global_error_code(ctx, HID_API_ERROR_NO_MEM, L"hid_device allocation error");
 		goto end_of_function;
 	}
 
@@ -860,17 +1657,23 @@ end_of_function:
 	return dev;
 }
 
+HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path)
+{
+	return hid_context_open_path(NULL, path);
+}
+
 int HID_API_EXPORT HID_API_CALL hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
 	DWORD bytes_written = 0;
 	int function_result = -1;
 	BOOL res;
 	BOOL overlapped = FALSE;
+	size_t report_length = length;
 
 	unsigned char *buf;
 
 	if (!data || !length) {
-		register_string_error(dev, L"Zero buffer/length");
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
 		return function_result;
 	}
 
@@ -911,6 +1714,8 @@ int HID_API_EXPORT HID_API_CALL hid_write(hid_device *dev, const unsigned char *
 		res = WaitForSingleObject(dev->write_ol.hEvent, 1000);
 		if (res != WAIT_OBJECT_0) {
 			/* There was a Timeout. */
+			if (res == WAIT_TIMEOUT)
+				SetLastError(WAIT_TIMEOUT);
 			register_winapi_error(dev, L"hid_write/WaitForSingleObject");
 			goto end_of_function;
 		}
@@ -919,6 +1724,7 @@ int HID_API_EXPORT HID_API_CALL hid_write(hid_device *dev, const unsigned char *
 		res = GetOverlappedResult(dev->device_handle, &dev->write_ol, &bytes_written, FALSE/*wait*/);
 		if (res) {
 			function_result = bytes_written;
+			capture_report(dev, HID_CAPTURE_OUTPUT, data, report_length);
 		}
 		else {
 			/* The Write operation failed. */
@@ -932,23 +1738,340 @@ end_of_function:
 }
 
 
-int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Passes a report to the callback subscribed to its Report ID, if any.
+   Returns 1 if the callback consumed the report. */
+static int dispatch_subscribed_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int consumed = 0;
+
+	if (length == 0)
+		return 0;
+
+	EnterCriticalSection(&dev->subscriptions_lock);
+	if (dev->subscriptions && dev->subscriptions[data[0]].callback) {
+		dev->subscriptions[data[0]].callback(dev, data, length, dev->subscriptions[data[0]].user_data);
+		consumed = 1;
+	}
+	LeaveCriticalSection(&dev->subscriptions_lock);
+
+	return consumed;
+}
+
+/* Replaces the report in the slot of its Report ID. The report
+   starts with its Report ID, as Windows returns it.
+   Must be called with dev->latest_lock held. */
+static void store_latest_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int report_id = data[0];
+	struct latest_report *slot = dev->latest_reports[report_id];
+
+	/* Stored the way hid_read() would return it */
+	if (report_id == 0x0) {
+		data++;
+		length--;
+	}
+
+	if (!slot || length > slot->capacity) {
+		/* The first report of this Report ID, or a longer one than
+		   the slot holds: publish a bigger slot. Readers may still be
+		   copying from the old one, which is kept until hid_close(). */
+		struct latest_report *bigger;
+		size_t capacity = length;
+
+		if (slot && capacity < 2 * slot->capacity)
+			capacity = 2 * slot->capacity;
+		bigger = (struct latest_report*) malloc(sizeof(struct latest_report) + capacity);
+		if (!bigger)
+			return;
+		bigger->seq = 0;
+		bigger->len = 0;
+		bigger->capacity = capacity;
+		bigger->data = (unsigned char*) (bigger + 1);
+		bigger->retired = slot;
+		InterlockedExchangePointer((PVOID volatile *) &dev->latest_reports[report_id], bigger);
+		slot = bigger;
+	}
+
+	/* The interlocked operations are full memory barriers */
+	InterlockedIncrement(&slot->seq);
+	memcpy(slot->data, data, length);
+	slot->len = length;
+	InterlockedIncrement(&slot->seq);
+}
+
+/* Copies the report of a slot, without blocking its writer. */
+static int load_latest_report(struct latest_report *slot, unsigned char *data, size_t length)
+{
+	LONG seq;
+	size_t len;
+
+	for (;;) {
+		seq = slot->seq;
+		MemoryBarrier();
+		if (seq & 1)
+			continue; /* Being written */
+
+		len = slot->len;
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		MemoryBarrier();
+		if (slot->seq == seq)
+			return (int) len;
+	}
+}
+
+/* Writes a report over the oldest one of the ring. Only called by the
+   reader holding the pumping flag. The lock of the ring is only taken
+   when a reader sleeps, to wake it up. */
+static void store_broadcast_report(struct broadcast_ring *ring, const unsigned char *data, size_t length)
+{
+	ULONG head = (ULONG) ring->head;
+	struct broadcast_slot *slot = &ring->slots[head & ring->mask];
+
+	/* Stored the way hid_read() would return it */
+	if (data[0] == 0x0) {
+		data++;
+		length--;
+	}
+
+	if (length > ring->slot_size)
+		length = ring->slot_size;
+
+	/* The interlocked operations are full memory barriers */
+	InterlockedIncrement(&slot->seq);
+	slot->number = (LONG) head;
+	memcpy(slot->data, data, length);
+	slot->len = length;
+	InterlockedIncrement(&slot->seq);
+
+	/* Either this sees the waiter, or the waiter sees the new head */
+	InterlockedExchange(&ring->head, (LONG) (head + 1));
+	if (InterlockedCompareExchange(&ring->waiters, 0, 0)) {
+		EnterCriticalSection(&ring->lock);
+		WakeAllConditionVariable(&ring->condition);
+		LeaveCriticalSection(&ring->lock);
+	}
+}
+
+/* Copies the next report of a reader, without blocking the writer.
+   Returns 0 if there is none yet. A reader left behind by more than
+   the ring holds skips to the oldest report still in it. */
+static int load_broadcast_report(hid_broadcast_reader *reader, unsigned char *data, size_t length)
+{
+	struct broadcast_ring *ring = reader->ring;
+	struct broadcast_slot *slot;
+	ULONG head;
+	LONG seq;
+	size_t len;
+
+	for (;;) {
+		head = (ULONG) InterlockedCompareExchange(&ring->head, 0, 0);
+		if (head == reader->cursor)
+			return 0;
+
+		if (head - reader->cursor > ring->mask + 1) {
+			reader->overflow += head - reader->cursor - (ring->mask + 1);
+			reader->cursor = head - (ring->mask + 1);
+		}
+
+		slot = &ring->slots[reader->cursor & ring->mask];
+		seq = slot->seq;
+		MemoryBarrier();
+		if ((seq & 1) || (ULONG) slot->number != reader->cursor)
+			continue; /* Being overwritten, head moves past the cursor */
+
+		len = slot->len;
+		if (len > length)
+			len = length;
+		memcpy(data, slot->data, len);
+
+		MemoryBarrier();
+		if (slot->seq == seq) {
+			reader->cursor++;
+			return (int) len;
+		}
+	}
+}
+
+/* Returns non-zero if a and b differ in the bits set in mask.
+   Compares 16 bytes at a time where the CPU allows it. */
+static int masked_reports_differ(const unsigned char *a, const unsigned char *b, const unsigned char *mask, size_t length)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	for (; i + 16 <= length; i += 16) {
+		__m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i)));
+		diff = _mm_and_si128(diff, _mm_loadu_si128((const __m128i *) (mask + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+			return 1;
+	}
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t diff = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		if (vmaxvq_u8(vandq_u8(diff, vld1q_u8(mask + i))))
+			return 1;
+	}
+#endif
+	for (; i < length; i++) {
+		if ((a[i] ^ b[i]) & mask[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* In changes-only mode, returns 1 if the report is the same as the
+   previous one of its Report ID, to be dropped. Otherwise the report
+   becomes the previous one and 0 is returned. Locks
+   dev->changes_lock. */
+static int drop_unchanged_report(hid_device *dev, int report_id, const unsigned char *data, size_t length)
+{
+	struct change_filter *filter;
+	int unchanged = 0;
+
+	if (length == 0)
+		return 0;
+
+	EnterCriticalSection(&dev->changes_lock);
+	if (!dev->changes_only)
+		goto out;
+
+	filter = &dev->change_filters[report_id];
+	if (filter->len == length) {
+		size_t masked = (filter->mask_len < length)? filter->mask_len: length;
+
+		/* The unmasked rest goes to memcmp(), vectorized by the C library */
+		if (!masked_reports_differ(filter->data, data, filter->mask, masked) &&
+		    memcmp(filter->data + masked, data + masked, length - masked) == 0) {
+			dev->unchanged_count++;
+			unchanged = 1;
+			goto out;
+		}
+	}
+
+	if (length > filter->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(filter->data, length);
+		if (!buf) {
+			/* Deliver every report of this Report ID instead */
+			filter->len = 0;
+			goto out;
+		}
+		filter->data = buf;
+		filter->capacity = length;
+	}
+	memcpy(filter->data, data, length);
+	filter->len = length;
+
+out:
+	LeaveCriticalSection(&dev->changes_lock);
+	return unchanged;
+}
+
+/* Passes a report through the decimation stage of its Report ID, if
+   any. Returns 1 if nothing is to be delivered. Otherwise the report to
+   deliver is in data: in the window modes it is the report of the
+   window which this one closes, the two being swapped within the
+   capacity of data. Locks
+   dev->changes_lock. */
+static int decimate_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	struct report_decimator *d;
+	DWORD now;
+	int drop = 0;
+
+	EnterCriticalSection(&dev->changes_lock);
+	d = dev->decimators? dev->decimators[report_id]: NULL;
+	if (!d || *length == 0)
+		goto out;
+
+	if (d->config.mode == HID_DECIMATE_EVERY_NTH) {
+		drop = (d->skipped != 0);
+		if (++d->skipped >= d->config.every)
+			d->skipped = 0;
+		goto out;
+	}
+
+	if (*length > d->capacity) {
+		unsigned char *buf = (unsigned char*) realloc(d->window, *length);
+		if (!buf)
+			goto out; /* Deliver it as is */
+		d->window = buf;
+		d->capacity = *length;
+	}
+
+	now = GetTickCount();
+	if (d->window_len && (LONG) (now - d->window_end) >= 0) {
+		/* Deliver the window, and start the next one with this report */
+		size_t window_len = (d->window_len < capacity)? d->window_len: capacity;
+		size_t n = (*length > window_len)? *length: window_len;
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			unsigned char c = data[i];
+			data[i] = d->window[i];
+			d->window[i] = c;
+		}
+		d->window_len = *length;
+		*length = window_len;
+		d->window_count = 0;
+		d->window_end = now + d->config.window_ms;
+	}
+	else {
+		drop = 1;
+		if (!d->window_len) {
+			d->window_count = 0;
+			d->window_end = now + d->config.window_ms;
+		}
+		if (!d->window_len || d->config.mode == HID_DECIMATE_WINDOW_LATEST) {
+			memcpy(d->window, data, *length);
+			d->window_len = *length;
+		}
+	}
+
+	if (d->config.mode == HID_DECIMATE_WINDOW_REDUCE) {
+		/* The first report of a window is in the window already */
+		if (d->window_count == 0)
+			d->config.reducer(d->window, d->window_len, d->window, d->window_len, 0, d->config.user_data);
+		else
+			d->config.reducer(d->window, d->window_len, data, *length, d->window_count, d->config.user_data);
+	}
+	d->window_count++;
+
+out:
+	LeaveCriticalSection(&dev->changes_lock);
+	return drop;
+}
+
+/* The stages between the arrival of a report and its delivery:
+   changes-only mode, then decimation. Returns 1 if the report is
+   dropped. *length changes when a window is delivered instead. */
+static int filter_report(hid_device *dev, int report_id, unsigned char *data, size_t *length, size_t capacity)
+{
+	return drop_unchanged_report(dev, report_id, data, *length) ||
+	       decimate_report(dev, report_id, data, length, capacity);
+}
+
+/* hid_read_timeout(), with the reports stored by store_latest_report()
+   instead of returned in latest mode. */
+static int read_reports(hid_device *dev, unsigned char *data, size_t length, int milliseconds, BOOL latest)
 {
 	DWORD bytes_read = 0;
 	size_t copy_len = 0;
 	BOOL res = FALSE;
 	BOOL overlapped = FALSE;
-
-	if (!data || !length) {
-		register_string_error(dev, L"Zero buffer/length");
-		return -1;
-	}
+	DWORD start = GetTickCount();
+	int timeout = milliseconds;
 
 	register_string_error(dev, NULL);
 
 	/* Copy the handle for convenience. */
 	HANDLE ev = dev->ol.hEvent;
 
+next_report:
+	overlapped = FALSE;
 	if (!dev->read_pending) {
 		/* Start an Overlapped I/O read. */
 		dev->read_pending = TRUE;
@@ -973,9 +2096,9 @@ int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char
 	}
 
 	if (overlapped) {
-		if (milliseconds >= 0) {
+		if (timeout >= 0) {
 			/* See if there is any data yet. */
-			res = WaitForSingleObject(ev, milliseconds);
+			res = WaitForSingleObject(ev, timeout);
 			if (res != WAIT_OBJECT_0) {
 				/* There was no data this time. Return zero bytes available,
 				   but leave the Overlapped I/O running. */
@@ -991,6 +2114,52 @@ int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char
 	/* Set pending back to false, even if GetOverlappedResult() returned error. */
 	dev->read_pending = FALSE;
 
+	if (res && bytes_read > 0) {
+		BOOL consumed = FALSE;
+
+		capture_report(dev, HID_CAPTURE_INPUT, (const unsigned char *) dev->read_buf, bytes_read);
+
+		/* Repeated and decimated reports go no further. The reports
+		   are filtered as hid_read() returns them, i.e. without the
+		   Report ID 0x0 Windows puts in front of unnumbered ones. */
+		if (dev->read_buf[0] == 0x0) {
+			size_t len = bytes_read - 1;
+			consumed = filter_report(dev, 0, (unsigned char *) dev->read_buf + 1, &len, dev->input_report_length - 1);
+			bytes_read = (DWORD) len + 1;
+		}
+		else {
+			size_t len = bytes_read;
+			consumed = filter_report(dev, (unsigned char) dev->read_buf[0], (unsigned char *) dev->read_buf, &len, dev->input_report_length);
+			bytes_read = (DWORD) len;
+		}
+
+		/* Reports with a non-zero Report ID may be subscribed to */
+		if (!consumed && dev->read_buf[0] != 0x0)
+			consumed = dispatch_subscribed_report(dev, (const unsigned char *) dev->read_buf, bytes_read);
+
+		/* In latest mode the report replaces the previous one instead */
+		if (!consumed && latest) {
+			store_latest_report(dev, (const unsigned char *) dev->read_buf, bytes_read);
+			consumed = TRUE;
+		}
+
+		/* In broadcast mode it goes to the ring, see hid_broadcast_read() */
+		if (!consumed && dev->broadcast) {
+			store_broadcast_report(dev->broadcast, (const unsigned char *) dev->read_buf, bytes_read);
+			return (int) bytes_read;
+		}
+
+		if (consumed) {
+			/* Wait for the next report for the rest of the timeout.
+			   Once the time is up, only fetch what's already there. */
+			if (milliseconds > 0) {
+				DWORD elapsed = GetTickCount() - start;
+				timeout = elapsed < (DWORD) milliseconds? (int) (milliseconds - elapsed): 0;
+			}
+			goto next_report;
+		}
+	}
+
 	if (res && bytes_read > 0) {
 		if (dev->read_buf[0] == 0x0) {
 			/* If report numbers aren't being used, but Windows sticks a report
@@ -1019,6 +2188,254 @@ end_of_function:
 	return (int) copy_len;
 }
 
+/* Appends a report to held_reports. Returns -1 if out of memory. */
+static int hold_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	struct input_report **cur = &dev->held_reports;
+	int num_queued = 0;
+	struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
+
+	if (!rpt)
+		return -1;
+	rpt->data = (unsigned char*) malloc(length);
+	if (!rpt->data) {
+		free(rpt);
+		return -1;
+	}
+	memcpy(rpt->data, data, length);
+	rpt->len = length;
+	rpt->next = NULL;
+
+	while (*cur) {
+		cur = &(*cur)->next;
+		num_queued++;
+	}
+	*cur = rpt;
+
+	/* Drop the oldest one past 30, like the queues of the other backends */
+	if (num_queued >= 30) {
+		rpt = dev->held_reports;
+		dev->held_reports = rpt->next;
+		free(rpt->data);
+		free(rpt);
+	}
+
+	return 0;
+}
+
+/* Returns the first report of held_reports. */
+static int return_held_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	struct input_report *rpt = dev->held_reports;
+	size_t len = (length < rpt->len)? length: rpt->len;
+
+	memcpy(data, rpt->data, len);
+	dev->held_reports = rpt->next;
+	free(rpt->data);
+	free(rpt);
+	return (int) len;
+}
+
+/* Reads a batch, see hid_set_batching(). The first report is returned
+   in data; Windows completes a ReadFile() for each report, so keep
+   reading the others into held_reports until the batch is full, the
+   delay has passed since the first one or the caller's timeout is up,
+   whichever comes first. */
+static int read_batch(hid_device *dev, LONG max_reports, unsigned char *data, size_t length, int milliseconds)
+{
+	unsigned char *buf;
+	LONG num_reports = 1;
+	DWORD start = GetTickCount(), batch_start, batch_delay, elapsed;
+	int res = read_reports(dev, data, length, milliseconds, FALSE);
+	int timeout;
+
+	if (res <= 0)
+		return res;
+
+	batch_start = GetTickCount();
+	batch_delay = (DWORD) ((dev->batch_delay_us + 999ULL) / 1000);
+
+	buf = (unsigned char*) malloc(dev->input_report_length);
+	if (!buf) {
+		/* The first report is delivered either way */
+		register_string_error(dev, NULL);
+		return res;
+	}
+
+	while (num_reports < max_reports) {
+		int len;
+
+		/* A non-blocking call only takes what's already there */
+		timeout = 0;
+		if (milliseconds != 0) {
+			elapsed = GetTickCount() - batch_start;
+			timeout = elapsed < batch_delay? (int) (batch_delay - elapsed): 0;
+			if (milliseconds > 0) {
+				elapsed = GetTickCount() - start;
+				if (elapsed >= (DWORD) milliseconds)
+					timeout = 0;
+				else if ((DWORD) timeout > (DWORD) milliseconds - elapsed)
+					timeout = (int) ((DWORD) milliseconds - elapsed);
+			}
+		}
+
+		len = read_reports(dev, buf, dev->input_report_length, timeout, FALSE);
+		if (len < 0 || (len == 0 && timeout == 0))
+			break;
+		if (len > 0) {
+			if (hold_report(dev, buf, (size_t) len) < 0)
+				break;
+			num_reports++;
+		}
+	}
+
+	free(buf);
+	register_string_error(dev, NULL);
+	return res;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	LONG batch_reports;
+	int res;
+
+	if (!data || !length) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
+		return -1;
+	}
+
+	if (InterlockedCompareExchangePointer((PVOID volatile *) &dev->broadcast, NULL, NULL)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_read_timeout: not available in broadcast mode");
+		return -1;
+	}
+
+	/* The reports held back by hid_transact() or a batch come first */
+	if (dev->held_reports) {
+		register_string_error(dev, NULL);
+		return return_held_report(dev, data, length);
+	}
+
+	if (!InterlockedCompareExchange(&dev->read_latest, 0, 0)) {
+		batch_reports = InterlockedCompareExchange(&dev->batch_reports, 0, 0);
+		if (batch_reports > 1)
+			return read_batch(dev, batch_reports, data, length, milliseconds);
+		return read_reports(dev, data, length, milliseconds, FALSE);
+	}
+
+	EnterCriticalSection(&dev->latest_lock);
+	res = read_reports(dev, data, length, milliseconds, TRUE);
+	LeaveCriticalSection(&dev->latest_lock);
+
+	return res;
+}
+
+int HID_API_EXPORT_CALL hid_set_read_latest(hid_device *dev, int enable)
+{
+	if (enable && InterlockedCompareExchangePointer((PVOID volatile *) &dev->broadcast, NULL, NULL)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_set_read_latest: not available in broadcast mode");
+		return -1;
+	}
+
+	if (enable) {
+		EnterCriticalSection(&dev->latest_lock);
+		if (!dev->latest_reports)
+			dev->latest_reports = (struct latest_report**) calloc(256, sizeof(struct latest_report*));
+		LeaveCriticalSection(&dev->latest_lock);
+
+		if (!dev->latest_reports) {
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_read_latest: out of memory");
+			return -1;
+		}
+	}
+
+	InterlockedExchange(&dev->read_latest, enable? 1: 0);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_read_latest(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length)
+{
+	struct latest_report *slot;
+
+	if (!InterlockedCompareExchange(&dev->read_latest, 0, 0)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_read_latest: the device is not in latest mode");
+		return -1;
+	}
+
+	/* Only a copy: the reports are stored by hid_read_timeout() */
+	slot = (struct latest_report*) InterlockedCompareExchangePointer((PVOID volatile *) &dev->latest_reports[report_id], NULL, NULL);
+	if (!slot)
+		return 0;
+
+	return load_latest_report(slot, data, length);
+}
+
+int HID_API_EXPORT_CALL hid_transact(hid_device *dev, const unsigned char *request, size_t request_length, hid_report_match match, void *user_data, unsigned char *response, size_t response_length, int milliseconds)
+{
+	unsigned char *buf;
+	DWORD start;
+	int timeout = milliseconds;
+	int res;
+
+	if (!match || !response || !response_length) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_transact: no predicate or response buffer");
+		return -1;
+	}
+
+	if (InterlockedCompareExchange(&dev->read_latest, 0, 0)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_transact: not available in latest mode");
+		return -1;
+	}
+
+	if (InterlockedCompareExchangePointer((PVOID volatile *) &dev->broadcast, NULL, NULL)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_transact: not available in broadcast mode");
+		return -1;
+	}
+
+	/* The reports which don't match are held whole */
+	buf = (unsigned char*) malloc(dev->input_report_length);
+	if (!buf) {
+		register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_transact: out of memory");
+		return -1;
+	}
+
+	if (hid_write(dev, request, request_length) < 0) {
+		free(buf);
+		return -1;
+	}
+
+	start = GetTickCount();
+
+	for (;;) {
+		res = read_reports(dev, buf, dev->input_report_length, timeout, FALSE);
+		if (res <= 0)
+			break;
+
+		if (match(buf, (size_t) res, user_data)) {
+			if ((size_t) res > response_length)
+				res = (int) response_length;
+			memcpy(response, buf, res);
+			break;
+		}
+
+		if (hold_report(dev, buf, (size_t) res) < 0) {
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_transact: out of memory");
+			res = -1;
+			break;
+		}
+
+		/* Once the time is up, only fetch what's already there */
+		if (milliseconds > 0) {
+			DWORD elapsed = GetTickCount() - start;
+			timeout = elapsed < (DWORD) milliseconds? (int) (milliseconds - elapsed): 0;
+		}
+	}
+
+	free(buf);
+	return res;
+}
+
 int HID_API_EXPORT HID_API_CALL hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
@@ -1030,6 +2447,395 @@ int HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *dev, int nonbloc
 	return 0; /* Success */
 }
 
+int HID_API_EXPORT_CALL hid_get_input_fd(hid_device *dev)
+{
+	register_string_error_code(dev, HID_API_ERROR_NOT_SUPPORTED, L"hid_get_input_fd is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_set_changes_only(hid_device *dev, int enable)
+{
+	EnterCriticalSection(&dev->changes_lock);
+	if (enable) {
+		int i;
+
+		if (!dev->change_filters)
+			dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+		if (!dev->change_filters) {
+			LeaveCriticalSection(&dev->changes_lock);
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_changes_only: out of memory");
+			return -1;
+		}
+
+		/* Always deliver the first report of each Report ID */
+		for (i = 0; i < 256; i++)
+			dev->change_filters[i].len = 0;
+	}
+	dev->changes_only = enable? 1: 0;
+	LeaveCriticalSection(&dev->changes_lock);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_change_mask(hid_device *dev, unsigned char report_id, const unsigned char *mask, size_t length)
+{
+	unsigned char *copy = NULL;
+	unsigned char *old;
+
+	if (mask && length) {
+		copy = (unsigned char*) malloc(length);
+		if (!copy) {
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_change_mask: out of memory");
+			return -1;
+		}
+		memcpy(copy, mask, length);
+	}
+	else {
+		length = 0;
+	}
+
+	EnterCriticalSection(&dev->changes_lock);
+	if (!dev->change_filters)
+		dev->change_filters = (struct change_filter*) calloc(256, sizeof(struct change_filter));
+	if (!dev->change_filters) {
+		LeaveCriticalSection(&dev->changes_lock);
+		free(copy);
+		register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_change_mask: out of memory");
+		return -1;
+	}
+	old = dev->change_filters[report_id].mask;
+	dev->change_filters[report_id].mask = copy;
+	dev->change_filters[report_id].mask_len = length;
+	LeaveCriticalSection(&dev->changes_lock);
+
+	free(old);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_unchanged_count(hid_device *dev, unsigned long long *count)
+{
+	if (!count) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_get_unchanged_count: count is NULL");
+		return -1;
+	}
+
+	EnterCriticalSection(&dev->changes_lock);
+	*count = dev->unchanged_count;
+	LeaveCriticalSection(&dev->changes_lock);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_decimation(hid_device *dev, unsigned char report_id, const struct hid_decimation *decimation)
+{
+	struct report_decimator *d = NULL;
+	struct report_decimator *old;
+
+	if (decimation && decimation->mode != HID_DECIMATE_OFF) {
+		if ((decimation->mode == HID_DECIMATE_EVERY_NTH && decimation->every == 0) ||
+		    ((decimation->mode == HID_DECIMATE_WINDOW_LATEST || decimation->mode == HID_DECIMATE_WINDOW_REDUCE) && decimation->window_ms == 0) ||
+		    (decimation->mode == HID_DECIMATE_WINDOW_REDUCE && !decimation->reducer) ||
+		    decimation->mode > HID_DECIMATE_WINDOW_REDUCE) {
+			register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_set_decimation: invalid stage");
+			return -1;
+		}
+
+		d = (struct report_decimator*) calloc(1, sizeof(struct report_decimator));
+		if (!d) {
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_decimation: out of memory");
+			return -1;
+		}
+		d->config = *decimation;
+	}
+
+	EnterCriticalSection(&dev->changes_lock);
+	if (d && !dev->decimators)
+		dev->decimators = (struct report_decimator**) calloc(256, sizeof(struct report_decimator*));
+	if (d && !dev->decimators) {
+		LeaveCriticalSection(&dev->changes_lock);
+		free(d);
+		register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_decimation: out of memory");
+		return -1;
+	}
+	old = dev->decimators? dev->decimators[report_id]: NULL;
+	if (dev->decimators)
+		dev->decimators[report_id] = d;
+	LeaveCriticalSection(&dev->changes_lock);
+
+	if (old) {
+		free(old->window);
+		free(old);
+	}
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_batching(hid_device *dev, unsigned int max_reports, unsigned int max_delay_us)
+{
+	if (max_reports > 30 || (max_reports > 1 && max_delay_us == 0)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_set_batching: invalid batch size or delay");
+		return -1;
+	}
+
+	dev->batch_delay_us = max_delay_us;
+	InterlockedExchange(&dev->batch_reports, (LONG) max_reports);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_set_broadcast(hid_device *dev, unsigned int slots, size_t max_report_length)
+{
+	struct broadcast_ring *ring = NULL;
+	struct broadcast_ring *old;
+	unsigned int num_slots = 1;
+
+	if (slots > 65536 || (slots > 0 && max_report_length == 0)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_set_broadcast: invalid ring size");
+		return -1;
+	}
+
+	if (slots > 0 && InterlockedCompareExchange(&dev->read_latest, 0, 0)) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_set_broadcast: not available in latest mode");
+		return -1;
+	}
+
+	if (slots > 0) {
+		while (num_slots < slots)
+			num_slots <<= 1;
+		ring = new_broadcast_ring(num_slots, max_report_length);
+		if (!ring) {
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_set_broadcast: out of memory");
+			return -1;
+		}
+	}
+
+	EnterCriticalSection(&dev->subscriptions_lock);
+	old = dev->broadcast;
+	if (old && old->readers > 0) {
+		LeaveCriticalSection(&dev->subscriptions_lock);
+		if (ring)
+			free_broadcast_ring(ring);
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_set_broadcast: readers are open");
+		return -1;
+	}
+	InterlockedExchangePointer((PVOID volatile *) &dev->broadcast, ring);
+	LeaveCriticalSection(&dev->subscriptions_lock);
+
+	if (old)
+		free_broadcast_ring(old);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+HID_API_EXPORT hid_broadcast_reader * HID_API_CALL hid_broadcast_open(hid_device *dev)
+{
+	hid_broadcast_reader *reader = (hid_broadcast_reader*) calloc(1, sizeof(hid_broadcast_reader));
+
+	if (!reader) {
+		register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_broadcast_open: out of memory");
+		return NULL;
+	}
+
+	EnterCriticalSection(&dev->subscriptions_lock);
+	if (!dev->broadcast) {
+		LeaveCriticalSection(&dev->subscriptions_lock);
+		free(reader);
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_broadcast_open: the device is not in broadcast mode");
+		return NULL;
+	}
+	reader->dev = dev;
+	reader->ring = dev->broadcast;
+	reader->ring->readers++;
+	reader->cursor = (ULONG) InterlockedCompareExchange(&reader->ring->head, 0, 0);
+	LeaveCriticalSection(&dev->subscriptions_lock);
+
+	register_string_error(dev, NULL);
+	return reader;
+}
+
+int HID_API_EXPORT_CALL hid_broadcast_read(hid_broadcast_reader *reader, unsigned char *data, size_t length, int milliseconds)
+{
+	struct broadcast_ring *ring = reader->ring;
+	hid_device *dev = reader->dev;
+	DWORD start = GetTickCount();
+	int timeout = milliseconds;
+	BOOL timed_out = FALSE;
+
+	if (!data || !length) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_broadcast_read: zero buffer/length");
+		return -1;
+	}
+
+	for (;;) {
+		int bytes_read = load_broadcast_report(reader, data, length);
+		if (bytes_read > 0 || timed_out)
+			return bytes_read;
+
+		EnterCriticalSection(&ring->lock);
+		if ((ULONG) InterlockedCompareExchange(&ring->head, 0, 0) == reader->cursor && !ring->pumping) {
+			/* Nobody reads from the device: read the next report
+			   for all the readers */
+			ring->pumping = TRUE;
+			LeaveCriticalSection(&ring->lock);
+
+			bytes_read = read_reports(dev, NULL, 0, timeout, FALSE);
+
+			/* Let a sleeping reader take over */
+			EnterCriticalSection(&ring->lock);
+			ring->pumping = FALSE;
+			WakeAllConditionVariable(&ring->condition);
+			LeaveCriticalSection(&ring->lock);
+
+			if (bytes_read <= 0)
+				return bytes_read;
+		}
+		else {
+			InterlockedIncrement(&ring->waiters);
+			if ((ULONG) InterlockedCompareExchange(&ring->head, 0, 0) != reader->cursor) {
+				/* Written meanwhile */
+			}
+			else if (timeout != 0) {
+				/* Another reader reads from the device */
+				timed_out = !SleepConditionVariableCS(&ring->condition, &ring->lock, timeout < 0? INFINITE: (DWORD) timeout);
+			}
+			else {
+				timed_out = TRUE;
+			}
+			InterlockedDecrement(&ring->waiters);
+			LeaveCriticalSection(&ring->lock);
+		}
+
+		/* Once the time is up, only fetch what's already there */
+		if (milliseconds > 0) {
+			DWORD elapsed = GetTickCount() - start;
+			timeout = elapsed < (DWORD) milliseconds? (int) (milliseconds - elapsed): 0;
+		}
+	}
+}
+
+int HID_API_EXPORT_CALL hid_broadcast_get_overflow(hid_broadcast_reader *reader, unsigned long long *count)
+{
+	if (!reader || !count)
+		return -1;
+
+	*count = reader->overflow;
+	return 0;
+}
+
+void HID_API_EXPORT_CALL hid_broadcast_close(hid_broadcast_reader *reader)
+{
+	if (!reader)
+		return;
+
+	EnterCriticalSection(&reader->dev->subscriptions_lock);
+	reader->ring->readers--;
+	LeaveCriticalSection(&reader->dev->subscriptions_lock);
+	free(reader);
+}
+
+int HID_API_EXPORT_CALL hid_subscribe_report_id(hid_device *dev, unsigned char report_id, hid_report_callback callback, void *user_data)
+{
+	if (report_id == 0 || !callback) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_subscribe_report_id: Report ID 0 or no callback");
+		return -1;
+	}
+
+	EnterCriticalSection(&dev->subscriptions_lock);
+	if (!dev->subscriptions) {
+		dev->subscriptions = (struct report_subscription*) calloc(256, sizeof(struct report_subscription));
+		if (!dev->subscriptions) {
+			LeaveCriticalSection(&dev->subscriptions_lock);
+			register_string_error_code(dev, HID_API_ERROR_NO_MEM, L"hid_subscribe_report_id: out of memory");
+			return -1;
+		}
+	}
+	dev->subscriptions[report_id].callback = callback;
+	dev->subscriptions[report_id].user_data = user_data;
+	LeaveCriticalSection(&dev->subscriptions_lock);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_unsubscribe_report_id(hid_device *dev, unsigned char report_id)
+{
+	int res = -1;
+
+	EnterCriticalSection(&dev->subscriptions_lock);
+	if (dev->subscriptions && dev->subscriptions[report_id].callback) {
+		dev->subscriptions[report_id].callback = NULL;
+		dev->subscriptions[report_id].user_data = NULL;
+		res = 0;
+	}
+	LeaveCriticalSection(&dev->subscriptions_lock);
+
+	if (res < 0)
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_unsubscribe_report_id: no subscription for this Report ID");
+	else
+		register_string_error(dev, NULL);
+	return res;
+}
+
+int HID_API_EXPORT_CALL hid_start_capture(hid_device *dev, const char *path, const struct hid_device_info *info)
+{
+	struct capture_file *capture;
+
+	if (!path) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_start_capture: NULL path");
+		return -1;
+	}
+
+	if (InterlockedCompareExchangePointer((PVOID volatile *) &dev->capture, NULL, NULL)) {
+		register_string_error_code(dev, HID_API_ERROR_BUSY, L"hid_start_capture: the device is already recorded");
+		return -1;
+	}
+
+	capture = create_capture_file(path, info);
+	if (!capture) {
+		register_winapi_error(dev, L"hid_start_capture");
+		return -1;
+	}
+
+	EnterCriticalSection(&dev->capture_lock);
+	if (dev->capture) {
+		LeaveCriticalSection(&dev->capture_lock);
+		close_capture_file(capture);
+		register_string_error_code(dev, HID_API_ERROR_BUSY, L"hid_start_capture: the device is already recorded");
+		return -1;
+	}
+	InterlockedExchangePointer((PVOID volatile *) &dev->capture, capture);
+	LeaveCriticalSection(&dev->capture_lock);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
+int HID_API_EXPORT_CALL hid_stop_capture(hid_device *dev)
+{
+	struct capture_file *capture;
+
+	EnterCriticalSection(&dev->capture_lock);
+	capture = (struct capture_file*) InterlockedExchangePointer((PVOID volatile *) &dev->capture, NULL);
+	LeaveCriticalSection(&dev->capture_lock);
+
+	if (!capture) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"hid_stop_capture: the device is not recorded");
+		return -1;
+	}
+
+	close_capture_file(capture);
+
+	register_string_error(dev, NULL);
+	return 0;
+}
+
 int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	BOOL res = FALSE;
@@ -1037,7 +2843,7 @@ int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *dev, const u
 	size_t length_to_send;
 
 	if (!data || !length) {
-		register_string_error(dev, L"Zero buffer/length");
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
 		return -1;
 	}
 
@@ -1067,6 +2873,7 @@ int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *dev, const u
 		return -1;
 	}
 
+	capture_report(dev, HID_CAPTURE_FEATURE_SET, data, length);
 	return (int) length;
 }
 
@@ -1079,7 +2886,7 @@ static int hid_get_report(hid_device *dev, DWORD report_type, unsigned char *dat
 	memset(&ol, 0, sizeof(ol));
 
 	if (!data || !length) {
-		register_string_error(dev, L"Zero buffer/length");
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
 		return -1;
 	}
 
@@ -1115,6 +2922,7 @@ static int hid_get_report(hid_device *dev, DWORD report_type, unsigned char *dat
 		bytes_returned++;
 	}
 
+	capture_report(dev, report_type == IOCTL_HID_GET_FEATURE? HID_CAPTURE_FEATURE_GET: HID_CAPTURE_INPUT_GET, data, bytes_returned);
 	return bytes_returned;
 }
 
@@ -1147,7 +2955,7 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_manufacturer_string(hid_device *dev
 	}
 
 	if (!string || !maxlen) {
-		register_string_error(dev, L"Zero buffer/length");
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
 		return -1;
 	}
 
@@ -1167,7 +2975,7 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_product_string(hid_device *dev, wch
 	}
 
 	if (!string || !maxlen) {
-		register_string_error(dev, L"Zero buffer/length");
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
 		return -1;
 	}
 
@@ -1187,7 +2995,7 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_serial_number_string(hid_device *de
 	}
 
 	if (!string || !maxlen) {
-		register_string_error(dev, L"Zero buffer/length");
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
 		return -1;
 	}
 
@@ -1214,6 +3022,87 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_indexed_string(hid_device *dev, int
 	return 0;
 }
 
+/* Copies the UTF-8 string src to string (maxlen bytes including the
+   terminating NULL), truncating it at a character boundary. */
+static int hid_internal_copy_utf8_string(hid_device *dev, const char *src, char *string, size_t maxlen)
+{
+	size_t len;
+
+	if (!string || !maxlen) {
+		register_string_error_code(dev, HID_API_ERROR_INVALID_PARAM, L"Zero buffer/length");
+		return -1;
+	}
+
+	if (!src)
+		src = "";
+
+	len = strlen(src);
+	if (len >= maxlen) {
+		len = maxlen - 1;
+		/* Don't cut a multi-byte sequence */
+		while (len > 0 && ((unsigned char) src[len] & 0xc0) == 0x80)
+			len--;
+	}
+	memcpy(string, src, len);
+	string[len] = '\0';
+
+	register_string_error(dev, NULL);
+
+	return 0;
+}
+
+int HID_API_EXPORT_CALL HID_API_CALL hid_get_manufacturer_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	if (!dev->device_info) {
+		register_string_error(dev, L"NULL device info");
+		return -1;
+	}
+
+	return hid_internal_copy_utf8_string(dev, dev->device_info->manufacturer_string_utf8, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL HID_API_CALL hid_get_product_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	if (!dev->device_info) {
+		register_string_error(dev, L"NULL device info");
+		return -1;
+	}
+
+	return hid_internal_copy_utf8_string(dev, dev->device_info->product_string_utf8, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL HID_API_CALL hid_get_serial_number_string_utf8(hid_device *dev, char *string, size_t maxlen)
+{
+	if (!dev->device_info) {
+		register_string_error(dev, L"NULL device info");
+		return -1;
+	}
+
+	return hid_internal_copy_utf8_string(dev, dev->device_info->serial_number_utf8, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL HID_API_CALL hid_get_indexed_string_utf8(hid_device *dev, int string_index, char *string, size_t maxlen)
+{
+	wchar_t wstring[MAX_STRING_WCHARS];
+	char *utf8;
+	int res;
+
+	if (hid_get_indexed_string(dev, string_index, wstring, MAX_STRING_WCHARS) < 0)
+		return -1;
+	wstring[MAX_STRING_WCHARS - 1] = L'\0';
+
+	utf8 = hid_internal_UTF16toUTF8(wstring);
+	if (!utf8) {
+		register_string_error(dev, L"String conversion failure");
+		return -1;
+	}
+
+	res = hid_internal_copy_utf8_string(dev, utf8, string, maxlen);
+	free(utf8);
+
+	return res;
+}
+
 int HID_API_EXPORT_CALL hid_winapi_get_container_id(hid_device *dev, GUID *container_id)
 {
 	wchar_t *interface_path = NULL, *device_id = NULL;
@@ -1274,9 +3163,31 @@ HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 		return (wchar_t*)dev->last_error_str;
 	}
 
-	if (last_global_error_str == NULL)
+	return hid_context_error(NULL);
+}
+
+int HID_API_EXPORT_CALL hid_error_code(hid_device *dev)
+{
+	if (dev)
+		return dev->last_error_code;
+
+	return hid_context_error_code(NULL);
+}
+
+HID_API_EXPORT const wchar_t * HID_API_CALL hid_context_error(hid_context *ctx)
+{
+	struct global_error *err = get_context_error(resolve_context(ctx), 0);
+
+	if (err == NULL || err->str == NULL)
 		return L"Success";
-	return last_global_error_str;
+	return err->str;
+}
+
+int HID_API_EXPORT_CALL hid_context_error_code(hid_context *ctx)
+{
+	struct global_error *err = get_context_error(resolve_context(ctx), 0);
+
+	return err? err->code: HID_API_ERROR_SUCCESS;
 }
 
 #ifdef __cplusplus